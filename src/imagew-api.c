@@ -218,6 +218,26 @@ static void default_resize_settings(struct iw_resize_settings *rs)
 	}
 }
 
+// Settings that are not 0 by default.
+static void default_settings(struct iw_context *ctx)
+{
+	default_resize_settings(&ctx->resize_settings[IW_DIMENSION_H]);
+	default_resize_settings(&ctx->resize_settings[IW_DIMENSION_V]);
+	ctx->input_w = -1;
+	ctx->input_h = -1;
+	iw_make_srgb_csdescr_2(&ctx->img1cs);
+	iw_make_srgb_csdescr_2(&ctx->img2cs);
+	ctx->to_grayscale=0;
+	ctx->grayscale_formula = IW_GSF_STANDARD;
+	ctx->req.include_screen = 1;
+	ctx->opt_grayscale = 1;
+	ctx->opt_palette = 1;
+	ctx->opt_16_to_8 = 1;
+	ctx->opt_strip_alpha = 1;
+	ctx->opt_binary_trns = 1;
+	ctx->max_threads = 1;
+}
+
 IW_IMPL(struct iw_context*) iw_create_context(struct iw_init_params *params)
 {
 	struct iw_context *ctx;
@@ -247,24 +267,79 @@ IW_IMPL(struct iw_context*) iw_create_context(struct iw_init_params *params)
 
 	ctx->max_malloc = IW_DEFAULT_MAX_MALLOC;
 	ctx->max_width = ctx->max_height = IW_DEFAULT_MAX_DIMENSION;
-	default_resize_settings(&ctx->resize_settings[IW_DIMENSION_H]);
-	default_resize_settings(&ctx->resize_settings[IW_DIMENSION_V]);
-	ctx->input_w = -1;
-	ctx->input_h = -1;
-	iw_make_srgb_csdescr_2(&ctx->img1cs);
-	iw_make_srgb_csdescr_2(&ctx->img2cs);
-	ctx->to_grayscale=0;
-	ctx->grayscale_formula = IW_GSF_STANDARD;
-	ctx->req.include_screen = 1;
-	ctx->opt_grayscale = 1;
-	ctx->opt_palette = 1;
-	ctx->opt_16_to_8 = 1;
-	ctx->opt_strip_alpha = 1;
-	ctx->opt_binary_trns = 1;
+	default_settings(ctx);
 
 	return ctx;
 }
 
+// Free everything that is specific to the current image, except for
+// memory that can be reused.
+static void free_image_data(struct iw_context *ctx)
+{
+	iwpvt_release_input_image(ctx,1);
+	if(ctx->error_msg) { iw_free(ctx,ctx->error_msg); ctx->error_msg=NULL; }
+	if(ctx->optctx.palette) { iw_free(ctx,ctx->optctx.palette); ctx->optctx.palette=NULL; }
+	iwpvt_opt_free_scan(ctx);
+	if(ctx->output_rev_color_corr_table) { iw_free(ctx,ctx->output_rev_color_corr_table); ctx->output_rev_color_corr_table=NULL; }
+	if(ctx->nearest_color_table) { iw_free(ctx,ctx->nearest_color_table); ctx->nearest_color_table=NULL; }
+	if(ctx->prng) { iwpvt_prng_destroy(ctx,ctx->prng); ctx->prng=NULL; }
+}
+
+static void free_membufs(struct iw_context *ctx)
+{
+	iwpvt_membuf_free(ctx,&ctx->img2_pixels_buf);
+	iwpvt_membuf_free(ctx,&ctx->intermediate_buf);
+	iwpvt_membuf_free(ctx,&ctx->intermediate_alpha_buf);
+	iwpvt_membuf_free(ctx,&ctx->dither_errors_buf);
+	iwpvt_membuf_free(ctx,&ctx->spare_input_buf);
+}
+
+IW_IMPL(void) iw_reset_context(struct iw_context *ctx)
+{
+	struct iw_context tmpctx;
+
+	if(!ctx) return;
+	free_image_data(ctx);
+
+	// Save everything we're keeping, then start over.
+	tmpctx = *ctx; // struct copy
+	iw_zeromem(ctx,sizeof(struct iw_context));
+
+	ctx->caller_api_version = tmpctx.caller_api_version;
+	ctx->userdata = tmpctx.userdata;
+	ctx->mallocfn = tmpctx.mallocfn;
+	ctx->freefn = tmpctx.freefn;
+	ctx->translate_fn = tmpctx.translate_fn;
+	ctx->warning_fn = tmpctx.warning_fn;
+	ctx->zlib_module = tmpctx.zlib_module;
+	ctx->max_malloc = tmpctx.max_malloc;
+	ctx->max_width = tmpctx.max_width;
+	ctx->max_height = tmpctx.max_height;
+	ctx->req.options = tmpctx.req.options;
+	ctx->req.options_count = tmpctx.req.options_count;
+	ctx->req.options_numalloc = tmpctx.req.options_numalloc;
+
+	ctx->keep_buffers = 1;
+	ctx->img2_pixels_buf = tmpctx.img2_pixels_buf;
+	ctx->intermediate_buf = tmpctx.intermediate_buf;
+	ctx->intermediate_alpha_buf = tmpctx.intermediate_alpha_buf;
+	ctx->dither_errors_buf = tmpctx.dither_errors_buf;
+	ctx->spare_input_buf = tmpctx.spare_input_buf;
+	ctx->arena = tmpctx.arena;
+
+	default_settings(ctx);
+}
+
+IW_IMPL(int) iw_set_arena_size(struct iw_context *ctx, size_t arena_size)
+{
+	// The blocks in the current arena would be left dangling.
+	if(ctx->arena.num_allocs>0) return 0;
+
+	iwpvt_arena_destroy(ctx);
+	if(arena_size==0) return 1;
+	return iwpvt_arena_init(ctx,arena_size);
+}
+
 IW_IMPL(void) iw_destroy_context(struct iw_context *ctx)
 {
 	int i;
@@ -276,15 +351,9 @@ IW_IMPL(void) iw_destroy_context(struct iw_context *ctx)
 		}
 		iw_free(ctx, ctx->req.options);
 	}
-	if(ctx->img1.pixels) iw_free(ctx,ctx->img1.pixels);
-	if(ctx->img2.pixels) iw_free(ctx,ctx->img2.pixels);
-	if(ctx->error_msg) iw_free(ctx,ctx->error_msg);
-	if(ctx->optctx.tmp_pixels) iw_free(ctx,ctx->optctx.tmp_pixels);
-	if(ctx->optctx.palette) iw_free(ctx,ctx->optctx.palette);
-	if(ctx->input_color_corr_table) iw_free(ctx,ctx->input_color_corr_table);
-	if(ctx->output_rev_color_corr_table) iw_free(ctx,ctx->output_rev_color_corr_table);
-	if(ctx->nearest_color_table) iw_free(ctx,ctx->nearest_color_table);
-	if(ctx->prng) iwpvt_prng_destroy(ctx,ctx->prng);
+	free_image_data(ctx);
+	free_membufs(ctx);
+	iwpvt_arena_destroy(ctx);
 	iw_free(ctx,ctx);
 }
 
@@ -859,6 +928,38 @@ IW_IMPL(void) iw_set_value(struct iw_context *ctx, int code, int n)
 	case IW_VAL_NEGATE_TARGET:
 		ctx->req.negate_target = n;
 		break;
+	case IW_VAL_INCREMENTAL_OPT_SCAN:
+		ctx->opt_incremental_scan = n?1:0;
+		break;
+	case IW_VAL_QUANTIZE:
+		if(n<0) n=0;
+		if(n==1) n=2;
+		if(n>256) n=256;
+		ctx->quantize_maxcolors = n;
+		break;
+	case IW_VAL_QUANTIZE_DITHER:
+		ctx->quantize_dither = n?1:0;
+		break;
+	case IW_VAL_PADDED_STRIDE:
+		ctx->padded_stride = n?1:0;
+		break;
+	case IW_VAL_INTERMED_PRECISION:
+		if(n==IW_PRECISION_FLOAT16 || n==IW_PRECISION_BFLOAT16)
+			ctx->intermed_precision = (iw_byte)n;
+		else
+			ctx->intermed_precision = IW_PRECISION_FLOAT32;
+		break;
+	case IW_VAL_MAX_THREADS:
+		if(n<1) n=1;
+		if(n>IW_MAX_THREADS) n=IW_MAX_THREADS;
+		ctx->max_threads = n;
+		break;
+	case IW_VAL_MIN_READ_WIDTH:
+		ctx->req.min_read_width = (n>0) ? n : 0;
+		break;
+	case IW_VAL_MIN_READ_HEIGHT:
+		ctx->req.min_read_height = (n>0) ? n : 0;
+		break;
 	}
 }
 
@@ -956,6 +1057,39 @@ IW_IMPL(int) iw_get_value(struct iw_context *ctx, int code)
 	case IW_VAL_NEGATE_TARGET:
 		ret = ctx->req.negate_target;
 		break;
+	case IW_VAL_INCREMENTAL_OPT_SCAN:
+		ret = ctx->opt_incremental_scan;
+		break;
+	case IW_VAL_QUANTIZE:
+		ret = ctx->quantize_maxcolors;
+		break;
+	case IW_VAL_QUANTIZE_DITHER:
+		ret = ctx->quantize_dither;
+		break;
+	case IW_VAL_PADDED_STRIDE:
+		ret = ctx->padded_stride;
+		break;
+	case IW_VAL_INTERMED_PRECISION:
+		ret = ctx->intermed_precision;
+		break;
+	case IW_VAL_MAX_THREADS:
+		ret = ctx->max_threads;
+		break;
+	case IW_VAL_MIN_READ_WIDTH:
+		ret = ctx->req.min_read_width;
+		break;
+	case IW_VAL_MIN_READ_HEIGHT:
+		ret = ctx->req.min_read_height;
+		break;
+	case IW_VAL_TARGETSIZE_QUALITY:
+		ret = ctx->req.targetsize_quality;
+		break;
+	case IW_VAL_TARGETSIZE_TRIES:
+		ret = ctx->req.targetsize_tries;
+		break;
+	case IW_VAL_TARGETSIZE_FILESIZE:
+		ret = ctx->req.targetsize_filesize;
+		break;
 	}
 
 	return ret;
@@ -993,6 +1127,19 @@ IW_IMPL(double) iw_get_value_dbl(struct iw_context *ctx, int code)
 	return ret;
 }
 
+// Options are kept when the context is reset, so they must not be allocated
+// from the arena.
+static char *option_strdup(struct iw_context *ctx, const char *s)
+{
+	size_t len;
+	char *s2;
+	len = strlen(s);
+	s2 = iw_malloc_ex(ctx, IW_MALLOCFLAG_NOARENA, len+1);
+	if(!s2) return NULL;
+	memcpy(s2, s, len+1);
+	return s2;
+}
+
 IW_IMPL(void) iw_set_option(struct iw_context *ctx, const char *name, const char *val)
 {
 #define IW_MAX_OPTIONS 32
@@ -1006,7 +1153,8 @@ IW_IMPL(void) iw_set_option(struct iw_context *ctx, const char *name, const char
 
 	// Allocate req.options if that hasn't been done yet.
 	if(!ctx->req.options) {
-		ctx->req.options = iw_mallocz(ctx, IW_MAX_OPTIONS*sizeof(struct iw_option_struct));
+		ctx->req.options = iw_malloc_ex(ctx, IW_MALLOCFLAG_ZEROMEM|IW_MALLOCFLAG_NOARENA,
+			IW_MAX_OPTIONS*sizeof(struct iw_option_struct));
 		if(!ctx->req.options) return;
 		ctx->req.options_numalloc = IW_MAX_OPTIONS;
 		ctx->req.options_count = 0;
@@ -1016,15 +1164,15 @@ IW_IMPL(void) iw_set_option(struct iw_context *ctx, const char *name, const char
 	for(i=0; i<ctx->req.options_count; i++) {
 		if(ctx->req.options[i].name && !strcmp(ctx->req.options[i].name, name)) {
 			iw_free(ctx, ctx->req.options[i].val);
-			ctx->req.options[i].val = iw_strdup(ctx, val);
+			ctx->req.options[i].val = option_strdup(ctx, val);
 			return;
 		}
 	}
 
 	// Add the new option.
 	if(ctx->req.options_count>=IW_MAX_OPTIONS) return;
-	ctx->req.options[ctx->req.options_count].name = iw_strdup(ctx, name);
-	ctx->req.options[ctx->req.options_count].val = iw_strdup(ctx, val);
+	ctx->req.options[ctx->req.options_count].name = option_strdup(ctx, name);
+	ctx->req.options[ctx->req.options_count].val = option_strdup(ctx, val);
 	ctx->req.options_count++;
 }
 
@@ -665,7 +665,7 @@ static int bmpr_read_uncompressed(struct iwbmprcontext *rctx)
 
 	bmp_bpr = iwbmp_calc_bpr(rctx->bitcount,rctx->width);
 
-	rctx->img->pixels = (iw_byte*)iw_malloc_large(rctx->ctx,rctx->img->bpr,rctx->img->height);
+	rctx->img->pixels = (iw_byte*)iw_malloc_input_pixels(rctx->ctx,rctx->img->bpr,rctx->img->height);
 	if(!rctx->img->pixels) goto done;
 
 	rowbuf = iw_malloc(rctx->ctx,bmp_bpr);
@@ -869,7 +869,7 @@ static int bmpr_read_rle(struct iwbmprcontext *rctx)
 	rctx->img->bit_depth = 8;
 	rctx->img->bpr = iw_calc_bytesperrow(rctx->width,32);
 
-	rctx->img->pixels = (iw_byte*)iw_malloc_large(rctx->ctx,rctx->img->bpr,rctx->img->height);
+	rctx->img->pixels = (iw_byte*)iw_malloc_input_pixels(rctx->ctx,rctx->img->bpr,rctx->img->height);
 	if(!rctx->img->pixels) goto done;
 
 	if(!bmpr_read_rle_internal(rctx)) goto done;
@@ -167,6 +167,12 @@ struct params_struct {
 	int include_screen;
 	int noopt_grayscale,noopt_binarytrns,noopt_palette;
 	int noopt_reduceto8,noopt_stripalpha;
+	int incremental_opt;
+	int quantize_maxcolors;
+	int quantize_dither;
+	int padded_stride;
+	int intermed_precision;
+	int max_threads;
 	int cs_in_set, cs_out_set;
 	struct iw_csdescr cs_in;
 	struct iw_csdescr cs_out;
@@ -1043,67 +1049,28 @@ static void iwcmd_set_bitdepth(struct params_struct *p, struct iw_context *ctx)
 	}
 }
 
-static int iwcmd_run(struct params_struct *p)
+static struct iw_context *iwcmd_create_context(struct params_struct *p)
 {
-	int retval = 0;
-	struct iw_context *ctx = NULL;
-	//int imgtype_read;
-	struct iw_iodescr readdescr;
-	struct iw_iodescr writedescr;
-	char errmsg[200];
 	struct iw_init_params init_params;
-	const char *s;
-	unsigned int profile;
-	int i;
-	int k;
-	int tmpflag;
+	struct iw_context *ctx;
 
 	memset(&init_params,0,sizeof(struct iw_init_params));
-	memset(&readdescr,0,sizeof(struct iw_iodescr));
-	memset(&writedescr,0,sizeof(struct iw_iodescr));
-
-	if(!p->noinfo) {
-		iwcmd_message(p,"%s \xe2\x86\x92 %s\n",p->input_uri.filename,p->output_uri.filename);
-	}
-
 	init_params.api_version = IW_VERSION_INT;
 	init_params.userdata = (void*)p;
 	init_params.mallocfn = my_mallocfn;
 	init_params.freefn = my_freefn;
 
 	ctx = iw_create_context(&init_params);
-	if(!ctx) goto done;
+	if(!ctx) return NULL;
 
 	iw_set_warning_fn(ctx,my_warning_handler);
+	return ctx;
+}
 
-	// Decide on the output format as early as possible, so we can give up
-	// quickly if it's not supported.
-	if(p->outfmt==IW_FORMAT_UNKNOWN) {
-		if(p->output_uri.scheme==IWCMD_SCHEME_FILE) {
-			p->outfmt=iw_detect_fmt_from_filename(p->output_uri.filename);
-		}
-		else if(p->output_uri.scheme==IWCMD_SCHEME_CLIPBOARD) {
-			p->outfmt=IW_FORMAT_BMP;
-		}
-	}
-
-	if(p->outfmt==IW_FORMAT_UNKNOWN) {
-		iw_set_error(ctx,"Unknown output format; use -outfmt.");
-		goto done;
-	}
-	else if(!iw_is_output_fmt_supported(p->outfmt)) {
-		s = iw_get_fmt_name(p->outfmt);
-		if(!s) s="(unknown)";
-		iw_set_errorf(ctx,"Writing %s files is not supported.",s);
-		goto done;
-	}
-
-	if(p->output_uri.scheme==IWCMD_SCHEME_CLIPBOARD) {
-		if(p->outfmt!=IW_FORMAT_BMP) {
-			iw_set_error(ctx,"Only BMP images can be copied to the clipboard");
-			goto done;
-		}
-	}
+// Settings that don't depend on the input image.
+static void iwcmd_apply_settings(struct params_struct *p, struct iw_context *ctx)
+{
+	int i;
 
 	for(i=0; i<p->options_count; i++) {
 		iw_set_option(ctx, p->options[i].name, p->options[i].val);
@@ -1133,6 +1100,12 @@ static int iwcmd_run(struct params_struct *p)
 	if(p->noopt_reduceto8) iw_set_allow_opt(ctx,IW_OPT_16_TO_8,0);
 	if(p->noopt_stripalpha) iw_set_allow_opt(ctx,IW_OPT_STRIP_ALPHA,0);
 	if(p->noopt_binarytrns) iw_set_allow_opt(ctx,IW_OPT_BINARY_TRNS,0);
+	if(p->incremental_opt) iw_set_value(ctx,IW_VAL_INCREMENTAL_OPT_SCAN,1);
+	if(p->quantize_maxcolors>0) iw_set_value(ctx,IW_VAL_QUANTIZE,p->quantize_maxcolors);
+	if(p->quantize_dither) iw_set_value(ctx,IW_VAL_QUANTIZE_DITHER,1);
+	if(p->padded_stride) iw_set_value(ctx,IW_VAL_PADDED_STRIDE,1);
+	if(p->intermed_precision) iw_set_value(ctx,IW_VAL_INTERMED_PRECISION,p->intermed_precision);
+	if(p->max_threads>0) iw_set_value(ctx,IW_VAL_MAX_THREADS,p->max_threads);
 	if(p->edge_policy_x>=0) iw_set_value(ctx,IW_VAL_EDGE_POLICY_X,p->edge_policy_x);
 	if(p->edge_policy_y>=0) iw_set_value(ctx,IW_VAL_EDGE_POLICY_Y,p->edge_policy_y);
 	if(p->grayscale_formula>=0) {
@@ -1144,6 +1117,555 @@ static int iwcmd_run(struct params_struct *p)
 	if(p->page_to_read>0) iw_set_value(ctx,IW_VAL_PAGE_TO_READ,p->page_to_read);
 	if(p->include_screen>=0) iw_set_value(ctx,IW_VAL_INCLUDE_SCREEN,p->include_screen);
 	if(p->negate) iw_set_value(ctx,IW_VAL_NEGATE_TARGET,1);
+}
+
+// Finish deciding on the resize algorithms, once the target image size is
+// known. Call iwcmd_set_resize() afterward.
+static void iwcmd_prepare_resize(struct params_struct *p)
+{
+	int tmpflag;
+
+	tmpflag = 0; // Have we displayed a "gaussian filter" warning yet?
+	if(p->resize_blur_x.is_set && !p->resize_alg_x.family) {
+		if(!p->nowarn) {
+			iwcmd_warning(p,"Notice: Selecting gaussian filter for blurring\n");
+			tmpflag = 1;
+		}
+		p->resize_alg_x.family = IW_RESIZETYPE_GAUSSIAN;
+	}
+	if(p->resize_blur_y.is_set && !p->resize_alg_y.family) {
+		if(!p->nowarn && !tmpflag) {
+			iwcmd_warning(p,"Notice: Selecting gaussian filter for blurring\n");
+		}
+		p->resize_alg_y.family = IW_RESIZETYPE_GAUSSIAN;
+	}
+
+	// We wait until we know the target image size to do this, so that we can
+	// support our "interpolate" option.
+	if(p->resize_alg_x.family) {
+		if(p->resize_blur_x.interpolate && p->dst_width<p->src_width) {
+			// If downscaling, "sharpen" the filter to emulate interpolation.
+			p->resize_blur_x.blur *= ((double)p->dst_width)/p->src_width;
+		}
+	}
+	if(p->resize_alg_y.family) {
+		if(p->resize_blur_y.interpolate && p->dst_height<p->src_height) {
+			p->resize_blur_y.blur *= ((double)p->dst_height)/p->src_height;
+		}
+	}
+}
+
+static void iwcmd_print_size_message(struct params_struct *p)
+{
+	if(p->noinfo) {
+		;
+	}
+	else if(p->dst_width==p->src_width && p->dst_height==p->src_height) {
+		iwcmd_message(p,"Processing: %d\xc3\x97%d\n",p->dst_width,p->dst_height);
+	}
+	else {
+		iwcmd_message(p,"Resizing: %d\xc3\x97%d \xe2\x86\x92 %d\xc3\x97%d\n",p->src_width,p->src_height,
+			p->dst_width,p->dst_height);
+	}
+}
+
+static int iwcmd_open_output(struct params_struct *p, struct iw_context *ctx,
+	struct iw_iodescr *writedescr)
+{
+	char errmsg[200];
+
+	if(p->output_uri.scheme==IWCMD_SCHEME_FILE) {
+		writedescr->write_fn = my_writefn;
+		writedescr->seek_fn = my_seekfn;
+		writedescr->fp = (void*)iwcmd_fopen(p->output_uri.filename, "wb", errmsg, sizeof(errmsg));
+		if(!writedescr->fp) {
+			iw_set_errorf(ctx,"Failed to open %s for writing: %s", p->output_uri.filename, errmsg);
+			return 0;
+		}
+	}
+	else if(p->output_uri.scheme==IWCMD_SCHEME_STDOUT) {
+#ifdef IW_WINDOWS
+		(void)_setmode(_fileno(stdout),_O_BINARY);
+#endif
+		writedescr->write_fn = my_writefn;
+		writedescr->fp = (void*)stdout;
+	}
+#ifdef IW_WINDOWS
+	else if(p->output_uri.scheme==IWCMD_SCHEME_CLIPBOARD) {
+		writedescr->write_fn = my_clipboard_writefn;
+		writedescr->seek_fn = my_clipboard_w_seekfn;
+	}
+#endif
+	else {
+		iw_set_error(ctx,"Unsupported output scheme");
+		return 0;
+	}
+	return 1;
+}
+
+static void iwcmd_close_output(struct params_struct *p, struct iw_context *ctx,
+	struct iw_iodescr *writedescr)
+{
+	if(p->output_uri.scheme==IWCMD_SCHEME_FILE) {
+		fclose((FILE*)writedescr->fp);
+	}
+#ifdef IW_WINDOWS
+	else if(p->output_uri.scheme==IWCMD_SCHEME_CLIPBOARD) {
+		finish_clipboard_write(p,ctx);
+	}
+#endif
+	writedescr->fp=NULL;
+}
+
+// Go back to the start of the input file, so that it can be read again.
+static int iwcmd_rewind_input(struct params_struct *p, struct iw_context *ctx,
+	struct iw_iodescr *readdescr)
+{
+	clearerr((FILE*)readdescr->fp);
+	if(fseek((FILE*)readdescr->fp,(long)p->input_initial_bytes_stored,SEEK_SET)) {
+		iw_set_error(ctx,"Failed to seek in input file");
+		return 0;
+	}
+	p->input_initial_bytes_consumed = 0;
+	return 1;
+}
+
+#if IW_SUPPORT_JPEG == 1
+// Returns 1 if the input and output are JPEG, and nothing has been requested
+// that changes the colors or the type of the image.
+static int iwcmd_jpeg_to_jpeg_as_is(struct params_struct *p)
+{
+	int k;
+
+	if(p->infmt!=IW_FORMAT_JPEG || p->outfmt!=IW_FORMAT_JPEG) return 0;
+	// The input file may need to be read twice.
+	if(p->input_uri.scheme!=IWCMD_SCHEME_FILE) return 0;
+	if(p->output_uri.scheme!=IWCMD_SCHEME_FILE &&
+		p->output_uri.scheme!=IWCMD_SCHEME_STDOUT)
+	{
+		return 0;
+	}
+
+	if(p->depth || p->depthcc || p->sample_type>=0) return 0;
+	if(p->color_count_all || p->color_count_nonalpha) return 0;
+	if(p->dither_all.family>=0 || p->dither_nonalpha.family>=0) return 0;
+	for(k=0;k<5;k++) {
+		if(p->channel_depth[k] || p->color_count[k] || p->dither[k].family>=0) return 0;
+	}
+	for(k=0;k<3;k++) {
+		if(p->offset_h[k]!=0.0 || p->offset_v[k]!=0.0) return 0;
+	}
+	if(p->grayscale || p->condgrayscale || p->negate || p->apply_bkgd) return 0;
+	if(p->cs_in_set || p->cs_out_set) return 0;
+	return 1;
+}
+
+// Returns 1 if the options allow a JPEG-to-JPEG conversion to be done
+// losslessly with iw_jpeg_lossless_transform(), instead of by decoding and
+// re-encoding the image. That is, if nothing has been requested that would
+// change the pixels (other than rotating, mirroring, and cropping them), or
+// that needs them to be re-encoded.
+static int iwcmd_lossless_jpeg_allowed(struct params_struct *p, struct iw_context *ctx)
+{
+	int i;
+	const char *name;
+	const char *optv;
+
+	if(!iwcmd_jpeg_to_jpeg_as_is(p)) return 0;
+
+	if(p->dst_width_req>0 || p->dst_height_req>0 || p->rel_width_flag ||
+		p->rel_height_flag || p->imagesize_set || p->translate_set)
+	{
+		return 0;
+	}
+	if(p->resize_alg_x.family || p->resize_alg_y.family ||
+		p->resize_blur_x.is_set || p->resize_blur_y.is_set)
+	{
+		return 0;
+	}
+	if(p->density_policy!=IWCMD_DENSITY_POLICY_AUTO) return 0;
+
+	optv = iw_get_option(ctx, "jpeg:lossless");
+	if(optv && !iw_parse_int(optv)) return 0;
+
+	for(i=0; i<p->options_count; i++) {
+		name = p->options[i].name;
+		if(!strcmp(name,"jpeg:lossless")) {
+			;
+		}
+		else if(!strncmp(name,"jpeg:",5) && strcmp(name,"jpeg:arith") &&
+			strcmp(name,"jpeg:optcoding") && strcmp(name,"jpeg:rstm") &&
+			strcmp(name,"jpeg:rstr"))
+		{
+			// E.g. jpeg:quality
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+// If the image can be rotated/cropped losslessly, do it, and set *pdone.
+// Otherwise, rewind the input file, so that it can be read normally.
+static int iwcmd_try_lossless_jpeg(struct params_struct *p, struct iw_context *ctx,
+	struct iw_iodescr *readdescr, struct iw_iodescr *writedescr, int *pdone)
+{
+	unsigned int flags;
+	int crop_x, crop_y, crop_w, crop_h;
+	int ret;
+
+	*pdone = 0;
+
+	if(p->use_crop) {
+		crop_x = p->crop_x; crop_y = p->crop_y;
+		crop_w = p->crop_w; crop_h = p->crop_h;
+	}
+	else {
+		crop_x = 0; crop_y = 0;
+		crop_w = -1; crop_h = -1;
+	}
+
+	// If the pixels aren't square, we'd normally resize the image. If the
+	// transform doesn't change anything, there's no reason to prefer it
+	// over re-encoding the image.
+	flags = IW_JPEGXFORM_SQUARE_PIXELS | IW_JPEGXFORM_REQUIRE_CHANGE;
+
+	ret = iw_jpeg_lossless_transform(ctx,readdescr,NULL,p->reorient,
+		crop_x,crop_y,crop_w,crop_h,flags);
+	if(iw_get_errorflag(ctx)) return 0;
+
+	if(!iwcmd_rewind_input(p,ctx,readdescr)) return 0;
+
+	if(!ret) return 1;
+
+	if(p->interlace) {
+		iw_set_value(ctx,IW_VAL_OUTPUT_INTERLACED,1);
+	}
+
+	if(!p->noinfo) {
+		iwcmd_message(p,"Transforming losslessly\n");
+	}
+
+	if(!iwcmd_open_output(p,ctx,writedescr)) return 0;
+	if(!iw_jpeg_lossless_transform(ctx,readdescr,writedescr,p->reorient,
+		crop_x,crop_y,crop_w,crop_h,flags))
+	{
+		return 0;
+	}
+	iwcmd_close_output(p,ctx,writedescr);
+	*pdone = 1;
+	return 1;
+}
+
+// Returns 1 if "-opt jpeg:planar" was used, and the image can be resized
+// with iwcmd_run_planar_jpeg().
+static int iwcmd_planar_jpeg_allowed(struct params_struct *p, struct iw_context *ctx)
+{
+	int i;
+	const char *name;
+	const char *optv;
+
+	optv = iw_get_option(ctx, "jpeg:planar");
+	if(!optv || !iw_parse_int(optv)) return 0;
+
+	if(!iwcmd_jpeg_to_jpeg_as_is(p)) return 0;
+	if(p->use_crop || p->imagesize_set || p->translate_set) return 0;
+
+	for(i=0; i<p->options_count; i++) {
+		name = p->options[i].name;
+		if(!strncmp(name,"jpeg:sampling",13) || !strcmp(name,"jpeg:colortype") ||
+			!strcmp(name,"jpeg:bgycc") || !strcmp(name,"jpeg:block"))
+		{
+			// These affect the structure of the output image.
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+// Report the result of the "jpeg:targetsize" or "webp:targetsize" option.
+static void iwcmd_report_targetsize(struct params_struct *p, struct iw_context *ctx)
+{
+	int num_tries;
+
+	if(p->noinfo) return;
+	num_tries = iw_get_value(ctx,IW_VAL_TARGETSIZE_TRIES);
+	if(num_tries<1) return;
+	iwcmd_message(p,"Target size: quality %d, %d bytes (%d %s)\n",
+		iw_get_value(ctx,IW_VAL_TARGETSIZE_QUALITY),
+		iw_get_value(ctx,IW_VAL_TARGETSIZE_FILESIZE),
+		num_tries, num_tries==1?"try":"tries");
+}
+
+// Resize a JPEG image without converting it to RGB: The Y, Cb, and Cr planes
+// are each resized by a separate context, at their own resolution, and the
+// sampling factors of the image are kept.
+// If the image isn't YCbCr or grayscale, rewinds the input file, and returns
+// without setting *pdone.
+static int iwcmd_run_planar_jpeg(struct params_struct *p, struct iw_context *ctx,
+	struct iw_iodescr *readdescr, struct iw_iodescr *writedescr, int *pdone)
+{
+	struct iw_context *plane_ctx[3];
+	struct iw_csdescr cs_linear;
+	int num_planes = 0;
+	int h_samp[3], v_samp[3];
+	int max_h_samp, max_v_samp;
+	int plane_src_w, plane_src_h;
+	int plane_dst_w, plane_dst_h;
+	double plane_size_x, plane_size_y;
+	int tmpi;
+	int k;
+	char errmsg[200];
+	int retval = 0;
+
+	*pdone = 0;
+
+	for(k=0; k<3; k++) {
+		plane_ctx[k] = NULL;
+	}
+	for(k=0; k<3; k++) {
+		plane_ctx[k] = iwcmd_create_context(p);
+		if(!plane_ctx[k]) goto done;
+		iwcmd_apply_settings(p,plane_ctx[k]);
+	}
+
+	if(!iw_read_jpeg_planes(ctx,readdescr,plane_ctx,&num_planes,h_samp,v_samp)) goto done;
+
+	if(num_planes==0) {
+		if(!iwcmd_rewind_input(p,ctx,readdescr)) goto done;
+		retval = 1;
+		goto done;
+	}
+
+	fclose((FILE*)readdescr->fp);
+	readdescr->fp=NULL;
+
+	max_h_samp = 1;
+	max_v_samp = 1;
+	for(k=0; k<num_planes; k++) {
+		if(p->reorient) {
+			iw_reorient_image(plane_ctx[k],p->reorient);
+			if(p->reorient & 0x04) {
+				tmpi = h_samp[k];
+				h_samp[k] = v_samp[k];
+				v_samp[k] = tmpi;
+			}
+		}
+		if(h_samp[k]>max_h_samp) max_h_samp = h_samp[k];
+		if(v_samp[k]>max_v_samp) max_v_samp = v_samp[k];
+	}
+
+	// The Y plane determines the size of the image.
+	p->src_width=iw_get_value(plane_ctx[0],IW_VAL_INPUT_WIDTH);
+	p->src_height=iw_get_value(plane_ctx[0],IW_VAL_INPUT_HEIGHT);
+	figure_out_size_and_density(p,plane_ctx[0]);
+	iwcmd_prepare_resize(p);
+	iwcmd_print_size_message(p);
+
+	// The samples aren't really linear, but that's the way to tell the
+	// library to resize them as they are.
+	iw_make_linear_csdescr(&cs_linear);
+
+	for(k=0; k<num_planes; k++) {
+		iw_set_output_profile(plane_ctx[k], iw_get_profile_by_fmt(IW_FORMAT_JPEG));
+		iw_set_input_colorspace(plane_ctx[k],&cs_linear);
+		iw_set_output_colorspace(plane_ctx[k],&cs_linear);
+		// Each plane is a single gray channel; don't let the library
+		// expand it to RGB.
+		iw_set_value(plane_ctx[k],IW_VAL_CVT_TO_GRAYSCALE,1);
+
+		if(p->resize_alg_x.family) {
+			iwcmd_set_resize(plane_ctx[k],IW_DIMENSION_H,&p->resize_alg_x,&p->resize_blur_x);
+		}
+		if(p->resize_alg_y.family) {
+			iwcmd_set_resize(plane_ctx[k],IW_DIMENSION_V,&p->resize_alg_y,&p->resize_blur_y);
+		}
+
+		// This is how libjpeg calculates the size of a plane.
+		plane_dst_w = (p->dst_width*h_samp[k] + max_h_samp-1)/max_h_samp;
+		plane_dst_h = (p->dst_height*v_samp[k] + max_v_samp-1)/max_v_samp;
+		iw_set_output_canvas_size(plane_ctx[k],plane_dst_w,plane_dst_h);
+
+		// Scale every plane by the same factor as the Y plane, so that they
+		// stay aligned. The last row or column of a subsampled plane may
+		// cover less than a whole sample's worth of the image.
+		plane_src_w = iw_get_value(plane_ctx[k],IW_VAL_INPUT_WIDTH);
+		plane_src_h = iw_get_value(plane_ctx[k],IW_VAL_INPUT_HEIGHT);
+		plane_size_x = ((double)plane_src_w*p->dst_width)/p->src_width;
+		plane_size_y = ((double)plane_src_h*p->dst_height)/p->src_height;
+		if(fabs(plane_size_x-plane_dst_w)>0.000001 || fabs(plane_size_y-plane_dst_h)>0.000001) {
+			iw_set_output_image_size(plane_ctx[k],plane_size_x,plane_size_y);
+		}
+
+		if(!iw_process_image(plane_ctx[k])) goto done;
+	}
+
+	if(p->interlace) {
+		iw_set_value(ctx,IW_VAL_OUTPUT_INTERLACED,1);
+	}
+
+	if(!iwcmd_open_output(p,ctx,writedescr)) goto done;
+	if(!iw_write_jpeg_planes(ctx,writedescr,plane_ctx,num_planes,h_samp,v_samp)) goto done;
+	iwcmd_close_output(p,ctx,writedescr);
+	iwcmd_report_targetsize(p,ctx);
+
+	*pdone = 1;
+	retval = 1;
+
+done:
+	for(k=0; k<3; k++) {
+		if(!plane_ctx[k]) continue;
+		if(iw_get_errorflag(plane_ctx[k]) && !iw_get_errorflag(ctx)) {
+			iw_set_error(ctx,iw_get_errormsg(plane_ctx[k],errmsg,sizeof(errmsg)));
+		}
+		iw_destroy_context(plane_ctx[k]);
+	}
+	return retval;
+}
+#endif
+
+struct iwcmd_gif_composite_ctx {
+	int page; // The frame we want. 1=first
+	int found;
+};
+
+// An iw_gif_frame_fn, used with "-opt gif:composite". When the requested
+// frame is reached, copies the screen to the input image, and stops reading.
+static int iwcmd_gif_composite_frame(struct iw_context *ctx, void *userdata,
+	const struct iw_image *img, const struct iw_gif_frame_info *info)
+{
+	struct iwcmd_gif_composite_ctx *gc = (struct iwcmd_gif_composite_ctx*)userdata;
+	struct iw_image img2;
+
+	if(info->frame_num < gc->page) return 1;
+
+	img2 = *img; // struct copy
+	img2.pixels = (iw_byte*)iw_malloc_input_pixels(ctx,img->bpr,img->height);
+	if(!img2.pixels) return 0;
+	memcpy(img2.pixels,img->pixels,img->bpr*img->height);
+	iw_set_input_image(ctx,&img2);
+
+	if(info->has_bkgd_label) {
+		iw_set_input_bkgd_label_2(ctx,&info->bkgd_label);
+	}
+	gc->found = 1;
+	return 0;
+}
+
+// Read a GIF file, and set the input image to the screen as it looks when
+// the requested page is displayed, after playing through the frames before
+// it.
+static int iwcmd_read_gif_composite(struct params_struct *p, struct iw_context *ctx,
+	struct iw_iodescr *readdescr)
+{
+	struct iwcmd_gif_composite_ctx gc;
+	struct iw_csdescr csdescr;
+
+	memset(&gc,0,sizeof(struct iwcmd_gif_composite_ctx));
+	gc.page = (p->page_to_read>0) ? p->page_to_read : 1;
+
+	// The frames are composited onto the screen, so there is no way to
+	// extract just one of them.
+	if(p->include_screen==0) {
+		iw_warning(ctx,"-noincludescreen is ignored when gif:composite is used");
+	}
+
+	if(!iw_read_gif_frames(ctx,readdescr,iwcmd_gif_composite_frame,(void*)&gc)) {
+		return 0;
+	}
+	if(!gc.found) {
+		iw_set_error(ctx,"Image not found");
+		return 0;
+	}
+
+	// Assume GIF images are sRGB.
+	iw_make_srgb_csdescr_2(&csdescr);
+	iw_set_input_colorspace(ctx,&csdescr);
+	return 1;
+}
+
+// Tell the library how big the image needs to be, so that it can decode a
+// reduced-size version of it ("-opt jpeg:thumbnail"), or use faster decoding
+// methods if it's going to be shrunk a lot ("-opt jpeg:fastdecode").
+static void iwcmd_set_min_read_size(struct params_struct *p, struct iw_context *ctx)
+{
+	int w, h;
+
+	// We need to know the target size in pixels, and the source pixels
+	// have to be the original ones.
+	if(p->noresize_flag || p->rel_width_flag || p->rel_height_flag) return;
+	if(p->use_crop || p->imagesize_set || p->translate_set) return;
+
+	w = (p->dst_width_req>0) ? p->dst_width_req : 0;
+	h = (p->dst_height_req>0) ? p->dst_height_req : 0;
+	if(w==0 && h==0) return;
+
+	if(p->reorient&0x04) {
+		// The image will be transposed, so the target width is the source
+		// height, and vice versa.
+		iw_set_value(ctx,IW_VAL_MIN_READ_WIDTH,h);
+		iw_set_value(ctx,IW_VAL_MIN_READ_HEIGHT,w);
+	}
+	else {
+		iw_set_value(ctx,IW_VAL_MIN_READ_WIDTH,w);
+		iw_set_value(ctx,IW_VAL_MIN_READ_HEIGHT,h);
+	}
+}
+
+static int iwcmd_run(struct params_struct *p)
+{
+	int retval = 0;
+	struct iw_context *ctx = NULL;
+	//int imgtype_read;
+	struct iw_iodescr readdescr;
+	struct iw_iodescr writedescr;
+	char errmsg[200];
+	const char *s;
+	unsigned int profile;
+	int i;
+	int k;
+
+	memset(&readdescr,0,sizeof(struct iw_iodescr));
+	memset(&writedescr,0,sizeof(struct iw_iodescr));
+
+	if(!p->noinfo) {
+		iwcmd_message(p,"%s \xe2\x86\x92 %s\n",p->input_uri.filename,p->output_uri.filename);
+	}
+
+	ctx = iwcmd_create_context(p);
+	if(!ctx) goto done;
+
+	// Decide on the output format as early as possible, so we can give up
+	// quickly if it's not supported.
+	if(p->outfmt==IW_FORMAT_UNKNOWN) {
+		if(p->output_uri.scheme==IWCMD_SCHEME_FILE) {
+			p->outfmt=iw_detect_fmt_from_filename(p->output_uri.filename);
+		}
+		else if(p->output_uri.scheme==IWCMD_SCHEME_CLIPBOARD) {
+			p->outfmt=IW_FORMAT_BMP;
+		}
+	}
+
+	if(p->outfmt==IW_FORMAT_UNKNOWN) {
+		iw_set_error(ctx,"Unknown output format; use -outfmt.");
+		goto done;
+	}
+	else if(!iw_is_output_fmt_supported(p->outfmt)) {
+		s = iw_get_fmt_name(p->outfmt);
+		if(!s) s="(unknown)";
+		iw_set_errorf(ctx,"Writing %s files is not supported.",s);
+		goto done;
+	}
+
+	if(p->output_uri.scheme==IWCMD_SCHEME_CLIPBOARD) {
+		if(p->outfmt!=IW_FORMAT_BMP) {
+			iw_set_error(ctx,"Only BMP images can be copied to the clipboard");
+			goto done;
+		}
+	}
+
+	iwcmd_apply_settings(p,ctx);
 
 	if(p->input_uri.scheme==IWCMD_SCHEME_FILE) {
 		readdescr.read_fn = my_readfn;
@@ -1195,7 +1717,36 @@ static int iwcmd_run(struct params_struct *p)
 		iw_set_value(ctx,IW_VAL_BMP_NO_FILEHEADER,1);
 	}
 
-	if(!iw_read_file_by_fmt(ctx,&readdescr,p->infmt)) goto done;
+	// This has to happen before the planar JPEG path, which uses the same
+	// hints to choose its decoding options.
+	iwcmd_set_min_read_size(p,ctx);
+
+#if IW_SUPPORT_JPEG == 1
+	if(iwcmd_lossless_jpeg_allowed(p,ctx)) {
+		int done_flag;
+		if(!iwcmd_try_lossless_jpeg(p,ctx,&readdescr,&writedescr,&done_flag)) goto done;
+		if(done_flag) {
+			retval = 1;
+			goto done;
+		}
+	}
+	if(iwcmd_planar_jpeg_allowed(p,ctx)) {
+		int done_flag;
+		if(!iwcmd_run_planar_jpeg(p,ctx,&readdescr,&writedescr,&done_flag)) goto done;
+		if(done_flag) {
+			retval = 1;
+			goto done;
+		}
+	}
+#endif
+
+	s = iw_get_option(ctx,"gif:composite");
+	if(p->infmt==IW_FORMAT_GIF && s && iw_parse_int(s)) {
+		if(!iwcmd_read_gif_composite(p,ctx,&readdescr)) goto done;
+	}
+	else {
+		if(!iw_read_file_by_fmt(ctx,&readdescr,p->infmt)) goto done;
+	}
 
 	if(p->input_uri.scheme==IWCMD_SCHEME_FILE) {
 		fclose((FILE*)readdescr.fp);
@@ -1354,47 +1905,15 @@ static int iwcmd_run(struct params_struct *p)
 		iw_set_value_dbl(ctx,IW_VAL_TRANSLATE_Y,p->translate_y);
 	}
 
-	tmpflag = 0; // Have we displayed a "gaussian filter" warning yet?
-	if(p->resize_blur_x.is_set && !p->resize_alg_x.family) {
-		if(!p->nowarn) {
-			iwcmd_warning(p,"Notice: Selecting gaussian filter for blurring\n");
-			tmpflag = 1;
-		}
-		p->resize_alg_x.family = IW_RESIZETYPE_GAUSSIAN;
-	}
-	if(p->resize_blur_y.is_set && !p->resize_alg_y.family) {
-		if(!p->nowarn && !tmpflag) {
-			iwcmd_warning(p,"Notice: Selecting gaussian filter for blurring\n");
-		}
-		p->resize_alg_y.family = IW_RESIZETYPE_GAUSSIAN;
-	}
-
-	// Wait until we know the target image size to set the resize algorithm, so
-	// that we can support our "interpolate" option.
+	iwcmd_prepare_resize(p);
 	if(p->resize_alg_x.family) {
-		if(p->resize_blur_x.interpolate && p->dst_width<p->src_width) {
-			// If downscaling, "sharpen" the filter to emulate interpolation.
-			p->resize_blur_x.blur *= ((double)p->dst_width)/p->src_width;
-		}
 		iwcmd_set_resize(ctx,IW_DIMENSION_H,&p->resize_alg_x,&p->resize_blur_x);
 	}
 	if(p->resize_alg_y.family) {
-		if(p->resize_blur_y.interpolate && p->dst_height<p->src_height) {
-			p->resize_blur_y.blur *= ((double)p->dst_height)/p->src_height;
-		}
 		iwcmd_set_resize(ctx,IW_DIMENSION_V,&p->resize_alg_y,&p->resize_blur_y);
 	}
 
-	if(p->noinfo) {
-		;
-	}
-	else if(p->dst_width==p->src_width && p->dst_height==p->src_height) {
-		iwcmd_message(p,"Processing: %d\xc3\x97%d\n",p->dst_width,p->dst_height);
-	}
-	else {
-		iwcmd_message(p,"Resizing: %d\xc3\x97%d \xe2\x86\x92 %d\xc3\x97%d\n",p->src_width,p->src_height,
-			p->dst_width,p->dst_height);
-	}
+	iwcmd_print_size_message(p);
 
 	iw_set_output_canvas_size(ctx,p->dst_width,p->dst_height);
 	if(p->imagesize_set) {
@@ -1413,44 +1932,12 @@ static int iwcmd_run(struct params_struct *p)
 		iw_set_value(ctx,IW_VAL_OUTPUT_INTERLACED,1);
 	}
 
-	if(p->output_uri.scheme==IWCMD_SCHEME_FILE) {
-		writedescr.write_fn = my_writefn;
-		writedescr.seek_fn = my_seekfn;
-		writedescr.fp = (void*)iwcmd_fopen(p->output_uri.filename, "wb", errmsg, sizeof(errmsg));
-		if(!writedescr.fp) {
-			iw_set_errorf(ctx,"Failed to open %s for writing: %s", p->output_uri.filename, errmsg);
-			goto done;
-		}
-	}
-	else if(p->output_uri.scheme==IWCMD_SCHEME_STDOUT) {
-#ifdef IW_WINDOWS
-		(void)_setmode(_fileno(stdout),_O_BINARY);
-#endif
-		writedescr.write_fn = my_writefn;
-		writedescr.fp = (void*)stdout;
-	}
-#ifdef IW_WINDOWS
-	else if(p->output_uri.scheme==IWCMD_SCHEME_CLIPBOARD) {
-		writedescr.write_fn = my_clipboard_writefn;
-		writedescr.seek_fn = my_clipboard_w_seekfn;
-	}
-#endif
-	else {
-		iw_set_error(ctx,"Unsupported output scheme");
-		goto done;
-	}
+	if(!iwcmd_open_output(p,ctx,&writedescr)) goto done;
 
 	if(!iw_write_file_by_fmt(ctx,&writedescr,p->outfmt)) goto done;
 
-	if(p->output_uri.scheme==IWCMD_SCHEME_FILE) {
-		fclose((FILE*)writedescr.fp);
-	}
-#ifdef IW_WINDOWS
-	else if(p->output_uri.scheme==IWCMD_SCHEME_CLIPBOARD) {
-		finish_clipboard_write(p,ctx);
-	}
-#endif
-	writedescr.fp=NULL;
+	iwcmd_close_output(p,ctx,&writedescr);
+	iwcmd_report_targetsize(p,ctx);
 
 	retval = 1;
 
@@ -1774,6 +2261,8 @@ static int iwcmd_decode_dithertype(struct params_struct *p,const char *s,struct
 	 {"halftone"  ,IW_DITHERFAMILY_ORDERED,IW_DITHERSUBTYPE_HALFTONE},
 	 {"r"         ,IW_DITHERFAMILY_RANDOM ,IW_DITHERSUBTYPE_DEFAULT},
 	 {"r2"        ,IW_DITHERFAMILY_RANDOM ,IW_DITHERSUBTYPE_SAMEPATTERN},
+	 {"rh"        ,IW_DITHERFAMILY_RANDOM ,IW_DITHERSUBTYPE_HASH},
+	 {"rh2"       ,IW_DITHERFAMILY_RANDOM ,IW_DITHERSUBTYPE_HASH_SAMEPATTERN},
 	 {"jjn"       ,IW_DITHERFAMILY_ERRDIFF,IW_DITHERSUBTYPE_JJN},
 	 {"stucki"    ,IW_DITHERFAMILY_ERRDIFF,IW_DITHERSUBTYPE_STUCKI},
 	 {"burkes"    ,IW_DITHERFAMILY_ERRDIFF,IW_DITHERSUBTYPE_BURKES},
@@ -1996,6 +2485,24 @@ static int iwcmd_option_intent(struct params_struct *p, const char *s)
 
 }
 
+static int iwcmd_option_intermedprec(struct params_struct *p, const char *s)
+{
+	if(!strcmp(s,"f32")) {
+		p->intermed_precision = IW_PRECISION_FLOAT32;
+	}
+	else if(!strcmp(s,"f16")) {
+		p->intermed_precision = IW_PRECISION_FLOAT16;
+	}
+	else if(!strcmp(s,"bf16")) {
+		p->intermed_precision = IW_PRECISION_BFLOAT16;
+	}
+	else {
+		iwcmd_error(p,"Unknown precision \xe2\x80\x9c%s\xe2\x80\x9d\n",s);
+		return 0;
+	}
+	return 1;
+}
+
 static int iwcmd_option_reorient(struct params_struct *p, const char *s)
 {
 	if(s[0]>='0' && s[0]<='9') {
@@ -2082,7 +2589,7 @@ enum iwcmd_param_types {
  PT_EDGE_POLICY_Y, PT_GRAYSCALEFORMULA,
  PT_DENSITY_POLICY, PT_PAGETOREAD, PT_INCLUDESCREEN, PT_NOINCLUDESCREEN,
  PT_BESTFIT, PT_NOBESTFIT, PT_NORESIZE, PT_GRAYSCALE, PT_CONDGRAYSCALE, PT_NOGAMMA,
- PT_INTCLAMP, PT_NOCSLABEL, PT_NOOPT, PT_USEBKGDLABEL, PT_BKGDLABEL, PT_NOBKGDLABEL,
+ PT_INTCLAMP, PT_NOCSLABEL, PT_NOOPT, PT_INCREMENTALOPT, PT_QUANTIZE, PT_QUANTIZEDITHER, PT_PADDEDSTRIDE, PT_INTERMEDPREC, PT_THREADS, PT_USEBKGDLABEL, PT_BKGDLABEL, PT_NOBKGDLABEL,
  PT_MSGSTOSTDOUT, PT_MSGSTOSTDERR,
  PT_QUIET, PT_NOWARN, PT_NOINFO, PT_VERSION, PT_HELP, PT_ENCODING
 };
@@ -2158,6 +2665,7 @@ static int process_option_name(struct params_struct *p, struct parsestate_struct
 		{"compress",PT_COMPRESS,1},
 		{"colortype",PT_COLORTYPE,1},
 		{"page",PT_PAGETOREAD,1},
+		{"quantize",PT_QUANTIZE,1},
 		{"jpegquality",PT_JPEGQUALITY,1},
 		{"jpegsampling",PT_JPEGSAMPLING,1},
 		{"webpquality",PT_WEBPQUALITY,1},
@@ -2175,6 +2683,8 @@ static int process_option_name(struct params_struct *p, struct parsestate_struct
 		{"grayscaleformula",PT_GRAYSCALEFORMULA,1},
 		{"intent",PT_INTENT,1},
 		{"noopt",PT_NOOPT,1},
+		{"intermedprec",PT_INTERMEDPREC,1},
+		{"threads",PT_THREADS,1},
 		{"encoding",PT_ENCODING,1},
 		{"interlace",PT_INTERLACE,0},
 		{"bestfit",PT_BESTFIT,0},
@@ -2185,6 +2695,9 @@ static int process_option_name(struct params_struct *p, struct parsestate_struct
 		{"nogamma",PT_NOGAMMA,0},
 		{"intclamp",PT_INTCLAMP,0},
 		{"nocslabel",PT_NOCSLABEL,0},
+		{"incrementalopt",PT_INCREMENTALOPT,0},
+		{"quantizedither",PT_QUANTIZEDITHER,0},
+		{"paddedstride",PT_PADDEDSTRIDE,0},
 		{"usebkgdlabel",PT_USEBKGDLABEL,0},
 		{"nobkgdlabel",PT_NOBKGDLABEL,0},
 		{"includescreen",PT_INCLUDESCREEN,0},
@@ -2246,6 +2759,15 @@ static int process_option_name(struct params_struct *p, struct parsestate_struct
 	case PT_NOCSLABEL:
 		p->no_cslabel=1;
 		break;
+	case PT_INCREMENTALOPT:
+		p->incremental_opt=1;
+		break;
+	case PT_QUANTIZEDITHER:
+		p->quantize_dither=1;
+		break;
+	case PT_PADDEDSTRIDE:
+		p->padded_stride=1;
+		break;
 	case PT_USEBKGDLABEL:
 		p->use_bkgd_label=1;
 		break;
@@ -2647,6 +3169,9 @@ static int process_option_arg(struct params_struct *p, struct parsestate_struct
 	case PT_PAGETOREAD:
 		p->page_to_read = iw_parse_int(v);
 		break;
+	case PT_QUANTIZE:
+		p->quantize_maxcolors = iw_parse_int(v);
+		break;
 	case PT_JPEGQUALITY:
 		add_opt(p, "jpeg:quality", v);
 		break;
@@ -2717,6 +3242,13 @@ static int process_option_arg(struct params_struct *p, struct parsestate_struct
 		if(!iwcmd_parse_noopt(p,v))
 			return 0;
 		break;
+	case PT_INTERMEDPREC:
+		if(!iwcmd_option_intermedprec(p,v))
+			return 0;
+		break;
+	case PT_THREADS:
+		p->max_threads = iw_parse_int(v);
+		break;
 	case PT_ENCODING:
 		// Already handled.
 		break;
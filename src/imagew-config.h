@@ -53,6 +53,12 @@
 #define IW_SUPPORT_WEBP 0
 #endif
 
+#if defined(HAVE_LIBPTHREAD) && defined(HAVE_PTHREAD_H)
+#define IW_SUPPORT_THREADS 1
+#else
+#define IW_SUPPORT_THREADS 0
+#endif
+
 #else
 // Not using autoconf
 
@@ -75,10 +81,26 @@
 #define IW_SUPPORT_WEBP 1
 #endif
 
+// Threads are implemented with the Windows API on Windows, and with
+// pthreads elsewhere.
+#ifndef IW_SUPPORT_THREADS
+#define IW_SUPPORT_THREADS 1
+#endif
+
 #endif
 
 #ifndef IW_WEBP_SUPPORT_TRANSPARENCY
 #define IW_WEBP_SUPPORT_TRANSPARENCY 1
 #endif
 
+// SSE2 and AVX2 code is only written for x86-64. Which one is used is
+// decided at runtime.
+#ifndef IW_SUPPORT_SIMD
+#if defined(__x86_64__) || defined(_M_X64)
+#define IW_SUPPORT_SIMD 1
+#else
+#define IW_SUPPORT_SIMD 0
+#endif
+#endif
+
 #endif // IMAGEW_CONFIG_H
@@ -3,8 +3,10 @@
 // For more information, see the readme.txt file.
 
 // This is a self-contained GIF image decoder.
-// It supports a single image only, so it does not support animated GIFs,
-// or any GIF where the main image is constructed from multiple sub-images.
+// iw_read_gif_file() reads a single image only, so it does not support
+// animated GIFs, or any GIF where the main image is constructed from multiple
+// sub-images. iw_read_gif_frames() reads all the images, and composites them
+// as an animation would.
 
 #include "imagew-config.h"
 
@@ -35,13 +37,37 @@ struct iwgifrcontext {
 	int has_bg_color;
 	int bg_color_index;
 	int trans_color_index;
+	int disposal; // From the graphic control extension
+	int delay;
+
+	// Used by iw_read_gif_frames()
+	int frames_mode;
+	iw_gif_frame_fn frame_fn;
+	void *frame_userdata;
+	struct iw_gif_frame_info frame_info;
+	int prev_disposal; // Disposal method of the previous frame
+	int prev_x1, prev_y1, prev_x2, prev_y2; // The part of the screen it covered
+	iw_byte *saved_pixels; // For disposal method 3
 
 	size_t pixels_set; // Number of pixels decoded so far
 	size_t total_npixels; // Total number of pixels in the "image" (not the "screen")
 
 	iw_byte **row_pointers;
 
+	// The palette indices of the row currently being decoded. Each row is
+	// converted to RGB(A) when it is complete.
+	iw_byte *rowbuf;
+	int row_pos; // Number of pixels in rowbuf
+	int rows_done; // Number of rows converted
+	int visible_width; // Number of pixels of each row that are on the screen
+
+	// The colortable, as the bytes to write to the image. Illegal palette
+	// indices are black (or transparent black), like the pixels they would
+	// otherwise leave unset.
+	iw_byte pal_lut[256][4];
+
 	struct iw_palette colortable;
+	struct iw_palette global_colortable;
 
 	// A buffer used when reading the GIF file.
 	// The largest block we need to read is a 256-color palette.
@@ -161,6 +187,8 @@ static int iwgif_read_graphic_control_ext(struct iwgifrcontext *rctx)
 	if(rctx->has_transparency) {
 		rctx->trans_color_index = (int)rctx->rbuf[4];
 	}
+	rctx->disposal = (int)((rctx->rbuf[1]>>2)&0x07);
+	rctx->delay = (int)iw_get_ui16le(&rctx->rbuf[2]);
 
 	retval=1;
 done:
@@ -177,7 +205,7 @@ static int iwgif_read_extension(struct iwgifrcontext *rctx)
 
 	switch(ext_type) {
 	case 0xf9:
-		if(rctx->page == rctx->pages_seen+1) {
+		if(rctx->frames_mode || rctx->page == rctx->pages_seen+1) {
 			if(!iwgif_read_graphic_control_ext(rctx)) goto done;
 		}
 		else {
@@ -195,56 +223,65 @@ done:
 	return retval;
 }
 
-// Set the (rctx->pixels_set + offset)th pixel in the logical image to the
-// color represented by palette entry #coloridx.
-static void iwgif_record_pixel(struct iwgifrcontext *rctx, unsigned int coloridx,
-		int offset)
+// Set up rctx->pal_lut, from the current colortable.
+static void iwgif_make_pal_lut(struct iwgifrcontext *rctx)
 {
-	struct iw_image *img;
-	unsigned int r,g,b,a;
-	size_t pixnum;
-	size_t xi,yi; // position in image coordinates
-	size_t xs,ys; // position in screen coordinates
-	iw_byte *ptr;
-
-	img = rctx->img;
-
-	// Figure out which pixel to set.
-
-	pixnum = rctx->pixels_set + offset;
-	xi = pixnum%rctx->image_width;
-	yi = pixnum/rctx->image_width;
-	xs = rctx->image_left + xi;
-	ys = rctx->image_top + yi;
-
-	// Make sure the coordinate is within the image, and on the screen.
-	if(yi>=(size_t)rctx->image_height) return;
-	if(xs>=(size_t)rctx->screen_width) return;
-	if(ys>=(size_t)rctx->screen_height) return;
-
-	// Because of how we de-interlace, it's not obvious whether the Y coordinate
-	// is on the screen. The easiest way is to check if the row pointer is NULL.
-	if(rctx->row_pointers[yi]==NULL) return;
-
-	// Figure out what color to set the pixel to.
-
-	if(coloridx<(unsigned int)rctx->colortable.num_entries) {
-		r=rctx->colortable.entry[coloridx].r;
-		g=rctx->colortable.entry[coloridx].g;
-		b=rctx->colortable.entry[coloridx].b;
-		a=rctx->colortable.entry[coloridx].a;
+	int k;
+
+	iw_zeromem(rctx->pal_lut,sizeof(rctx->pal_lut));
+	for(k=0;k<rctx->colortable.num_entries && k<256;k++) {
+		rctx->pal_lut[k][0] = rctx->colortable.entry[k].r;
+		rctx->pal_lut[k][1] = rctx->colortable.entry[k].g;
+		rctx->pal_lut[k][2] = rctx->colortable.entry[k].b;
+		rctx->pal_lut[k][3] = rctx->colortable.entry[k].a;
 	}
-	else {
-		return; // Illegal palette index
-	}
-
-	// Set the pixel.
+}
 
-	ptr = &rctx->row_pointers[yi][rctx->bytes_per_pixel*xi];
-	ptr[0]=r; ptr[1]=g; ptr[2]=b;
-	if(img->imgtype==IW_IMGTYPE_RGBA) {
-		ptr[3]=a;
+// Convert the row in rctx->rowbuf, and record it in the image. The row is
+// normally complete, but may not be if the image data ended early.
+static void iwgif_finish_row(struct iwgifrcontext *rctx)
+{
+	iw_byte *ptr;
+	const iw_byte *c;
+	int i;
+	int w;
+
+	w = rctx->visible_width;
+	if(w > rctx->row_pos) w = rctx->row_pos;
+
+	// Because of how we de-interlace, it's not obvious whether the row is on
+	// the screen. The easiest way is to check if the row pointer is NULL.
+	ptr = rctx->row_pointers[rctx->rows_done];
+	if(ptr) {
+		if(rctx->frames_mode) {
+			// Don't paint transparent pixels (or illegal palette indices) over
+			// the previous frame.
+			for(i=0;i<w;i++) {
+				c = rctx->pal_lut[rctx->rowbuf[i]];
+				if(c[3]) {
+					ptr[0]=c[0]; ptr[1]=c[1]; ptr[2]=c[2]; ptr[3]=c[3];
+				}
+				ptr += 4;
+			}
+		}
+		else if(rctx->bytes_per_pixel==4) {
+			for(i=0;i<w;i++) {
+				c = rctx->pal_lut[rctx->rowbuf[i]];
+				ptr[0]=c[0]; ptr[1]=c[1]; ptr[2]=c[2]; ptr[3]=c[3];
+				ptr += 4;
+			}
+		}
+		else {
+			for(i=0;i<w;i++) {
+				c = rctx->pal_lut[rctx->rowbuf[i]];
+				ptr[0]=c[0]; ptr[1]=c[1]; ptr[2]=c[2];
+				ptr += 3;
+			}
+		}
 	}
+
+	rctx->rows_done++;
+	rctx->row_pos = 0;
 }
 
 ////////////////////////////////////////////////////////
@@ -274,6 +311,9 @@ struct lzwdeccontext {
 
 	unsigned int ct_used; // Number of items used in the code table
 	struct lzw_tableentry ct[4096]; // Code table
+
+	// Used for strings that don't fit in the current row.
+	iw_byte strbuf[4096];
 };
 
 static void lzw_init(struct lzwdeccontext *d, unsigned int root_codesize)
@@ -304,24 +344,60 @@ static void lzw_clear(struct lzwdeccontext *d)
 
 // Decode an LZW code to one or more pixels, and record it in the image.
 static void lzw_emit_code(struct iwgifrcontext *rctx, struct lzwdeccontext *d,
-		unsigned int first_code)
+		unsigned int code)
 {
-	unsigned int code;
-	code = first_code;
+	unsigned int len;
+	unsigned int n;
+	iw_byte *p;
+	const iw_byte *src;
+
+	len = d->ct[code].length;
+
+	// Track the total number of pixels decoded in this image.
+	rctx->pixels_set += len;
+
+	if(rctx->rows_done >= rctx->image_height) return;
 
 	// An LZW code may decode to more than one pixel. Note that the pixels for
-	// an LZW code are decoded in reverse order (right to left).
+	// an LZW code are decoded in reverse order (right to left), so we need to
+	// know where the string ends. If it fits in the current row, write it
+	// there directly. Otherwise, decode it to a temporary buffer first.
+	if((unsigned int)(rctx->image_width - rctx->row_pos) >= len) {
+		p = &rctx->rowbuf[rctx->row_pos + len];
+		rctx->row_pos += len;
+	}
+	else {
+		p = &d->strbuf[len];
+	}
 
-	while(1) {
-		iwgif_record_pixel(rctx, (unsigned int)d->ct[code].lastchar, (int)(d->ct[code].length-1));
-		if(d->ct[code].length<=1) break;
-		// The codes are structured as a "forest" (multiple trees).
-		// Go to the parent code, which will have a length 1 less than this one.
+	// The codes are structured as a "forest" (multiple trees). Each code's
+	// parent has a length 1 less than it.
+	for(n=len; n>0; n--) {
+		*(--p) = d->ct[code].lastchar;
 		code = (unsigned int)d->ct[code].parent;
 	}
 
-	// Track the total number of pixels decoded in this image.
-	rctx->pixels_set += d->ct[first_code].length;
+	if(p!=d->strbuf) {
+		if(rctx->row_pos >= rctx->image_width) {
+			iwgif_finish_row(rctx);
+		}
+		return;
+	}
+
+	// Copy the string from the temporary buffer, splitting it into rows.
+	src = d->strbuf;
+	while(len>0) {
+		n = (unsigned int)(rctx->image_width - rctx->row_pos);
+		if(n>len) n=len;
+		memcpy(&rctx->rowbuf[rctx->row_pos], src, n);
+		rctx->row_pos += n;
+		src += n;
+		len -= n;
+		if(rctx->row_pos >= rctx->image_width) {
+			iwgif_finish_row(rctx);
+			if(rctx->rows_done >= rctx->image_height) return;
+		}
+	}
 }
 
 // Add a code to the dictionary.
@@ -429,27 +505,26 @@ static int lzw_process_bytes(struct iwgifrcontext *rctx, struct lzwdeccontext *d
 	iw_byte *data, size_t data_size)
 {
 	size_t i;
-	int b;
+	unsigned int code;
 	int retval=0;
 
 	for(i=0;i<data_size;i++) {
-		// Look at the bits one at a time.
-		for(b=0;b<8;b++) {
+		// Add the byte's bits to the pending bits, least significant bit first.
+		d->pending_code |= ((unsigned int)data[i])<<d->bits_in_pending_code;
+		d->bits_in_pending_code += 8;
+
+		// Process each complete LZW code. The code size can change after
+		// any code, so they have to be extracted one at a time.
+		while(d->bits_in_pending_code >= d->current_codesize) {
+			code = d->pending_code & ((1U<<d->current_codesize)-1);
+			d->pending_code >>= d->current_codesize;
+			d->bits_in_pending_code -= d->current_codesize;
+			if(!lzw_process_code(rctx,d,code)) goto done;
+
 			if(d->eoi_flag) { // Stop if we've seen an EOI (end of image) code.
 				retval=1;
 				goto done;
 			}
-
-			if(data[i]&(1<<b))
-				d->pending_code |= 1<<d->bits_in_pending_code;
-			d->bits_in_pending_code++;
-
-			// When we get enough bits to form a complete LZW code, process it.
-			if(d->bits_in_pending_code >= d->current_codesize) {
-				if(!lzw_process_code(rctx,d,d->pending_code)) goto done;
-				d->pending_code=0;
-				d->bits_in_pending_code=0;
-			}
 		}
 	}
 	retval=1;
@@ -498,7 +573,7 @@ static int iwgif_init_screen(struct iwgifrcontext *rctx)
 	}
 
 	// Allocate IW image
-	if(rctx->has_transparency || bg_visible) {
+	if(rctx->has_transparency || bg_visible || rctx->frames_mode) {
 		rctx->bytes_per_pixel=4;
 		img->imgtype = IW_IMGTYPE_RGBA;
 	}
@@ -509,7 +584,10 @@ static int iwgif_init_screen(struct iwgifrcontext *rctx)
 	img->bit_depth = 8;
 	img->bpr = rctx->bytes_per_pixel * img->width;
 
-	img->pixels = (iw_byte*)iw_malloc_large(rctx->ctx, img->bpr, img->height);
+	if(rctx->frames_mode)
+		img->pixels = (iw_byte*)iw_malloc_large(rctx->ctx, img->bpr, img->height);
+	else
+		img->pixels = (iw_byte*)iw_malloc_input_pixels(rctx->ctx, img->bpr, img->height);
 	if(!img->pixels) goto done;
 
 	// Start by clearing the screen to black, or transparent black.
@@ -572,6 +650,65 @@ static int iwgif_make_row_pointers(struct iwgifrcontext *rctx)
 	return 1;
 }
 
+// Used by iw_read_gif_frames(). Called when a frame's image is about to be
+// decoded onto the screen.
+static int iwgif_start_frame(struct iwgifrcontext *rctx)
+{
+	struct iw_image *img = rctx->img;
+	size_t offset, rowsize;
+	int j;
+
+	// Dispose of the previous frame.
+	if(rctx->prev_disposal==2 || rctx->prev_disposal==3) {
+		rowsize = 4*(size_t)(rctx->prev_x2 - rctx->prev_x1);
+		for(j=rctx->prev_y1; j<rctx->prev_y2; j++) {
+			offset = j*img->bpr + 4*(size_t)rctx->prev_x1;
+			if(rctx->prev_disposal==2) {
+				// Restore to background. We use transparent black, as we do
+				// for the parts of the screen not covered by any image.
+				iw_zeromem(&img->pixels[offset], rowsize);
+			}
+			else {
+				// Restore to previous.
+				memcpy(&img->pixels[offset], &rctx->saved_pixels[offset], rowsize);
+			}
+		}
+	}
+	rctx->prev_disposal = 0;
+
+	// Figure out the part of the screen that this frame covers.
+	rctx->prev_x1 = rctx->image_left;
+	rctx->prev_y1 = rctx->image_top;
+	rctx->prev_x2 = rctx->image_left + rctx->image_width;
+	rctx->prev_y2 = rctx->image_top + rctx->image_height;
+	if(rctx->prev_x1 > rctx->screen_width) rctx->prev_x1 = rctx->screen_width;
+	if(rctx->prev_y1 > rctx->screen_height) rctx->prev_y1 = rctx->screen_height;
+	if(rctx->prev_x2 > rctx->screen_width) rctx->prev_x2 = rctx->screen_width;
+	if(rctx->prev_y2 > rctx->screen_height) rctx->prev_y2 = rctx->screen_height;
+
+	if(rctx->disposal==3) {
+		// Save the part of the screen that this frame is about to change.
+		if(!rctx->saved_pixels) {
+			rctx->saved_pixels = (iw_byte*)iw_malloc_large(rctx->ctx, img->bpr, img->height);
+			if(!rctx->saved_pixels) return 0;
+		}
+		rowsize = 4*(size_t)(rctx->prev_x2 - rctx->prev_x1);
+		for(j=rctx->prev_y1; j<rctx->prev_y2; j++) {
+			offset = j*img->bpr + 4*(size_t)rctx->prev_x1;
+			memcpy(&rctx->saved_pixels[offset], &img->pixels[offset], rowsize);
+		}
+	}
+
+	rctx->frame_info.frame_num = rctx->pages_seen;
+	rctx->frame_info.left = rctx->image_left;
+	rctx->frame_info.top = rctx->image_top;
+	rctx->frame_info.width = rctx->image_width;
+	rctx->frame_info.height = rctx->image_height;
+	rctx->frame_info.delay = rctx->delay;
+	rctx->frame_info.disposal = rctx->disposal;
+	return 1;
+}
+
 static int iwgif_skip_image(struct iwgifrcontext *rctx)
 {
 	int has_local_ct;
@@ -616,6 +753,7 @@ static int iwgif_read_image(struct iwgifrcontext *rctx)
 	size_t subblocksize;
 	int has_local_ct;
 	int local_ct_size;
+	int end_of_data = 0;
 
 	unsigned int root_codesize;
 
@@ -635,6 +773,10 @@ static int iwgif_read_image(struct iwgifrcontext *rctx)
 
 	rctx->interlaced = (int)((rctx->rbuf[8]>>6)&0x01);
 
+	// A local color table, and the transparent color, only apply to this
+	// image, so start over with the global color table.
+	rctx->colortable = rctx->global_colortable; // struct copy
+
 	has_local_ct = (int)((rctx->rbuf[8]>>7)&0x01);
 	if(has_local_ct) {
 		local_ct_size = (int)(rctx->rbuf[8]&0x07);
@@ -642,9 +784,8 @@ static int iwgif_read_image(struct iwgifrcontext *rctx)
 	}
 
 	if(has_local_ct) {
-		// We only support one image, so we don't need to keep both a global and a
-		// local color table. If an image has both, the local table will overwrite
-		// the global one.
+		// If an image has both a global and a local color table, the local
+		// table overwrites our copy of the global one.
 		if(!iwgif_read_color_table(rctx,&rctx->colortable)) goto done;
 	}
 
@@ -675,6 +816,20 @@ static int iwgif_read_image(struct iwgifrcontext *rctx)
 
 	if(!iwgif_make_row_pointers(rctx)) goto done;
 
+	if(rctx->rowbuf) iw_free(rctx->ctx,rctx->rowbuf);
+	rctx->rowbuf = (iw_byte*)iw_malloc(rctx->ctx, (size_t)rctx->image_width);
+	if(!rctx->rowbuf) goto done;
+	rctx->row_pos = 0;
+	rctx->rows_done = 0;
+	rctx->visible_width = rctx->screen_width - rctx->image_left;
+	if(rctx->visible_width > rctx->image_width) rctx->visible_width = rctx->image_width;
+	if(rctx->visible_width < 0) rctx->visible_width = 0;
+	iwgif_make_pal_lut(rctx);
+
+	if(rctx->frames_mode) {
+		if(!iwgif_start_frame(rctx)) goto done;
+	}
+
 	d = iw_mallocz(rctx->ctx, sizeof(struct lzwdeccontext));
 	if(!d) goto done;
 	lzw_init(d, root_codesize);
@@ -684,7 +839,10 @@ static int iwgif_read_image(struct iwgifrcontext *rctx)
 		// Read size of next subblock
 		if(!iwgif_read(rctx,rctx->rbuf,1)) goto done;
 		subblocksize = (size_t)rctx->rbuf[0];
-		if(subblocksize==0) break;
+		if(subblocksize==0) {
+			end_of_data = 1;
+			break;
+		}
 
 		// Read next subblock
 		if(!iwgif_read(rctx,rctx->rbuf,subblocksize)) goto done;
@@ -697,6 +855,17 @@ static int iwgif_read_image(struct iwgifrcontext *rctx)
 		if(rctx->pixels_set >= rctx->total_npixels) break;
 	}
 
+	// Record any pixels decoded for a row that was not finished.
+	if(rctx->row_pos>0 && rctx->rows_done<rctx->image_height) {
+		iwgif_finish_row(rctx);
+	}
+
+	// If we're going to read more images, we have to skip over any image data
+	// we didn't need.
+	if(rctx->frames_mode && !end_of_data) {
+		if(!iwgif_skip_subblocks(rctx)) goto done;
+	}
+
 	retval=1;
 
 done:
@@ -704,23 +873,32 @@ done:
 	return retval;
 }
 
-static int iwgif_read_main(struct iwgifrcontext *rctx)
+// Read everything that comes before the first block.
+static int iwgif_read_file_start(struct iwgifrcontext *rctx)
 {
-	int retval=0;
 	int i;
-	int image_found=0;
 
 	// Make all colors opaque by default.
 	for(i=0;i<256;i++) {
 		rctx->colortable.entry[i].a=255;
 	}
 
-	if(!iwgif_read_file_header(rctx)) goto done;
+	if(!iwgif_read_file_header(rctx)) return 0;
 
-	if(!iwgif_read_screen_descriptor(rctx)) goto done;
+	if(!iwgif_read_screen_descriptor(rctx)) return 0;
 
 	// Read global color table
-	if(!iwgif_read_color_table(rctx,&rctx->colortable)) goto done;
+	if(!iwgif_read_color_table(rctx,&rctx->colortable)) return 0;
+	rctx->global_colortable = rctx->colortable; // struct copy
+	return 1;
+}
+
+static int iwgif_read_main(struct iwgifrcontext *rctx)
+{
+	int retval=0;
+	int image_found=0;
+
+	if(!iwgif_read_file_start(rctx)) goto done;
 
 	// Tell IW the background color.
 	if(rctx->has_bg_color) {
@@ -812,8 +990,109 @@ done:
 
 	if(rctx) {
 		if(rctx->row_pointers) iw_free(ctx,rctx->row_pointers);
+		if(rctx->rowbuf) iw_free(ctx,rctx->rowbuf);
 		iw_free(ctx,rctx);
 	}
 
 	return retval;
 }
+
+static int iwgif_read_frames_main(struct iwgifrcontext *rctx)
+{
+	struct iw_gif_frame_info *fi = &rctx->frame_info;
+	int retval=0;
+
+	if(!iwgif_read_file_start(rctx)) goto done;
+
+	if(rctx->has_bg_color) {
+		fi->has_bkgd_label = 1;
+		fi->bkgd_label.c[0] = ((double)rctx->colortable.entry[rctx->bg_color_index].r)/255.0;
+		fi->bkgd_label.c[1] = ((double)rctx->colortable.entry[rctx->bg_color_index].g)/255.0;
+		fi->bkgd_label.c[2] = ((double)rctx->colortable.entry[rctx->bg_color_index].b)/255.0;
+		fi->bkgd_label.c[3] = 1.0;
+	}
+
+	while(1) {
+		// Read block type
+		if(!iwgif_read(rctx,rctx->rbuf,1)) goto done;
+
+		switch(rctx->rbuf[0]) {
+		case 0x21: // extension
+			if(!iwgif_read_extension(rctx)) goto done;
+			break;
+		case 0x2c: // image
+			rctx->pages_seen++;
+			rctx->pixels_set = 0;
+			if(!iwgif_read_image(rctx)) goto done;
+
+			if(!(*rctx->frame_fn)(rctx->ctx, rctx->frame_userdata, rctx->img, fi)) {
+				// The caller doesn't want any more frames. That's only a
+				// failure if it reported an error.
+				if(!iw_get_errorflag(rctx->ctx)) retval=1;
+				goto done;
+			}
+
+			// The disposal method takes effect when the next frame starts.
+			rctx->prev_disposal = rctx->disposal;
+
+			// Reset anything that was set by a graphic control extension.
+			// Their scope is the first image that follows them.
+			rctx->has_transparency = 0;
+			rctx->disposal = 0;
+			rctx->delay = 0;
+			break;
+		case 0x3b: // file trailer
+			if(rctx->pages_seen==0) {
+				iw_set_error(rctx->ctx,"No image in file");
+				goto done;
+			}
+			retval=1;
+			goto done;
+		default:
+			iw_set_error(rctx->ctx,"Invalid or unsupported GIF file");
+			goto done;
+		}
+	}
+
+done:
+	return retval;
+}
+
+IW_IMPL(int) iw_read_gif_frames(struct iw_context *ctx, struct iw_iodescr *iodescr,
+	iw_gif_frame_fn fn, void *userdata)
+{
+	struct iw_image img;
+	struct iwgifrcontext *rctx = NULL;
+	int retval=0;
+
+	iw_zeromem(&img,sizeof(struct iw_image));
+	rctx = iw_mallocz(ctx,sizeof(struct iwgifrcontext));
+	if(!rctx) goto done;
+
+	rctx->ctx = ctx;
+	rctx->iodescr = iodescr;
+	rctx->img = &img;
+	rctx->frames_mode = 1;
+	rctx->frame_fn = fn;
+	rctx->frame_userdata = userdata;
+	rctx->include_screen = 1;
+
+	if(!iwgif_read_frames_main(rctx))
+		goto done;
+
+	retval = 1;
+
+done:
+	if(!retval) {
+		iw_set_error(ctx,"Failed to read GIF file");
+	}
+
+	iw_free(ctx, img.pixels);
+	if(rctx) {
+		if(rctx->row_pointers) iw_free(ctx,rctx->row_pointers);
+		if(rctx->rowbuf) iw_free(ctx,rctx->rowbuf);
+		if(rctx->saved_pixels) iw_free(ctx,rctx->saved_pixels);
+		iw_free(ctx,rctx);
+	}
+	return retval;
+}
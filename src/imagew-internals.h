@@ -34,6 +34,30 @@ typedef double iw_tmpsample;
 
 struct iw_rr_ctx; // "resize rows" state; see imagew-resize.c.
 
+// A block of memory that may be reused for more than one image.
+// See iwpvt_membuf_get().
+struct iw_membuf {
+	void *mem;
+	size_t size; // The size of mem, in bytes.
+};
+
+// An optional block of memory that small allocations are carved out of,
+// instead of each one being allocated with ctx->mallocfn.
+// See iw_set_arena_size().
+#define IW_ARENA_ALIGN 16
+struct iw_arena {
+	void *block; // The memory as returned by ctx->mallocfn
+	unsigned char *mem; // The first aligned byte in block
+	size_t size; // Usable bytes, starting at mem
+	size_t used;
+	size_t last_pos; // Offset of the most recent allocation
+	int num_allocs; // Number of blocks that have not been freed
+};
+
+// Internal flag for iw_malloc_ex(), for memory that must not come from the
+// arena (because it may outlive the image, or be very large).
+#define IW_MALLOCFLAG_NOARENA 0x0100
+
 // "Raw" settings from the application.
 struct iw_resize_settings {
 	int family;
@@ -83,11 +107,14 @@ struct iw_channelinfo_out {
 
 	int use_nearest_color_table;
 
+	iw_uint32 random_seed; // Used with IW_DITHERSUBTYPE_HASH*
+
 	double bkgd1_color_lin; // Used if ctx->apply_bkgd
 	double bkgd2_color_lin; // Used if ctx->apply_bkgd && bkgd_checkerboard
 };
 
 struct iw_prng; // Defined imagew-util.c
+struct iw_opt_scan; // Defined imagew-opt.c
 
 // Tracks the current image properties. May change as we optimize the image.
 struct iw_opt_ctx {
@@ -96,14 +123,10 @@ struct iw_opt_ctx {
 	int bit_depth;
 	size_t bpr;
 
-	// A pointer to the current pixels. May point to tmp_pixels, or
-	// to ctx->img2.pixels.
+	// A pointer to the current pixels. This is always ctx->img2.pixels,
+	// which the optimizer may have rewritten in place.
 	const iw_byte *pixelsptr;
 
-	// A place for optimized pixels. If this is non-NULL, it will be
-	// freed when IW is finished.
-	iw_byte *tmp_pixels;
-
 	int has_transparency;
 	int has_partial_transparency;
 	int has_16bit_precision;
@@ -117,6 +140,10 @@ struct iw_opt_ctx {
 
 	int has_bkgdlabel;
 	unsigned int bkgdlabel[4]; // Indexed by IW_CHANNELTYPE_[RED..ALPHA]
+
+	// Statistics about the unoptimized image, possibly collected while the
+	// image was being generated.
+	struct iw_opt_scan *scan;
 };
 
 struct iw_option_struct {
@@ -162,9 +189,11 @@ struct iw_req_struct {
 	int compression; // IW_COMPRESSION_*. Suggested compression algorithm.
 	int page_to_read;
 	int include_screen;
+	int min_read_width, min_read_height; // 0 = not set
 	int jpeg_samp_factor_h, jpeg_samp_factor_v; // 0 means default
 	int interlaced;
 	int bmp_no_fileheader;
+	int targetsize_quality, targetsize_tries, targetsize_filesize; // Set by iw_search_quality()
 
 	struct iw_option_struct *options;
 	int options_count;
@@ -181,7 +210,9 @@ struct iw_context {
 
 	iw_float32 *intermediate32;
 	iw_float32 *intermediate_alpha32;
-	iw_float32 *final_alpha32;
+	// Used instead of the above if intermed_precision is FLOAT16 or BFLOAT16.
+	iw_uint16 *intermediate16;
+	iw_uint16 *intermediate_alpha16;
 
 	struct iw_channelinfo_in img1_ci[IW_CI_COUNT];
 
@@ -203,6 +234,9 @@ struct iw_context {
 	int intermed_numchannels;
 	int intermed_alpha_channel_index;
 	int intermed_canvas_width, intermed_canvas_height;
+	// Distance between rows of intermediate32 and intermediate_alpha32, in
+	// samples. At least intermed_canvas_width.
+	size_t intermed_stride;
 
 	struct iw_image img2;
 	struct iw_csdescr img2cs;
@@ -248,9 +282,27 @@ struct iw_context {
 
 	// Max number of rows for error-diffusion dithering, including current row.
 #define IW_DITHER_MAXROWS 3
-	// Error accumulators for error-diffusion dithering.
+	// Number of extra elements on each side of an error row, so that the
+	// filters don't need to check for the edges of the image.
+#define IW_DITHER_PAD 2
+	// Error accumulators for error-diffusion dithering. Each points to
+	// element IW_DITHER_PAD of its allocated buffer. The rows are rotated
+	// after each image row is processed.
 	double *dither_errors[IW_DITHER_MAXROWS]; // 0 is the current row.
 
+	// Memory for the large work buffers. If keep_buffers is set, it is not
+	// freed after an image is processed, so that it can be reused for the
+	// next image (see iw_reset_context()).
+	int keep_buffers;
+	struct iw_membuf img2_pixels_buf; // For img2.pixels
+	struct iw_membuf intermediate_buf;
+	struct iw_membuf intermediate_alpha_buf;
+	struct iw_membuf dither_errors_buf; // For all of the dither_errors rows
+	// Input image memory from a previous image, for iw_malloc_input_pixels().
+	struct iw_membuf spare_input_buf;
+
+	struct iw_arena arena;
+
 	int randomize; // 0 to use random_seed, nonzero to use a different seed every time.
 	int random_seed;
 
@@ -274,6 +326,15 @@ struct iw_context {
 	iw_byte opt_16_to_8;   // Reduce >8 bitdepth to 8
 	iw_byte opt_strip_alpha; // RGBA->RGB or GA->G
 	iw_byte opt_binary_trns; // Color-keyed binary transparency
+	iw_byte opt_incremental_scan; // IW_VAL_INCREMENTAL_OPT_SCAN
+	int quantize_maxcolors; // IW_VAL_QUANTIZE. 0 = disabled
+	iw_byte quantize_dither; // IW_VAL_QUANTIZE_DITHER
+	iw_byte padded_stride; // IW_VAL_PADDED_STRIDE
+	iw_byte intermed_precision; // IW_VAL_INTERMED_PRECISION
+	int max_threads; // IW_VAL_MAX_THREADS
+	// The intermediate channel whose rows complete the output rows, if the
+	// optimizer is scanning them as they are written. Otherwise -1.
+	int opt_scan_intermed_channel;
 
 	int canvas_width, canvas_height;
 	int input_start_x, input_start_y, input_w, input_h;
@@ -298,9 +359,16 @@ void iwpvt_prng_destroy(struct iw_context *ctx, struct iw_prng *prng);
 void iwpvt_prng_set_random_seed(struct iw_prng *prng, int s);
 iw_uint32 iwpvt_prng_rand(struct iw_prng *prng); // Returns a pseudorandom number.
 int iwpvt_util_randomize(struct iw_prng *prng); // Returns the random seed that was used.
+iw_uint32 iwpvt_prng_hash(iw_uint32 seed, int x, int y); // Stateless; depends only on its arguments.
 void* iwpvt_default_malloc(void *userdata, unsigned int flags, size_t n);
 void iwpvt_default_free(void *userdata, void *mem);
 char* iwpvt_strdup_dbl(struct iw_context *ctx, double n);
+void* iwpvt_membuf_get(struct iw_context *ctx, struct iw_membuf *buf, size_t n1, size_t n2);
+void iwpvt_membuf_free(struct iw_context *ctx, struct iw_membuf *buf);
+void iwpvt_release_input_image(struct iw_context *ctx, int keep_pixels);
+int iwpvt_arena_init(struct iw_context *ctx, size_t size);
+void iwpvt_arena_destroy(struct iw_context *ctx);
+int iwpvt_arena_owns(struct iw_context *ctx, const void *mem);
 
 // Defined in imagew-resize.c
 struct iw_rr_ctx *iwpvt_resize_rows_init(struct iw_context *ctx,
@@ -310,3 +378,19 @@ void iwpvt_resize_row_main(struct iw_rr_ctx *rrctx, iw_tmpsample *in_pix, iw_tmp
 
 // Defined in imagew-opt.c
 void iwpvt_optimize_image(struct iw_context *ctx);
+void iwpvt_opt_scan_begin(struct iw_context *ctx);
+void iwpvt_opt_scan_row(struct iw_context *ctx, int row);
+void iwpvt_opt_free_scan(struct iw_context *ctx);
+
+// Defined in imagew-simd.c
+#define IW_SIMD_NONE 0
+#define IW_SIMD_SSE2 1
+#define IW_SIMD_AVX2 2
+int iwpvt_get_simd_level(void); // Returns the best IW_SIMD_* this CPU supports.
+#define IW_SCANFLAG_COLOR 0x1 // Some pixel is not gray.
+#define IW_SCANFLAG_16BIT 0x2 // Some sample needs 16-bit precision.
+// Looks for the IW_SCANFLAG_* flags in 'want', in one row of 8- or 16-bit
+// pixels with nc channels. Invisible pixels are ignored. Returns the flags
+// that were found.
+unsigned int iwpvt_scan_row_flags(int simd_level, const iw_byte *row, int width,
+  int nc, int bit_depth, unsigned int want);
@@ -406,6 +406,190 @@ static void convert_cmyk_to_rbg(struct iw_context *ctx, const JSAMPLE *src,
 	}
 }
 
+// Returns the IW_REORIENT_* code for the orientation in the Exif data.
+static unsigned int iwjpeg_get_exif_transform(struct iwjpegrcontext *rctx)
+{
+	static const unsigned int exif_orient_to_transform[9] =
+	   { 0,0, 1,3,2,4,5,7,6 };
+
+	if(rctx->exif_orientation>=2 && rctx->exif_orientation<=8) {
+		return exif_orient_to_transform[rctx->exif_orientation];
+	}
+	return 0;
+}
+
+// The natural-order position of each DCT coefficient, indexed by its
+// position in zigzag order. (libjpeg has this table, but doesn't export it.)
+static const int iwjpeg_natural_order[DCTSIZE2] = {
+	 0, 1, 8,16, 9, 2, 3,10,17,24,32,25,18,11, 4, 5,
+	12,19,26,33,40,48,41,34,27,20,13, 6, 7,14,21,28,
+	35,42,49,56,57,50,43,36,29,22,15,23,30,37,44,51,
+	58,59,52,45,38,31,39,46,53,60,61,54,47,55,62,63 };
+
+// Get the size (in the orientation of the JPEG image) that the caller says
+// it's going to shrink the image to. 0 means unknown.
+// Returns 0 if neither dimension is known.
+static int iwjpeg_get_min_read_size(struct iw_context *ctx,
+	struct iwjpegrcontext *rctx, int *pmin_w, int *pmin_h)
+{
+	int min_w, min_h;
+
+	min_w = iw_get_value(ctx,IW_VAL_MIN_READ_WIDTH);
+	min_h = iw_get_value(ctx,IW_VAL_MIN_READ_HEIGHT);
+
+	if(iwjpeg_get_exif_transform(rctx)&0x04) {
+		// The image will be transposed after we read it.
+		*pmin_w = min_h;
+		*pmin_h = min_w;
+	}
+	else {
+		*pmin_w = min_w;
+		*pmin_h = min_h;
+	}
+	return (min_w>0 || min_h>0);
+}
+
+// If "jpeg:thumbnail" is set, and the caller says it's going to shrink the
+// image, use libjpeg's DCT scaling to decode it at the smallest size
+// (a multiple of 1/8) that is still at least as large as the caller needs.
+// Returns 1 if the image will be decoded at a reduced size.
+static int iwjpeg_choose_scale(struct jr_rsrc_struct *jr)
+{
+	struct jpeg_decompress_struct *cinfo = &jr->cinfo;
+	const char *optv;
+	int min_w, min_h;
+	unsigned int num;
+
+	optv = iw_get_option(jr->ctx, "jpeg:thumbnail");
+	if(!optv || !iw_parse_int(optv)) return 0;
+
+	if(!iwjpeg_get_min_read_size(jr->ctx,&jr->rctx,&min_w,&min_h)) return 0;
+
+	cinfo->scale_denom = 8;
+	for(num=1; num<8; num++) {
+		cinfo->scale_num = num;
+		// Older versions of libjpeg may round the scale up to 1/4, 1/2, or 1/1,
+		// so look at the dimensions it actually intends to use.
+		jpeg_calc_output_dimensions(cinfo);
+		if((int)cinfo->output_width>=min_w && (int)cinfo->output_height>=min_h) {
+			return (cinfo->output_width<cinfo->image_width ||
+				cinfo->output_height<cinfo->image_height);
+		}
+	}
+
+	cinfo->scale_num = 1;
+	cinfo->scale_denom = 1;
+	return 0;
+}
+
+// Choose the IDCT method, upsampling method, and whether to smooth the
+// blocks of an incomplete progressive image.
+// If "jpeg:fastdecode=<n>" is set, and the caller is going to shrink the
+// decoded image by at least a factor of n in each dimension, the less
+// accurate but faster methods are used, because the differences will mostly
+// be averaged away. Any of these can also be set explicitly.
+static void iwjpeg_set_decode_options(struct iw_context *ctx,
+	struct iwjpegrcontext *rctx, struct jpeg_decompress_struct *cinfo)
+{
+	const char *optv;
+	int min_w, min_h;
+	int factor = 0;
+	int fast = 0;
+
+	optv = iw_get_option(ctx, "jpeg:fastdecode");
+	if(optv) factor = iw_parse_int(optv);
+
+	if(factor>0 && iwjpeg_get_min_read_size(ctx,rctx,&min_w,&min_h)) {
+		// Find the size libjpeg is going to decode the image at.
+		jpeg_calc_output_dimensions(cinfo);
+		fast = 1;
+		if(min_w>0 && (double)cinfo->output_width < (double)factor*(double)min_w) fast=0;
+		if(min_h>0 && (double)cinfo->output_height < (double)factor*(double)min_h) fast=0;
+	}
+
+	if(fast) {
+		cinfo->dct_method = JDCT_IFAST;
+		cinfo->do_fancy_upsampling = FALSE;
+		cinfo->do_block_smoothing = FALSE;
+	}
+
+	optv = iw_get_option(ctx, "jpeg:dct");
+	if(optv) {
+		if(!strcmp(optv, "int")) {
+			cinfo->dct_method = JDCT_ISLOW;
+		}
+		else if(!strcmp(optv, "fast")) {
+			cinfo->dct_method = JDCT_IFAST;
+		}
+		else if(!strcmp(optv, "float")) {
+			cinfo->dct_method = JDCT_FLOAT;
+		}
+		else {
+			iw_warningf(ctx,"Unrecognized jpeg:dct setting \"%s\"",optv);
+		}
+	}
+
+	optv = iw_get_option(ctx, "jpeg:fancyupsampling");
+	if(optv) {
+		cinfo->do_fancy_upsampling = iw_parse_int(optv) ? TRUE : FALSE;
+	}
+
+	optv = iw_get_option(ctx, "jpeg:blocksmoothing");
+	if(optv) {
+		cinfo->do_block_smoothing = iw_parse_int(optv) ? TRUE : FALSE;
+	}
+}
+
+// Returns 1 if the scans of a progressive JPEG image read so far contain
+// all the information that will be used when decoding it at a reduced size.
+// That is, for each component, the coefficients that fit into its scaled
+// DCT block are complete.
+static int iwjpeg_have_needed_scans(struct jpeg_decompress_struct *cinfo)
+{
+	jpeg_component_info *compptr;
+	int ci, k;
+	int size_h, size_v;
+
+	for(ci=0; ci<cinfo->num_components; ci++) {
+		compptr = &cinfo->comp_info[ci];
+#if JPEG_LIB_VERSION >= 70
+		size_h = compptr->DCT_h_scaled_size;
+		size_v = compptr->DCT_v_scaled_size;
+#else
+		size_h = compptr->DCT_scaled_size;
+		size_v = compptr->DCT_scaled_size;
+#endif
+		for(k=0; k<DCTSIZE2; k++) {
+			if(iwjpeg_natural_order[k]%DCTSIZE >= size_h) continue;
+			if(iwjpeg_natural_order[k]/DCTSIZE >= size_v) continue;
+			// coef_bits is -1 if we haven't seen this coefficient, or the
+			// number of low bits still missing from it.
+			if(cinfo->coef_bits[ci][k]!=0) return 0;
+		}
+	}
+	return 1;
+}
+
+// Used in buffered-image mode. Reads only as many scans as we need, then
+// starts the output pass.
+static int iwjpeg_read_needed_scans(struct jr_rsrc_struct *jr)
+{
+	int ret;
+
+	while(1) {
+		ret = jpeg_consume_input(&jr->cinfo);
+		if(ret==JPEG_REACHED_EOI) break;
+		if(ret==JPEG_SUSPENDED) {
+			iw_set_error(jr->ctx,"Error reading JPEG file");
+			return 0;
+		}
+		if(ret==JPEG_SCAN_COMPLETED && iwjpeg_have_needed_scans(&jr->cinfo)) break;
+	}
+
+	jpeg_start_output(&jr->cinfo, jr->cinfo.input_scan_number);
+	return 1;
+}
+
 static int iw_read_jpeg_file3(struct jr_rsrc_struct *jr)
 {
 	struct iw_context *ctx = jr->ctx;
@@ -414,9 +598,13 @@ static int iw_read_jpeg_file3(struct jr_rsrc_struct *jr)
 	int colorspace;
 	JDIMENSION rownum;
 	JSAMPLE *jsamprow;
+	JSAMPROW rowptrs[8];
+	JDIMENSION nrows;
+	JDIMENSION i;
 	int numchannels=0;
 	int cmyk_flag = 0;
 	int ret;
+	unsigned int t;
 
 	jpeg_create_decompress(&jr->cinfo);
 	jr->cinfo_valid=1;
@@ -457,8 +645,20 @@ static int iw_read_jpeg_file3(struct jr_rsrc_struct *jr)
 
 	iwjpeg_read_saved_markers(&jr->rctx,&jr->cinfo);
 
+	if(iwjpeg_choose_scale(jr) && jr->cinfo.progressive_mode) {
+		// A small image may not need the later scans of a progressive
+		// image, so decode the scans one at a time.
+		jr->cinfo.buffered_image = TRUE;
+	}
+
+	iwjpeg_set_decode_options(ctx,&jr->rctx,&jr->cinfo);
+
 	jpeg_start_decompress(&jr->cinfo);
 
+	if(jr->cinfo.buffered_image) {
+		if(!iwjpeg_read_needed_scans(jr)) goto done;
+	}
+
 	colorspace=jr->cinfo.out_color_space;
 	numchannels=jr->cinfo.output_components;
 
@@ -492,7 +692,7 @@ static int iw_read_jpeg_file3(struct jr_rsrc_struct *jr)
 	jr->img.bit_depth = 8;
 	jr->img.bpr = iw_calc_bytesperrow(jr->img.width,jr->img.bit_depth*numchannels);
 
-	jr->img.pixels = (iw_byte*)iw_malloc_large(ctx, jr->img.bpr, jr->img.height);
+	jr->img.pixels = (iw_byte*)iw_malloc_input_pixels(ctx, jr->img.bpr, jr->img.height);
 	if(!jr->img.pixels) {
 		goto done;
 	}
@@ -511,33 +711,53 @@ static int iw_read_jpeg_file3(struct jr_rsrc_struct *jr)
 			convert_cmyk_to_rbg(ctx,jr->tmprow,jsamprow,jr->img.width);
 		}
 		else {
-			// read directly into img.pixels
-			jpeg_read_scanlines(&jr->cinfo, &jsamprow, 1);
+			// Read directly into img.pixels, as many rows at a time as
+			// libjpeg recommends. (Some of its upsampling methods produce
+			// more than one row at a time.)
+			nrows = (JDIMENSION)jr->cinfo.rec_outbuf_height;
+			if(nrows>8) nrows=8;
+			if(nrows>jr->cinfo.output_height-rownum) nrows=jr->cinfo.output_height-rownum;
+			for(i=0; i<nrows; i++) {
+				rowptrs[i] = &jsamprow[jr->img.bpr * i];
+			}
+			jpeg_read_scanlines(&jr->cinfo, rowptrs, nrows);
 		}
 		if(jr->cinfo.output_scanline<=rownum) {
 			iw_set_error(ctx,"Error reading JPEG file");
 			goto done;
 		}
 	}
-	jpeg_finish_decompress(&jr->cinfo);
+	if(jr->cinfo.buffered_image) {
+		// Don't bother to read the rest of the file.
+		jpeg_abort_decompress(&jr->cinfo);
+	}
+	else {
+		jpeg_finish_decompress(&jr->cinfo);
+	}
 
 	handle_exif_density(&jr->rctx, &jr->img);
 
+	if(jr->img.density_code==IW_DENSITY_UNITS_PER_METER &&
+		jr->cinfo.output_width!=jr->cinfo.image_width)
+	{
+		// The image was decoded at a reduced size.
+		jr->img.density_x *= ((double)jr->cinfo.output_width)/(double)jr->cinfo.image_width;
+		jr->img.density_y *= ((double)jr->cinfo.output_height)/(double)jr->cinfo.image_height;
+	}
+
 	iw_set_input_image(ctx, &jr->img);
 	// The contents of img no longer belong to us.
 	jr->img.pixels = NULL;
 
-	if(jr->rctx.exif_orientation>=2 && jr->rctx.exif_orientation<=8) {
-		static const unsigned int exif_orient_to_transform[9] =
-		   { 0,0, 1,3,2,4,5,7,6 };
-
+	t = iwjpeg_get_exif_transform(&jr->rctx);
+	if(t) {
 		// An Exif marker indicated an unusual image orientation.
 
 		// Note that if there is also a JFIF segment (jr->rctx.is_jfif), the
 		// orientation is technically ambiguous. But, these days, the usual
 		// practice is to allow Exif to overrule JFIF.
 
-		iw_reorient_image(ctx,exif_orient_to_transform[jr->rctx.exif_orientation]);
+		iw_reorient_image(ctx,t);
 	}
 
 	retval=1;
@@ -601,14 +821,39 @@ struct iwjpegwcontext {
 	size_t buffer_len;
 };
 
+// Used with the "jpeg:targetsize" option. Each trial compression is written
+// to memory, and the best one found so far is kept, so that the image does not
+// have to be compressed again when the search is done.
+struct iwjpeg_outbuf {
+	iw_byte *data;
+	size_t len;
+	size_t alloc;
+	int failed;
+};
+
+typedef int (*iwjpeg_compress_fn)(void *userdata, struct iw_iodescr *iodescr);
+
+struct iwjpeg_target_ctx {
+	struct iw_context *ctx;
+	struct jpeg_compress_struct *cinfo;
+	iwjpeg_compress_fn compress_fn;
+	void *userdata;
+	size_t target_size;
+	struct iwjpeg_outbuf buf[2]; // [0] = the current trial, [1] = the best
+	int have_best;
+	int best_quality;
+};
+
 struct jw_rsrc_struct {
 	struct iw_context *ctx;
 	struct iw_iodescr *iodescr;
 	struct iwjpegwcontext wctx;
 	JSAMPROW *row_pointers;
+	const struct iw_image *img;
 	int compress_created;
 	struct jpeg_compress_struct cinfo;
 	struct my_error_mgr jerr;
+	struct iwjpeg_target_ctx target;
 };
 
 static void iwjpg_set_density(struct iw_context *ctx,struct jpeg_compress_struct *cinfo,
@@ -674,148 +919,1042 @@ static void my_term_destination_fn(j_compress_ptr cinfo)
 	}
 }
 
-static int iw_write_jpeg_file3(struct jw_rsrc_struct *jw)
+// Multithreaded compression, used if IW_VAL_MAX_THREADS is more than 1.
+// The image is split into bands of whole MCU rows, which are compressed
+// independently by separate libjpeg objects. The bands are joined into one
+// baseline JPEG stream, with a restart marker between each pair of bands,
+// and the restart interval set to the number of MCUs in a band.
+// The result is the same as if libjpeg had compressed the whole image with
+// that restart interval.
+//
+// If optimized Huffman tables are requested, the bands are first compressed
+// with the standard tables. Then the coefficients are read back, the symbol
+// statistics of all the bands are combined, and the bands are re-encoded
+// (without redoing the DCT) using the tables made from them.
+
+// The approximate number of pixels in each band.
+#define IWJPEG_BAND_SIZE 524288
+
+#define IWJPEG_PHASE_COMPRESS  1
+#define IWJPEG_PHASE_REENCODE  2
+
+// A destination manager that writes to a memory buffer allocated by libjpeg,
+// which lasts until the compression object is destroyed.
+struct iwjpeg_memdest {
+	struct jpeg_destination_mgr pub; // This field must be first.
+	JOCTET *buf;
+	size_t buf_len;
+	size_t data_len;
+};
+
+struct iwjpeg_band {
+	int first_row;
+	int num_rows;
+	int ok;
+	struct my_error_mgr jerr; // Shared by all the libjpeg objects below
+	int cinfo_valid;
+	struct jpeg_compress_struct cinfo;
+	struct iwjpeg_memdest dest;
+	// Used when re-encoding:
+	int dinfo_valid;
+	struct jpeg_decompress_struct dinfo;
+	struct jpeg_source_mgr src;
+	jvirt_barray_ptr *coefs;
+	int cinfo2_valid;
+	struct jpeg_compress_struct cinfo2;
+	struct iwjpeg_memdest dest2;
+	long dc_counts[NUM_HUFF_TBLS][257];
+	long ac_counts[NUM_HUFF_TBLS][257];
+	// The finished band
+	const JOCTET *out;
+	size_t out_len;
+};
+
+struct iwjpeg_par_ctx {
+	struct iw_context *ctx;
+	struct jpeg_compress_struct *params; // Not used for compression
+	JSAMPROW *row_pointers;
+	int phase;
+	int optimize;
+	int num_bands;
+	struct iwjpeg_band *bands;
+	int num_threads;
+	JHUFF_TBL *dc_tbls[NUM_HUFF_TBLS]; // Optimized tables (in params)
+	JHUFF_TBL *ac_tbls[NUM_HUFF_TBLS];
+};
+
+static void iwjpeg_memdest_init(j_compress_ptr cinfo)
 {
-	struct iw_context *ctx = jw->ctx;
-	struct iw_iodescr *iodescr = jw->iodescr;
-	int retval=0;
-	J_COLOR_SPACE in_colortype; // Color type of the data we give to libjpeg
-	int jpeg_cmpts;
-	int compress_started = 0;
-	int is_grayscale;
-	int j;
-	struct iw_image img;
-	int jpeg_quality;
-	int samp_factor_h, samp_factor_v;
-	int disable_subsampling = 0;
-	const char *optv;
-	int ret;
+	struct iwjpeg_memdest *dest = (struct iwjpeg_memdest*)cinfo->dest;
 
-	iw_get_output_image(ctx,&img);
+	dest->buf_len = 65536;
+	dest->buf = (JOCTET*)(*cinfo->mem->alloc_large)((j_common_ptr)cinfo,
+		JPOOL_PERMANENT, dest->buf_len);
+	dest->pub.next_output_byte = dest->buf;
+	dest->pub.free_in_buffer = dest->buf_len;
+}
 
-	if(IW_IMGTYPE_HAS_ALPHA(img.imgtype)) {
-		iw_set_error(ctx,"Internal: Transparency not supported with JPEG output");
-		goto done;
-	}
+static boolean iwjpeg_memdest_empty(j_compress_ptr cinfo)
+{
+	struct iwjpeg_memdest *dest = (struct iwjpeg_memdest*)cinfo->dest;
+	JOCTET *newbuf;
+
+	// The buffer is full. Replace it with one twice as big. (The old one
+	// won't be freed until the end, but that's not worth worrying about.)
+	newbuf = (JOCTET*)(*cinfo->mem->alloc_large)((j_common_ptr)cinfo,
+		JPOOL_PERMANENT, 2*dest->buf_len);
+	memcpy(newbuf, dest->buf, dest->buf_len);
+	dest->pub.next_output_byte = &newbuf[dest->buf_len];
+	dest->pub.free_in_buffer = dest->buf_len;
+	dest->buf = newbuf;
+	dest->buf_len *= 2;
+	return TRUE;
+}
 
-	if(img.bit_depth!=8) {
-		iw_set_errorf(ctx,"Internal: Precision %d not supported with JPEG output",img.bit_depth);
-		goto done;
-	}
+static void iwjpeg_memdest_term(j_compress_ptr cinfo)
+{
+	struct iwjpeg_memdest *dest = (struct iwjpeg_memdest*)cinfo->dest;
 
-	is_grayscale = IW_IMGTYPE_IS_GRAY(img.imgtype);
+	dest->data_len = dest->buf_len - dest->pub.free_in_buffer;
+}
 
-	if(is_grayscale) {
-		in_colortype=JCS_GRAYSCALE;
-		jpeg_cmpts=1;
-	}
-	else {
-		in_colortype=JCS_RGB;
-		jpeg_cmpts=3;
-	}
+static void iwjpeg_use_memdest(j_compress_ptr cinfo, struct iwjpeg_memdest *dest)
+{
+	dest->pub.init_destination = iwjpeg_memdest_init;
+	dest->pub.empty_output_buffer = iwjpeg_memdest_empty;
+	dest->pub.term_destination = iwjpeg_memdest_term;
+	cinfo->dest = &dest->pub;
+}
 
-	jpeg_create_compress(&jw->cinfo);
-	jw->compress_created=1;
+static void iwjpeg_memsrc_init(j_decompress_ptr cinfo)
+{
+}
 
-	// Set up our custom destination manager.
-	jw->wctx.pub.init_destination = my_init_destination_fn;
-	jw->wctx.pub.empty_output_buffer = my_empty_output_buffer_fn;
-	jw->wctx.pub.term_destination = my_term_destination_fn;
-	jw->wctx.ctx = ctx;
-	jw->wctx.iodescr = iodescr;
-	jw->wctx.buffer_len = 32768;
-	jw->wctx.buffer = iw_malloc(ctx,jw->wctx.buffer_len);
-	if(!jw->wctx.buffer) goto done;
-	// Our wctx is organized so it can double as a
-	// 'struct jpeg_destination_mgr'.
-	jw->cinfo.dest = (struct jpeg_destination_mgr*)&jw->wctx;
+static boolean iwjpeg_memsrc_fill(j_decompress_ptr cinfo)
+{
+	static const JOCTET fake_eoi[2] = { 0xff, JPEG_EOI };
 
-	jw->cinfo.image_width = img.width;
-	jw->cinfo.image_height = img.height;
-	jw->cinfo.input_components = jpeg_cmpts;
-	jw->cinfo.in_color_space = in_colortype;
+	// Shouldn't happen; the data came from libjpeg.
+	cinfo->src->next_input_byte = fake_eoi;
+	cinfo->src->bytes_in_buffer = 2;
+	return TRUE;
+}
 
-	jpeg_set_defaults(&jw->cinfo);
+static void iwjpeg_memsrc_skip(j_decompress_ptr cinfo, long num_bytes)
+{
+	if(num_bytes<=0) return;
+	if((size_t)num_bytes > cinfo->src->bytes_in_buffer)
+		num_bytes = (long)cinfo->src->bytes_in_buffer;
+	cinfo->src->next_input_byte += num_bytes;
+	cinfo->src->bytes_in_buffer -= (size_t)num_bytes;
+}
 
-	optv = iw_get_option(ctx, "jpeg:rstm");
-	if(optv) {
-		jw->cinfo.restart_interval = (unsigned int)iw_parse_int(optv);
+static void iwjpeg_memsrc_term(j_decompress_ptr cinfo)
+{
+}
+
+// Copy the things that can't be inferred from a JPEG file: the fields that
+// control which markers are written.
+static void iwjpeg_copy_marker_params(struct jpeg_compress_struct *dst,
+	const struct jpeg_compress_struct *src)
+{
+	dst->write_JFIF_header = src->write_JFIF_header;
+	dst->JFIF_major_version = src->JFIF_major_version;
+	dst->JFIF_minor_version = src->JFIF_minor_version;
+	dst->density_unit = src->density_unit;
+	dst->X_density = src->X_density;
+	dst->Y_density = src->Y_density;
+	dst->write_Adobe_marker = src->write_Adobe_marker;
+}
+
+// Set up band->cinfo to compress the band's rows the same way that
+// par->params says to compress the whole image.
+static void iwjpeg_setup_band(struct iwjpeg_par_ctx *par, struct iwjpeg_band *band)
+{
+	const struct jpeg_compress_struct *params = par->params;
+	struct jpeg_compress_struct *cinfo = &band->cinfo;
+	int ci;
+	int n;
+
+	cinfo->image_width = params->image_width;
+	cinfo->image_height = (JDIMENSION)band->num_rows;
+	cinfo->input_components = params->input_components;
+	cinfo->in_color_space = params->in_color_space;
+	jpeg_set_defaults(cinfo);
+	jpeg_set_colorspace(cinfo, params->jpeg_color_space);
+#if JPEG_LIB_VERSION_MAJOR >= 9
+	cinfo->color_transform = params->color_transform;
+#endif
+
+	for(ci=0; ci<params->num_components; ci++) {
+		cinfo->comp_info[ci].h_samp_factor = params->comp_info[ci].h_samp_factor;
+		cinfo->comp_info[ci].v_samp_factor = params->comp_info[ci].v_samp_factor;
+		cinfo->comp_info[ci].quant_tbl_no = params->comp_info[ci].quant_tbl_no;
 	}
-	optv = iw_get_option(ctx, "jpeg:rstr");
-	if(optv) {
-		jw->cinfo.restart_in_rows = (int)iw_parse_int(optv);
+
+	for(n=0; n<NUM_QUANT_TBLS; n++) {
+		if(!params->quant_tbl_ptrs[n]) continue;
+		if(!cinfo->quant_tbl_ptrs[n])
+			cinfo->quant_tbl_ptrs[n] = jpeg_alloc_quant_table((j_common_ptr)cinfo);
+		memcpy(cinfo->quant_tbl_ptrs[n]->quantval, params->quant_tbl_ptrs[n]->quantval,
+			sizeof(params->quant_tbl_ptrs[n]->quantval));
 	}
 
-	optv = iw_get_option(ctx, "jpeg:block");
-	if(optv) {
-#if (JPEG_LIB_VERSION_MAJOR>=9 || \
-	(JPEG_LIB_VERSION_MAJOR==8 && JPEG_LIB_VERSION_MINOR>=3))
-		// Note: This might not work if DCT_SCALING_SUPPORTED was not defined when
-		// libjpeg was compiled, but that symbol is not normally exposed to
-		// applications.
-		jw->cinfo.block_size = iw_parse_int(optv);
-#else
-		iw_warning(ctx, "Setting block size is not supported by this version of libjpeg");
-#endif
+	iwjpeg_copy_marker_params(cinfo, params);
+	cinfo->optimize_coding = FALSE;
+	cinfo->restart_interval = 0;
+	cinfo->restart_in_rows = 0;
+
+	iwjpeg_use_memdest(cinfo, &band->dest);
+}
+
+// Count the Huffman symbols that one block will be encoded with, the same
+// way libjpeg does it when optimizing the tables.
+static void iwjpeg_count_block(JCOEF *block, int last_dc_val,
+	long *dc_counts, long *ac_counts)
+{
+	int temp;
+	int nbits;
+	int k, r;
+
+	temp = block[0] - last_dc_val;
+	if(temp<0) temp = -temp;
+	nbits = 0;
+	while(temp) {
+		nbits++;
+		temp >>= 1;
+	}
+	dc_counts[nbits]++;
+
+	r = 0; // run length of zeros
+	for(k=1; k<DCTSIZE2; k++) {
+		temp = block[iwjpeg_natural_order[k]];
+		if(temp==0) {
+			r++;
+			continue;
+		}
+		while(r>15) {
+			ac_counts[0xf0]++;
+			r -= 16;
+		}
+		if(temp<0) temp = -temp;
+		nbits = 1;
+		while((temp >>= 1)) nbits++;
+		ac_counts[(r<<4) + nbits]++;
+		r = 0;
 	}
+	if(r>0) ac_counts[0]++; // EOB
+}
 
-	optv = iw_get_option(ctx, "jpeg:arith");
-	if(optv)
-		jw->cinfo.arith_code = iw_parse_int(optv) ? TRUE : FALSE;
-	else
-		jw->cinfo.arith_code = FALSE;
+// Count the Huffman symbols in a band, whose coefficients have been read
+// into band->coefs. The blocks are visited in the order they'll be
+// encoded in, including the dummy blocks at the edges of the MCUs.
+static void iwjpeg_count_band(struct iwjpeg_band *band)
+{
+	struct jpeg_decompress_struct *dinfo = &band->dinfo;
+	jpeg_component_info *compptr;
+	JBLOCKARRAY rows[MAX_COMPS_IN_SCAN];
+	int last_dc_val[MAX_COMPS_IN_SCAN];
+	int max_h, max_v;
+	JDIMENSION mcus_per_row, mcu_rows;
+	JDIMENSION mx, my;
+	int ci, xx, yy;
+
+	for(ci=0; ci<dinfo->num_components; ci++) {
+		last_dc_val[ci] = 0;
+	}
 
-	optv = iw_get_option(ctx, "jpeg:colortype");
-	if(optv) {
-		if(!strcmp(optv, "rgb")) {
-			if(in_colortype==JCS_RGB) {
-				jpeg_set_colorspace(&jw->cinfo,JCS_RGB);
-				disable_subsampling = 1;
+	if(dinfo->num_components==1) {
+		// Non-interleaved: each MCU is one block.
+		compptr = &dinfo->comp_info[0];
+		for(my=0; my<compptr->height_in_blocks; my++) {
+			rows[0] = (*dinfo->mem->access_virt_barray)((j_common_ptr)dinfo,
+				band->coefs[0], my, 1, FALSE);
+			for(mx=0; mx<compptr->width_in_blocks; mx++) {
+				iwjpeg_count_block(rows[0][0][mx], last_dc_val[0],
+					band->dc_counts[compptr->dc_tbl_no], band->ac_counts[compptr->ac_tbl_no]);
+				last_dc_val[0] = rows[0][0][mx][0];
 			}
 		}
-		else if(!strcmp(optv, "rgb1")) {
-			if(in_colortype==JCS_RGB) {
-#if JPEG_LIB_VERSION_MAJOR >= 9
-				jw->cinfo.color_transform = JCT_SUBTRACT_GREEN;
-#else
-				iw_warning(ctx, "Color type rgb1 is not supported by this version of libjpeg");
-#endif
-				jpeg_set_colorspace(&jw->cinfo,JCS_RGB);
-				disable_subsampling = 1;
+		return;
+	}
+
+	max_h = dinfo->max_h_samp_factor;
+	max_v = dinfo->max_v_samp_factor;
+	mcus_per_row = (dinfo->image_width + max_h*DCTSIZE - 1)/(max_h*DCTSIZE);
+	mcu_rows = (dinfo->image_height + max_v*DCTSIZE - 1)/(max_v*DCTSIZE);
+
+	for(my=0; my<mcu_rows; my++) {
+		for(ci=0; ci<dinfo->num_components; ci++) {
+			compptr = &dinfo->comp_info[ci];
+			rows[ci] = (*dinfo->mem->access_virt_barray)((j_common_ptr)dinfo,
+				band->coefs[ci], my*compptr->v_samp_factor,
+				(JDIMENSION)compptr->v_samp_factor, FALSE);
+		}
+		for(mx=0; mx<mcus_per_row; mx++) {
+			for(ci=0; ci<dinfo->num_components; ci++) {
+				compptr = &dinfo->comp_info[ci];
+				for(yy=0; yy<compptr->v_samp_factor; yy++) {
+					for(xx=0; xx<compptr->h_samp_factor; xx++) {
+						JCOEF *block = rows[ci][yy][mx*compptr->h_samp_factor + xx];
+						iwjpeg_count_block(block, last_dc_val[ci],
+							band->dc_counts[compptr->dc_tbl_no],
+							band->ac_counts[compptr->ac_tbl_no]);
+						last_dc_val[ci] = block[0];
+					}
+				}
 			}
 		}
 	}
+}
 
-	optv = iw_get_option(ctx, "jpeg:optcoding");
-	if(optv && iw_parse_int(optv)) {
-		jw->cinfo.optimize_coding = TRUE;
-	}
+// Read back the coefficients of a compressed band, and count its symbols.
+static void iwjpeg_read_band_coefs(struct iwjpeg_band *band)
+{
+	struct jpeg_decompress_struct *dinfo = &band->dinfo;
+
+	dinfo->err = &band->jerr.pub;
+	jpeg_create_decompress(dinfo);
+	band->dinfo_valid = 1;
+
+	band->src.init_source = iwjpeg_memsrc_init;
+	band->src.fill_input_buffer = iwjpeg_memsrc_fill;
+	band->src.skip_input_data = iwjpeg_memsrc_skip;
+	band->src.resync_to_restart = jpeg_resync_to_restart;
+	band->src.term_source = iwjpeg_memsrc_term;
+	band->src.next_input_byte = band->dest.buf;
+	band->src.bytes_in_buffer = band->dest.data_len;
+	dinfo->src = &band->src;
+
+	jpeg_read_header(dinfo, TRUE);
+	band->coefs = jpeg_read_coefficients(dinfo);
+	iwjpeg_count_band(band);
+
+	// We don't need the first version of the band anymore.
+	jpeg_destroy_compress(&band->cinfo);
+	band->cinfo_valid = 0;
+}
 
-	optv = iw_get_option(ctx, "jpeg:bgycc");
-	if(optv && iw_parse_int(optv)) {
-#if (JPEG_LIB_VERSION_MAJOR>9 || \
-	(JPEG_LIB_VERSION_MAJOR==9 && JPEG_LIB_VERSION_MINOR>=1))
-		jpeg_set_colorspace(&jw->cinfo, JCS_BG_YCC);
-#else
-		iw_warning(ctx, "Big gamut YCC is not supported by this version of libjpeg");
-#endif
+// Encode the band's coefficients again, with the optimized tables.
+static void iwjpeg_reencode_band(struct iwjpeg_par_ctx *par, struct iwjpeg_band *band)
+{
+	struct jpeg_compress_struct *cinfo2 = &band->cinfo2;
+	JHUFF_TBL **tbl;
+	int n;
+
+	cinfo2->err = &band->jerr.pub;
+	jpeg_create_compress(cinfo2);
+	band->cinfo2_valid = 1;
+
+	jpeg_copy_critical_parameters(&band->dinfo, cinfo2);
+	iwjpeg_copy_marker_params(cinfo2, par->params);
+	cinfo2->optimize_coding = FALSE;
+
+	for(n=0; n<NUM_HUFF_TBLS; n++) {
+		if(par->dc_tbls[n]) {
+			tbl = &cinfo2->dc_huff_tbl_ptrs[n];
+			if(!*tbl) *tbl = jpeg_alloc_huff_table((j_common_ptr)cinfo2);
+			memcpy((*tbl)->bits, par->dc_tbls[n]->bits, sizeof((*tbl)->bits));
+			memcpy((*tbl)->huffval, par->dc_tbls[n]->huffval, sizeof((*tbl)->huffval));
+		}
+		if(par->ac_tbls[n]) {
+			tbl = &cinfo2->ac_huff_tbl_ptrs[n];
+			if(!*tbl) *tbl = jpeg_alloc_huff_table((j_common_ptr)cinfo2);
+			memcpy((*tbl)->bits, par->ac_tbls[n]->bits, sizeof((*tbl)->bits));
+			memcpy((*tbl)->huffval, par->ac_tbls[n]->huffval, sizeof((*tbl)->huffval));
+		}
 	}
 
-	iwjpg_set_density(ctx,&jw->cinfo,&img);
+	iwjpeg_use_memdest(cinfo2, &band->dest2);
+	jpeg_write_coefficients(cinfo2, band->coefs);
+	jpeg_finish_compress(cinfo2);
 
-	optv = iw_get_option(ctx, "jpeg:quality");
-	if(optv)
-		jpeg_quality = iw_parse_int(optv);
-	else
-		jpeg_quality = 0;
+	jpeg_destroy_decompress(&band->dinfo);
+	band->dinfo_valid = 0;
+}
 
-	if(jpeg_quality>0) {
-		jpeg_set_quality(&jw->cinfo,jpeg_quality,0);
+static void iwjpeg_band_task(void *userdata, int task_num, int thread_num)
+{
+	struct iwjpeg_par_ctx *par = (struct iwjpeg_par_ctx*)userdata;
+	struct iwjpeg_band *band = &par->bands[task_num];
+
+	if(setjmp(band->jerr.setjmp_buffer)) {
+		return;
 	}
 
-	if(jpeg_cmpts>1 && !disable_subsampling) {
-		samp_factor_h = 0;
-		samp_factor_v = 0;
+	if(par->phase==IWJPEG_PHASE_COMPRESS) {
+		band->cinfo.err = jpeg_std_error(&band->jerr.pub);
+		band->jerr.pub.error_exit = my_error_exit;
+		band->jerr.pub.output_message = my_output_message;
+		jpeg_create_compress(&band->cinfo);
+		band->cinfo_valid = 1;
+		iwjpeg_setup_band(par, band);
+
+		jpeg_start_compress(&band->cinfo, TRUE);
+		jpeg_write_scanlines(&band->cinfo, &par->row_pointers[band->first_row],
+			(JDIMENSION)band->num_rows);
+		jpeg_finish_compress(&band->cinfo);
+
+		if(par->optimize) {
+			iwjpeg_read_band_coefs(band);
+		}
+		else {
+			band->out = band->dest.buf;
+			band->out_len = band->dest.data_len;
+		}
+	}
+	else {
+		iwjpeg_reencode_band(par, band);
+		band->out = band->dest2.buf;
+		band->out_len = band->dest2.data_len;
+	}
+
+	band->ok = 1;
+}
+
+// Make an optimal Huffman table from the symbol frequencies, the same way
+// libjpeg does it (see section K.2 of the JPEG standard).
+// Returns 0 if the table can't be made.
+static int iwjpeg_gen_optimal_table(JHUFF_TBL *htbl, const long *counts)
+{
+	long freq[257];
+	int codesize[257];
+	int others[257];
+	int bits[33];
+	int c1, c2;
+	int i, j, p;
+	long v;
+
+	for(i=0; i<257; i++) {
+		freq[i] = counts[i];
+		codesize[i] = 0;
+		others[i] = -1;
+	}
+	// A reserved symbol, so that no code will be all 1 bits.
+	freq[256] = 1;
+
+	while(1) {
+		// Find the two least frequent symbols (preferring the larger value
+		// in case of a tie).
+		c1 = -1;
+		v = 1000000000L;
+		for(i=0; i<=256; i++) {
+			if(freq[i] && freq[i]<=v) {
+				v = freq[i];
+				c1 = i;
+			}
+		}
+		c2 = -1;
+		v = 1000000000L;
+		for(i=0; i<=256; i++) {
+			if(freq[i] && freq[i]<=v && i!=c1) {
+				v = freq[i];
+				c2 = i;
+			}
+		}
+		if(c2<0) break;
+
+		// Merge them.
+		freq[c1] += freq[c2];
+		freq[c2] = 0;
+		codesize[c1]++;
+		while(others[c1]>=0) {
+			c1 = others[c1];
+			codesize[c1]++;
+		}
+		others[c1] = c2;
+		codesize[c2]++;
+		while(others[c2]>=0) {
+			c2 = others[c2];
+			codesize[c2]++;
+		}
+	}
+
+	for(i=0; i<33; i++) bits[i] = 0;
+	for(i=0; i<=256; i++) {
+		if(codesize[i]) {
+			if(codesize[i]>32) return 0;
+			bits[codesize[i]]++;
+		}
+	}
+
+	// Limit the code lengths to 16 bits.
+	for(i=32; i>16; i--) {
+		while(bits[i]>0) {
+			j = i-2;
+			while(bits[j]==0) j--;
+			bits[i] -= 2;
+			bits[i-1]++;
+			bits[j+1] += 2;
+			bits[j]--;
+		}
+	}
+	// Remove the reserved symbol, which has the longest code.
+	while(bits[i]==0) i--;
+	bits[i]--;
+
+	for(i=0; i<17; i++) {
+		htbl->bits[i] = (UINT8)bits[i];
+	}
+	p = 0;
+	for(i=1; i<=32; i++) {
+		for(j=0; j<=255; j++) {
+			if(codesize[j]==i) {
+				htbl->huffval[p++] = (UINT8)j;
+			}
+		}
+	}
+	htbl->sent_table = FALSE;
+	return 1;
+}
+
+// Combine the symbol counts of all the bands, and make the tables.
+static int iwjpeg_make_optimal_tables(struct iwjpeg_par_ctx *par)
+{
+	struct jpeg_compress_struct *params = par->params;
+	long counts[257];
+	int used_dc[NUM_HUFF_TBLS];
+	int used_ac[NUM_HUFF_TBLS];
+	int ci, n, b, i;
+
+	for(n=0; n<NUM_HUFF_TBLS; n++) {
+		used_dc[n] = 0;
+		used_ac[n] = 0;
+	}
+	for(ci=0; ci<params->num_components; ci++) {
+		used_dc[params->comp_info[ci].dc_tbl_no] = 1;
+		used_ac[params->comp_info[ci].ac_tbl_no] = 1;
+	}
+
+	for(n=0; n<NUM_HUFF_TBLS; n++) {
+		if(used_dc[n]) {
+			for(i=0; i<257; i++) counts[i] = 0;
+			for(b=0; b<par->num_bands; b++) {
+				for(i=0; i<257; i++) counts[i] += par->bands[b].dc_counts[n][i];
+			}
+			par->dc_tbls[n] = jpeg_alloc_huff_table((j_common_ptr)params);
+			if(!iwjpeg_gen_optimal_table(par->dc_tbls[n], counts)) return 0;
+		}
+		if(used_ac[n]) {
+			for(i=0; i<257; i++) counts[i] = 0;
+			for(b=0; b<par->num_bands; b++) {
+				for(i=0; i<257; i++) counts[i] += par->bands[b].ac_counts[n][i];
+			}
+			par->ac_tbls[n] = jpeg_alloc_huff_table((j_common_ptr)params);
+			if(!iwjpeg_gen_optimal_table(par->ac_tbls[n], counts)) return 0;
+		}
+	}
+	return 1;
+}
+
+// Find the SOF and SOS markers in a band, and the start of its
+// entropy-coded data.
+static int iwjpeg_parse_band(const JOCTET *d, size_t len,
+	size_t *psof_pos, size_t *psos_pos, size_t *pdata_pos)
+{
+	size_t pos;
+	size_t seglen;
+
+	*psof_pos = 0;
+	if(len<4 || d[0]!=0xff || d[1]!=0xd8) return 0;
+	pos = 2;
+	while(1) {
+		if(pos+4 > len) return 0;
+		if(d[pos]!=0xff) return 0;
+		seglen = ((size_t)d[pos+2]<<8) | d[pos+3];
+		if(d[pos+1]==0xc0 || d[pos+1]==0xc1) {
+			*psof_pos = pos;
+		}
+		else if(d[pos+1]==0xda) {
+			*psos_pos = pos;
+			*pdata_pos = pos+2+seglen;
+			break;
+		}
+		pos += 2+seglen;
+	}
+
+	if(*psof_pos==0 || *pdata_pos+2 > len) return 0;
+	// The data should end with an EOI marker.
+	if(d[len-2]!=0xff || d[len-1]!=JPEG_EOI) return 0;
+	return 1;
+}
+
+// Join the bands, and write the JPEG file.
+static int iwjpeg_write_bands(struct iwjpeg_par_ctx *par, struct iw_iodescr *iodescr,
+	unsigned int restart_interval)
+{
+	struct iw_context *ctx = par->ctx;
+	struct iwjpeg_band *band;
+	size_t sof_pos, sos_pos, data_pos;
+	size_t sof_pos0, sos_pos0, data_pos0;
+	JOCTET tmp[6];
+	int i;
+
+	band = &par->bands[0];
+	if(!iwjpeg_parse_band(band->out, band->out_len, &sof_pos0, &sos_pos0, &data_pos0))
+		goto parse_error;
+
+	// The first band's markers, with the image height fixed.
+	(*iodescr->write_fn)(ctx, iodescr, (void*)band->out, sof_pos0+5);
+	tmp[0] = (JOCTET)(par->params->image_height>>8);
+	tmp[1] = (JOCTET)(par->params->image_height&0xff);
+	(*iodescr->write_fn)(ctx, iodescr, tmp, 2);
+	(*iodescr->write_fn)(ctx, iodescr, (void*)&band->out[sof_pos0+7], sos_pos0-(sof_pos0+7));
+
+	// DRI, which libjpeg would have written just before SOS.
+	tmp[0] = 0xff;
+	tmp[1] = 0xdd;
+	tmp[2] = 0;
+	tmp[3] = 4;
+	tmp[4] = (JOCTET)(restart_interval>>8);
+	tmp[5] = (JOCTET)(restart_interval&0xff);
+	(*iodescr->write_fn)(ctx, iodescr, tmp, 6);
+
+	(*iodescr->write_fn)(ctx, iodescr, (void*)&band->out[sos_pos0], data_pos0-sos_pos0);
+
+	for(i=0; i<par->num_bands; i++) {
+		band = &par->bands[i];
+		if(i==0) {
+			data_pos = data_pos0;
+		}
+		else {
+			if(!iwjpeg_parse_band(band->out, band->out_len, &sof_pos, &sos_pos, &data_pos))
+				goto parse_error;
+			tmp[0] = 0xff;
+			tmp[1] = (JOCTET)(JPEG_RST0 + ((i-1)&7));
+			(*iodescr->write_fn)(ctx, iodescr, tmp, 2);
+		}
+		// The entropy-coded data, not including EOI.
+		(*iodescr->write_fn)(ctx, iodescr, (void*)&band->out[data_pos],
+			band->out_len-2-data_pos);
+	}
+
+	tmp[0] = 0xff;
+	tmp[1] = JPEG_EOI;
+	(*iodescr->write_fn)(ctx, iodescr, tmp, 2);
+	return 1;
+
+parse_error:
+	iw_set_error(ctx, "Internal: Failed to join JPEG bands");
+	return 0;
+}
+
+static void iwjpeg_par_free(struct iwjpeg_par_ctx *par)
+{
+	struct iwjpeg_band *band;
+	int i;
+
+	if(par->bands) {
+		for(i=0; i<par->num_bands; i++) {
+			band = &par->bands[i];
+			if(band->cinfo_valid) jpeg_destroy_compress(&band->cinfo);
+			if(band->dinfo_valid) jpeg_destroy_decompress(&band->dinfo);
+			if(band->cinfo2_valid) jpeg_destroy_compress(&band->cinfo2);
+		}
+		iw_free(par->ctx, par->bands);
+	}
+	iw_free(par->ctx, par);
+}
+
+// Reports any libjpeg error that happened in a band.
+static int iwjpeg_check_bands(struct iwjpeg_par_ctx *par)
+{
+	struct iwjpeg_band *band;
+	char buffer[JMSG_LENGTH_MAX];
+	int i;
+
+	for(i=0; i<par->num_bands; i++) {
+		band = &par->bands[i];
+		if(band->ok) continue;
+		if(band->jerr.have_libjpeg_error) {
+			(*band->jerr.pub.format_message)((j_common_ptr)&band->cinfo, buffer);
+			iw_set_errorf(par->ctx, "libjpeg reports write error: %s", buffer);
+		}
+		else {
+			iw_set_error(par->ctx, "JPEG compression failed");
+		}
+		return 0;
+	}
+	return 1;
+}
+
+// Decide on the number of rows in each band, and the number of MCUs in each
+// band (the restart interval).
+// Returns 0 if the image should not be compressed in bands.
+static int iwjpeg_calc_bands(struct iw_context *ctx, struct jpeg_compress_struct *cinfo,
+	int *pband_height, unsigned int *prestart_interval)
+{
+	int max_h = 1;
+	int max_v = 1;
+	int mcu_w, mcu_h;
+	int mcus_per_row;
+	int mcu_rows_per_band;
+	int ci;
+
+	if(iw_get_value(ctx,IW_VAL_MAX_THREADS)<2) return 0;
+	if(cinfo->scan_info || cinfo->arith_code) return 0;
+	if(cinfo->restart_interval || cinfo->restart_in_rows) return 0;
+#if (JPEG_LIB_VERSION_MAJOR>=9 || \
+	(JPEG_LIB_VERSION_MAJOR==8 && JPEG_LIB_VERSION_MINOR>=3))
+	if(cinfo->block_size!=DCTSIZE) return 0;
+#endif
+
+	for(ci=0; ci<cinfo->num_components; ci++) {
+		if(cinfo->comp_info[ci].h_samp_factor>max_h) max_h = cinfo->comp_info[ci].h_samp_factor;
+		if(cinfo->comp_info[ci].v_samp_factor>max_v) max_v = cinfo->comp_info[ci].v_samp_factor;
+	}
+	if(cinfo->num_components==1) {
+		// Non-interleaved, so each MCU is one block.
+		max_h = 1;
+		max_v = 1;
+	}
+	mcu_w = max_h*DCTSIZE;
+	mcu_h = max_v*DCTSIZE;
+	mcus_per_row = ((int)cinfo->image_width + mcu_w - 1)/mcu_w;
+
+	mcu_rows_per_band = (int)(IWJPEG_BAND_SIZE/cinfo->image_width)/mcu_h;
+	if(mcu_rows_per_band<1) mcu_rows_per_band=1;
+	// The restart interval is limited to 65535 MCUs.
+	if(mcu_rows_per_band*mcus_per_row > 65535) mcu_rows_per_band = 65535/mcus_per_row;
+	if(mcu_rows_per_band<1) return 0;
+
+	// It's not worth it if there's only one band.
+	if(mcu_rows_per_band*mcu_h >= (int)cinfo->image_height) return 0;
+
+	*pband_height = mcu_rows_per_band*mcu_h;
+	*prestart_interval = (unsigned int)(mcu_rows_per_band*mcus_per_row);
+	return 1;
+}
+
+// Compress the image using multiple threads. jw->cinfo contains the
+// compression parameters, but is not started.
+static int iwjpeg_write_parallel(struct jw_rsrc_struct *jw, const struct iw_image *img,
+	struct iw_iodescr *iodescr, int band_height, unsigned int restart_interval)
+{
+	struct iw_context *ctx = jw->ctx;
+	struct iwjpeg_par_ctx *par;
+	struct iwjpeg_band *band;
+	int retval = 0;
+	int i;
+
+	par = iw_mallocz(ctx, sizeof(struct iwjpeg_par_ctx));
+	if(!par) goto done;
+	par->ctx = ctx;
+	par->params = &jw->cinfo;
+	par->row_pointers = jw->row_pointers;
+	par->optimize = jw->cinfo.optimize_coding ? 1 : 0;
+
+	par->num_bands = (img->height + band_height - 1)/band_height;
+	par->bands = iw_mallocz(ctx, par->num_bands*sizeof(struct iwjpeg_band));
+	if(!par->bands) goto done;
+	for(i=0; i<par->num_bands; i++) {
+		band = &par->bands[i];
+		band->first_row = i*band_height;
+		band->num_rows = band_height;
+		if(band->first_row + band->num_rows > img->height)
+			band->num_rows = img->height - band->first_row;
+	}
+	par->num_threads = iw_get_num_threads_for_tasks(ctx, par->num_bands);
+
+	par->phase = IWJPEG_PHASE_COMPRESS;
+	iw_run_tasks(ctx, par->num_bands, par->num_threads, iwjpeg_band_task, (void*)par);
+	if(!iwjpeg_check_bands(par)) goto done;
+
+	if(par->optimize) {
+		if(!iwjpeg_make_optimal_tables(par)) {
+			iw_set_error(ctx, "Failed to make Huffman tables");
+			goto done;
+		}
+		for(i=0; i<par->num_bands; i++) {
+			par->bands[i].ok = 0;
+		}
+		par->phase = IWJPEG_PHASE_REENCODE;
+		iw_run_tasks(ctx, par->num_bands, par->num_threads, iwjpeg_band_task, (void*)par);
+		if(!iwjpeg_check_bands(par)) goto done;
+	}
+
+	if(!iwjpeg_write_bands(par, iodescr, restart_interval)) goto done;
+	retval = 1;
+
+done:
+	if(par) iwjpeg_par_free(par);
+	return retval;
+}
+
+static int iwjpeg_outbuf_write(struct iw_context *ctx, struct iw_iodescr *iodescr,
+	const void *buf, size_t nbytes)
+{
+	struct iwjpeg_outbuf *ob = (struct iwjpeg_outbuf*)iodescr->fp;
+	size_t newalloc;
+	iw_byte *newdata;
+
+	if(ob->failed) return 0;
+	if(nbytes > ob->alloc - ob->len) {
+		newalloc = ob->alloc ? ob->alloc*2 : 65536;
+		while(nbytes > newalloc - ob->len) newalloc *= 2;
+		newdata = iw_realloc(ctx, ob->data, ob->alloc, newalloc);
+		if(!newdata) {
+			ob->failed = 1;
+			return 0;
+		}
+		ob->data = newdata;
+		ob->alloc = newalloc;
+	}
+	memcpy(&ob->data[ob->len], buf, nbytes);
+	ob->len += nbytes;
+	return 1;
+}
+
+// An iw_encode_at_quality_fn.
+static int iwjpeg_try_quality(void *userdata, int quality, size_t *psize)
+{
+	struct iwjpeg_target_ctx *tg = (struct iwjpeg_target_ctx*)userdata;
+	struct iw_iodescr memdescr;
+	struct iwjpeg_outbuf tmpbuf;
+	size_t size, best_size;
+	int is_better;
+
+	tg->buf[0].len = 0;
+	iw_zeromem(&memdescr, sizeof(struct iw_iodescr));
+	memdescr.fp = (void*)&tg->buf[0];
+	memdescr.write_fn = iwjpeg_outbuf_write;
+
+	jpeg_set_quality(tg->cinfo, quality, 0);
+	if(!(*tg->compress_fn)(tg->userdata, &memdescr)) return 0;
+	if(tg->buf[0].failed) return 0;
+	size = tg->buf[0].len;
+	*psize = size;
+
+	// Keep the trial that iw_search_quality() is going to choose.
+	best_size = tg->buf[1].len;
+	if(!tg->have_best)
+		is_better = 1;
+	else if(size<=tg->target_size)
+		is_better = (best_size>tg->target_size || quality>tg->best_quality);
+	else
+		is_better = (best_size>tg->target_size && quality<tg->best_quality);
+
+	if(is_better) {
+		tmpbuf = tg->buf[1];
+		tg->buf[1] = tg->buf[0];
+		tg->buf[0] = tmpbuf;
+		tg->have_best = 1;
+		tg->best_quality = quality;
+	}
+	return 1;
+}
+
+// Compress the image at the highest quality that makes the file no larger
+// than target_size (or as close as we can get), and write it to iodescr.
+// start_quality is the first quality to try.
+static int iwjpeg_write_to_target_size(struct iwjpeg_target_ctx *tg,
+	struct iw_iodescr *iodescr, int start_quality)
+{
+	struct iw_context *ctx = tg->ctx;
+	int quality;
+
+	if(!iw_search_quality(ctx, tg->target_size, 1, 100, start_quality,
+		iwjpeg_try_quality, (void*)tg, &quality))
+	{
+		return 0;
+	}
+	if(!tg->have_best || tg->best_quality!=quality) {
+		iw_set_error(ctx, "Internal: JPEG target size search failed");
+		return 0;
+	}
+
+	if(tg->buf[1].len > tg->target_size) {
+		iw_warningf(ctx, "Could not make a JPEG file as small as %u bytes",
+			(unsigned int)tg->target_size);
+	}
+
+	(*iodescr->write_fn)(ctx, iodescr, tg->buf[1].data, tg->buf[1].len);
+	return 1;
+}
+
+static void iwjpeg_target_free(struct iw_context *ctx, struct iwjpeg_target_ctx *tg)
+{
+	int i;
+	for(i=0; i<2; i++) {
+		if(tg->buf[i].data) iw_free(ctx, tg->buf[i].data);
+	}
+}
+
+// Returns the "jpeg:targetsize" setting, or 0 if not set.
+static size_t iwjpeg_get_target_size(struct iw_context *ctx)
+{
+	const char *optv;
+	int n;
+
+	optv = iw_get_option(ctx, "jpeg:targetsize");
+	if(!optv) return 0;
+	n = iw_parse_int(optv);
+	return (n>0) ? (size_t)n : 0;
+}
+
+// Compress the image to iodescr, using the parameters in jw->cinfo.
+// This may be called more than once.
+// An iwjpeg_compress_fn.
+static int iwjpeg_compress_image(void *userdata, struct iw_iodescr *iodescr)
+{
+	struct jw_rsrc_struct *jw = (struct jw_rsrc_struct*)userdata;
+	int band_height;
+	unsigned int restart_interval;
+
+	if(iwjpeg_calc_bands(jw->ctx,&jw->cinfo,&band_height,&restart_interval)) {
+		return iwjpeg_write_parallel(jw,jw->img,iodescr,band_height,restart_interval);
+	}
+
+	jw->wctx.iodescr = iodescr;
+	jpeg_start_compress(&jw->cinfo, TRUE);
+	jpeg_write_scanlines(&jw->cinfo, jw->row_pointers, jw->img->height);
+	jpeg_finish_compress(&jw->cinfo);
+	return 1;
+}
+
+static int iw_write_jpeg_file3(struct jw_rsrc_struct *jw)
+{
+	struct iw_context *ctx = jw->ctx;
+	struct iw_iodescr *iodescr = jw->iodescr;
+	int retval=0;
+	J_COLOR_SPACE in_colortype; // Color type of the data we give to libjpeg
+	int jpeg_cmpts;
+	int is_grayscale;
+	int j;
+	struct iw_image img;
+	int jpeg_quality;
+	size_t target_size;
+	int samp_factor_h, samp_factor_v;
+	int disable_subsampling = 0;
+	const char *optv;
+	int ret;
+
+	iw_get_output_image(ctx,&img);
+	jw->img = &img;
+
+	if(IW_IMGTYPE_HAS_ALPHA(img.imgtype)) {
+		iw_set_error(ctx,"Internal: Transparency not supported with JPEG output");
+		goto done;
+	}
+
+	if(img.bit_depth!=8) {
+		iw_set_errorf(ctx,"Internal: Precision %d not supported with JPEG output",img.bit_depth);
+		goto done;
+	}
+
+	is_grayscale = IW_IMGTYPE_IS_GRAY(img.imgtype);
+
+	if(is_grayscale) {
+		in_colortype=JCS_GRAYSCALE;
+		jpeg_cmpts=1;
+	}
+	else {
+		in_colortype=JCS_RGB;
+		jpeg_cmpts=3;
+	}
+
+	jpeg_create_compress(&jw->cinfo);
+	jw->compress_created=1;
+
+	// Set up our custom destination manager.
+	jw->wctx.pub.init_destination = my_init_destination_fn;
+	jw->wctx.pub.empty_output_buffer = my_empty_output_buffer_fn;
+	jw->wctx.pub.term_destination = my_term_destination_fn;
+	jw->wctx.ctx = ctx;
+	jw->wctx.iodescr = iodescr;
+	jw->wctx.buffer_len = 32768;
+	jw->wctx.buffer = iw_malloc(ctx,jw->wctx.buffer_len);
+	if(!jw->wctx.buffer) goto done;
+	// Our wctx is organized so it can double as a
+	// 'struct jpeg_destination_mgr'.
+	jw->cinfo.dest = (struct jpeg_destination_mgr*)&jw->wctx;
+
+	jw->cinfo.image_width = img.width;
+	jw->cinfo.image_height = img.height;
+	jw->cinfo.input_components = jpeg_cmpts;
+	jw->cinfo.in_color_space = in_colortype;
+
+	jpeg_set_defaults(&jw->cinfo);
+
+	optv = iw_get_option(ctx, "jpeg:rstm");
+	if(optv) {
+		jw->cinfo.restart_interval = (unsigned int)iw_parse_int(optv);
+	}
+	optv = iw_get_option(ctx, "jpeg:rstr");
+	if(optv) {
+		jw->cinfo.restart_in_rows = (int)iw_parse_int(optv);
+	}
+
+	optv = iw_get_option(ctx, "jpeg:block");
+	if(optv) {
+#if (JPEG_LIB_VERSION_MAJOR>=9 || \
+	(JPEG_LIB_VERSION_MAJOR==8 && JPEG_LIB_VERSION_MINOR>=3))
+		// Note: This might not work if DCT_SCALING_SUPPORTED was not defined when
+		// libjpeg was compiled, but that symbol is not normally exposed to
+		// applications.
+		jw->cinfo.block_size = iw_parse_int(optv);
+#else
+		iw_warning(ctx, "Setting block size is not supported by this version of libjpeg");
+#endif
+	}
+
+	optv = iw_get_option(ctx, "jpeg:arith");
+	if(optv)
+		jw->cinfo.arith_code = iw_parse_int(optv) ? TRUE : FALSE;
+	else
+		jw->cinfo.arith_code = FALSE;
+
+	optv = iw_get_option(ctx, "jpeg:colortype");
+	if(optv) {
+		if(!strcmp(optv, "rgb")) {
+			if(in_colortype==JCS_RGB) {
+				jpeg_set_colorspace(&jw->cinfo,JCS_RGB);
+				disable_subsampling = 1;
+			}
+		}
+		else if(!strcmp(optv, "rgb1")) {
+			if(in_colortype==JCS_RGB) {
+#if JPEG_LIB_VERSION_MAJOR >= 9
+				jw->cinfo.color_transform = JCT_SUBTRACT_GREEN;
+#else
+				iw_warning(ctx, "Color type rgb1 is not supported by this version of libjpeg");
+#endif
+				jpeg_set_colorspace(&jw->cinfo,JCS_RGB);
+				disable_subsampling = 1;
+			}
+		}
+	}
+
+	optv = iw_get_option(ctx, "jpeg:optcoding");
+	if(optv && iw_parse_int(optv)) {
+		jw->cinfo.optimize_coding = TRUE;
+	}
+
+	optv = iw_get_option(ctx, "jpeg:bgycc");
+	if(optv && iw_parse_int(optv)) {
+#if (JPEG_LIB_VERSION_MAJOR>9 || \
+	(JPEG_LIB_VERSION_MAJOR==9 && JPEG_LIB_VERSION_MINOR>=1))
+		jpeg_set_colorspace(&jw->cinfo, JCS_BG_YCC);
+#else
+		iw_warning(ctx, "Big gamut YCC is not supported by this version of libjpeg");
+#endif
+	}
+
+	iwjpg_set_density(ctx,&jw->cinfo,&img);
+
+	optv = iw_get_option(ctx, "jpeg:quality");
+	if(optv)
+		jpeg_quality = iw_parse_int(optv);
+	else
+		jpeg_quality = 0;
+
+	if(jpeg_quality>0) {
+		jpeg_set_quality(&jw->cinfo,jpeg_quality,0);
+	}
+
+	if(jpeg_cmpts>1 && !disable_subsampling) {
+		samp_factor_h = 0;
+		samp_factor_v = 0;
 
 		// sampling-x and sampling-y are for backward compatibility, and should
 		// not be used.
@@ -826,98 +1965,949 @@ static int iw_write_jpeg_file3(struct jw_rsrc_struct *jw)
 		if(optv)
 			samp_factor_v = iw_parse_int(optv);
 
-		optv = iw_get_option(ctx, "jpeg:sampling");
-		if(optv) {
-			double tmpsamp[2];
-			tmpsamp[0] = 1.0;
-			tmpsamp[1] = 1.0;
-			ret = iw_parse_number_list(optv, 2, tmpsamp);
-			samp_factor_h = iw_round_to_int(tmpsamp[0]);
-			if(ret==1) {
-				// If only one value was given, use it for both factors.
-				samp_factor_v = samp_factor_h;
+		optv = iw_get_option(ctx, "jpeg:sampling");
+		if(optv) {
+			double tmpsamp[2];
+			tmpsamp[0] = 1.0;
+			tmpsamp[1] = 1.0;
+			ret = iw_parse_number_list(optv, 2, tmpsamp);
+			samp_factor_h = iw_round_to_int(tmpsamp[0]);
+			if(ret==1) {
+				// If only one value was given, use it for both factors.
+				samp_factor_v = samp_factor_h;
+			}
+			else {
+				samp_factor_v = iw_round_to_int(tmpsamp[1]);
+			}
+		}
+
+		if(samp_factor_h>0) {
+			if(samp_factor_h>4) samp_factor_h=4;
+			jw->cinfo.comp_info[0].h_samp_factor = samp_factor_h;
+		}
+		if(samp_factor_v>0) {
+			if(samp_factor_v>4) samp_factor_v=4;
+			jw->cinfo.comp_info[0].v_samp_factor = samp_factor_v;
+		}
+	}
+
+	if(iw_get_value(ctx,IW_VAL_OUTPUT_INTERLACED)) {
+		jpeg_simple_progression(&jw->cinfo);
+	}
+
+	jw->row_pointers = (JSAMPROW*)iw_malloc(ctx, img.height * sizeof(JSAMPROW));
+	if(!jw->row_pointers) goto done;
+
+	for(j=0;j<img.height;j++) {
+		jw->row_pointers[j] = &img.pixels[j*img.bpr];
+	}
+
+	target_size = iwjpeg_get_target_size(ctx);
+	if(target_size>0) {
+		jw->target.ctx = ctx;
+		jw->target.cinfo = &jw->cinfo;
+		jw->target.compress_fn = iwjpeg_compress_image;
+		jw->target.userdata = (void*)jw;
+		jw->target.target_size = target_size;
+		retval = iwjpeg_write_to_target_size(&jw->target, iodescr,
+			(jpeg_quality>0) ? jpeg_quality : 75);
+		goto done;
+	}
+
+	retval = iwjpeg_compress_image((void*)jw, iodescr);
+
+done:
+	// Don't free memory here; do it in iw_write_jpeg_file().
+	return retval;
+}
+
+// This function serves as a target for longjmp(). It shouldn't do much of
+// anything else.
+static int iw_write_jpeg_file2(struct jw_rsrc_struct *jw)
+{
+	if (setjmp(jw->jerr.setjmp_buffer)) {
+		return 0;
+	}
+
+	return iw_write_jpeg_file3(jw);
+}
+
+IW_IMPL(int) iw_write_jpeg_file(struct iw_context *ctx,  struct iw_iodescr *iodescr)
+{
+	struct jw_rsrc_struct *jw = NULL;
+	int retval = 0;
+
+	jw = iw_mallocz(ctx, sizeof(struct jw_rsrc_struct));
+	if(!jw) goto done;
+	jw->ctx = ctx;
+	jw->iodescr = iodescr;
+
+	jw->cinfo.err = jpeg_std_error(&jw->jerr.pub);
+	jw->jerr.pub.error_exit = my_error_exit;
+	jw->jerr.pub.output_message = my_output_message;
+
+	retval = iw_write_jpeg_file2(jw);
+
+done:
+	if(jw) {
+		if(jw->jerr.have_libjpeg_error) {
+			char buffer[JMSG_LENGTH_MAX];
+
+			(*jw->cinfo.err->format_message) ((j_common_ptr)&jw->cinfo, buffer);
+			iw_set_errorf(jw->ctx, "libjpeg reports write error: %s", buffer);
+		}
+
+		if(jw->compress_created) jpeg_destroy_compress(&jw->cinfo);
+		if(jw->row_pointers) iw_free(ctx, jw->row_pointers);
+		if(jw->wctx.buffer) iw_free(ctx, jw->wctx.buffer);
+		iwjpeg_target_free(ctx, &jw->target);
+		iw_free(ctx, jw);
+	}
+	return retval;
+}
+
+////////////////////////////////////
+
+struct jt_rsrc_struct {
+	struct iw_context *ctx;
+	struct iw_iodescr *readdescr;
+	struct iw_iodescr *writedescr;
+	unsigned int reorient;
+	int crop_x, crop_y, crop_w, crop_h;
+	unsigned int flags;
+
+	struct iwjpegrcontext rctx;
+	struct iwjpegwcontext wctx;
+	int dinfo_valid;
+	struct jpeg_decompress_struct dinfo;
+	int cinfo_valid;
+	struct jpeg_compress_struct cinfo;
+	struct my_error_mgr jerr; // Shared by dinfo and cinfo
+};
+
+// Helpers used by the functions that have to do something other than read or
+// write an ordinary RGB/grayscale image.
+
+static int iwjpeg_init_source(struct iw_context *ctx, struct iw_iodescr *iodescr,
+	struct iwjpegrcontext *rctx, struct jpeg_decompress_struct *dinfo)
+{
+	rctx->pub.init_source = my_init_source_fn;
+	rctx->pub.fill_input_buffer = my_fill_input_buffer_fn;
+	rctx->pub.skip_input_data = my_skip_input_data_fn;
+	rctx->pub.resync_to_restart = jpeg_resync_to_restart;
+	rctx->pub.term_source = my_term_source_fn;
+	rctx->ctx = ctx;
+	rctx->iodescr = iodescr;
+	rctx->buffer_len = 32768;
+	rctx->buffer = iw_malloc(ctx, rctx->buffer_len);
+	if(!rctx->buffer) return 0;
+	rctx->exif_density_x = -1.0;
+	rctx->exif_density_y = -1.0;
+	dinfo->src = (struct jpeg_source_mgr*)rctx;
+	return 1;
+}
+
+static int iwjpeg_init_destination(struct iw_context *ctx, struct iw_iodescr *iodescr,
+	struct iwjpegwcontext *wctx, struct jpeg_compress_struct *cinfo)
+{
+	wctx->pub.init_destination = my_init_destination_fn;
+	wctx->pub.empty_output_buffer = my_empty_output_buffer_fn;
+	wctx->pub.term_destination = my_term_destination_fn;
+	wctx->ctx = ctx;
+	wctx->iodescr = iodescr;
+	wctx->buffer_len = 32768;
+	wctx->buffer = iw_malloc(ctx,wctx->buffer_len);
+	if(!wctx->buffer) return 0;
+	cinfo->dest = (struct jpeg_destination_mgr*)wctx;
+	return 1;
+}
+
+// The options that can be used when we aren't in control of the compression
+// parameters.
+static void iwjpeg_set_coding_options(struct iw_context *ctx,
+	struct jpeg_compress_struct *cinfo)
+{
+	const char *optv;
+
+	optv = iw_get_option(ctx, "jpeg:rstm");
+	if(optv) {
+		cinfo->restart_interval = (unsigned int)iw_parse_int(optv);
+	}
+	optv = iw_get_option(ctx, "jpeg:rstr");
+	if(optv) {
+		cinfo->restart_in_rows = (int)iw_parse_int(optv);
+	}
+	optv = iw_get_option(ctx, "jpeg:arith");
+	if(optv)
+		cinfo->arith_code = iw_parse_int(optv) ? TRUE : FALSE;
+	else
+		cinfo->arith_code = FALSE;
+	optv = iw_get_option(ctx, "jpeg:optcoding");
+	if(optv && iw_parse_int(optv)) {
+		cinfo->optimize_coding = TRUE;
+	}
+	if(iw_get_value(ctx,IW_VAL_OUTPUT_INTERLACED)) {
+		jpeg_simple_progression(cinfo);
+	}
+}
+
+// Same as iw_reorient_image(), applied to an IW_REORIENT_* code.
+static unsigned int iwjpeg_combine_reorient(unsigned int t, unsigned int x)
+{
+	static const unsigned int transpose_tbl[8] = { 4,6,5,7,0,2,1,3 };
+	x = x & 0x07;
+	if(x&0x04) t = transpose_tbl[t];
+	return t ^ (x&0x03);
+}
+
+// Copy the DCT blocks of one component of the transformed image.
+// t is the IW_REORIENT_* code; (xoffs,yoffs) is the position, in blocks, of
+// the cropped region in the reoriented image.
+// dst_w and dst_h are the size of the destination array, in blocks.
+static void iwjpeg_transform_component(struct jt_rsrc_struct *jt, int ci,
+	jvirt_barray_ptr src_arr, jvirt_barray_ptr dst_arr, unsigned int t,
+	JDIMENSION xoffs, JDIMENSION yoffs, JDIMENSION dst_w, JDIMENSION dst_h)
+{
+	j_common_ptr dcom = (j_common_ptr)&jt->dinfo;
+	jpeg_component_info *scomp = &jt->dinfo.comp_info[ci];
+	JDIMENSION ow, oh; // Size of the reoriented component, in blocks
+	JDIMENSION bx, by; // Block position in the destination
+	JDIMENSION rx, ry; // Block position in the reoriented image
+	JDIMENSION sx, sy; // Block position in the source
+	int transpose = (t&0x04) ? 1 : 0;
+	int flip_sx, flip_sy; // Which source axes are reversed
+	JBLOCKARRAY dst_row;
+	JBLOCKARRAY src_row;
+	JCOEFPTR src, dst;
+	int u, v;
+
+	if(transpose) {
+		flip_sx = (t&0x02) ? 1 : 0;
+		flip_sy = (t&0x01) ? 1 : 0;
+		ow = scomp->height_in_blocks;
+		oh = scomp->width_in_blocks;
+	}
+	else {
+		flip_sx = (t&0x01) ? 1 : 0;
+		flip_sy = (t&0x02) ? 1 : 0;
+		ow = scomp->width_in_blocks;
+		oh = scomp->height_in_blocks;
+	}
+
+	for(by=0; by<dst_h; by++) {
+		dst_row = (*dcom->mem->access_virt_barray)(dcom, dst_arr, by, 1, TRUE);
+
+		for(bx=0; bx<dst_w; bx++) {
+			// Blocks past the edge of the image (padding) are copied from
+			// the nearest block in the image.
+			rx = xoffs+bx;
+			ry = yoffs+by;
+			if(rx>=ow) rx = ow-1;
+			if(ry>=oh) ry = oh-1;
+
+			if(transpose) {
+				sx = ry;
+				sy = rx;
 			}
 			else {
-				samp_factor_v = iw_round_to_int(tmpsamp[1]);
+				sx = rx;
+				sy = ry;
+			}
+			if(flip_sx) sx = scomp->width_in_blocks-1-sx;
+			if(flip_sy) sy = scomp->height_in_blocks-1-sy;
+
+			src_row = (*dcom->mem->access_virt_barray)(dcom, src_arr, sy, 1, FALSE);
+			src = src_row[0][sx];
+			dst = dst_row[0][bx];
+
+			// Coefficients are in natural order: dst[v*DCTSIZE+u] is
+			// vertical frequency v, horizontal frequency u.
+			// Reversing an axis negates the odd frequencies along it.
+			for(v=0; v<DCTSIZE; v++) {
+				for(u=0; u<DCTSIZE; u++) {
+					JCOEF c;
+					if(transpose) {
+						c = src[u*DCTSIZE+v];
+						if(flip_sx && (v&1)) c = -c;
+						if(flip_sy && (u&1)) c = -c;
+					}
+					else {
+						c = src[v*DCTSIZE+u];
+						if(flip_sx && (u&1)) c = -c;
+						if(flip_sy && (v&1)) c = -c;
+					}
+					dst[v*DCTSIZE+u] = c;
+				}
 			}
 		}
+	}
+}
 
-		if(samp_factor_h>0) {
-			if(samp_factor_h>4) samp_factor_h=4;
-			jw->cinfo.comp_info[0].h_samp_factor = samp_factor_h;
+static int iw_jpeg_transform3(struct jt_rsrc_struct *jt, int *ppossible)
+{
+	struct iw_context *ctx = jt->ctx;
+	struct iw_image img; // Only used for the density
+	jvirt_barray_ptr *src_coef_arrays;
+	jvirt_barray_ptr dst_coef_arrays[MAX_COMPONENTS];
+	j_common_ptr dcom = (j_common_ptr)&jt->dinfo;
+	jpeg_component_info *comp;
+	unsigned int t;
+	int transpose;
+	int flip_sx, flip_sy;
+	int src_w, src_h; // Dimensions of the source image
+	int w, h; // Dimensions of the reoriented image
+	int mcu_w, mcu_h; // MCU size of the reoriented image, in pixels
+	int max_h_samp, max_v_samp;
+	int h_samp[MAX_COMPONENTS], v_samp[MAX_COMPONENTS]; // For the output image
+	JDIMENSION dst_w[MAX_COMPONENTS], dst_h[MAX_COMPONENTS];
+	int ci;
+	int k;
+	double tmpd;
+	int ret;
+	int retval = 0;
+
+	*ppossible = 0;
+	iw_zeromem(&img,sizeof(struct iw_image));
+
+	jpeg_create_decompress(&jt->dinfo);
+	jt->dinfo_valid=1;
+
+	if(!iwjpeg_init_source(ctx,jt->readdescr,&jt->rctx,&jt->dinfo)) goto done;
+
+	jpeg_save_markers(&jt->dinfo, 0xe1, 65535);
+
+	ret = jpeg_read_header(&jt->dinfo, TRUE);
+	if(ret != JPEG_HEADER_OK) {
+		iw_set_error(ctx, "Unexpected libjpeg error");
+		goto done;
+	}
+
+	iwjpeg_read_density(ctx,&img,&jt->dinfo);
+	iwjpeg_read_saved_markers(&jt->rctx,&jt->dinfo);
+	handle_exif_density(&jt->rctx,&img);
+
+	// The orientation to use is the one from the Exif data (as used by
+	// iw_read_jpeg_file()), followed by the one requested by the caller.
+	t = iwjpeg_get_exif_transform(&jt->rctx);
+	t = iwjpeg_combine_reorient(t, jt->reorient);
+	transpose = (t&0x04) ? 1 : 0;
+
+	// Now decide whether the transform can be done exactly.
+
+	if(jt->dinfo.jpeg_color_space!=JCS_GRAYSCALE &&
+		jt->dinfo.jpeg_color_space!=JCS_YCbCr)
+	{
+		goto done;
+	}
+#if JPEG_LIB_VERSION >= 80
+	if(jt->dinfo.block_size!=DCTSIZE) goto done;
+#endif
+
+	if((jt->flags & IW_JPEGXFORM_SQUARE_PIXELS) &&
+		img.density_code!=IW_DENSITY_UNKNOWN &&
+		fabs(img.density_x-img.density_y)>=0.00001)
+	{
+		goto done;
+	}
+
+	max_h_samp = 1;
+	max_v_samp = 1;
+	for(ci=0; ci<jt->dinfo.num_components; ci++) {
+		comp = &jt->dinfo.comp_info[ci];
+		if(comp->h_samp_factor>max_h_samp) max_h_samp = comp->h_samp_factor;
+		if(comp->v_samp_factor>max_v_samp) max_v_samp = comp->v_samp_factor;
+	}
+
+	src_w = (int)jt->dinfo.image_width;
+	src_h = (int)jt->dinfo.image_height;
+	if(transpose) {
+		flip_sx = (t&0x02) ? 1 : 0;
+		flip_sy = (t&0x01) ? 1 : 0;
+		w = src_h;
+		h = src_w;
+		mcu_w = max_v_samp*DCTSIZE;
+		mcu_h = max_h_samp*DCTSIZE;
+	}
+	else {
+		flip_sx = (t&0x01) ? 1 : 0;
+		flip_sy = (t&0x02) ? 1 : 0;
+		w = src_w;
+		h = src_h;
+		mcu_w = max_h_samp*DCTSIZE;
+		mcu_h = max_v_samp*DCTSIZE;
+	}
+
+	// An edge of the source image that gets moved to the top or left must
+	// be on an MCU boundary.
+	if(flip_sx && (src_w % (max_h_samp*DCTSIZE))) goto done;
+	if(flip_sy && (src_h % (max_v_samp*DCTSIZE))) goto done;
+
+	// Clip the crop region to the image, the same way the command-line
+	// utility does before calling iw_set_input_crop().
+	if(jt->crop_x<0) jt->crop_x=0;
+	if(jt->crop_y<0) jt->crop_y=0;
+	if(jt->crop_x>w-1) jt->crop_x=w-1;
+	if(jt->crop_y>h-1) jt->crop_y=h-1;
+	if(jt->crop_w<0 || jt->crop_w>w-jt->crop_x) jt->crop_w=w-jt->crop_x;
+	if(jt->crop_h<0 || jt->crop_h>h-jt->crop_y) jt->crop_h=h-jt->crop_y;
+	if(jt->crop_w<1) jt->crop_w=1;
+	if(jt->crop_h<1) jt->crop_h=1;
+
+	// The upper-left corner of the crop region must be on an MCU boundary.
+	if(jt->crop_x % mcu_w) goto done;
+	if(jt->crop_y % mcu_h) goto done;
+
+	if((jt->flags & IW_JPEGXFORM_REQUIRE_CHANGE) && t==0 &&
+		jt->crop_w==w && jt->crop_h==h)
+	{
+		goto done;
+	}
+
+	*ppossible = 1;
+	if(!jt->writedescr) {
+		// The caller only wanted to know if it's possible.
+		retval = 1;
+		goto done;
+	}
+
+	// Request the destination coefficient arrays. This must be done before
+	// jpeg_read_coefficients() is called. Each array is padded to a whole
+	// number of MCUs.
+	for(ci=0; ci<jt->dinfo.num_components; ci++) {
+		comp = &jt->dinfo.comp_info[ci];
+		h_samp[ci] = transpose ? comp->v_samp_factor : comp->h_samp_factor;
+		v_samp[ci] = transpose ? comp->h_samp_factor : comp->v_samp_factor;
+		dst_w[ci] = (JDIMENSION)((jt->crop_w+mcu_w-1)/mcu_w * h_samp[ci]);
+		dst_h[ci] = (JDIMENSION)((jt->crop_h+mcu_h-1)/mcu_h * v_samp[ci]);
+		dst_coef_arrays[ci] = (*dcom->mem->request_virt_barray)(dcom, JPOOL_IMAGE, FALSE,
+			dst_w[ci], dst_h[ci], (JDIMENSION)v_samp[ci]);
+	}
+
+	src_coef_arrays = jpeg_read_coefficients(&jt->dinfo);
+
+	for(ci=0; ci<jt->dinfo.num_components; ci++) {
+		iwjpeg_transform_component(jt, ci, src_coef_arrays[ci], dst_coef_arrays[ci], t,
+			(JDIMENSION)(jt->crop_x/mcu_w*h_samp[ci]),
+			(JDIMENSION)(jt->crop_y/mcu_h*v_samp[ci]),
+			dst_w[ci], dst_h[ci]);
+	}
+
+	// Set up the output image.
+
+	jt->cinfo.err = &jt->jerr.pub;
+	jpeg_create_compress(&jt->cinfo);
+	jt->cinfo_valid=1;
+
+	if(!iwjpeg_init_destination(ctx,jt->writedescr,&jt->wctx,&jt->cinfo)) goto done;
+
+	jpeg_copy_critical_parameters(&jt->dinfo, &jt->cinfo);
+
+	jt->cinfo.image_width = (JDIMENSION)jt->crop_w;
+	jt->cinfo.image_height = (JDIMENSION)jt->crop_h;
+#if JPEG_LIB_VERSION >= 70
+	jt->cinfo.jpeg_width = (JDIMENSION)jt->crop_w;
+	jt->cinfo.jpeg_height = (JDIMENSION)jt->crop_h;
+#endif
+	for(ci=0; ci<jt->cinfo.num_components; ci++) {
+		jt->cinfo.comp_info[ci].h_samp_factor = h_samp[ci];
+		jt->cinfo.comp_info[ci].v_samp_factor = v_samp[ci];
+	}
+
+	if(transpose) {
+		// The quantization tables have to be transposed along with the
+		// coefficients.
+		for(k=0; k<NUM_QUANT_TBLS; k++) {
+			JQUANT_TBL *qtbl = jt->cinfo.quant_tbl_ptrs[k];
+			UINT16 qtemp;
+			int u, v;
+
+			if(!qtbl) continue;
+			for(v=0; v<DCTSIZE; v++) {
+				for(u=v+1; u<DCTSIZE; u++) {
+					qtemp = qtbl->quantval[v*DCTSIZE+u];
+					qtbl->quantval[v*DCTSIZE+u] = qtbl->quantval[u*DCTSIZE+v];
+					qtbl->quantval[u*DCTSIZE+v] = qtemp;
+				}
+			}
 		}
-		if(samp_factor_v>0) {
-			if(samp_factor_v>4) samp_factor_v=4;
-			jw->cinfo.comp_info[0].v_samp_factor = samp_factor_v;
+	}
+
+	// Write the density the same way iw_write_jpeg_file() would.
+	if(transpose) {
+		tmpd = img.density_x;
+		img.density_x = img.density_y;
+		img.density_y = tmpd;
+	}
+	jt->cinfo.density_unit = 0;
+	jt->cinfo.X_density = 1;
+	jt->cinfo.Y_density = 1;
+	iwjpg_set_density(ctx,&jt->cinfo,&img);
+
+	iwjpeg_set_coding_options(ctx,&jt->cinfo);
+
+	jpeg_write_coefficients(&jt->cinfo, dst_coef_arrays);
+	jpeg_finish_compress(&jt->cinfo);
+	jpeg_finish_decompress(&jt->dinfo);
+
+	retval = 1;
+
+done:
+	return retval;
+}
+
+static int iw_jpeg_transform2(struct jt_rsrc_struct *jt, int *ppossible)
+{
+	if (setjmp(jt->jerr.setjmp_buffer)) {
+		return 0;
+	}
+
+	return iw_jpeg_transform3(jt, ppossible);
+}
+
+IW_IMPL(int) iw_jpeg_lossless_transform(struct iw_context *ctx,
+	struct iw_iodescr *readdescr, struct iw_iodescr *writedescr,
+	unsigned int reorient, int crop_x, int crop_y, int crop_w, int crop_h,
+	unsigned int flags)
+{
+	struct jt_rsrc_struct *jt = NULL;
+	int retval = 0;
+	int possible = 0;
+
+	jt = iw_mallocz(ctx, sizeof(struct jt_rsrc_struct));
+	if(!jt) goto done;
+	jt->ctx = ctx;
+	jt->readdescr = readdescr;
+	jt->writedescr = writedescr;
+	jt->reorient = reorient;
+	jt->crop_x = crop_x;
+	jt->crop_y = crop_y;
+	jt->crop_w = crop_w;
+	jt->crop_h = crop_h;
+	jt->flags = flags;
+	jt->dinfo.err = jpeg_std_error(&jt->jerr.pub);
+	jt->jerr.pub.error_exit = my_error_exit;
+	jt->jerr.pub.output_message = my_output_message;
+
+	retval = iw_jpeg_transform2(jt, &possible);
+
+	if(!retval && !possible && writedescr && !jt->jerr.have_libjpeg_error &&
+		!iw_get_errorflag(ctx))
+	{
+		iw_set_error(ctx, "This JPEG image can\xe2\x80\x99t be transformed losslessly");
+	}
+
+done:
+	if(jt) {
+		if(jt->jerr.have_libjpeg_error) {
+			char buffer[JMSG_LENGTH_MAX];
+
+			(*jt->jerr.pub.format_message) ((j_common_ptr)&jt->dinfo, buffer);
+			iw_set_errorf(ctx, "libjpeg reports error: %s", buffer);
 		}
+
+		if(jt->cinfo_valid) jpeg_destroy_compress(&jt->cinfo);
+		if(jt->dinfo_valid) jpeg_destroy_decompress(&jt->dinfo);
+		if(jt->rctx.buffer) iw_free(ctx, jt->rctx.buffer);
+		if(jt->wctx.buffer) iw_free(ctx, jt->wctx.buffer);
+		iw_free(ctx, jt);
 	}
+	return retval;
+}
 
-	if(iw_get_value(ctx,IW_VAL_OUTPUT_INTERLACED)) {
-		jpeg_simple_progression(&jw->cinfo);
+////////////////////////////////////
+
+struct jp_rsrc_struct {
+	struct iw_context *ctx;
+	struct iw_iodescr *iodescr;
+	struct iw_context **plane_ctx;
+	struct iwjpegrcontext rctx;
+	struct iwjpegwcontext wctx;
+	iw_byte *pixels[3]; // Planes that have not yet been given to plane_ctx
+	iw_byte *rowbuf[3];
+	int dinfo_valid;
+	struct jpeg_decompress_struct dinfo;
+	int cinfo_valid;
+	struct jpeg_compress_struct cinfo;
+	struct my_error_mgr jerr;
+	struct iwjpeg_target_ctx target;
+	int num_planes;
+	struct iw_image plane_img[3];
+	size_t buf_w[3];
+};
+
+static int iw_read_jpeg_planes3(struct jp_rsrc_struct *jp, int *pnum_planes,
+	int *h_samp, int *v_samp)
+{
+	struct iw_context *ctx = jp->ctx;
+	struct iw_image img;
+	jpeg_component_info *comp;
+	JSAMPROW rowptrs[3][4*DCTSIZE];
+	JSAMPARRAY data[3];
+	size_t bpr[3];
+	JDIMENSION imcu_row;
+	int num_planes;
+	unsigned int t;
+	int tmpi;
+	int ci;
+	int j;
+	int ret;
+	int retval = 0;
+
+	*pnum_planes = 0;
+	iw_zeromem(&img,sizeof(struct iw_image));
+
+	jpeg_create_decompress(&jp->dinfo);
+	jp->dinfo_valid=1;
+
+	if(!iwjpeg_init_source(ctx,jp->iodescr,&jp->rctx,&jp->dinfo)) goto done;
+
+	jpeg_save_markers(&jp->dinfo, 0xe1, 65535);
+
+	ret = jpeg_read_header(&jp->dinfo, TRUE);
+	if(ret != JPEG_HEADER_OK) {
+		iw_set_error(ctx, "Unexpected libjpeg error");
+		goto done;
 	}
 
-	jw->row_pointers = (JSAMPROW*)iw_malloc(ctx, img.height * sizeof(JSAMPROW));
-	if(!jw->row_pointers) goto done;
+	jp->rctx.is_jfif = jp->dinfo.saw_JFIF_marker;
+	iwjpeg_read_density(ctx,&img,&jp->dinfo);
+	iwjpeg_read_saved_markers(&jp->rctx,&jp->dinfo);
 
-	for(j=0;j<img.height;j++) {
-		jw->row_pointers[j] = &img.pixels[j*img.bpr];
+	num_planes = jp->dinfo.num_components;
+	if(jp->dinfo.jpeg_color_space==JCS_GRAYSCALE && num_planes==1) {
+		;
+	}
+	else if(jp->dinfo.jpeg_color_space==JCS_YCbCr && num_planes==3) {
+		;
+	}
+	else {
+		// Not supported; the caller will have to read the image normally.
+		retval = 1;
+		goto done;
 	}
+#if JPEG_LIB_VERSION >= 80
+	if(jp->dinfo.block_size!=DCTSIZE) {
+		retval = 1;
+		goto done;
+	}
+#endif
 
-	jpeg_start_compress(&jw->cinfo, TRUE);
-	compress_started=1;
+	jp->dinfo.raw_data_out = TRUE;
+	jp->dinfo.out_color_space = jp->dinfo.jpeg_color_space;
+	iwjpeg_set_decode_options(jp->ctx,&jp->rctx,&jp->dinfo);
+	jpeg_start_decompress(&jp->dinfo);
 
-	jpeg_write_scanlines(&jw->cinfo, jw->row_pointers, img.height);
+	for(ci=0; ci<num_planes; ci++) {
+		comp = &jp->dinfo.comp_info[ci];
+		if(!iw_check_image_dimensions(ctx,(int)comp->downsampled_width,
+			(int)comp->downsampled_height))
+		{
+			goto done;
+		}
 
-	retval=1;
+		// libjpeg always returns whole blocks, so the rows we allocate are
+		// padded to a multiple of 8 pixels, and there are enough of them for
+		// every iMCU row.
+		bpr[ci] = (size_t)comp->width_in_blocks * DCTSIZE;
+		jp->pixels[ci] = (iw_byte*)iw_malloc_input_pixels(jp->plane_ctx[ci], bpr[ci],
+			(size_t)jp->dinfo.total_iMCU_rows * comp->v_samp_factor * DCTSIZE);
+		if(!jp->pixels[ci]) goto done;
+		data[ci] = rowptrs[ci];
+	}
 
-done:
-	if(compress_started)
-		jpeg_finish_compress(&jw->cinfo);
+	for(imcu_row=0; imcu_row<jp->dinfo.total_iMCU_rows; imcu_row++) {
+		for(ci=0; ci<num_planes; ci++) {
+			comp = &jp->dinfo.comp_info[ci];
+			for(j=0; j<comp->v_samp_factor*DCTSIZE; j++) {
+				rowptrs[ci][j] = &jp->pixels[ci][bpr[ci] *
+					((size_t)imcu_row*comp->v_samp_factor*DCTSIZE + j)];
+			}
+		}
+		ret = (int)jpeg_read_raw_data(&jp->dinfo, data,
+			(JDIMENSION)(jp->dinfo.max_v_samp_factor*DCTSIZE));
+		if(ret<1) {
+			iw_set_error(ctx,"Error reading JPEG file");
+			goto done;
+		}
+	}
 
-	// Don't free memory here; do it in iw_write_jpeg_file().
+	handle_exif_density(&jp->rctx, &img);
+	t = iwjpeg_get_exif_transform(&jp->rctx);
+
+	for(ci=0; ci<num_planes; ci++) {
+		comp = &jp->dinfo.comp_info[ci];
+
+		img.imgtype = IW_IMGTYPE_GRAY;
+		img.native_grayscale = (num_planes==1);
+		img.bit_depth = 8;
+		img.width = (int)comp->downsampled_width;
+		img.height = (int)comp->downsampled_height;
+		img.bpr = bpr[ci];
+		img.pixels = jp->pixels[ci];
+		if(ci>0) {
+			// Only the Y plane's density means anything.
+			img.density_code = IW_DENSITY_UNKNOWN;
+		}
+
+		iw_set_input_image(jp->plane_ctx[ci], &img);
+		// The pixels now belong to the plane's context.
+		jp->pixels[ci] = NULL;
+
+		if(t) {
+			iw_reorient_image(jp->plane_ctx[ci], t);
+		}
+
+		h_samp[ci] = comp->h_samp_factor;
+		v_samp[ci] = comp->v_samp_factor;
+		if(t&0x04) {
+			tmpi = h_samp[ci];
+			h_samp[ci] = v_samp[ci];
+			v_samp[ci] = tmpi;
+		}
+	}
+
+	jpeg_finish_decompress(&jp->dinfo);
+
+	*pnum_planes = num_planes;
+	retval = 1;
+
+done:
 	return retval;
 }
 
-// This function serves as a target for longjmp(). It shouldn't do much of
-// anything else.
-static int iw_write_jpeg_file2(struct jw_rsrc_struct *jw)
+static int iw_read_jpeg_planes2(struct jp_rsrc_struct *jp, int *pnum_planes,
+	int *h_samp, int *v_samp)
 {
-	if (setjmp(jw->jerr.setjmp_buffer)) {
+	if (setjmp(jp->jerr.setjmp_buffer)) {
 		return 0;
 	}
 
-	return iw_write_jpeg_file3(jw);
+	return iw_read_jpeg_planes3(jp, pnum_planes, h_samp, v_samp);
 }
 
-IW_IMPL(int) iw_write_jpeg_file(struct iw_context *ctx,  struct iw_iodescr *iodescr)
+IW_IMPL(int) iw_read_jpeg_planes(struct iw_context *ctx, struct iw_iodescr *iodescr,
+	struct iw_context **plane_ctx, int *pnum_planes, int *h_samp, int *v_samp)
 {
-	struct jw_rsrc_struct *jw = NULL;
+	struct jp_rsrc_struct *jp = NULL;
 	int retval = 0;
+	int ci;
 
-	jw = iw_mallocz(ctx, sizeof(struct jw_rsrc_struct));
-	if(!jw) goto done;
-	jw->ctx = ctx;
-	jw->iodescr = iodescr;
+	*pnum_planes = 0;
 
-	jw->cinfo.err = jpeg_std_error(&jw->jerr.pub);
-	jw->jerr.pub.error_exit = my_error_exit;
-	jw->jerr.pub.output_message = my_output_message;
+	jp = iw_mallocz(ctx, sizeof(struct jp_rsrc_struct));
+	if(!jp) goto done;
+	jp->ctx = ctx;
+	jp->iodescr = iodescr;
+	jp->plane_ctx = plane_ctx;
+	jp->dinfo.err = jpeg_std_error(&jp->jerr.pub);
+	jp->jerr.pub.error_exit = my_error_exit;
+	jp->jerr.pub.output_message = my_output_message;
 
-	retval = iw_write_jpeg_file2(jw);
+	retval = iw_read_jpeg_planes2(jp, pnum_planes, h_samp, v_samp);
 
 done:
-	if(jw) {
-		if(jw->jerr.have_libjpeg_error) {
+	if(jp) {
+		if(jp->jerr.have_libjpeg_error) {
 			char buffer[JMSG_LENGTH_MAX];
 
-			(*jw->cinfo.err->format_message) ((j_common_ptr)&jw->cinfo, buffer);
-			iw_set_errorf(jw->ctx, "libjpeg reports write error: %s", buffer);
+			(*jp->dinfo.err->format_message) ((j_common_ptr)&jp->dinfo, buffer);
+			iw_set_errorf(ctx, "libjpeg reports read error: %s", buffer);
 		}
 
-		if(jw->compress_created) jpeg_destroy_compress(&jw->cinfo);
-		if(jw->row_pointers) iw_free(ctx, jw->row_pointers);
-		if(jw->wctx.buffer) iw_free(ctx, jw->wctx.buffer);
-		iw_free(ctx, jw);
+		if(jp->dinfo_valid) jpeg_destroy_decompress(&jp->dinfo);
+		if(jp->rctx.buffer) iw_free(ctx, jp->rctx.buffer);
+		for(ci=0; ci<3; ci++) {
+			if(jp->pixels[ci]) iw_free(plane_ctx[ci], jp->pixels[ci]);
+		}
+		iw_free(ctx, jp);
+	}
+	return retval;
+}
+
+// Compress the planes to iodescr, using the parameters in jp->cinfo.
+// This may be called more than once.
+// An iwjpeg_compress_fn.
+static int iwjpeg_compress_planes(void *userdata, struct iw_iodescr *iodescr)
+{
+	struct jp_rsrc_struct *jp = (struct jp_rsrc_struct*)userdata;
+	struct iw_context *ctx = jp->ctx;
+	struct iw_image *img = jp->plane_img;
+	jpeg_component_info *comp;
+	JSAMPROW rowptrs[3][4*DCTSIZE];
+	JSAMPARRAY data[3];
+	size_t *buf_w = jp->buf_w;
+	const iw_byte *srcrow;
+	JDIMENSION imcu_row;
+	int ci;
+	int i, j;
+	int y;
+	int w;
+
+	jp->wctx.iodescr = iodescr;
+	jpeg_start_compress(&jp->cinfo, TRUE);
+
+	for(ci=0; ci<jp->num_planes; ci++) {
+		comp = &jp->cinfo.comp_info[ci];
+		if(!jp->rowbuf[ci]) {
+			buf_w[ci] = (size_t)comp->width_in_blocks * DCTSIZE;
+			jp->rowbuf[ci] = iw_malloc(ctx, buf_w[ci]*comp->v_samp_factor*DCTSIZE);
+			if(!jp->rowbuf[ci]) {
+				jpeg_abort_compress(&jp->cinfo);
+				return 0;
+			}
+		}
+		for(j=0; j<comp->v_samp_factor*DCTSIZE; j++) {
+			rowptrs[ci][j] = &jp->rowbuf[ci][buf_w[ci]*j];
+		}
+		data[ci] = rowptrs[ci];
+	}
+
+	for(imcu_row=0; imcu_row<jp->cinfo.total_iMCU_rows; imcu_row++) {
+		// libjpeg wants whole blocks, so pad each plane by repeating its
+		// last row and column.
+		for(ci=0; ci<jp->num_planes; ci++) {
+			comp = &jp->cinfo.comp_info[ci];
+			w = img[ci].width;
+			if((size_t)w>buf_w[ci]) w = (int)buf_w[ci];
+			for(j=0; j<comp->v_samp_factor*DCTSIZE; j++) {
+				y = (int)imcu_row*comp->v_samp_factor*DCTSIZE + j;
+				if(y>img[ci].height-1) y = img[ci].height-1;
+				srcrow = &img[ci].pixels[img[ci].bpr*y];
+				memcpy(rowptrs[ci][j], srcrow, w);
+				for(i=w; i<(int)buf_w[ci]; i++) {
+					rowptrs[ci][j][i] = srcrow[w-1];
+				}
+			}
+		}
+		jpeg_write_raw_data(&jp->cinfo, data,
+			(JDIMENSION)(jp->cinfo.max_v_samp_factor*DCTSIZE));
+	}
+
+	jpeg_finish_compress(&jp->cinfo);
+	return 1;
+}
+
+static int iw_write_jpeg_planes3(struct jp_rsrc_struct *jp, int num_planes,
+	const int *h_samp, const int *v_samp)
+{
+	struct iw_context *ctx = jp->ctx;
+	struct iw_image *img = jp->plane_img;
+	int jpeg_quality;
+	size_t target_size;
+	int ci;
+	const char *optv;
+	int retval = 0;
+
+	if(num_planes!=1 && num_planes!=3) {
+		iw_set_error(ctx,"Internal: Bad number of JPEG planes");
+		goto done;
+	}
+	jp->num_planes = num_planes;
+
+	for(ci=0; ci<num_planes; ci++) {
+		iw_get_output_image(jp->plane_ctx[ci], &img[ci]);
+		if(img[ci].imgtype!=IW_IMGTYPE_GRAY || img[ci].bit_depth!=8 ||
+			h_samp[ci]<1 || h_samp[ci]>4 || v_samp[ci]<1 || v_samp[ci]>4)
+		{
+			iw_set_error(ctx,"Internal: Unsupported JPEG plane");
+			goto done;
+		}
+	}
+
+	jpeg_create_compress(&jp->cinfo);
+	jp->cinfo_valid=1;
+
+	if(!iwjpeg_init_destination(ctx,jp->iodescr,&jp->wctx,&jp->cinfo)) goto done;
+
+	jp->cinfo.image_width = img[0].width;
+	jp->cinfo.image_height = img[0].height;
+	jp->cinfo.input_components = num_planes;
+	jp->cinfo.in_color_space = (num_planes==1) ? JCS_GRAYSCALE : JCS_YCbCr;
+
+	jpeg_set_defaults(&jp->cinfo);
+	jpeg_set_colorspace(&jp->cinfo, jp->cinfo.in_color_space);
+	for(ci=0; ci<num_planes; ci++) {
+		jp->cinfo.comp_info[ci].h_samp_factor = h_samp[ci];
+		jp->cinfo.comp_info[ci].v_samp_factor = v_samp[ci];
+	}
+	jp->cinfo.raw_data_in = TRUE;
+
+	iwjpeg_set_coding_options(ctx,&jp->cinfo);
+
+	iwjpg_set_density(ctx,&jp->cinfo,&img[0]);
+
+	optv = iw_get_option(ctx, "jpeg:quality");
+	if(optv)
+		jpeg_quality = iw_parse_int(optv);
+	else
+		jpeg_quality = 0;
+
+	if(jpeg_quality>0) {
+		jpeg_set_quality(&jp->cinfo,jpeg_quality,0);
+	}
+
+	target_size = iwjpeg_get_target_size(ctx);
+	if(target_size>0) {
+		jp->target.ctx = ctx;
+		jp->target.cinfo = &jp->cinfo;
+		jp->target.compress_fn = iwjpeg_compress_planes;
+		jp->target.userdata = (void*)jp;
+		jp->target.target_size = target_size;
+		retval = iwjpeg_write_to_target_size(&jp->target, jp->iodescr,
+			(jpeg_quality>0) ? jpeg_quality : 75);
+		goto done;
+	}
+
+	retval = iwjpeg_compress_planes((void*)jp, jp->iodescr);
+
+done:
+	return retval;
+}
+
+static int iw_write_jpeg_planes2(struct jp_rsrc_struct *jp, int num_planes,
+	const int *h_samp, const int *v_samp)
+{
+	if (setjmp(jp->jerr.setjmp_buffer)) {
+		return 0;
+	}
+
+	return iw_write_jpeg_planes3(jp, num_planes, h_samp, v_samp);
+}
+
+IW_IMPL(int) iw_write_jpeg_planes(struct iw_context *ctx, struct iw_iodescr *iodescr,
+	struct iw_context **plane_ctx, int num_planes, const int *h_samp, const int *v_samp)
+{
+	struct jp_rsrc_struct *jp = NULL;
+	int retval = 0;
+	int ci;
+
+	jp = iw_mallocz(ctx, sizeof(struct jp_rsrc_struct));
+	if(!jp) goto done;
+	jp->ctx = ctx;
+	jp->iodescr = iodescr;
+	jp->plane_ctx = plane_ctx;
+	jp->cinfo.err = jpeg_std_error(&jp->jerr.pub);
+	jp->jerr.pub.error_exit = my_error_exit;
+	jp->jerr.pub.output_message = my_output_message;
+
+	retval = iw_write_jpeg_planes2(jp, num_planes, h_samp, v_samp);
+
+done:
+	if(jp) {
+		if(jp->jerr.have_libjpeg_error) {
+			char buffer[JMSG_LENGTH_MAX];
+
+			(*jp->cinfo.err->format_message) ((j_common_ptr)&jp->cinfo, buffer);
+			iw_set_errorf(ctx, "libjpeg reports write error: %s", buffer);
+		}
+
+		if(jp->cinfo_valid) jpeg_destroy_compress(&jp->cinfo);
+		if(jp->wctx.buffer) iw_free(ctx, jp->wctx.buffer);
+		for(ci=0; ci<3; ci++) {
+			if(jp->rowbuf[ci]) iw_free(ctx, jp->rowbuf[ci]);
+		}
+		iwjpeg_target_free(ctx, &jp->target);
+		iw_free(ctx, jp);
 	}
 	return retval;
 }
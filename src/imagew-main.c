@@ -7,10 +7,110 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#if defined(__F16C__)
+#include <immintrin.h>
+#endif
 
 #include "imagew-internals.h"
 
 
+// Conversions for IW_PRECISION_FLOAT16 and IW_PRECISION_BFLOAT16.
+// All of them round to the nearest value, with ties going to even.
+// The samples are finite, and usually in the range 0 to 1.
+
+union iw_float32_bits {
+	iw_float32 f;
+	iw_uint32 u;
+};
+
+static IW_INLINE iw_uint16 float32_to_float16(iw_float32 f)
+{
+#if defined(__F16C__)
+	return (iw_uint16)_cvtss_sh(f,0);
+#else
+	union iw_float32_bits b;
+	iw_uint32 x, m, sign, h, rem, half;
+	int shift;
+
+	b.f = f;
+	sign = (b.u>>16)&0x8000;
+	x = b.u&0x7fffffff;
+
+	if(x>=0x47800000) { // Too large: infinity or NaN
+		return (iw_uint16)(sign | ((x>0x7f800000) ? 0x7e00 : 0x7c00));
+	}
+	if(x<0x38800000) { // Subnormal
+		if(x<0x33000000) return (iw_uint16)sign;
+		m = (x&0x7fffff)|0x800000;
+		shift = 126 - (int)(x>>23);
+		h = m>>shift;
+		rem = m&((1U<<shift)-1);
+		half = 1U<<(shift-1);
+		if(rem>half || (rem==half && (h&1))) h++;
+		return (iw_uint16)(sign|h);
+	}
+
+	h = (x-0x38000000)>>13;
+	rem = x&0x1fff;
+	if(rem>0x1000 || (rem==0x1000 && (h&1))) h++; // May round up to infinity
+	return (iw_uint16)(sign|h);
+#endif
+}
+
+static IW_INLINE iw_float32 float16_to_float32(iw_uint16 h)
+{
+#if defined(__F16C__)
+	return _cvtsh_ss(h);
+#else
+	union iw_float32_bits b;
+	iw_uint32 e, m;
+
+	e = (h>>10)&0x1f;
+	m = h&0x3ff;
+	if(e==0) { // Zero or subnormal
+		b.f = (iw_float32)m * (1.0f/16777216.0f);
+		b.u |= ((iw_uint32)(h&0x8000))<<16;
+		return b.f;
+	}
+	if(e==31) {
+		b.u = 0x7f800000 | (m<<13);
+	}
+	else {
+		b.u = ((e+112)<<23) | (m<<13);
+	}
+	b.u |= ((iw_uint32)(h&0x8000))<<16;
+	return b.f;
+#endif
+}
+
+static IW_INLINE iw_uint16 float32_to_bfloat16(iw_float32 f)
+{
+	union iw_float32_bits b;
+	b.f = f;
+	return (iw_uint16)((b.u + 0x7fff + ((b.u>>16)&1))>>16);
+}
+
+static IW_INLINE iw_float32 bfloat16_to_float32(iw_uint16 h)
+{
+	union iw_float32_bits b;
+	b.u = ((iw_uint32)h)<<16;
+	return b.f;
+}
+
+static IW_INLINE iw_uint16 tmpsample_to_16(struct iw_context *ctx, iw_tmpsample v)
+{
+	if(ctx->intermed_precision==IW_PRECISION_BFLOAT16)
+		return float32_to_bfloat16((iw_float32)v);
+	return float32_to_float16((iw_float32)v);
+}
+
+static IW_INLINE iw_tmpsample tmpsample_from_16(struct iw_context *ctx, iw_uint16 v)
+{
+	if(ctx->intermed_precision==IW_PRECISION_BFLOAT16)
+		return (iw_tmpsample)bfloat16_to_float32(v);
+	return (iw_tmpsample)float16_to_float32(v);
+}
+
 // Given a color type having an alpha channel, returns the index of the
 // alpha channel.
 // Return value is not meaningful if type does not have an alpha channel.
@@ -451,35 +551,36 @@ IW_IMPL(double) iw_convert_sample_from_linear(double v, const struct iw_csdescr
 	return (double)linear_to_x_sample(v,csdescr);
 }
 
+static const float iw_ordered_dither_pattern[2][64] = {
+ { // Dispersed ordered dither
+	 0.5/64,48.5/64,12.5/64,60.5/64, 3.5/64,51.5/64,15.5/64,63.5/64,
+	32.5/64,16.5/64,44.5/64,28.5/64,35.5/64,19.5/64,47.5/64,31.5/64,
+	 8.5/64,56.5/64, 4.5/64,52.5/64,11.5/64,59.5/64, 7.5/64,55.5/64,
+	40.5/64,24.5/64,36.5/64,20.5/64,43.5/64,27.5/64,39.5/64,23.5/64,
+	 2.5/64,50.5/64,14.5/64,62.5/64, 1.5/64,49.5/64,13.5/64,61.5/64,
+	34.5/64,18.5/64,46.5/64,30.5/64,33.5/64,17.5/64,45.5/64,29.5/64,
+	10.5/64,58.5/64, 6.5/64,54.5/64, 9.5/64,57.5/64, 5.5/64,53.5/64,
+	42.5/64,26.5/64,38.5/64,22.5/64,41.5/64,25.5/64,37.5/64,21.5/64
+ },
+ { // Halftone ordered dither
+	 3.5/64, 9.5/64,17.5/64,27.5/64,25.5/64,15.5/64, 7.5/64, 1.5/64,
+	11.5/64,29.5/64,37.5/64,45.5/64,43.5/64,35.5/64,23.5/64, 5.5/64,
+	19.5/64,39.5/64,51.5/64,57.5/64,55.5/64,49.5/64,33.5/64,13.5/64,
+	31.5/64,47.5/64,59.5/64,63.5/64,61.5/64,53.5/64,41.5/64,21.5/64,
+	30.5/64,46.5/64,58.5/64,62.5/64,60.5/64,52.5/64,40.5/64,20.5/64,
+	18.5/64,38.5/64,50.5/64,56.5/64,54.5/64,48.5/64,32.5/64,12.5/64,
+	10.5/64,28.5/64,36.5/64,44.5/64,42.5/64,34.5/64,22.5/64, 4.5/64,
+	 2.5/64, 8.5/64,16.5/64,26.5/64,24.5/64,14.5/64, 6.5/64, 0.5/64
+ }};
+
 // Returns 0 if we should round down, 1 if we should round up.
 // TODO: It might be good to use a different-sized matrix for alpha channels
 // (e.g. 9x7), but I don't know how to make a good one.
 static int iw_ordered_dither(int dithersubtype, double fraction, int x, int y)
 {
 	double threshold;
-	static const float pattern[2][64] = {
-	 { // Dispersed ordered dither
-		 0.5/64,48.5/64,12.5/64,60.5/64, 3.5/64,51.5/64,15.5/64,63.5/64,
-		32.5/64,16.5/64,44.5/64,28.5/64,35.5/64,19.5/64,47.5/64,31.5/64,
-		 8.5/64,56.5/64, 4.5/64,52.5/64,11.5/64,59.5/64, 7.5/64,55.5/64,
-		40.5/64,24.5/64,36.5/64,20.5/64,43.5/64,27.5/64,39.5/64,23.5/64,
-		 2.5/64,50.5/64,14.5/64,62.5/64, 1.5/64,49.5/64,13.5/64,61.5/64,
-		34.5/64,18.5/64,46.5/64,30.5/64,33.5/64,17.5/64,45.5/64,29.5/64,
-		10.5/64,58.5/64, 6.5/64,54.5/64, 9.5/64,57.5/64, 5.5/64,53.5/64,
-		42.5/64,26.5/64,38.5/64,22.5/64,41.5/64,25.5/64,37.5/64,21.5/64
-	 },
-	 { // Halftone ordered dither
-		 3.5/64, 9.5/64,17.5/64,27.5/64,25.5/64,15.5/64, 7.5/64, 1.5/64,
-		11.5/64,29.5/64,37.5/64,45.5/64,43.5/64,35.5/64,23.5/64, 5.5/64,
-		19.5/64,39.5/64,51.5/64,57.5/64,55.5/64,49.5/64,33.5/64,13.5/64,
-		31.5/64,47.5/64,59.5/64,63.5/64,61.5/64,53.5/64,41.5/64,21.5/64,
-		30.5/64,46.5/64,58.5/64,62.5/64,60.5/64,52.5/64,40.5/64,20.5/64,
-		18.5/64,38.5/64,50.5/64,56.5/64,54.5/64,48.5/64,32.5/64,12.5/64,
-		10.5/64,28.5/64,36.5/64,44.5/64,42.5/64,34.5/64,22.5/64, 4.5/64,
-		 2.5/64, 8.5/64,16.5/64,26.5/64,24.5/64,14.5/64, 6.5/64, 0.5/64
-	 }};
-
-	threshold = pattern[dithersubtype][(x%8) + 8*(y%8)];
+
+	threshold = iw_ordered_dither_pattern[dithersubtype][(x%8) + 8*(y%8)];
 	return (fraction >= threshold);
 }
 
@@ -488,81 +589,87 @@ static int iw_random_dither(struct iw_context *ctx, double fraction, int x, int
 	int dithersubtype, int channel)
 {
 	double threshold;
+	iw_uint32 r;
 
-	threshold = ((double)iwpvt_prng_rand(ctx->prng)) / (double)0xffffffff;
+	if(dithersubtype==IW_DITHERSUBTYPE_HASH || dithersubtype==IW_DITHERSUBTYPE_HASH_SAMEPATTERN)
+		r = iwpvt_prng_hash(ctx->img2_ci[channel].random_seed,x,y);
+	else
+		r = iwpvt_prng_rand(ctx->prng);
+
+	threshold = ((double)r) / (double)0xffffffff;
 	if(fraction>=threshold) return 1;
 	return 0;
 }
 
+// Distribute the error from the sample at (x,y) to nearby samples that haven't
+// been processed yet.
+// Error rows are padded, so samples that would be off the edge of the image
+// are written to the padding, and later discarded.
 static void iw_errdiff_dither(struct iw_context *ctx,int dithersubtype,
 	double err,int x,int y)
 {
-	int fwd;
-
-	struct dmatrix_struct {
-		double x[12];
-	};
+	int f1, f2;
+	double *e0, *e1, *e2;
 
 	//        x  0  1
 	//  2  3  4  5  6
 	//  7  8  9 10 11
 
-	static const struct dmatrix_struct matrix_list[12] = {
-		{{                          7.0/16, 0.0,     // 0 = Floyd-Steinberg
-		    0.0   , 3.0/16, 5.0/16, 1.0/16, 0.0,
-	        0.0   ,    0.0,    0.0, 0.0   , 0.0    }},
-		{{                          7.0/48, 5.0/48,  // 1 = JJN
-		    3.0/48, 5.0/48, 7.0/48, 5.0/48, 3.0/48,
-		    1.0/48, 3.0/48, 5.0/48, 3.0/48, 1.0/48 }},
-		{{                          8.0/42, 4.0/42,  // 2 = Stucki
-		    2.0/42, 4.0/42, 8.0/42, 4.0/42, 2.0/42,
-		    1.0/42, 2.0/42, 4.0/42, 2.0/42, 1.0/42 }},
-		{{                          8.0/32, 4.0/32,  // 3 = Burkes
-		    2.0/32, 4.0/32, 8.0/32, 4.0/32, 2.0/32,
-		    0.0   , 0.0   , 0.0   , 0.0   , 0.0    }},
-		{{                          5.0/32, 3.0/32,  // 4 = Sierra3
-		    2.0/32, 4.0/32, 5.0/32, 4.0/32, 2.0/32,
-		    0.0   , 2.0/32, 3.0/32, 2.0/32, 0.0    }},
-		{{                          4.0/16, 3.0/16,  // 5 = Sierra2
-		    1.0/16, 2.0/16, 3.0/16, 2.0/16, 1.0/16,
-		    0.0   , 0.0   , 0.0   , 0.0   , 0.0    }},
-		{{                          2.0/4 , 0.0,     // 6 = Sierra42a
-		    0.0   , 1.0/4 , 1.0/4 , 0.0   , 0.0,
-		    0.0   , 0.0   , 0.0   , 0.0   , 0.0    }},
-		{{                          1.0/8 , 1.0/8,   // 7 = Atkinson
-		    0.0   , 1.0/8 , 1.0/8 , 1.0/8 , 0.0,
-		    0.0   , 0.0   , 1.0/8 , 0.0   , 0.0    }}
-	};
-	const struct dmatrix_struct *m;
-
-	if(dithersubtype<=7)
-		m = &matrix_list[dithersubtype];
-	else
-		m = &matrix_list[0];
-
-	fwd = (y%2)?(-1):1;
-
-	if((x-fwd)>=0 && (x-fwd)<ctx->img2.width) {
-		if((x-2*fwd)>=0 && (x-2*fwd)<ctx->img2.width) {
-			ctx->dither_errors[1][x-2*fwd] += err*(m->x[2]);
-			ctx->dither_errors[2][x-2*fwd] += err*(m->x[7]);
-		}
-		ctx->dither_errors[1][x-fwd] += err*(m->x[3]);
-		ctx->dither_errors[2][x-fwd] += err*(m->x[8]);
-	}
-
-	ctx->dither_errors[1][x] += err*(m->x[4]);
-	ctx->dither_errors[2][x] += err*(m->x[9]);
-
-	if((x+fwd)>=0 && (x+fwd)<ctx->img2.width) {
-		ctx->dither_errors[0][x+fwd] += err*(m->x[0]);
-		ctx->dither_errors[1][x+fwd] += err*(m->x[5]);
-		ctx->dither_errors[2][x+fwd] += err*(m->x[10]);
-		if((x+2*fwd)>=0 && (x+2*fwd)<ctx->img2.width) {
-			ctx->dither_errors[0][x+2*fwd] += err*(m->x[1]);
-			ctx->dither_errors[1][x+2*fwd] += err*(m->x[6]);
-			ctx->dither_errors[2][x+2*fwd] += err*(m->x[11]);
-		}
+	// Alternate rows are processed in reverse order.
+	f1 = (y%2)?(-1):1;
+	f2 = 2*f1;
+
+	e0 = &ctx->dither_errors[0][x];
+	e1 = &ctx->dither_errors[1][x];
+	e2 = &ctx->dither_errors[2][x];
+
+	switch(dithersubtype) {
+	case IW_DITHERSUBTYPE_JJN:
+		e0[ f1] += err*(7.0/48); e0[ f2] += err*(5.0/48);
+		e1[-f2] += err*(3.0/48); e1[-f1] += err*(5.0/48); e1[0] += err*(7.0/48);
+		e1[ f1] += err*(5.0/48); e1[ f2] += err*(3.0/48);
+		e2[-f2] += err*(1.0/48); e2[-f1] += err*(3.0/48); e2[0] += err*(5.0/48);
+		e2[ f1] += err*(3.0/48); e2[ f2] += err*(1.0/48);
+		break;
+	case IW_DITHERSUBTYPE_STUCKI:
+		e0[ f1] += err*(8.0/42); e0[ f2] += err*(4.0/42);
+		e1[-f2] += err*(2.0/42); e1[-f1] += err*(4.0/42); e1[0] += err*(8.0/42);
+		e1[ f1] += err*(4.0/42); e1[ f2] += err*(2.0/42);
+		e2[-f2] += err*(1.0/42); e2[-f1] += err*(2.0/42); e2[0] += err*(4.0/42);
+		e2[ f1] += err*(2.0/42); e2[ f2] += err*(1.0/42);
+		break;
+	case IW_DITHERSUBTYPE_BURKES:
+		e0[ f1] += err*(8.0/32); e0[ f2] += err*(4.0/32);
+		e1[-f2] += err*(2.0/32); e1[-f1] += err*(4.0/32); e1[0] += err*(8.0/32);
+		e1[ f1] += err*(4.0/32); e1[ f2] += err*(2.0/32);
+		break;
+	case IW_DITHERSUBTYPE_SIERRA3:
+		e0[ f1] += err*(5.0/32); e0[ f2] += err*(3.0/32);
+		e1[-f2] += err*(2.0/32); e1[-f1] += err*(4.0/32); e1[0] += err*(5.0/32);
+		e1[ f1] += err*(4.0/32); e1[ f2] += err*(2.0/32);
+		e2[-f1] += err*(2.0/32); e2[0] += err*(3.0/32);
+		e2[ f1] += err*(2.0/32);
+		break;
+	case IW_DITHERSUBTYPE_SIERRA2:
+		e0[ f1] += err*(4.0/16); e0[ f2] += err*(3.0/16);
+		e1[-f2] += err*(1.0/16); e1[-f1] += err*(2.0/16); e1[0] += err*(3.0/16);
+		e1[ f1] += err*(2.0/16); e1[ f2] += err*(1.0/16);
+		break;
+	case IW_DITHERSUBTYPE_SIERRA42A:
+		e0[ f1] += err*(2.0/4);
+		e1[-f1] += err*(1.0/4);  e1[0] += err*(1.0/4);
+		break;
+	case IW_DITHERSUBTYPE_ATKINSON:
+		e0[ f1] += err*(1.0/8);  e0[ f2] += err*(1.0/8);
+		e1[-f1] += err*(1.0/8);  e1[0] += err*(1.0/8);
+		e1[ f1] += err*(1.0/8);
+		e2[0] += err*(1.0/8);
+		break;
+	default: // Floyd-Steinberg
+		e0[ f1] += err*(7.0/16);
+		e1[-f1] += err*(3.0/16); e1[0] += err*(5.0/16);
+		e1[ f1] += err*(1.0/16);
+		break;
 	}
 }
 
@@ -718,7 +825,11 @@ static void put_sample_convert_from_linear(struct iw_context *ctx, iw_tmpsample
 
 		// Hack to keep the PRNG in sync. We have to generate exactly one random
 		// number per sample, regardless of whether we use it.
-		if(ditherfamily==IW_DITHERFAMILY_RANDOM) {
+		// (Not needed for the "hash" subtypes, which have no sequential state.)
+		if(ditherfamily==IW_DITHERFAMILY_RANDOM &&
+			ctx->img2_ci[channel].dithersubtype!=IW_DITHERSUBTYPE_HASH &&
+			ctx->img2_ci[channel].dithersubtype!=IW_DITHERSUBTYPE_HASH_SAMEPATTERN)
+		{
 			(void)iwpvt_prng_rand(ctx->prng);
 		}
 		goto okay;
@@ -764,6 +875,104 @@ okay:
 	put_raw_sample(ctx,s_full,x,y,channel);
 }
 
+// Fast path for ordered dithering, used when the channel has a modest number
+// of available output levels. The linear-light value of every level is
+// computed in advance, so that a row can be quantized without converting
+// each sample to the target colorspace.
+#define IW_OD_MAXLEVELS 256
+struct iw_ordered_dither_tbl {
+	int num_levels;
+	double level_lin[IW_OD_MAXLEVELS];  // In increasing order
+	double level_code[IW_OD_MAXLEVELS]; // The sample value to write
+};
+
+// Returns NULL if the fast path can't be used for this channel.
+static struct iw_ordered_dither_tbl *iw_create_ordered_dither_tbl(struct iw_context *ctx,
+	const struct iw_channelinfo_out *out_ci, const struct iw_csdescr *csdescr)
+{
+	struct iw_ordered_dither_tbl *tbl;
+	int num_levels;
+	int m;
+	double code;
+
+	if(out_ci->color_count==0)
+		num_levels = out_ci->maxcolorcode_int+1;
+	else
+		num_levels = out_ci->color_count;
+
+	if(num_levels<2 || num_levels>IW_OD_MAXLEVELS) return NULL;
+
+	// If posterizing, the shades must land exactly on sample values, or the
+	// results could differ from the normal method.
+	if(out_ci->color_count!=0 &&
+		(out_ci->maxcolorcode_int % (num_levels-1))!=0)
+	{
+		return NULL;
+	}
+
+	tbl = (struct iw_ordered_dither_tbl*)iw_malloc(ctx,sizeof(struct iw_ordered_dither_tbl));
+	if(!tbl) return NULL;
+	tbl->num_levels = num_levels;
+
+	for(m=0;m<num_levels;m++) {
+		code = (double)(m*(out_ci->maxcolorcode_int/(num_levels-1)));
+		tbl->level_code[m] = code;
+		tbl->level_lin[m] = cvt_int_sample_to_linear_output(ctx,(unsigned int)code,
+			csdescr,out_ci->maxcolorcode_dbl);
+	}
+	return tbl;
+}
+
+// Quantize and store an entire row of linear samples, using ordered
+// dithering. Makes the same decisions as put_sample_convert_from_linear().
+static void put_row_ordered_dither(struct iw_context *ctx, const iw_tmpsample *samps,
+	int y, int channel, const struct iw_ordered_dither_tbl *tbl)
+{
+	double thresholds[8];
+	const float *pattern_row;
+	double samp_lin;
+	double d_floor, d_ceil;
+	int x;
+	int lo, hi, mid;
+	int top;
+
+	pattern_row = &iw_ordered_dither_pattern[ctx->img2_ci[channel].dithersubtype][8*(y%8)];
+	for(x=0;x<8;x++) {
+		thresholds[x] = (double)pattern_row[x];
+	}
+
+	top = tbl->num_levels-1;
+
+	for(x=0;x<ctx->img2.width;x++) {
+		samp_lin = samps[x];
+		if(samp_lin<0.0) samp_lin=0.0;
+		if(samp_lin>1.0) samp_lin=1.0;
+
+		if(samp_lin>=tbl->level_lin[top]) {
+			put_raw_sample(ctx,tbl->level_code[top],x,y,channel);
+			continue;
+		}
+
+		// Find the largest level that is not larger than samp_lin.
+		lo = 0;
+		hi = top;
+		while(hi-lo>1) {
+			mid = (lo+hi)/2;
+			if(tbl->level_lin[mid] > samp_lin)
+				hi = mid;
+			else
+				lo = mid;
+		}
+
+		d_floor = samp_lin-tbl->level_lin[lo];
+		d_ceil  = tbl->level_lin[lo+1]-samp_lin;
+		if(d_floor/(d_floor+d_ceil) >= thresholds[x%8])
+			put_raw_sample(ctx,tbl->level_code[lo+1],x,y,channel);
+		else
+			put_raw_sample(ctx,tbl->level_code[lo],x,y,channel);
+	}
+}
+
 // A stripped-down version of put_sample_convert_from_linear(),
 // intended for use with background colors.
 static unsigned int calc_sample_convert_from_linear(struct iw_context *ctx, iw_tmpsample samp_lin,
@@ -849,12 +1058,12 @@ static int iw_process_cols_to_intermediate(struct iw_context *ctx, int channel,
 	is_alpha_channel = (int_ci->channeltype==IW_CHANNELTYPE_ALPHA);
 
 	num_in_pix = ctx->input_h;
-	inpix_tofree = (iw_tmpsample*)iw_malloc(ctx, num_in_pix * sizeof(iw_tmpsample));
+	inpix_tofree = (iw_tmpsample*)iw_malloc_ex(ctx, IW_MALLOCFLAG_ALIGNED, num_in_pix * sizeof(iw_tmpsample));
 	if(!inpix_tofree) goto done;
 	in_pix = inpix_tofree;
 
 	num_out_pix = ctx->intermed_canvas_height;
-	outpix_tofree = (iw_tmpsample*)iw_malloc(ctx, num_out_pix * sizeof(iw_tmpsample));
+	outpix_tofree = (iw_tmpsample*)iw_malloc_ex(ctx, IW_MALLOCFLAG_ALIGNED, num_out_pix * sizeof(iw_tmpsample));
 	if(!outpix_tofree) goto done;
 	out_pix = outpix_tofree;
 
@@ -902,12 +1111,20 @@ static int iw_process_cols_to_intermediate(struct iw_context *ctx, int channel,
 			clamp_output_samples(ctx,out_pix,num_out_pix);
 
 		// The intermediate pixels are in ctx->out_pix. Copy them to the intermediate array.
+		if(ctx->intermed_precision!=IW_PRECISION_FLOAT32) {
+			iw_uint16 *plane16;
+			plane16 = is_alpha_channel ? ctx->intermediate_alpha16 : ctx->intermediate16;
+			for(j=0;j<ctx->intermed_canvas_height;j++) {
+				plane16[((size_t)j)*ctx->intermed_stride + i] = tmpsample_to_16(ctx,out_pix[j]);
+			}
+			continue;
+		}
 		for(j=0;j<ctx->intermed_canvas_height;j++) {
 			if(is_alpha_channel) {
-				ctx->intermediate_alpha32[((size_t)j)*ctx->intermed_canvas_width + i] = (iw_float32)out_pix[j];
+				ctx->intermediate_alpha32[((size_t)j)*ctx->intermed_stride + i] = (iw_float32)out_pix[j];
 			}
 			else {
-				ctx->intermediate32[((size_t)j)*ctx->intermed_canvas_width + i] = (iw_float32)out_pix[j];
+				ctx->intermediate32[((size_t)j)*ctx->intermed_stride + i] = (iw_float32)out_pix[j];
 			}
 		}
 	}
@@ -926,6 +1143,56 @@ done:
 	return retval;
 }
 
+// Copy row j of the intermediate image (or the intermediate alpha image) to
+// a row of iw_tmpsamples.
+static void load_intermed_row(struct iw_context *ctx, int is_alpha_channel, int j,
+	iw_tmpsample *dst)
+{
+	int i;
+	size_t pos = ((size_t)j)*ctx->intermed_stride;
+
+	if(ctx->intermed_precision!=IW_PRECISION_FLOAT32) {
+		const iw_uint16 *row16;
+		row16 = &(is_alpha_channel ? ctx->intermediate_alpha16 : ctx->intermediate16)[pos];
+		for(i=0;i<ctx->intermed_canvas_width;i++) {
+			dst[i] = tmpsample_from_16(ctx,row16[i]);
+		}
+	}
+	else {
+		const iw_float32 *row32;
+		row32 = &(is_alpha_channel ? ctx->intermediate_alpha32 : ctx->intermediate32)[pos];
+		for(i=0;i<ctx->intermed_canvas_width;i++) {
+			dst[i] = row32[i];
+		}
+	}
+}
+
+// Resize row j of the alpha channel to the final width, the same way it is
+// done when the alpha channel itself is processed.
+// The samples are rounded to the precision of the intermediate images, as
+// they would be if they had been stored.
+static void make_final_alpha_row(struct iw_context *ctx, struct iw_rr_ctx *alpha_rrctx,
+	int j, iw_tmpsample *tmprow, iw_tmpsample *alpha_row)
+{
+	int i;
+
+	load_intermed_row(ctx,1,j,tmprow);
+	iwpvt_resize_row_main(alpha_rrctx,tmprow,alpha_row);
+	if(ctx->intclamp)
+		clamp_output_samples(ctx,alpha_row,ctx->img2.width);
+
+	if(ctx->intermed_precision!=IW_PRECISION_FLOAT32) {
+		for(i=0;i<ctx->img2.width;i++) {
+			alpha_row[i] = tmpsample_from_16(ctx,tmpsample_to_16(ctx,alpha_row[i]));
+		}
+	}
+	else {
+		for(i=0;i<ctx->img2.width;i++) {
+			alpha_row[i] = (iw_float32)alpha_row[i];
+		}
+	}
+}
+
 static int iw_process_rows_intermediate_to_final(struct iw_context *ctx, int intermed_channel,
 	const struct iw_csdescr *out_csdescr)
 {
@@ -948,6 +1215,12 @@ static int iw_process_rows_intermediate_to_final(struct iw_context *ctx, int int
 	int ditherfamily, dithersubtype;
 	struct iw_channelinfo_intermed *int_ci;
 	struct iw_channelinfo_out *out_ci;
+	struct iw_ordered_dither_tbl *od_tbl = NULL;
+	// The resized alpha samples for the current row, if needed.
+	iw_tmpsample *alpha_row = NULL;
+	iw_tmpsample *alpha_tmprow = NULL;
+	struct iw_rr_ctx *alpha_rrctx = NULL;
+	struct iw_rr_ctx *alpha_rrctx_tofree = NULL;
 
 	iw_tmpsample *in_pix = NULL;
 	iw_tmpsample *out_pix = NULL;
@@ -977,11 +1250,11 @@ static int iw_process_rows_intermediate_to_final(struct iw_context *ctx, int int
 	is_alpha_channel = (int_ci->channeltype==IW_CHANNELTYPE_ALPHA);
 	bkgd_has_transparency = iw_bkgd_has_transparency(ctx);
 
-	inpix_tofree = (iw_tmpsample*)iw_malloc(ctx, num_in_pix * sizeof(iw_tmpsample));
+	inpix_tofree = (iw_tmpsample*)iw_malloc_ex(ctx, IW_MALLOCFLAG_ALIGNED, num_in_pix * sizeof(iw_tmpsample));
 	in_pix = inpix_tofree;
 
 	// We need an output buffer.
-	outpix_tofree = (iw_tmpsample*)iw_malloc(ctx, num_out_pix * sizeof(iw_tmpsample));
+	outpix_tofree = (iw_tmpsample*)iw_malloc_ex(ctx, IW_MALLOCFLAG_ALIGNED, num_out_pix * sizeof(iw_tmpsample));
 	if(!outpix_tofree) goto done;
 	out_pix = outpix_tofree;
 
@@ -1002,22 +1275,31 @@ static int iw_process_rows_intermediate_to_final(struct iw_context *ctx, int int
 	if(ditherfamily==IW_DITHERFAMILY_RANDOM) {
 		// Decide what random seed to use. The alpha channel always has its own
 		// seed. If using "r" (not "r2") dithering, every channel has its own seed.
-		if(dithersubtype==IW_DITHERSUBTYPE_SAMEPATTERN && out_ci->channeltype!=IW_CHANNELTYPE_ALPHA)
+		if((dithersubtype==IW_DITHERSUBTYPE_SAMEPATTERN ||
+			dithersubtype==IW_DITHERSUBTYPE_HASH_SAMEPATTERN) &&
+			out_ci->channeltype!=IW_CHANNELTYPE_ALPHA)
 		{
-			iwpvt_prng_set_random_seed(ctx->prng,ctx->random_seed);
+			out_ci->random_seed = (iw_uint32)ctx->random_seed;
 		}
 		else {
-			iwpvt_prng_set_random_seed(ctx->prng,ctx->random_seed+out_ci->channeltype);
+			out_ci->random_seed = (iw_uint32)(ctx->random_seed+out_ci->channeltype);
 		}
+		iwpvt_prng_set_random_seed(ctx->prng,(int)out_ci->random_seed);
+	}
+
+	// Decide if the ordered dithering fast path can be used.
+	if(output_channel>=0 && ditherfamily==IW_DITHERFAMILY_ORDERED &&
+		ctx->img2.sampletype!=IW_SAMPLETYPE_FLOATINGPOINT)
+	{
+		od_tbl = iw_create_ordered_dither_tbl(ctx,out_ci,out_csdescr);
 	}
 
 	// Initialize Floyd-Steinberg dithering.
 	if(output_channel>=0 && out_ci->ditherfamily==IW_DITHERFAMILY_ERRDIFF) {
 		using_errdiffdither = 1;
-		for(i=0;i<ctx->img2.width;i++) {
-			for(k=0;k<IW_DITHER_MAXROWS;k++) {
-				ctx->dither_errors[k][i] = 0.0;
-			}
+		for(k=0;k<IW_DITHER_MAXROWS;k++) {
+			iw_zeromem(ctx->dither_errors[k]-IW_DITHER_PAD,
+				(ctx->img2.width+2*IW_DITHER_PAD)*sizeof(double));
 		}
 	}
 
@@ -1031,21 +1313,29 @@ static int iw_process_rows_intermediate_to_final(struct iw_context *ctx, int int
 		if(!rs->rrctx) goto done;
 	}
 
-	for(j=0;j<ctx->intermed_canvas_height;j++) {
-
-		// As needed, either copy the input pixels to a temp buffer (inpix, which
-		// ctx->in_pix already points to), or point ctx->in_pix directly to the
-		// intermediate data.
-		if(is_alpha_channel) {
-			for(i=0;i<num_in_pix;i++) {
-				inpix_tofree[i] = ctx->intermediate_alpha32[((size_t)j)*ctx->intermed_canvas_width+i];
-			}
+	if(int_ci->need_unassoc_alpha_processing) {
+		// Rather than keeping the whole resized alpha channel, we resize each
+		// row of it again when it's needed.
+		alpha_row = (iw_tmpsample*)iw_malloc_ex(ctx, IW_MALLOCFLAG_ALIGNED, num_out_pix * sizeof(iw_tmpsample));
+		if(!alpha_row) goto done;
+		alpha_tmprow = (iw_tmpsample*)iw_malloc_ex(ctx, IW_MALLOCFLAG_ALIGNED, num_in_pix * sizeof(iw_tmpsample));
+		if(!alpha_tmprow) goto done;
+		if(rs->disable_rrctx_cache) {
+			alpha_rrctx_tofree = iwpvt_resize_rows_init(ctx,rs,
+				ctx->intermed_ci[ctx->intermed_alpha_channel_index].channeltype,
+				num_in_pix, num_out_pix);
+			if(!alpha_rrctx_tofree) goto done;
+			alpha_rrctx = alpha_rrctx_tofree;
 		}
 		else {
-			for(i=0;i<num_in_pix;i++) {
-				inpix_tofree[i] = ctx->intermediate32[((size_t)j)*ctx->intermed_canvas_width+i];
-			}
+			alpha_rrctx = rs->rrctx;
 		}
+	}
+
+	for(j=0;j<ctx->intermed_canvas_height;j++) {
+
+		// Copy the input pixels to a temp buffer.
+		load_intermed_row(ctx,is_alpha_channel,j,inpix_tofree);
 
 		// Resize ctx->in_pix to ctx->out_pix.
 		iwpvt_resize_row_main(rs->rrctx,in_pix,out_pix);
@@ -1053,13 +1343,6 @@ static int iw_process_rows_intermediate_to_final(struct iw_context *ctx, int int
 		if(ctx->intclamp)
 			clamp_output_samples(ctx,out_pix,num_out_pix);
 
-		// If necessary, copy the resized samples to the final_alpha image
-		if(is_alpha_channel && outpix_tofree && ctx->final_alpha32) {
-			for(i=0;i<num_out_pix;i++) {
-				ctx->final_alpha32[((size_t)j)*ctx->img2.width+i] = (iw_float32)outpix_tofree[i];
-			}
-		}
-
 		// Now convert the out_pix and put them in the final image.
 
 		if(output_channel == -1) {
@@ -1069,6 +1352,10 @@ static int iw_process_rows_intermediate_to_final(struct iw_context *ctx, int int
 			goto here;
 		}
 
+		if(alpha_row) {
+			make_final_alpha_row(ctx,alpha_rrctx,j,alpha_tmprow,alpha_row);
+		}
+
 		for(z=0;z<ctx->img2.width;z++) {
 			// For decent Floyd-Steinberg dithering, we need to process alternate
 			// rows in reverse order.
@@ -1090,7 +1377,7 @@ static int iw_process_rows_intermediate_to_final(struct iw_context *ctx, int int
 
 			if(int_ci->need_unassoc_alpha_processing) {
 				// Convert color samples back to unassociated alpha.
-				alphasamp = ctx->final_alpha32[((size_t)j)*ctx->img2.width + i];
+				alphasamp = alpha_row[i];
 
 				if(alphasamp!=0.0) {
 					tmpsamp /= alphasamp;
@@ -1114,25 +1401,34 @@ static int iw_process_rows_intermediate_to_final(struct iw_context *ctx, int int
 				tmpsamp = tmpsamp + tmpbkgdalpha*(1.0-tmpsamp);
 			}
 
-			if(ctx->img2.sampletype==IW_SAMPLETYPE_FLOATINGPOINT)
+			if(od_tbl)
+				out_pix[i] = tmpsamp; // Will be written below, a row at a time.
+			else if(ctx->img2.sampletype==IW_SAMPLETYPE_FLOATINGPOINT)
 				put_sample_convert_from_linear_flt(ctx,tmpsamp,i,j,output_channel,out_csdescr);
 			else
 				put_sample_convert_from_linear(ctx,tmpsamp,i,j,output_channel,out_csdescr);
 
 		}
 
+		if(od_tbl) {
+			put_row_ordered_dither(ctx,out_pix,j,output_channel,od_tbl);
+		}
+
 		if(using_errdiffdither) {
 			// Move "next row" error data to "this row", and clear the "next row".
-			// TODO: Obviously, it would be more efficient to just swap pointers
-			// to the rows.
-			for(i=0;i<ctx->img2.width;i++) {
-				// Move data in all rows but the first row up one row.
-				for(k=0;k<IW_DITHER_MAXROWS-1;k++) {
-					ctx->dither_errors[k][i] = ctx->dither_errors[k+1][i];
-				}
-				// Clear the last row.
-				ctx->dither_errors[IW_DITHER_MAXROWS-1][i] = 0.0;
+			// The row we just finished is recycled as the new last row.
+			double *tmprow;
+			tmprow = ctx->dither_errors[0];
+			for(k=0;k<IW_DITHER_MAXROWS-1;k++) {
+				ctx->dither_errors[k] = ctx->dither_errors[k+1];
 			}
+			ctx->dither_errors[IW_DITHER_MAXROWS-1] = tmprow;
+			iw_zeromem(tmprow-IW_DITHER_PAD,(ctx->img2.width+2*IW_DITHER_PAD)*sizeof(double));
+		}
+
+		if(intermed_channel==ctx->opt_scan_intermed_channel) {
+			// This row of the output image is now complete.
+			iwpvt_opt_scan_row(ctx,j);
 		}
 
 here:
@@ -1148,19 +1444,30 @@ done:
 		iwpvt_resize_rows_done(rs->rrctx);
 		rs->rrctx = NULL;
 	}
+	if(alpha_rrctx_tofree) iwpvt_resize_rows_done(alpha_rrctx_tofree);
+	if(alpha_tmprow) iw_free(ctx,alpha_tmprow);
+	if(alpha_row) iw_free(ctx,alpha_row);
 	if(inpix_tofree) iw_free(ctx,inpix_tofree);
 	if(outpix_tofree) iw_free(ctx,outpix_tofree);
+	if(od_tbl) iw_free(ctx,od_tbl);
 
 	return retval;
 }
 
+// If is_last_input_channel is set, the input image is released as soon as
+// it is no longer needed.
 static int iw_process_one_channel(struct iw_context *ctx, int intermed_channel,
-  const struct iw_csdescr *in_csdescr, const struct iw_csdescr *out_csdescr)
+  const struct iw_csdescr *in_csdescr, const struct iw_csdescr *out_csdescr,
+  int is_last_input_channel)
 {
 	if(!iw_process_cols_to_intermediate(ctx,intermed_channel,in_csdescr)) {
 		return 0;
 	}
 
+	if(is_last_input_channel) {
+		iwpvt_release_input_image(ctx,ctx->keep_buffers);
+	}
+
 	if(!iw_process_rows_intermediate_to_final(ctx,intermed_channel,out_csdescr)) {
 		return 0;
 	}
@@ -1365,39 +1672,78 @@ static void negate_target_image(struct iw_context *ctx)
 	}
 }
 
+static size_t float_sample_size(struct iw_context *ctx)
+{
+	if(ctx->intermed_precision!=IW_PRECISION_FLOAT32) return sizeof(iw_uint16);
+	return sizeof(iw_float32);
+}
+
+// Returns the number of samples to use for each row of a float image.
+static size_t calc_float_stride(struct iw_context *ctx, int width)
+{
+	size_t n = IW_MALLOC_ALIGNMENT/float_sample_size(ctx);
+
+	if(!ctx->padded_stride) return (size_t)width;
+	return (((size_t)width+n-1)/n)*n;
+}
+
+// Allocate one of the float images, in the format selected by
+// intermed_precision, and set either *p32 or *p16 to point to it.
+static int alloc_float_image(struct iw_context *ctx, struct iw_membuf *buf,
+	size_t stride, int height, iw_float32 **p32, iw_uint16 **p16)
+{
+	void *mem;
+
+	mem = iwpvt_membuf_get(ctx, buf, stride * height, float_sample_size(ctx));
+	if(!mem) return 0;
+	if(ctx->intermed_precision!=IW_PRECISION_FLOAT32)
+		*p16 = (iw_uint16*)mem;
+	else
+		*p32 = (iw_float32*)mem;
+	return 1;
+}
+
 static int iw_process_internal(struct iw_context *ctx)
 {
 	int channel;
 	int retval=0;
 	int i,k;
 	int ret;
+	int last_channel = -1;
 	// A linear color-correction descriptor to use with alpha channels.
 	struct iw_csdescr csdescr_linear;
 
 	ctx->intermediate32=NULL;
 	ctx->intermediate_alpha32=NULL;
-	ctx->final_alpha32=NULL;
+	ctx->intermediate16=NULL;
+	ctx->intermediate_alpha16=NULL;
 	ctx->intermed_canvas_width = ctx->input_w;
 	ctx->intermed_canvas_height = ctx->img2.height;
+	ctx->intermed_stride = calc_float_stride(ctx,ctx->intermed_canvas_width);
 
 	iw_make_linear_csdescr(&csdescr_linear);
 
 	ctx->img2.bpr = iw_calc_bytesperrow(ctx->img2.width,ctx->img2.bit_depth*ctx->img2_numchannels);
 
-	ctx->img2.pixels = iw_malloc_large(ctx, ctx->img2.bpr, ctx->img2.height);
+	// img2.pixels belongs to img2_pixels_buf.
+	ctx->img2.pixels = iwpvt_membuf_get(ctx, &ctx->img2_pixels_buf, ctx->img2.bpr, ctx->img2.height);
 	if(!ctx->img2.pixels) {
 		goto done;
 	}
 
-	ctx->intermediate32 = (iw_float32*)iw_malloc_large(ctx, ctx->intermed_canvas_width * ctx->intermed_canvas_height, sizeof(iw_float32));
-	if(!ctx->intermediate32) {
+	if(!alloc_float_image(ctx, &ctx->intermediate_buf, ctx->intermed_stride,
+		ctx->intermed_canvas_height, &ctx->intermediate32, &ctx->intermediate16))
+	{
 		goto done;
 	}
 
 	if(ctx->uses_errdiffdither) {
+		double *dither_rows;
+		dither_rows = (double*)iwpvt_membuf_get(ctx, &ctx->dither_errors_buf,
+			IW_DITHER_MAXROWS*(ctx->img2.width+2*IW_DITHER_PAD), sizeof(double));
+		if(!dither_rows) goto done;
 		for(k=0;k<IW_DITHER_MAXROWS;k++) {
-			ctx->dither_errors[k] = (double*)iw_malloc(ctx, ctx->img2.width * sizeof(double));
-			if(!ctx->dither_errors[k]) goto done;
+			ctx->dither_errors[k] = &dither_rows[k*(ctx->img2.width+2*IW_DITHER_PAD) + IW_DITHER_PAD];
 		}
 	}
 
@@ -1407,28 +1753,45 @@ static int iw_process_internal(struct iw_context *ctx)
 		iw_make_nearest_color_table(ctx,&ctx->nearest_color_table,&ctx->img2,&ctx->img2cs);
 	}
 
+	// The non-alpha channels are processed last, in order, so the output
+	// image is finished one row at a time during the last one.
+	// The negate feature modifies the image after that, so it can't be used
+	// with the incremental scan.
+	ctx->opt_scan_intermed_channel = -1;
+	if(ctx->opt_incremental_scan && !ctx->req.negate_target) {
+		for(channel=0;channel<ctx->intermed_numchannels;channel++) {
+			if(ctx->intermed_ci[channel].channeltype!=IW_CHANNELTYPE_ALPHA)
+				ctx->opt_scan_intermed_channel = channel;
+		}
+		iwpvt_opt_scan_begin(ctx);
+	}
+
 	// If an alpha channel is present, we have to process it first.
 	if(IW_IMGTYPE_HAS_ALPHA(ctx->intermed_imgtype)) {
-		ctx->intermediate_alpha32 = (iw_float32*)iw_malloc_large(ctx, ctx->intermed_canvas_width * ctx->intermed_canvas_height, sizeof(iw_float32));
-		if(!ctx->intermediate_alpha32) {
-			goto done;
-		}
-		ctx->final_alpha32 = (iw_float32*)iw_malloc_large(ctx, ctx->img2.width * ctx->img2.height, sizeof(iw_float32));
-		if(!ctx->final_alpha32) {
+		if(!alloc_float_image(ctx, &ctx->intermediate_alpha_buf, ctx->intermed_stride,
+			ctx->intermed_canvas_height, &ctx->intermediate_alpha32, &ctx->intermediate_alpha16))
+		{
 			goto done;
 		}
 
-		if(!iw_process_one_channel(ctx,ctx->intermed_alpha_channel_index,&csdescr_linear,&csdescr_linear)) goto done;
+		if(!iw_process_one_channel(ctx,ctx->intermed_alpha_channel_index,&csdescr_linear,&csdescr_linear,0)) goto done;
 	}
 
 	// Process the non-alpha channels.
+	// The input image is not needed after the last one has been read, which
+	// happens before its second (horizontal) pass.
+
+	for(channel=0;channel<ctx->intermed_numchannels;channel++) {
+		if(ctx->intermed_ci[channel].channeltype!=IW_CHANNELTYPE_ALPHA)
+			last_channel = channel;
+	}
 
 	for(channel=0;channel<ctx->intermed_numchannels;channel++) {
 		if(ctx->intermed_ci[channel].channeltype!=IW_CHANNELTYPE_ALPHA) {
 			if(ctx->no_gamma)
-				ret=iw_process_one_channel(ctx,channel,&csdescr_linear,&csdescr_linear);
+				ret=iw_process_one_channel(ctx,channel,&csdescr_linear,&csdescr_linear,channel==last_channel);
 			else
-				ret=iw_process_one_channel(ctx,channel,&ctx->img1cs,&ctx->img2cs);
+				ret=iw_process_one_channel(ctx,channel,&ctx->img1cs,&ctx->img2cs,channel==last_channel);
 
 			if(!ret) goto done;
 		}
@@ -1443,11 +1806,17 @@ static int iw_process_internal(struct iw_context *ctx)
 	retval=1;
 
 done:
-	if(ctx->intermediate32) { iw_free(ctx,ctx->intermediate32); ctx->intermediate32=NULL; }
-	if(ctx->intermediate_alpha32) { iw_free(ctx,ctx->intermediate_alpha32); ctx->intermediate_alpha32=NULL; }
-	if(ctx->final_alpha32) { iw_free(ctx,ctx->final_alpha32); ctx->final_alpha32=NULL; }
+	ctx->intermediate32 = NULL;
+	ctx->intermediate_alpha32 = NULL;
+	ctx->intermediate16 = NULL;
+	ctx->intermediate_alpha16 = NULL;
 	for(k=0;k<IW_DITHER_MAXROWS;k++) {
-		if(ctx->dither_errors[k]) { iw_free(ctx,ctx->dither_errors[k]); ctx->dither_errors[k]=NULL; }
+		ctx->dither_errors[k] = NULL;
+	}
+	if(!ctx->keep_buffers) {
+		iwpvt_membuf_free(ctx,&ctx->intermediate_buf);
+		iwpvt_membuf_free(ctx,&ctx->intermediate_alpha_buf);
+		iwpvt_membuf_free(ctx,&ctx->dither_errors_buf);
 	}
 	// The 'resize contexts' are usually kept around so that they can be reused.
 	// Now that we're done with everything, free them.
@@ -494,7 +494,7 @@ static int iwmiff_read_pixels(struct iwmiffrcontext *rctx)
 
 	img->bpr = tmprowsize;
 
-	img->pixels = (iw_byte*)iw_malloc_large(rctx->ctx, img->bpr, img->height);
+	img->pixels = (iw_byte*)iw_malloc_input_pixels(rctx->ctx, img->bpr, img->height);
 	if(!img->pixels) goto done;
 
 	for(j=0;j<img->height;j++) {
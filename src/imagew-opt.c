@@ -15,1096 +15,1370 @@
 
 #include "imagew-internals.h"
 
-static void iw_opt_scanpixels_rgb8(struct iw_opt_ctx *optctx)
+// Returns 0 if nothing found.
+static int iwopt_find_unused(const iw_byte *flags, int count, iw_byte *unused_clr)
 {
-	int i,j;
-	iw_byte r,g,b;
-	const iw_byte *ptr;
-
-	for(j=0;j<optctx->height;j++) {
-		for(i=0;i<optctx->width;i++) {
-			ptr = &optctx->pixelsptr[j*optctx->bpr+i*3];
-			r=ptr[0]; g=ptr[1]; b=ptr[2];
-
-			// Check grayscale
-			if(r!=g || r!=b)
-				optctx->has_color=1;
+	int i;
+	int found=0;
+	int found_dist=0; // Distance from our preferred value (192)
+	int d;
 
-			if(optctx->has_color) {
-				// No optimizations possible. Stop the scan
-				goto done;
+	for(i=0;i<count;i++) {
+		if(flags[i]==0) {
+			d=abs(i-192);
+			if(!found || d<found_dist) {
+				*unused_clr = (iw_byte)i;
+				found = 1;
+				found_dist = d;
 			}
 		}
 	}
-done:
-	;
+
+	if(found) {
+		return 1;
+	}
+	*unused_clr = 0;
+	return 0;
 }
 
-static void iw_opt_scanpixels_ga8(struct iw_opt_ctx *optctx)
-{
-	int i,j;
-	iw_byte a;
-	const iw_byte *ptr;
+////////////////////
 
-	for(j=0;j<optctx->height;j++) {
-		for(i=0;i<optctx->width;i++) {
-			ptr = &optctx->pixelsptr[j*optctx->bpr+i*2];
-			a=ptr[1];
-
-			// Check transparency
-			if(a<255) {
-				optctx->has_transparency=1;
-				if(a>0) {
-					optctx->has_partial_transparency=1;
-				}
-			}
+// A small open-addressing hash table, mapping colors to palette indices.
+// It has room for far more than 257 colors, so it never gets crowded.
+#define IWOPT_COLORHASH_BITS 10
+#define IWOPT_COLORHASH_SIZE (1<<IWOPT_COLORHASH_BITS)
 
-			if(optctx->has_partial_transparency) {
-				// No optimizations possible. Stop the scan
-				goto done;
-			}
-		}
+struct iwopt_colorhash {
+	iw_uint32 key[IWOPT_COLORHASH_SIZE];
+	int value[IWOPT_COLORHASH_SIZE]; // -1 = unused slot
+};
+
+static iw_uint32 iwopt_pack_color(const struct iw_rgba8color *c)
+{
+	return ((iw_uint32)c->r<<24) | ((iw_uint32)c->g<<16) | ((iw_uint32)c->b<<8) | (iw_uint32)c->a;
+}
+
+static void iwopt_colorhash_init(struct iwopt_colorhash *h)
+{
+	int i;
+	for(i=0;i<IWOPT_COLORHASH_SIZE;i++) {
+		h->value[i] = -1;
 	}
-done:
-	;
 }
 
-static void iw_opt_scanpixels_rgba8(struct iw_opt_ctx *optctx)
+// Returns the slot where 'key' is, or where it should be added.
+static int iwopt_colorhash_slot(const struct iwopt_colorhash *h, iw_uint32 key)
 {
-	int i,j;
-	iw_byte r,g,b,a;
-	const iw_byte *ptr;
+	int i;
+	i = (int)((key*0x9e3779b1U)>>(32-IWOPT_COLORHASH_BITS));
+	while(h->value[i]>=0 && h->key[i]!=key) {
+		i = (i+1)&(IWOPT_COLORHASH_SIZE-1);
+	}
+	return i;
+}
 
-	for(j=0;j<optctx->height;j++) {
-		for(i=0;i<optctx->width;i++) {
-			ptr = &optctx->pixelsptr[j*optctx->bpr+i*4];
-			r=ptr[0]; g=ptr[1]; b=ptr[2]; a=ptr[3];
-
-			// Check transparency
-			if(a<255) {
-				optctx->has_transparency=1;
-				if(a>0) {
-					optctx->has_partial_transparency=1;
-				}
-			}
+// returns palette entry, or -1 if not found
+static int iwopt_colorhash_find(const struct iwopt_colorhash *h, iw_uint32 key)
+{
+	return h->value[iwopt_colorhash_slot(h,key)];
+}
 
-			// Check grayscale
-			if(r!=g || r!=b)
-				optctx->has_color=1;
+// If the color is already present, its palette entry is not changed.
+static void iwopt_colorhash_add(struct iwopt_colorhash *h, iw_uint32 key, int value)
+{
+	int i;
+	i = iwopt_colorhash_slot(h,key);
+	if(h->value[i]>=0) return;
+	h->key[i] = key;
+	h->value[i] = value;
+}
 
-			if(optctx->has_partial_transparency && optctx->has_color) {
-				// No optimizations possible. Stop the scan
-				goto done;
-			}
+// Returns palette index to use for the background color, or -1 if not found.
+static int iwopt_find_bkgd_color(const struct iw_palette *pal, const struct iw_rgba8color *c)
+{
+	int i;
+	for(i=0;i<pal->num_entries;i++) {
+		if(pal->entry[i].a==0) {
+			// A fully transparent palette color can always be used for the background
+			// (assuming PNG-style background colors).
+			return i;
+		}
+		if(pal->entry[i].r==c->r && pal->entry[i].g==c->g &&
+			pal->entry[i].b==c->b)
+		{
+			return i;
 		}
 	}
-done:
-	;
+	return -1;
 }
 
-static void iw_opt_scanpixels_g16(struct iw_opt_ctx *optctx)
+// Information about the unoptimized image, collected in a single pass.
+// It is enough to make all of the optimization decisions, so that the image
+// only has to be read one more time, to write the optimized version.
+struct iw_opt_scan {
+	int num_channels;
+	int has_alpha;
+
+	// Set if we're collecting the colors used, for palette optimization.
+	int collect_colors;
+	int too_many_colors; // Set if more than 256 colors were found.
+	struct iw_palette *palette;
+	iw_uint32 prev_key;
+	int have_prev_key;
+	struct iwopt_colorhash colorhash;
+
+	// For binary transparency, we need a color that isn't used by any
+	// nontransparent pixel. Which of these gets used depends on the image
+	// type we end up with. (Refer to iwopt_decide_binary_trns().)
+	iw_byte key_used_rgb8[256];  // Red values, for colors (R,192,192)
+	iw_byte key_used_rgb16[256]; // Low byte of red, for (192*256+R,192*257,192*257)
+	iw_byte key_used_gray8[256];
+	iw_byte key_used_gray16[256]; // Low byte, for shades 192*256+V
+
+	int simd_level; // An IW_SIMD_* value, for iwpvt_scan_row_flags().
+
+	int rows_scanned; // Number of rows (from the top) looked at so far.
+	int done; // Set if there's nothing more to learn.
+};
+
+// Record a (normalized, 8-bit) color in the palette.
+static void iwopt_scan_add_color(struct iw_opt_scan *scan, const struct iw_rgba8color *c)
 {
-	int i,j;
-	const iw_byte *ptr;
+	iw_uint32 key;
 
-	for(j=0;j<optctx->height;j++) {
-		for(i=0;i<optctx->width;i++) {
-			ptr = &optctx->pixelsptr[j*optctx->bpr+(i*2)];
+	// Neighboring pixels are often the same color.
+	key = iwopt_pack_color(c);
+	if(scan->have_prev_key && key==scan->prev_key) return;
+	scan->prev_key = key;
+	scan->have_prev_key = 1;
 
-			// Check if 16-bit output is necessary
-			if(ptr[0]!=ptr[1])
-			{
-				optctx->has_16bit_precision=1;
-			}
+	if(iwopt_colorhash_find(&scan->colorhash,key)>=0) return;
 
-			if(optctx->has_16bit_precision) {
-				// No optimizations possible. Stop the scan
-				goto done;
-			}
-		}
+	if(scan->palette->num_entries>=256) {
+		// Image has more than 256 colors.
+		scan->too_many_colors = 1;
+		return;
 	}
-done:
-	;
+	iwopt_colorhash_add(&scan->colorhash,key,scan->palette->num_entries);
+	scan->palette->entry[scan->palette->num_entries] = *c; // struct copy
+	scan->palette->num_entries++;
 }
 
-static void iw_opt_scanpixels_ga16(struct iw_opt_ctx *optctx)
+static void iwopt_scan_row8(struct iw_opt_ctx *optctx, struct iw_opt_scan *scan,
+	const iw_byte *row)
 {
-	int i,j;
-	unsigned int a;
+	int i;
+	int nc;
 	const iw_byte *ptr;
+	struct iw_rgba8color c;
 
-	for(j=0;j<optctx->height;j++) {
-		for(i=0;i<optctx->width;i++) {
-			ptr = &optctx->pixelsptr[j*optctx->bpr+(i*2)*2];
+	nc = scan->num_channels;
 
-			// Check if 16-bit output is necessary
-			if(ptr[0]!=ptr[1] || ptr[2]!=ptr[3])
-			{
-				optctx->has_16bit_precision=1;
-			}
+	for(i=0;i<optctx->width;i++) {
+		ptr = &row[i*nc];
 
-			a=(((unsigned int)ptr[2])<<8) | ptr[3];
+		if(nc>=3) {
+			c.r = ptr[0]; c.g = ptr[1]; c.b = ptr[2];
+		}
+		else {
+			c.r = c.g = c.b = ptr[0];
+		}
+		c.a = scan->has_alpha ? ptr[nc-1] : 255;
 
-			// Check transparency
-			if(a<65535) {
-				optctx->has_transparency=1;
-				if(a>0) {
-					optctx->has_partial_transparency=1;
-				}
+		if(c.a<255) {
+			optctx->has_transparency=1;
+			if(c.a>0) {
+				optctx->has_partial_transparency=1;
 			}
-
-			if(optctx->has_partial_transparency && optctx->has_16bit_precision) {
-				// No optimizations possible. Stop the scan
-				goto done;
+			else {
+				// All invisible colors are the same.
+				c.r = c.g = c.b = 0;
 			}
 		}
-	}
-done:
-	;
-}
-
-static void iw_opt_scanpixels_rgb16(struct iw_opt_ctx *optctx)
-{
-	int i,j;
-	unsigned int r,g,b;
-	const iw_byte *ptr;
-
-	for(j=0;j<optctx->height;j++) {
-		for(i=0;i<optctx->width;i++) {
-			ptr = &optctx->pixelsptr[j*optctx->bpr+(i*2)*3];
 
-			// Check if 16-bit output is necessary
-			if(ptr[0]!=ptr[1] || ptr[2]!=ptr[3] || ptr[4]!=ptr[5])
-			{
-				optctx->has_16bit_precision=1;
-			}
-
-			r=(((unsigned int)ptr[0])<<8) | ptr[1];
-			g=(((unsigned int)ptr[2])<<8) | ptr[3];
-			b=(((unsigned int)ptr[4])<<8) | ptr[5];
+		if(c.r!=c.g || c.r!=c.b)
+			optctx->has_color=1;
 
-			// Check grayscale
-			if(r!=g || r!=b)
-				optctx->has_color=1;
+		if(c.a>0 && scan->has_alpha && !optctx->has_partial_transparency) {
+			if(c.g==192 && c.b==192) scan->key_used_rgb8[c.r] = 1;
+			scan->key_used_gray8[c.r] = 1;
+		}
 
-			if(optctx->has_color && optctx->has_16bit_precision) {
-				// No optimizations possible. Stop the scan
-				goto done;
-			}
+		if(scan->collect_colors && !scan->too_many_colors) {
+			iwopt_scan_add_color(scan,&c);
 		}
 	}
-done:
-	;
 }
 
-static void iw_opt_scanpixels_rgba16(struct iw_opt_ctx *optctx)
+static void iwopt_scan_row16(struct iw_opt_ctx *optctx, struct iw_opt_scan *scan,
+	const iw_byte *row)
 {
-	int i,j;
-	unsigned int r,g,b,a;
+	int i, k;
+	int nc;
 	const iw_byte *ptr;
+	unsigned int v[4]; // R, G, B, A
+	struct iw_rgba8color c;
 
-	for(j=0;j<optctx->height;j++) {
-		for(i=0;i<optctx->width;i++) {
-			ptr = &optctx->pixelsptr[j*optctx->bpr+(i*2)*4];
-
-			// Check if 16-bit output is necessary
-			if(ptr[0]!=ptr[1] || ptr[2]!=ptr[3] || ptr[4]!=ptr[5] || ptr[6]!=ptr[7])
-			{
-				optctx->has_16bit_precision=1;
-			}
+	nc = scan->num_channels;
 
-			r=(((unsigned int)ptr[0])<<8) | ptr[1];
-			g=(((unsigned int)ptr[2])<<8) | ptr[3];
-			b=(((unsigned int)ptr[4])<<8) | ptr[5];
-			a=(((unsigned int)ptr[6])<<8) | ptr[7];
+	for(i=0;i<optctx->width;i++) {
+		ptr = &row[i*nc*2];
 
-			// Check transparency
-			if(a<65535) {
-				optctx->has_transparency=1;
-				if(a>0) {
-					optctx->has_partial_transparency=1;
-				}
+		if(nc>=3) {
+			for(k=0;k<3;k++) {
+				v[k] = (((unsigned int)ptr[k*2])<<8) | ptr[k*2+1];
 			}
+		}
+		else {
+			v[0] = v[1] = v[2] = (((unsigned int)ptr[0])<<8) | ptr[1];
+		}
+		v[3] = scan->has_alpha ? ((((unsigned int)ptr[(nc-1)*2])<<8) | ptr[(nc-1)*2+1]) : 65535;
 
-			// Check grayscale
-			if(r!=g || r!=b)
-				optctx->has_color=1;
-
-			if(optctx->has_partial_transparency && optctx->has_color && optctx->has_16bit_precision) {
-				// No optimizations possible. Stop the scan
-				goto done;
+		if(v[3]<65535) {
+			optctx->has_transparency=1;
+			if(v[3]>0) {
+				optctx->has_partial_transparency=1;
+			}
+			else {
+				v[0] = v[1] = v[2] = 0;
 			}
 		}
-	}
-done:
-	;
-}
 
-static void iw_opt_16_to_8(struct iw_context *ctx, struct iw_opt_ctx *optctx, int spp)
-{
-	iw_byte *newpixels;
-	size_t newbpr;
-	int i,j,k;
-
-	if(!ctx->opt_16_to_8) return;
-
-	newbpr = iw_calc_bytesperrow(optctx->width,8*spp);
-	newpixels = iw_malloc_large(ctx, newbpr, optctx->height);
-	if(!newpixels) return;
-
-	for(j=0;j<optctx->height;j++) {
-		for(i=0;i<spp*optctx->width;i++) {
-			// i is a sample number, not a pixel number.
-			newpixels[j*newbpr + i] = optctx->pixelsptr[j*optctx->bpr + i*2];
+		// Check if 16-bit output is necessary
+		for(k=0;k<4;k++) {
+			if((v[k]>>8) != (v[k]&0xff))
+				optctx->has_16bit_precision=1;
 		}
-	}
 
-	// Remove previous image if it was allocated by the optimization code.
-	if(optctx->tmp_pixels) iw_free(ctx,optctx->tmp_pixels);
+		if(v[0]!=v[1] || v[0]!=v[2])
+			optctx->has_color=1;
 
-	// Attach our new image
-	optctx->tmp_pixels = newpixels;
-	optctx->pixelsptr = optctx->tmp_pixels;
-	optctx->bpr = newbpr;
-	optctx->bit_depth = 8;
+		if(v[3]>0 && scan->has_alpha && !optctx->has_partial_transparency) {
+			// For the colors we look for, all bytes are 192 except possibly the low-red byte.
+			if((v[0]>>8)==192 && v[1]==192*257 && v[2]==192*257)
+				scan->key_used_rgb16[v[0]&0xff] = 1;
+			if((v[0]>>8)==192)
+				scan->key_used_gray16[v[0]&0xff] = 1;
+			// In case the image gets reduced to 8 bits/sample.
+			if((v[1]>>8)==192 && (v[2]>>8)==192)
+				scan->key_used_rgb8[v[0]>>8] = 1;
+			scan->key_used_gray8[v[0]>>8] = 1;
+		}
 
-	// If there's a background color label, also reduce its precision.
-	if(optctx->has_bkgdlabel) {
-		for(k=0;k<4;k++) {
-			optctx->bkgdlabel[k] >>= 8;
+		// Colors are only useful if the image can be reduced to 8 bits/sample.
+		if(scan->collect_colors && !scan->too_many_colors && !optctx->has_16bit_precision) {
+			c.r = (iw_byte)(v[0]>>8);
+			c.g = (iw_byte)(v[1]>>8);
+			c.b = (iw_byte)(v[2]>>8);
+			c.a = (iw_byte)(v[3]>>8);
+			iwopt_scan_add_color(scan,&c);
 		}
 	}
 }
 
-// Create a new (8-bit) image by copying up to 3 channels from the old image.
-static void iw_opt_copychannels_8(struct iw_context *ctx, struct iw_opt_ctx *optctx,
-			int new_imgtype, int c0, int c1, int c2)
+// Once the colors are no longer being collected, and the key color info is
+// no longer needed, all that's left to learn from the pixels are a couple of
+// yes/no flags. iwpvt_scan_row_flags() finds them, with SIMD instructions if
+// the CPU has them.
+static void iwopt_scan_row_flags(struct iw_opt_ctx *optctx, struct iw_opt_scan *scan,
+	const iw_byte *row)
 {
-	iw_byte *newpixels;
-	int oldnc, newnc; // num_channels
-	size_t newbpr;
-	int i,j;
-
-	oldnc = iw_imgtype_num_channels(optctx->imgtype);
-	newnc = iw_imgtype_num_channels(new_imgtype);
-
-	newbpr = iw_calc_bytesperrow(optctx->width,8*newnc);
-	newpixels = iw_malloc_large(ctx, newbpr, optctx->height);
-	if(!newpixels) return;
-
-	for(j=0;j<optctx->height;j++) {
-		for(i=0;i<optctx->width;i++) {
-			newpixels[j*newbpr + i*newnc +0] = optctx->pixelsptr[j*optctx->bpr + i*oldnc +c0];
-			if(newnc>1)
-				newpixels[j*newbpr + i*newnc +1] = optctx->pixelsptr[j*optctx->bpr + i*oldnc +c1];
-			if(newnc>2)
-				newpixels[j*newbpr + i*newnc +2] = optctx->pixelsptr[j*optctx->bpr + i*oldnc +c2];
-		}
-	}
+	unsigned int want = 0;
+	unsigned int found;
 
-	// Remove previous image if it was allocated by the optimization code.
-	if(optctx->tmp_pixels) iw_free(ctx,optctx->tmp_pixels);
-
-	// Attach our new image
-	optctx->tmp_pixels = newpixels;
-	optctx->pixelsptr = optctx->tmp_pixels;
-	optctx->bpr = newbpr;
-	optctx->imgtype = new_imgtype;
+	if(scan->num_channels>=3 && !optctx->has_color) want |= IW_SCANFLAG_COLOR;
+	if(optctx->bit_depth==16 && !optctx->has_16bit_precision) want |= IW_SCANFLAG_16BIT;
+	if(!want) return;
 
+	found = iwpvt_scan_row_flags(scan->simd_level,row,optctx->width,
+		scan->num_channels,optctx->bit_depth,want);
+	if(found&IW_SCANFLAG_COLOR) optctx->has_color=1;
+	if(found&IW_SCANFLAG_16BIT) optctx->has_16bit_precision=1;
 }
 
-// Create a new (16-bit) image by copying up to 3 channels from the old image.
-static void iw_opt_copychannels_16(struct iw_context *ctx, struct iw_opt_ctx *optctx,
-			int new_imgtype, int c0, int c1, int c2)
+// Returns nonzero if iwopt_scan_row_flags() can be used for the next row.
+static int iwopt_scan_flags_only(struct iw_opt_ctx *optctx, struct iw_opt_scan *scan)
 {
-	iw_byte *newpixels;
-	int oldnc, newnc; // num_channels
-	size_t newbpr;
-	int i,j;
+	if(scan->has_alpha && !optctx->has_partial_transparency) return 0;
+	if(scan->collect_colors && !scan->too_many_colors && !optctx->has_16bit_precision) return 0;
+	return 1;
+}
 
-	oldnc = iw_imgtype_num_channels(optctx->imgtype);
-	newnc = iw_imgtype_num_channels(new_imgtype);
+// Sets scan->done if scanning more rows can't change any of our decisions.
+static void iwopt_scan_check_done(struct iw_opt_ctx *optctx, struct iw_opt_scan *scan)
+{
+	if(scan->num_channels>=3 && !optctx->has_color) return;
+	if(optctx->bit_depth==16 && !optctx->has_16bit_precision) return;
+	// Until we find partial transparency, we still need the key color info.
+	if(scan->has_alpha && !optctx->has_partial_transparency) return;
+	if(scan->collect_colors && !scan->too_many_colors && !optctx->has_16bit_precision) return;
+	scan->done = 1;
+}
 
-	newbpr = iw_calc_bytesperrow(optctx->width,16*newnc);
-	newpixels = iw_malloc_large(ctx, newbpr, optctx->height);
-	if(!newpixels) return;
+// Look at the next row of the image.
+static void iwopt_scan_next_row(struct iw_opt_ctx *optctx, struct iw_opt_scan *scan)
+{
+	const iw_byte *row;
 
-	for(j=0;j<optctx->height;j++) {
-		for(i=0;i<optctx->width;i++) {
-			newpixels[j*newbpr + (i*newnc+0)*2+0] = optctx->pixelsptr[j*optctx->bpr + (i*oldnc+c0)*2+0];
-			newpixels[j*newbpr + (i*newnc+0)*2+1] = optctx->pixelsptr[j*optctx->bpr + (i*oldnc+c0)*2+1];
-			if(newnc>1) {
-				newpixels[j*newbpr + (i*newnc+1)*2+0] = optctx->pixelsptr[j*optctx->bpr + (i*oldnc+c1)*2+0];
-				newpixels[j*newbpr + (i*newnc+1)*2+1] = optctx->pixelsptr[j*optctx->bpr + (i*oldnc+c1)*2+1];
-			}
-			if(newnc>2) {
-				newpixels[j*newbpr + (i*newnc+2)*2+0] = optctx->pixelsptr[j*optctx->bpr + (i*oldnc+c2)*2+0];
-				newpixels[j*newbpr + (i*newnc+2)*2+1] = optctx->pixelsptr[j*optctx->bpr + (i*oldnc+c2)*2+1];
-			}
-		}
+	row = &optctx->pixelsptr[scan->rows_scanned*optctx->bpr];
+	if(iwopt_scan_flags_only(optctx,scan)) {
+		iwopt_scan_row_flags(optctx,scan,row);
 	}
+	else if(optctx->bit_depth==16)
+		iwopt_scan_row16(optctx,scan,row);
+	else
+		iwopt_scan_row8(optctx,scan,row);
+	scan->rows_scanned++;
 
-	// Remove previous image if it was allocated by the optimization code.
-	if(optctx->tmp_pixels) iw_free(ctx,optctx->tmp_pixels);
-
-	// Attach our new image
-	optctx->tmp_pixels = newpixels;
-	optctx->pixelsptr = optctx->tmp_pixels;
-	optctx->bpr = newbpr;
-	optctx->imgtype = new_imgtype;
+	iwopt_scan_check_done(optctx,scan);
 }
 
-// Returns 0 if no scanning was done.
-static int iw_opt_scanpixels(struct iw_context *ctx, struct iw_opt_ctx *optctx)
+// Scan any rows that haven't been scanned yet.
+static void iwopt_scan_image(struct iw_opt_ctx *optctx, struct iw_opt_scan *scan)
 {
-	if(optctx->imgtype==IW_IMGTYPE_RGBA && optctx->bit_depth==16) {
-		iw_opt_scanpixels_rgba16(optctx);
+	while(!scan->done && scan->rows_scanned<optctx->height) {
+		iwopt_scan_next_row(optctx,scan);
 	}
-	else if(optctx->imgtype==IW_IMGTYPE_RGBA && optctx->bit_depth==8) {
-		iw_opt_scanpixels_rgba8(optctx);
-	}
-	else if(optctx->imgtype==IW_IMGTYPE_RGB && optctx->bit_depth==16) {
-		iw_opt_scanpixels_rgb16(optctx);
-	}
-	else if(optctx->imgtype==IW_IMGTYPE_RGB && optctx->bit_depth==8) {
-		iw_opt_scanpixels_rgb8(optctx);
-	}
-	else if(optctx->imgtype==IW_IMGTYPE_GRAYA && optctx->bit_depth==16) {
-		iw_opt_scanpixels_ga16(optctx);
-	}
-	else if(optctx->imgtype==IW_IMGTYPE_GRAYA && optctx->bit_depth==8) {
-		iw_opt_scanpixels_ga8(optctx);
-	}
-	else if(optctx->imgtype==IW_IMGTYPE_GRAY && optctx->bit_depth==16) {
-		iw_opt_scanpixels_g16(optctx);
-	}
-	else {
+}
+
+static int iwopt_profile_has_pal_lowgray(struct iw_context *ctx)
+{
+	if(!(ctx->output_profile&IW_PROFILE_PAL1) &&
+	   !(ctx->output_profile&IW_PROFILE_PAL2) &&
+	   !(ctx->output_profile&IW_PROFILE_PAL4) &&
+	   !(ctx->output_profile&IW_PROFILE_PAL8) &&
+	   !(ctx->output_profile&IW_PROFILE_GRAY1) &&
+	   !(ctx->output_profile&IW_PROFILE_GRAY2) &&
+	   !(ctx->output_profile&IW_PROFILE_GRAY4) )
+	{
 		return 0;
 	}
-
 	return 1;
 }
 
-////////////////////
-
-// Returns 0 if nothing found.
-static int iwopt_find_unused(const iw_byte *flags, int count, iw_byte *unused_clr)
+static struct iw_opt_scan *iwopt_create_scan(struct iw_context *ctx, struct iw_opt_ctx *optctx)
 {
-	int i;
-	int found=0;
-	int found_dist=0; // Distance from our preferred value (192)
-	int d;
-
-	for(i=0;i<count;i++) {
-		if(flags[i]==0) {
-			d=abs(i-192);
-			if(!found || d<found_dist) {
-				*unused_clr = (iw_byte)i;
-				found = 1;
-				found_dist = d;
-			}
+	struct iw_opt_scan *scan;
+
+	scan = (struct iw_opt_scan*)iw_mallocz(ctx,sizeof(struct iw_opt_scan));
+	if(!scan) return NULL;
+	scan->num_channels = iw_imgtype_num_channels(optctx->imgtype);
+	scan->has_alpha = IW_IMGTYPE_HAS_ALPHA(optctx->imgtype);
+	scan->simd_level = iwpvt_get_simd_level();
+
+	// Colors only need to be collected if we might make a palette image.
+	if(iwopt_profile_has_pal_lowgray(ctx) && (optctx->bit_depth==8 || ctx->opt_16_to_8)) {
+		scan->palette = iw_malloc(ctx,sizeof(struct iw_palette));
+		if(scan->palette) {
+			scan->palette->num_entries = 0;
+			iwopt_colorhash_init(&scan->colorhash);
+			scan->collect_colors = 1;
 		}
 	}
-
-	if(found) {
-		return 1;
-	}
-	*unused_clr = 0;
-	return 0;
+	return scan;
 }
 
-// Try to convert from RGBA to RGB+binary trns.
-// Assumes we already know there is transparency, but no partial transparency.
-static void iwopt_try_rgb8_binary_trns(struct iw_context *ctx, struct iw_opt_ctx *optctx)
+// If there is a background color label, make sure it's in the palette.
+// Returns 1 if a palette can still be used.
+static int iwopt_add_bkgd_to_palette(struct iw_context *ctx, struct iw_opt_ctx *optctx)
 {
-	int i,j;
-	const iw_byte *ptr;
-	iw_byte *ptr2;
-	iw_byte clr_used[256];
-	iw_byte key_clr=0; // Red component of the key color
-	iw_byte *trns_mask = NULL;
-
-	if(!(ctx->output_profile&IW_PROFILE_BINARYTRNS)) return;
-	if(!ctx->opt_binary_trns) return;
-
-	// Try to find a color that's not used in the image.
-	// Looking for all 2^24 possible colors is too much work.
-	// We will just look for 256 predefined colors: R={0-255},G=192,B=192
-	iw_zeromem(clr_used,256);
-
-	// Hard to decide how to do this. I don't want the optimization phase
-	// to modify img2.pixels, though that would be the easiest method.
-	// Another option would be to make a version of iw_opt_copychannels_8()
-	// that sets the transparent pixels to a certain value, but that would
-	// get messy.
-	// Instead, I'll make a transparency mask, then strip the alpha
-	// channel, then use the mask to patch up the new image.
-	trns_mask = iw_malloc_large(ctx, optctx->width, optctx->height);
-	if(!trns_mask) goto done;
+	struct iw_rgba8color c;
+	int e;
 
-	for(j=0;j<optctx->height;j++) {
-		for(i=0;i<optctx->width;i++) {
-			ptr = &optctx->pixelsptr[j*optctx->bpr+i*4];
-			if(ptr[3]==0) {
-				// transparent pixel
-				trns_mask[j*optctx->width+i] = 0; // Remember which pixels are transparent.
-				continue;
-			}
-			else {
-				trns_mask[j*optctx->width+i] = 1;
-			}
-			if(ptr[1]!=192 || ptr[2]!=192) continue;
-			clr_used[(int)ptr[0]] = 1;
+	if(!optctx->has_bkgdlabel) return 1;
+
+	c.r = optctx->bkgdlabel[0];
+	c.g = optctx->bkgdlabel[1];
+	c.b = optctx->bkgdlabel[2];
+	c.a = 255;
+	e = iwopt_find_bkgd_color(optctx->palette,&c);
+	if(e<0) {
+		// Did not find a suiteable palette entry for the background color.
+		// Is there room to add one?
+		if(optctx->palette->num_entries<256) {
+			// Yes.
+			optctx->palette->entry[optctx->palette->num_entries] = c;
+			optctx->palette->num_entries++;
 		}
-	}
-
-	if(!iwopt_find_unused(clr_used,256,&key_clr)) {
-		goto done;
-	}
-
-	// Strip the alpha channel:
-	iw_opt_copychannels_8(ctx,optctx,IW_IMGTYPE_RGB,0,1,2);
-	if(!optctx->tmp_pixels) goto done;
-
-	// Change the color of all transparent pixels to the key color
-	for(j=0;j<optctx->height;j++) {
-		for(i=0;i<optctx->width;i++) {
-			ptr2 = &optctx->tmp_pixels[j*optctx->bpr+i*3];
-			if(trns_mask[j*optctx->width+i]==0) {
-				ptr2[0] = key_clr;
-				ptr2[1] = 192;
-				ptr2[2] = 192;
-			}
+		else {
+			// No.
+			return 0;
 		}
 	}
-
-	optctx->has_colorkey_trns = 1;
-	optctx->colorkey[IW_CHANNELTYPE_RED] = key_clr;
-	optctx->colorkey[IW_CHANNELTYPE_GREEN] = 192;
-	optctx->colorkey[IW_CHANNELTYPE_BLUE] = 192;
-
-done:
-	if(trns_mask) iw_free(ctx,trns_mask);
+	return 1;
 }
 
-static void iwopt_try_rgb16_binary_trns(struct iw_context *ctx, struct iw_opt_ctx *optctx)
+static int iwopt_palsortfunc(const void* p1, const void* p2)
 {
-	int i,j;
-	const iw_byte *ptr;
-	iw_byte *ptr2;
-	iw_byte clr_used[256];
-	iw_byte key_clr=0; // low 8-bits of red component of the key color
-	iw_byte *trns_mask = NULL;
-
-	if(!(ctx->output_profile&IW_PROFILE_BINARYTRNS)) return;
-	if(!ctx->opt_binary_trns) return;
+	const struct iw_rgba8color *e1,*e2;
+	int s1,s2;
 
-	iw_zeromem(clr_used,256);
+	e1=(const struct iw_rgba8color*)p1;
+	e2=(const struct iw_rgba8color*)p2;
 
-	trns_mask = iw_malloc_large(ctx, optctx->width, optctx->height);
-	if(!trns_mask) goto done;
+	// First, sort by whether the color is fully opaque.
+	if(e1->a==255 && e2->a<255) return 1;
+	if(e1->a<255 && e2->a==255) return -1;
 
-	for(j=0;j<optctx->height;j++) {
-		for(i=0;i<optctx->width;i++) {
-			ptr = &optctx->pixelsptr[j*optctx->bpr+(i*2)*4];
-			if(ptr[6]==0 && ptr[7]==0) {
-				// Transparent pixel
-				trns_mask[j*optctx->width+i] = 0;
-				continue;
-			}
-			else {
-				// Nontransparent pixel
-				trns_mask[j*optctx->width+i] = 1;
-			}
-			// For the colors we look for, all bytes are 192 except possibly the low-red byte.
-			if(ptr[0]!=192 || ptr[2]!=192 || ptr[3]!=192 || ptr[4]!=192 || ptr[5]!=192)
-				continue;
-			clr_used[(int)ptr[1]] = 1;
-		}
-	}
+	// Then by the approximate brightness.
+	s1=e1->r+e1->g+e1->b;
+	s2=e2->r+e2->g+e2->b;
+	if(s1>s2) return 1;
+	if(s1<s2) return -1;
 
-	if(!iwopt_find_unused(clr_used,256,&key_clr)) {
-		goto done;
-	}
+	// This is to make the order fully deterministic.
+	if(e1->g > e2->g) return 1;
+	if(e1->g < e2->g) return -1;
+	if(e1->r > e2->r) return 1;
+	if(e1->r < e2->r) return -1;
+	if(e1->b > e2->b) return 1;
+	if(e1->b < e2->b) return -1;
+	if(e1->a > e2->a) return 1;
+	if(e1->a < e2->a) return -1;
 
-	// Strip the alpha channel:
-	iw_opt_copychannels_16(ctx,optctx,IW_IMGTYPE_RGB,0,1,2);
-	if(!optctx->tmp_pixels) goto done;
+	return 0; // Should be unreachable.
+}
 
-	// Change the color of all transparent pixels to the key color
-	for(j=0;j<optctx->height;j++) {
-		for(i=0;i<optctx->width;i++) {
-			ptr2 = &optctx->tmp_pixels[j*optctx->bpr+(i*2)*3];
-			if(trns_mask[j*optctx->width+i]==0) {
-				ptr2[0] = 192;
-				ptr2[1] = key_clr;
-				ptr2[2] = 192;
-				ptr2[3] = 192;
-				ptr2[4] = 192;
-				ptr2[5] = 192;
-			}
-		}
-	}
+// Figure out if we can do palette optimization at the given bitdepth.
+static int iwopt_palette_opt_ok(struct iw_context *ctx, struct iw_opt_ctx *optctx, int bpp)
+{
+	if(!ctx->opt_palette) return 0;
 
-	optctx->has_colorkey_trns = 1;
-	optctx->colorkey[IW_CHANNELTYPE_RED] = 192*256+key_clr;
-	optctx->colorkey[IW_CHANNELTYPE_GREEN] = 192*256+192;
-	optctx->colorkey[IW_CHANNELTYPE_BLUE] = 192*256+192;
+	if(optctx->has_transparency && !(ctx->output_profile&IW_PROFILE_PALETTETRNS)) return 0;
 
-done:
-	if(trns_mask) iw_free(ctx,trns_mask);
+	switch(bpp) {
+	case 1:
+		if(!(ctx->output_profile&IW_PROFILE_PAL1)) return 0;
+		if(optctx->palette->num_entries>2) return 0;
+		break;
+	case 2:
+		if(!(ctx->output_profile&IW_PROFILE_PAL2)) return 0;
+		if(optctx->palette->num_entries>4) return 0;
+		break;
+	case 4:
+		if(!(ctx->output_profile&IW_PROFILE_PAL4)) return 0;
+		if(optctx->palette->num_entries>16) return 0;
+		break;
+	case 8:
+		if(!(ctx->output_profile&IW_PROFILE_PAL8)) return 0;
+		if(optctx->palette->num_entries>256) return 0;
+		break;
+	default:
+		return 0;
+	}
+
+	return 1;
 }
 
-static void iwopt_try_gray8_binary_trns(struct iw_context *ctx, struct iw_opt_ctx *optctx)
+static int iwopt_palette_is_valid_gray(struct iw_context *ctx, struct iw_opt_ctx *optctx, int bpp,
+	int *pbinary_trns, unsigned int *ptrns_shade)
 {
-	int i,j;
-	const iw_byte *ptr;
-	iw_byte *ptr2;
+	int factor;
+	int i;
+	int max_entries;
 	iw_byte clr_used[256];
 	iw_byte key_clr=0;
-	iw_byte *trns_mask = NULL;
 
-	if(!(ctx->output_profile&IW_PROFILE_BINARYTRNS)) return;
-	if(!ctx->opt_binary_trns) return;
+	*pbinary_trns = 0;
+	*ptrns_shade = 0;
 
-	iw_zeromem(clr_used,256);
+	if(optctx->has_color) return 0;
+	if(optctx->has_partial_transparency) return 0;
+	if(optctx->has_transparency && !ctx->opt_binary_trns) return 0;
+	if(optctx->has_transparency && !(ctx->output_profile&IW_PROFILE_BINARYTRNS)) return 0;
+
+	switch(bpp) {
+	case 1: factor=255; max_entries=2; break;
+	case 2: factor=85; max_entries=4; break;
+	case 4: factor=17; max_entries=16; break;
+	case 8: factor=1; max_entries=256; break;
+	default: return 0;
+	}
 
-	trns_mask = iw_malloc_large(ctx, optctx->width, optctx->height);
-	if(!trns_mask) goto done;
+	if(optctx->palette->num_entries > max_entries)
+		return 0;
 
-	for(j=0;j<optctx->height;j++) {
-		for(i=0;i<optctx->width;i++) {
-			ptr = &optctx->pixelsptr[j*optctx->bpr+i*2];
-			if(ptr[1]==0) {
-				// Transparent pixel
-				trns_mask[j*optctx->width+i] = 0;
-				continue;
-			}
-			else {
-				// Nontransparent pixel
-				trns_mask[j*optctx->width+i] = 1;
-			}
-			clr_used[(int)ptr[0]] = 1;
+	// If there is a background color label, it must be one of the available gray shades.
+	if(optctx->has_bkgdlabel && bpp<8) {
+		// We already know the bkgd label is gray (because has_color is false), so we
+		// only have to look at one of the components.
+		if(optctx->bkgdlabel[0] % factor != 0) {
+			return 0;
 		}
 	}
 
-	if(!iwopt_find_unused(clr_used,256,&key_clr)) {
-		goto done;
-	}
+	iw_zeromem(clr_used,256);
 
-	// Strip the alpha channel:
-	iw_opt_copychannels_8(ctx,optctx,IW_IMGTYPE_GRAY,0,0,0);
-	if(!optctx->tmp_pixels) goto done;
+	for(i=0;i<optctx->palette->num_entries;i++) {
+		if(optctx->palette->entry[i].a>0) { // Look at all the nontransparent entries.
+			if(optctx->palette->entry[i].r % factor) return 0;
 
-	// Change the color of all transparent pixels to the key color
-	for(j=0;j<optctx->height;j++) {
-		for(i=0;i<optctx->width;i++) {
-			ptr2 = &optctx->tmp_pixels[j*optctx->bpr+i];
-			if(trns_mask[j*optctx->width+i]==0) {
-				ptr2[0] = key_clr;
-			}
+			// Keep track of which shades were used.
+			clr_used[optctx->palette->entry[i].r / factor] = 1;
 		}
 	}
 
-	optctx->has_colorkey_trns = 1;
-	optctx->colorkey[IW_CHANNELTYPE_RED] = key_clr;
-	optctx->colorkey[IW_CHANNELTYPE_GREEN] = key_clr;
-	optctx->colorkey[IW_CHANNELTYPE_BLUE] = key_clr;
+	// In order for binary transparency to be usable, there must be at least
+	// one unused gray shade.
+	if(optctx->has_transparency) {
+		if(!iwopt_find_unused(clr_used,max_entries,&key_clr))
+			return 0;
 
-done:
-	if(trns_mask) iw_free(ctx,trns_mask);
+		*pbinary_trns = 1;
+		*ptrns_shade = (unsigned int)key_clr;
+	}
+
+	return 1;
 }
 
-static void iwopt_try_gray16_binary_trns(struct iw_context *ctx, struct iw_opt_ctx *optctx)
+static void iwopt_make_gray_palette(struct iw_context *ctx, struct iw_opt_ctx *optctx, int bpp)
 {
-	int i,j;
-	const iw_byte *ptr;
-	iw_byte *ptr2;
-	iw_byte clr_used[256];
-	iw_byte key_clr=0; // low 8-bits of the key color
-	iw_byte *trns_mask = NULL;
+	int factor;
+	int i;
 
-	if(!(ctx->output_profile&IW_PROFILE_BINARYTRNS)) return;
-	if(!ctx->opt_binary_trns) return;
+	switch(bpp) {
+	case 1: factor=255; optctx->palette->num_entries=2; break;
+	case 2: factor=85; optctx->palette->num_entries=4; break;
+	case 4: factor=17; optctx->palette->num_entries=16; break;
+	default: factor=1; optctx->palette->num_entries=256; break;
+	}
 
-	iw_zeromem(clr_used,256);
+	for(i=0;i<optctx->palette->num_entries;i++) {
+		optctx->palette->entry[i].r = optctx->palette->entry[i].g =
+			optctx->palette->entry[i].b = factor*i;
+		optctx->palette->entry[i].a = 255;
+	}
 
-	trns_mask = iw_malloc_large(ctx, optctx->width, optctx->height);
-	if(!trns_mask) goto done;
+	optctx->palette_is_grayscale=1;
+}
 
-	for(j=0;j<optctx->height;j++) {
-		for(i=0;i<optctx->width;i++) {
-			ptr = &optctx->pixelsptr[j*optctx->bpr+(i*2)*2];
-			if(ptr[2]==0 && ptr[3]==0) {
-				// Transparent pixel
-				trns_mask[j*optctx->width+i] = 0;
-				continue;
-			}
-			else {
-				// Nontransparent pixel
-				trns_mask[j*optctx->width+i] = 1;
-			}
-			// For the colors we look for, the high byte is always 192.
-			if(ptr[0]!=192)
-				continue;
-			clr_used[(int)ptr[1]] = 1;
-		}
-	}
+// Optimize to palette, or 1-, 2-, or 4-bpp grayscale.
+// Decides the image type, and the palette, but does not convert the image.
+static void iwopt_try_pal_lowgray_optimization(struct iw_context *ctx, struct iw_opt_ctx *optctx,
+	struct iw_opt_scan *scan)
+{
+	int binary_trns;
+	unsigned int trns_shade;
 
-	if(!iwopt_find_unused(clr_used,256,&key_clr)) {
-		goto done;
+	if(!iwopt_profile_has_pal_lowgray(ctx)) {
+		// Output format doesn't support anything that this optimization can provide.
+		return;
 	}
 
-	// Strip the alpha channel:
-	iw_opt_copychannels_16(ctx,optctx,IW_IMGTYPE_GRAY,0,0,0);
-	if(!optctx->tmp_pixels) goto done;
+	if(optctx->bit_depth!=8) {
+		// Palettes aren't supported with bitdepth>8.
+		return;
+	}
 
-	// Change the color of all transparent pixels to the key color
-	for(j=0;j<optctx->height;j++) {
-		for(i=0;i<optctx->width;i++) {
-			ptr2 = &optctx->tmp_pixels[j*optctx->bpr+(i*2)];
-			if(trns_mask[j*optctx->width+i]==0) {
-				ptr2[0] = 192;
-				ptr2[1] = key_clr;
-			}
-		}
+	if(!scan->collect_colors || scan->too_many_colors) {
+		// Image can't be converted to a palette image.
+		return;
 	}
 
-	optctx->has_colorkey_trns = 1;
-	optctx->colorkey[IW_CHANNELTYPE_RED] = 192*256+key_clr;
-	optctx->colorkey[IW_CHANNELTYPE_GREEN] = 192*256+key_clr;
-	optctx->colorkey[IW_CHANNELTYPE_BLUE] = 192*256+key_clr;
+	// Take ownership of the palette.
+	optctx->palette = scan->palette;
+	scan->palette = NULL;
 
-done:
-	if(trns_mask) iw_free(ctx,trns_mask);
-}
+	if(optctx->palette->num_entries<1) goto done; // Shouldn't happen.
 
-////////////////////
+	if(!iwopt_add_bkgd_to_palette(ctx,optctx)) {
+		goto done;
+	}
 
-// returns palette entry, or -1 if not found
-static int iwopt_find_color(const struct iw_palette *pal, const struct iw_rgba8color *c)
-{
-	int i;
-	for(i=0;i<pal->num_entries;i++) {
-		if(pal->entry[i].r==c->r && pal->entry[i].g==c->g &&
-			pal->entry[i].b==c->b && pal->entry[i].a==c->a)
-		{
-			return i;
+	// optctx->palette now contains a palette that can be used.
+
+	// For images that have at most 256 (8-bit-compatible) colors, the order
+	// of preference is gray1, pal1, gray2, pal2, gray4, pal4, gray8, pal8.
+
+	if(ctx->opt_grayscale && (ctx->output_profile&IW_PROFILE_GRAY1) && iwopt_palette_is_valid_gray(ctx,optctx,1,&binary_trns,&trns_shade)) {
+		// Replace the palette with a fully-populated grayscale palette.
+		// The palette might already be correct, but it might not be.
+		// It will be missing any gray shade that wasn't in the image.
+		iwopt_make_gray_palette(ctx,optctx,1);
+		if(binary_trns) {
+			optctx->has_colorkey_trns = 1;
+			optctx->colorkey[IW_CHANNELTYPE_RED] = optctx->colorkey[IW_CHANNELTYPE_BLUE] = optctx->colorkey[IW_CHANNELTYPE_GREEN] = trns_shade;
 		}
 	}
-	return -1;
-}
-
-// Returns palette index to use for the background color, or -1 if not found.
-static int iwopt_find_bkgd_color(const struct iw_palette *pal, const struct iw_rgba8color *c)
-{
-	int i;
-	for(i=0;i<pal->num_entries;i++) {
-		if(pal->entry[i].a==0) {
-			// A fully transparent palette color can always be used for the background
-			// (assuming PNG-style background colors).
-			return i;
+	else if(iwopt_palette_opt_ok(ctx,optctx,1)) {
+		;
+	}
+	else if(ctx->opt_grayscale && (ctx->output_profile&IW_PROFILE_GRAY2) && iwopt_palette_is_valid_gray(ctx,optctx,2,&binary_trns,&trns_shade)) {
+		iwopt_make_gray_palette(ctx,optctx,2);
+		if(binary_trns) {
+			optctx->has_colorkey_trns = 1;
+			optctx->colorkey[IW_CHANNELTYPE_RED] = optctx->colorkey[IW_CHANNELTYPE_BLUE] = optctx->colorkey[IW_CHANNELTYPE_GREEN] = trns_shade;
 		}
-		if(pal->entry[i].r==c->r && pal->entry[i].g==c->g &&
-			pal->entry[i].b==c->b)
-		{
-			return i;
+	}
+	else if(iwopt_palette_opt_ok(ctx,optctx,2)) {
+		;
+	}
+	else if(ctx->opt_grayscale && (ctx->output_profile&IW_PROFILE_GRAY4) && iwopt_palette_is_valid_gray(ctx,optctx,4,&binary_trns,&trns_shade)) {
+		iwopt_make_gray_palette(ctx,optctx,4);
+		if(binary_trns) {
+			optctx->has_colorkey_trns = 1;
+			optctx->colorkey[IW_CHANNELTYPE_RED] = optctx->colorkey[IW_CHANNELTYPE_BLUE] = optctx->colorkey[IW_CHANNELTYPE_GREEN] = trns_shade;
 		}
 	}
-	return -1;
+	else if(iwopt_palette_opt_ok(ctx,optctx,4)) {
+		;
+	}
+	else if(ctx->opt_grayscale && (ctx->output_profile&IW_PROFILE_GRAYSCALE) && iwopt_palette_is_valid_gray(ctx,optctx,8,&binary_trns,&trns_shade)) {
+		// This image can best be encoded as 8-bit grayscale. We don't handle that here.
+		goto done;
+	}
+	else if(iwopt_palette_opt_ok(ctx,optctx,8)) {
+		;
+	}
+	else {
+		// Found no optimizations that we can perform.
+		goto done;
+	}
+
+	if(!optctx->palette_is_grayscale) {
+		// Sort the palette
+		qsort((void*)optctx->palette->entry,optctx->palette->num_entries,
+			sizeof(struct iw_rgba8color),iwopt_palsortfunc);
+	}
+
+	optctx->imgtype = IW_IMGTYPE_PALETTE;
+	optctx->bit_depth = 8;
+
+done:
+	if(optctx->imgtype!=IW_IMGTYPE_PALETTE) {
+		iw_free(ctx,optctx->palette);
+		optctx->palette = NULL;
+	}
 }
 
-// Writes to optctx->palette.
-// Returns 1 if a palette can be used.
-static int optctx_collect_palette_colors(struct iw_context *ctx, struct iw_opt_ctx *optctx)
+// Try to convert an alpha channel to binary (color-keyed) transparency.
+// Assumes there is no partial transparency.
+static void iwopt_decide_binary_trns(struct iw_context *ctx, struct iw_opt_ctx *optctx,
+	const struct iw_opt_scan *scan)
 {
-	int x,y;
-	struct iw_rgba8color c;
-	const iw_byte *ptr;
-	int spp;
-	int e;
+	const iw_byte *clr_used;
+	iw_byte key_clr=0;
+	int k;
 
-	spp = iw_imgtype_num_channels(optctx->imgtype);
+	if(!(ctx->output_profile&IW_PROFILE_BINARYTRNS)) return;
+	if(!ctx->opt_binary_trns) return;
 
-	for(y=0;y<optctx->height;y++) {
-		for(x=0;x<optctx->width;x++) {
-			ptr = &optctx->pixelsptr[y*optctx->bpr + x*spp];
+	// Try to find a color that's not used in the image.
+	// Looking for all 2^24 possible colors is too much work.
+	// We will just look for 256 predefined colors: R={0-255},G=192,B=192
+	if(optctx->imgtype==IW_IMGTYPE_RGBA)
+		clr_used = (optctx->bit_depth==16) ? scan->key_used_rgb16 : scan->key_used_rgb8;
+	else
+		clr_used = (optctx->bit_depth==16) ? scan->key_used_gray16 : scan->key_used_gray8;
 
-			if(optctx->imgtype==IW_IMGTYPE_RGB) {
-				c.r = ptr[0];
-				c.g = ptr[1];
-				c.b = ptr[2];
-				c.a = 255;
-			}
-			else if(optctx->imgtype==IW_IMGTYPE_RGBA) {
-				c.r = ptr[0];
-				c.g = ptr[1];
-				c.b = ptr[2];
-				c.a = ptr[3];
-				// TODO: This check is probably no longer necessary.
-				if(c.a==0) { c.r = c.g = c.b = 0; } // all invisible colors are the same
-			}
-			else if(optctx->imgtype==IW_IMGTYPE_GRAYA) {
-				c.r = c.g = c.b = ptr[0];
-				c.a = ptr[1];
-				// TODO: This check is probably no longer necessary.
-				if(c.a==0) { c.r = c.g = c.b = 0; }
-			}
-			else { // optctx->imgtype==IW_IMGTYPE_GRAY(?)
-				c.r = c.g = c.b = ptr[0];
-				c.a = 255;
-			}
+	if(!iwopt_find_unused(clr_used,256,&key_clr)) {
+		return;
+	}
 
-			e = iwopt_find_color(optctx->palette,&c);
-			if(e<0) {
-				// not in palette
-				if(optctx->palette->num_entries<256) {
-					optctx->palette->entry[optctx->palette->num_entries] = c; // struct copy
-					optctx->palette->num_entries++;
-				}
-				else {
-					// Image has more than 256 colors.
-					return 0;
-				}
-			}
+	optctx->has_colorkey_trns = 1;
+	if(optctx->imgtype==IW_IMGTYPE_RGBA) {
+		optctx->imgtype = IW_IMGTYPE_RGB;
+		if(optctx->bit_depth==16) {
+			optctx->colorkey[IW_CHANNELTYPE_RED] = 192*256+key_clr;
+			optctx->colorkey[IW_CHANNELTYPE_GREEN] = 192*256+192;
+			optctx->colorkey[IW_CHANNELTYPE_BLUE] = 192*256+192;
+		}
+		else {
+			optctx->colorkey[IW_CHANNELTYPE_RED] = key_clr;
+			optctx->colorkey[IW_CHANNELTYPE_GREEN] = 192;
+			optctx->colorkey[IW_CHANNELTYPE_BLUE] = 192;
 		}
 	}
-
-	if(optctx->palette->num_entries<1) return 0; // Shouldn't happen.
-
-	if(optctx->has_bkgdlabel) {
-		c.r = optctx->bkgdlabel[0];
-		c.g = optctx->bkgdlabel[1];
-		c.b = optctx->bkgdlabel[2];
-		c.a = 255;
-		e = iwopt_find_bkgd_color(optctx->palette,&c);
-		if(e<0) {
-			// Did not find a suiteable palette entry for the background color.
-			// Is there room to add one?
-			if(optctx->palette->num_entries<256) {
-				// Yes.
-				optctx->palette->entry[optctx->palette->num_entries] = c;
-				optctx->palette->num_entries++;
-			}
-			else {
-				// No.
-				return 0;
-			}
+	else {
+		optctx->imgtype = IW_IMGTYPE_GRAY;
+		for(k=0;k<3;k++) {
+			optctx->colorkey[k] = (optctx->bit_depth==16) ? 192*256+key_clr : key_clr;
 		}
 	}
-
-	return 1;
 }
 
-static void iwopt_convert_to_palette_image(struct iw_context *ctx, struct iw_opt_ctx *optctx)
+// Write the optimized image, based on the decisions that were made.
+// The source image is ctx->img2, which has type src_imgtype.
+// The optimized image is written in place, over the source image. This works
+// because no optimization ever makes a pixel (or a row) larger, so we never
+// overwrite a source sample that we haven't read yet.
+// Returns 0 on failure, in which case the image has not been modified.
+static int iwopt_write_optimized_image(struct iw_context *ctx, struct iw_opt_ctx *optctx,
+	int src_imgtype, int src_bit_depth)
 {
-	iw_byte *newpixels;
+	iw_byte *pixels;
 	size_t newbpr;
-	int x,y;
-	struct iw_rgba8color c;
+	int i,j,k;
+	int src_nc, dst_nc;
+	int src_has_alpha;
 	const iw_byte *ptr;
-	int spp;
+	iw_byte *dstptr;
+	unsigned int v[4]; // R, G, B, A, at the source bit depth
+	int shift; // 8 if reducing 16-bit samples to 8-bit
+	struct iw_rgba8color c;
+	iw_uint32 key;
+	iw_uint32 prev_key = 0;
 	int e;
+	int prev_e = -1;
+	struct iwopt_colorhash *h = NULL;
+	int retval = 0;
+
+	src_nc = iw_imgtype_num_channels(src_imgtype);
+	src_has_alpha = IW_IMGTYPE_HAS_ALPHA(src_imgtype);
+	dst_nc = iw_imgtype_num_channels(optctx->imgtype);
+	shift = (src_bit_depth==16 && optctx->bit_depth==8) ? 8 : 0;
+
+	pixels = ctx->img2.pixels;
+	newbpr = iw_calc_bytesperrow(optctx->width,optctx->bit_depth*dst_nc);
+
+	if(optctx->imgtype==IW_IMGTYPE_PALETTE) {
+		h = iw_malloc(ctx,sizeof(struct iwopt_colorhash));
+		if(!h) goto done;
+		// If the palette has duplicate colors, use the first one.
+		iwopt_colorhash_init(h);
+		for(i=0;i<optctx->palette->num_entries;i++) {
+			iwopt_colorhash_add(h,iwopt_pack_color(&optctx->palette->entry[i]),i);
+		}
+	}
+
+	for(j=0;j<optctx->height;j++) {
+		for(i=0;i<optctx->width;i++) {
+			if(src_bit_depth==16) {
+				ptr = &pixels[j*ctx->img2.bpr + i*src_nc*2];
+				for(k=0;k<src_nc;k++) {
+					v[k] = (((unsigned int)ptr[k*2])<<8) | ptr[k*2+1];
+				}
+			}
+			else {
+				ptr = &pixels[j*ctx->img2.bpr + i*src_nc];
+				for(k=0;k<src_nc;k++) {
+					v[k] = ptr[k];
+				}
+			}
 
-	spp = iw_imgtype_num_channels(optctx->imgtype);
+			// Move alpha to v[3], and expand gray to RGB.
+			if(src_has_alpha) v[3] = v[src_nc-1];
+			else v[3] = 1; // (any nonzero value)
+			if(src_nc<3) v[1] = v[2] = v[0];
 
-	newbpr = optctx->width;
-	newpixels = iw_malloc_large(ctx, newbpr, optctx->height);
-	if(!newpixels) return;
+			// Make all fully transparent pixels "black".
+			if(v[3]==0) v[0] = v[1] = v[2] = 0;
 
-	for(y=0;y<optctx->height;y++) {
-		for(x=0;x<optctx->width;x++) {
-			ptr = &optctx->pixelsptr[y*optctx->bpr + x*spp];
+			if(optctx->imgtype==IW_IMGTYPE_PALETTE) {
+				dstptr = &pixels[j*newbpr + i];
+				if(optctx->has_colorkey_trns && v[3]==0) {
+					// We'll only get here if the image is really grayscale.
+					dstptr[0] = (iw_byte)optctx->colorkey[IW_CHANNELTYPE_RED];
+					continue;
+				}
 
-			if(optctx->imgtype==IW_IMGTYPE_RGB) {
-				c.r = ptr[0];
-				c.g = ptr[1];
-				c.b = ptr[2];
-				c.a = 255;
-			}
-			else if(optctx->imgtype==IW_IMGTYPE_RGBA) {
-				c.r = ptr[0];
-				c.g = ptr[1];
-				c.b = ptr[2];
-				c.a = ptr[3];
-				if(c.a==0) { c.r = c.g = c.b = 0; }
+				c.r = (iw_byte)(v[0]>>shift);
+				c.g = (iw_byte)(v[1]>>shift);
+				c.b = (iw_byte)(v[2]>>shift);
+				c.a = src_has_alpha ? (iw_byte)(v[3]>>shift) : 255;
+				key = iwopt_pack_color(&c);
+				if(prev_e<0 || key!=prev_key) {
+					e = iwopt_colorhash_find(h,key);
+					if(e<0) e=0; // shouldn't happen
+					prev_key = key;
+					prev_e = e;
+				}
+				dstptr[0] = (iw_byte)prev_e;
+				continue;
 			}
-			else if(optctx->imgtype==IW_IMGTYPE_GRAYA) {
-				c.r = c.g = c.b = ptr[0];
-				c.a = ptr[1];
-				if(c.a==0) { c.r = c.g = c.b = 0; }
+
+			if(optctx->has_colorkey_trns && v[3]==0) {
+				// Change the color of transparent pixels to the key color.
+				// (The key color is already at the target bit depth.)
+				for(k=0;k<3;k++) v[k] = optctx->colorkey[k];
 			}
-			else { // optctx->imgtype==IW_IMGTYPE_GRAY(?)
-				c.r = c.g = c.b = ptr[0];
-				c.a = 255;
+			else {
+				for(k=0;k<4;k++) v[k] >>= shift;
 			}
 
-			if(optctx->has_colorkey_trns && c.a==0) {
-				// We'll only get here if the image is really grayscale.
-				e = optctx->colorkey[IW_CHANNELTYPE_RED];
+			// For GRAYA, the alpha sample goes second. Other types need no
+			// rearranging.
+			if(optctx->imgtype==IW_IMGTYPE_GRAYA) v[1] = v[3];
+
+			if(optctx->bit_depth==16) {
+				dstptr = &pixels[j*newbpr + i*dst_nc*2];
+				for(k=0;k<dst_nc;k++) {
+					dstptr[k*2]   = (iw_byte)(v[k]>>8);
+					dstptr[k*2+1] = (iw_byte)(v[k]&0xff);
+				}
 			}
 			else {
-				e = iwopt_find_color(optctx->palette,&c);
-				if(e<0) e=0; // shouldn't happen
+				dstptr = &pixels[j*newbpr + i*dst_nc];
+				for(k=0;k<dst_nc;k++) {
+					dstptr[k] = (iw_byte)v[k];
+				}
 			}
-
-			newpixels[y*newbpr + x] = e;
 		}
 	}
 
-	// Remove previous image if it was allocated by the optimization code.
-	if(optctx->tmp_pixels) iw_free(ctx,optctx->tmp_pixels);
-
-	// Attach our new image
-	optctx->tmp_pixels = newpixels;
-	optctx->pixelsptr = optctx->tmp_pixels;
+	optctx->pixelsptr = pixels;
 	optctx->bpr = newbpr;
-	optctx->bit_depth = 8;
-	optctx->imgtype = IW_IMGTYPE_PALETTE;
-}
-
-static int iwopt_palsortfunc(const void* p1, const void* p2)
-{
-	const struct iw_rgba8color *e1,*e2;
-	int s1,s2;
-
-	e1=(const struct iw_rgba8color*)p1;
-	e2=(const struct iw_rgba8color*)p2;
-
-	// First, sort by whether the color is fully opaque.
-	if(e1->a==255 && e2->a<255) return 1;
-	if(e1->a<255 && e2->a==255) return -1;
-
-	// Then by the approximate brightness.
-	s1=e1->r+e1->g+e1->b;
-	s2=e2->r+e2->g+e2->b;
-	if(s1>s2) return 1;
-	if(s1<s2) return -1;
-
-	// This is to make the order fully deterministic.
-	if(e1->g > e2->g) return 1;
-	if(e1->g < e2->g) return -1;
-	if(e1->r > e2->r) return 1;
-	if(e1->r < e2->r) return -1;
-	if(e1->b > e2->b) return 1;
-	if(e1->b < e2->b) return -1;
-	if(e1->a > e2->a) return 1;
-	if(e1->a < e2->a) return -1;
+	retval = 1;
 
-	return 0; // Should be unreachable.
+done:
+	if(h) iw_free(ctx,h);
+	return retval;
 }
 
-// Figure out if we can do palette optimization at the given bitdepth.
-static int iwopt_palette_opt_ok(struct iw_context *ctx, struct iw_opt_ctx *optctx, int bpp)
+////////////////////
+// Color quantization (IW_VAL_QUANTIZE)
+//
+// Converts an image that has too many colors for a palette, to a palette
+// image with at most ctx->quantize_maxcolors colors. It uses the median cut
+// algorithm on a histogram of colors that have reduced precision, followed
+// by one round of refinement using the actual colors of the pixels.
+// Invisible pixels get a palette entry of their own.
+
+// Histogram precision, in bits per sample.
+#define IWOPT_Q_COLORBITS 5
+#define IWOPT_Q_ALPHABITS 4
+
+struct iwopt_qbin {
+	iw_byte c[4]; // R, G, B, A, at reduced precision.
+	iw_uint32 count;
+};
+
+struct iwopt_qbox {
+	int start, end; // The bins in this box are bins[start] through bins[end-1].
+	int range; // The largest range of values of any channel. 0 if the box can't be split.
+	int channel; // The channel with that range.
+};
+
+struct iwopt_quantctx {
+	int abits; // IWOPT_Q_ALPHABITS, or 0 if all visible pixels are opaque.
+	int src_nc;
+	int src_has_alpha;
+	int src_bit_depth;
+	size_t src_bpr;
+
+	// Indexed by color key (see iwopt_q_key()). First it is the histogram.
+	// Later, it is a cache of the palette entry to use for each key
+	// (entry+1, or 0 if not yet known).
+	iw_uint32 *table;
+	size_t table_size;
+
+	struct iwopt_qbin *bins;
+	int num_bins;
+	iw_uint32 trns_count; // Number of invisible pixels.
+
+	int num_colors;
+	struct iw_rgba8color *pal; // The num_colors colors, before being sorted.
+};
+
+// Read pixel i of the given row, as 8-bit RGBA.
+static void iwopt_q_get_pixel(const struct iwopt_quantctx *q, const iw_byte *row, int i,
+	int *v)
 {
-	if(!ctx->opt_palette) return 0;
-
-	if(optctx->has_transparency && !(ctx->output_profile&IW_PROFILE_PALETTETRNS)) return 0;
+	int k;
+	const iw_byte *ptr;
+	unsigned int s;
 
-	switch(bpp) {
-	case 1:
-		if(!(ctx->output_profile&IW_PROFILE_PAL1)) return 0;
-		if(optctx->palette->num_entries>2) return 0;
-		break;
-	case 2:
-		if(!(ctx->output_profile&IW_PROFILE_PAL2)) return 0;
-		if(optctx->palette->num_entries>4) return 0;
-		break;
-	case 4:
-		if(!(ctx->output_profile&IW_PROFILE_PAL4)) return 0;
-		if(optctx->palette->num_entries>16) return 0;
-		break;
-	case 8:
-		if(!(ctx->output_profile&IW_PROFILE_PAL8)) return 0;
-		if(optctx->palette->num_entries>256) return 0;
-		break;
-	default:
-		return 0;
+	if(q->src_bit_depth==16) {
+		ptr = &row[i*q->src_nc*2];
+		for(k=0;k<q->src_nc;k++) {
+			s = (((unsigned int)ptr[k*2])<<8) | ptr[k*2+1];
+			v[k] = (int)((s*255+32767)/65535);
+		}
+	}
+	else {
+		ptr = &row[i*q->src_nc];
+		for(k=0;k<q->src_nc;k++) {
+			v[k] = ptr[k];
+		}
 	}
 
-	return 1;
+	if(q->src_has_alpha) v[3] = v[q->src_nc-1];
+	else v[3] = 255;
+	if(q->src_nc<3) v[1] = v[2] = v[0];
 }
 
-static int iwopt_palette_is_valid_gray(struct iw_context *ctx, struct iw_opt_ctx *optctx, int bpp,
-	int *pbinary_trns, unsigned int *ptrns_shade)
+// Reduce an 8-bit alpha value to the histogram's alpha precision.
+// Fully opaque gets a level of its own.
+static int iwopt_q_alpha_code(int a)
 {
-	int factor;
-	int i;
-	int max_entries;
-	iw_byte clr_used[256];
-	iw_byte key_clr=0;
+	if(a>=255) return (1<<IWOPT_Q_ALPHABITS)-1;
+	a >>= (8-IWOPT_Q_ALPHABITS);
+	if(a>(1<<IWOPT_Q_ALPHABITS)-2) a = (1<<IWOPT_Q_ALPHABITS)-2;
+	return a;
+}
 
-	*pbinary_trns = 0;
-	*ptrns_shade = 0;
+static size_t iwopt_q_key(const struct iwopt_quantctx *q, const int *v)
+{
+	size_t key;
+	key = (((size_t)v[0])>>(8-IWOPT_Q_COLORBITS)) << (2*IWOPT_Q_COLORBITS);
+	key |= (((size_t)v[1])>>(8-IWOPT_Q_COLORBITS)) << IWOPT_Q_COLORBITS;
+	key |= ((size_t)v[2])>>(8-IWOPT_Q_COLORBITS);
+	if(q->abits) {
+		key = (key<<q->abits) | (size_t)iwopt_q_alpha_code(v[3]);
+	}
+	return key;
+}
 
-	if(optctx->has_color) return 0;
-	if(optctx->has_partial_transparency) return 0;
-	if(optctx->has_transparency && !ctx->opt_binary_trns) return 0;
-	if(optctx->has_transparency && !(ctx->output_profile&IW_PROFILE_BINARYTRNS)) return 0;
+// The color that best represents a histogram bin, as 8-bit RGBA.
+static void iwopt_q_bin_color(const struct iwopt_quantctx *q, const iw_byte *c, int *v)
+{
+	int k;
 
-	switch(bpp) {
-	case 1: factor=255; max_entries=2; break;
-	case 2: factor=85; max_entries=4; break;
-	case 4: factor=17; max_entries=16; break;
-	case 8: factor=1; max_entries=256; break;
-	default: return 0;
+	for(k=0;k<3;k++) {
+		v[k] = (c[k]<<(8-IWOPT_Q_COLORBITS)) | (1<<(7-IWOPT_Q_COLORBITS));
 	}
+	if(!q->abits || c[3]==(1<<IWOPT_Q_ALPHABITS)-1)
+		v[3] = 255;
+	else
+		v[3] = (c[3]<<(8-IWOPT_Q_ALPHABITS)) | (1<<(7-IWOPT_Q_ALPHABITS));
+}
 
-	if(optctx->palette->num_entries > max_entries)
-		return 0;
-
-	// If there is a background color label, it must be one of the available gray shades.
-	if(optctx->has_bkgdlabel && bpp<8) {
-		// We already know the bkgd label is gray (because has_color is false), so we
-		// only have to look at one of the components.
-		if(optctx->bkgdlabel[0] % factor != 0) {
-			return 0;
-		}
-	}
+// The inverse of iwopt_q_key().
+static void iwopt_q_key_to_bin(const struct iwopt_quantctx *q, size_t key, iw_byte *c)
+{
+	c[3] = (iw_byte)(key & ((1<<q->abits)-1));
+	key >>= q->abits;
+	c[2] = (iw_byte)(key & ((1<<IWOPT_Q_COLORBITS)-1));
+	key >>= IWOPT_Q_COLORBITS;
+	c[1] = (iw_byte)(key & ((1<<IWOPT_Q_COLORBITS)-1));
+	key >>= IWOPT_Q_COLORBITS;
+	c[0] = (iw_byte)(key & ((1<<IWOPT_Q_COLORBITS)-1));
+}
 
-	iw_zeromem(clr_used,256);
+// Count the colors. Returns 0 on failure.
+static int iwopt_q_make_histogram(struct iw_context *ctx, struct iw_opt_ctx *optctx,
+	struct iwopt_quantctx *q)
+{
+	int i,j,k;
+	int v[4];
+	const iw_byte *row;
+	size_t key;
 
-	for(i=0;i<optctx->palette->num_entries;i++) {
-		if(optctx->palette->entry[i].a>0) { // Look at all the nontransparent entries.
-			if(optctx->palette->entry[i].r % factor) return 0;
+	q->table_size = ((size_t)1)<<(3*IWOPT_Q_COLORBITS+q->abits);
+	q->table = iw_mallocz(ctx, q->table_size*sizeof(iw_uint32));
+	if(!q->table) return 0;
 
-			// Keep track of which shades were used.
-			clr_used[optctx->palette->entry[i].r / factor] = 1;
+	for(j=0;j<optctx->height;j++) {
+		row = &ctx->img2.pixels[j*q->src_bpr];
+		for(i=0;i<optctx->width;i++) {
+			iwopt_q_get_pixel(q,row,i,v);
+			if(v[3]==0) {
+				q->trns_count++;
+				continue;
+			}
+			q->table[iwopt_q_key(q,v)]++;
 		}
 	}
 
-	// In order for binary transparency to be usable, there must be at least
-	// one unused gray shade.
-	if(optctx->has_transparency) {
-		if(!iwopt_find_unused(clr_used,max_entries,&key_clr))
-			return 0;
-
-		*pbinary_trns = 1;
-		*ptrns_shade = (unsigned int)key_clr;
+	// Make a list of the bins that are in use.
+	for(key=0;key<q->table_size;key++) {
+		if(q->table[key]) q->num_bins++;
 	}
+	if(q->num_bins<1) return 1;
 
+	q->bins = iw_malloc(ctx, q->num_bins*sizeof(struct iwopt_qbin));
+	if(!q->bins) return 0;
+
+	k = 0;
+	for(key=0;key<q->table_size;key++) {
+		if(!q->table[key]) continue;
+		q->bins[k].count = q->table[key];
+		iwopt_q_key_to_bin(q,key,q->bins[k].c);
+		k++;
+	}
 	return 1;
 }
 
-static void iwopt_make_gray_palette(struct iw_context *ctx, struct iw_opt_ctx *optctx, int bpp)
+// Find the channel with the largest range of values in the box, and set
+// box->range (in 8-bit units) and box->channel.
+static void iwopt_q_set_box_range(const struct iwopt_quantctx *q, struct iwopt_qbox *box)
 {
-	int factor;
-	int i;
+	int i, k;
+	int vmin[4], vmax[4];
+	int range;
 
-	switch(bpp) {
-	case 1: factor=255; optctx->palette->num_entries=2; break;
-	case 2: factor=85; optctx->palette->num_entries=4; break;
-	case 4: factor=17; optctx->palette->num_entries=16; break;
-	default: factor=1; optctx->palette->num_entries=256; break;
+	box->range = 0;
+	box->channel = 0;
+	if(box->end - box->start < 2) return;
+
+	for(k=0;k<4;k++) {
+		vmin[k] = 255;
+		vmax[k] = 0;
+	}
+	for(i=box->start;i<box->end;i++) {
+		for(k=0;k<4;k++) {
+			if(q->bins[i].c[k]<vmin[k]) vmin[k] = q->bins[i].c[k];
+			if(q->bins[i].c[k]>vmax[k]) vmax[k] = q->bins[i].c[k];
+		}
 	}
 
-	for(i=0;i<optctx->palette->num_entries;i++) {
-		optctx->palette->entry[i].r = optctx->palette->entry[i].g =
-			optctx->palette->entry[i].b = factor*i;
-		optctx->palette->entry[i].a = 255;
+	for(k=0;k<4;k++) {
+		if(k<3) range = (vmax[k]-vmin[k])<<(8-IWOPT_Q_COLORBITS);
+		else if(q->abits) range = (vmax[k]-vmin[k])<<(8-IWOPT_Q_ALPHABITS);
+		else range = 0;
+		if(range>box->range) {
+			box->range = range;
+			box->channel = k;
+		}
+	}
+}
+
+// Split the box at the median (by number of pixels) of its widest channel.
+// The second half is moved to newbox.
+static void iwopt_q_split_box(struct iwopt_quantctx *q, struct iwopt_qbox *box,
+	struct iwopt_qbox *newbox)
+{
+	int channel = box->channel;
+	iw_uint32 hist[256];
+	iw_uint32 total, sum;
+	int i, j;
+	int vmin = 255, vmax = 0;
+	int split; // Bins with values less than this go in the first box.
+	struct iwopt_qbin tmpbin;
+
+	iw_zeromem(hist,sizeof(hist));
+	total = 0;
+	for(i=box->start;i<box->end;i++) {
+		hist[q->bins[i].c[channel]] += q->bins[i].count;
+		total += q->bins[i].count;
+		if(q->bins[i].c[channel]<vmin) vmin = q->bins[i].c[channel];
+		if(q->bins[i].c[channel]>vmax) vmax = q->bins[i].c[channel];
+	}
+
+	// Both boxes must contain at least one value, so the split point is
+	// somewhere in vmin+1 ... vmax.
+	sum = hist[vmin];
+	split = vmin+1;
+	while(split<vmax && sum + hist[split]/2 < total/2) {
+		sum += hist[split];
+		split++;
+	}
+
+	// Partition the bins.
+	i = box->start;
+	j = box->end-1;
+	while(i<=j) {
+		if(q->bins[i].c[channel]<split) {
+			i++;
+		}
+		else {
+			tmpbin = q->bins[i];
+			q->bins[i] = q->bins[j];
+			q->bins[j] = tmpbin;
+			j--;
+		}
 	}
 
-	optctx->palette_is_grayscale=1;
+	newbox->start = i;
+	newbox->end = box->end;
+	box->end = i;
+	iwopt_q_set_box_range(q,box);
+	iwopt_q_set_box_range(q,newbox);
 }
 
-// Optimize to palette, or 1-, 2-, or 4-bpp grayscale.
-static void iwopt_try_pal_lowgray_optimization(struct iw_context *ctx, struct iw_opt_ctx *optctx)
+// Run the median cut algorithm, and set q->pal to the average color of each box.
+// Returns 0 on failure.
+static int iwopt_q_median_cut(struct iw_context *ctx, struct iwopt_quantctx *q, int maxcolors)
 {
-	int ret;
-	int binary_trns;
-	unsigned int trns_shade;
+	struct iwopt_qbox *boxes;
+	int num_boxes;
+	int i, j, k;
+	int best_box;
+	int v[4];
+	double sum[4];
+	double count;
+
+	boxes = iw_malloc(ctx, maxcolors*sizeof(struct iwopt_qbox));
+	if(!boxes) return 0;
+
+	boxes[0].start = 0;
+	boxes[0].end = q->num_bins;
+	iwopt_q_set_box_range(q,&boxes[0]);
+	num_boxes = 1;
+
+	while(num_boxes<maxcolors) {
+		// Split the box with the largest range of values.
+		best_box = 0;
+		for(i=1;i<num_boxes;i++) {
+			if(boxes[i].range>boxes[best_box].range) best_box = i;
+		}
+		if(boxes[best_box].range==0) break; // No box can be split.
 
-	if(!(ctx->output_profile&IW_PROFILE_PAL1) &&
-	   !(ctx->output_profile&IW_PROFILE_PAL2) &&
-	   !(ctx->output_profile&IW_PROFILE_PAL4) &&
-	   !(ctx->output_profile&IW_PROFILE_PAL8) &&
-	   !(ctx->output_profile&IW_PROFILE_GRAY1) &&
-	   !(ctx->output_profile&IW_PROFILE_GRAY2) &&
-	   !(ctx->output_profile&IW_PROFILE_GRAY4) )
-	{
-		// Output format doesn't support anything that this optimization can provide.
-		return;
+		iwopt_q_split_box(q,&boxes[best_box],&boxes[num_boxes]);
+		num_boxes++;
 	}
 
-	if(optctx->bit_depth!=8) {
-		// Palettes aren't supported with bitdepth>8.
-		return;
+	q->pal = iw_malloc(ctx, num_boxes*sizeof(struct iw_rgba8color));
+	if(!q->pal) {
+		iw_free(ctx,boxes);
+		return 0;
 	}
+	q->num_colors = num_boxes;
 
-	optctx->palette = iw_malloc(ctx,sizeof(struct iw_palette));
-	if(!optctx->palette) return;
+	for(i=0;i<num_boxes;i++) {
+		for(k=0;k<4;k++) sum[k] = 0.0;
+		count = 0.0;
+		for(j=boxes[i].start;j<boxes[i].end;j++) {
+			iwopt_q_bin_color(q,q->bins[j].c,v);
+			for(k=0;k<4;k++) sum[k] += (double)v[k] * (double)q->bins[j].count;
+			count += (double)q->bins[j].count;
+		}
+		q->pal[i].r = (iw_byte)(0.5+sum[0]/count);
+		q->pal[i].g = (iw_byte)(0.5+sum[1]/count);
+		q->pal[i].b = (iw_byte)(0.5+sum[2]/count);
+		q->pal[i].a = (iw_byte)(0.5+sum[3]/count);
+	}
 
-	optctx->palette->num_entries=0;
+	iw_free(ctx,boxes);
+	return 1;
+}
 
-	ret = optctx_collect_palette_colors(ctx,optctx);
-	if(!ret) {
-		// Image can't be converted to a palette image.
-		goto done;
+// Find the visible palette entry nearest to the color v.
+static int iwopt_q_nearest(const struct iw_rgba8color *pal, int num_entries, const int *v)
+{
+	int i;
+	int d, dr, dg, db, da;
+	int best_d = -1;
+	int best = 0;
+
+	for(i=0;i<num_entries;i++) {
+		if(pal[i].a==0) continue; // Reserved for invisible pixels
+		dr = v[0]-pal[i].r;
+		dg = v[1]-pal[i].g;
+		db = v[2]-pal[i].b;
+		da = v[3]-pal[i].a;
+		d = dr*dr + dg*dg + db*db + da*da;
+		if(best_d<0 || d<best_d) {
+			best_d = d;
+			best = i;
+		}
 	}
+	return best;
+}
 
-	// optctx->palette now contains a palette that can be used.
+// Returns the palette entry to use for a visible color.
+// All colors in the same histogram bin use the same entry, the one nearest
+// to the bin's color.
+static int iwopt_q_lookup(struct iwopt_quantctx *q, const struct iw_rgba8color *pal,
+	int num_entries, const int *v)
+{
+	size_t key;
+	iw_byte c[4];
+	int bv[4];
 
-	// For images that have at most 256 (8-bit-compatible) colors, the order
-	// of preference is gray1, pal1, gray2, pal2, gray4, pal4, gray8, pal8.
+	key = iwopt_q_key(q,v);
+	if(!q->table[key]) {
+		iwopt_q_key_to_bin(q,key,c);
+		iwopt_q_bin_color(q,c,bv);
+		q->table[key] = (iw_uint32)iwopt_q_nearest(pal,num_entries,bv) + 1;
+	}
+	return (int)q->table[key]-1;
+}
 
-	if(ctx->opt_grayscale && (ctx->output_profile&IW_PROFILE_GRAY1) && iwopt_palette_is_valid_gray(ctx,optctx,1,&binary_trns,&trns_shade)) {
-		// Replace the palette with a fully-populated grayscale palette.
-		// The palette might already be correct, but it might not be.
-		// It will be missing any gray shade that wasn't in the image.
-		iwopt_make_gray_palette(ctx,optctx,1);
-		if(binary_trns) {
-			optctx->has_colorkey_trns = 1;
-			optctx->colorkey[IW_CHANNELTYPE_RED] = optctx->colorkey[IW_CHANNELTYPE_BLUE] = optctx->colorkey[IW_CHANNELTYPE_GREEN] = trns_shade;
+// Improve the palette colors, by changing each one to the average of the
+// actual colors of the pixels that would use it.
+static void iwopt_q_refine_palette(struct iw_context *ctx, struct iw_opt_ctx *optctx,
+	struct iwopt_quantctx *q, double *sums)
+{
+	int i,j,k;
+	int e;
+	int v[4];
+	const iw_byte *row;
+	double *s;
+
+	iw_zeromem(q->table, q->table_size*sizeof(iw_uint32));
+	iw_zeromem(sums, q->num_colors*5*sizeof(double));
+
+	for(j=0;j<optctx->height;j++) {
+		row = &ctx->img2.pixels[j*q->src_bpr];
+		for(i=0;i<optctx->width;i++) {
+			iwopt_q_get_pixel(q,row,i,v);
+			if(v[3]==0) continue;
+			e = iwopt_q_lookup(q,q->pal,q->num_colors,v);
+			s = &sums[e*5];
+			for(k=0;k<4;k++) s[k] += (double)v[k];
+			s[4] += 1.0;
 		}
 	}
-	else if(iwopt_palette_opt_ok(ctx,optctx,1)) {
-		;
-	}
-	else if(ctx->opt_grayscale && (ctx->output_profile&IW_PROFILE_GRAY2) && iwopt_palette_is_valid_gray(ctx,optctx,2,&binary_trns,&trns_shade)) {
-		iwopt_make_gray_palette(ctx,optctx,2);
-		if(binary_trns) {
-			optctx->has_colorkey_trns = 1;
-			optctx->colorkey[IW_CHANNELTYPE_RED] = optctx->colorkey[IW_CHANNELTYPE_BLUE] = optctx->colorkey[IW_CHANNELTYPE_GREEN] = trns_shade;
-		}
+
+	for(e=0;e<q->num_colors;e++) {
+		s = &sums[e*5];
+		if(s[4]==0.0) continue; // Unused. Keep the old color.
+		q->pal[e].r = (iw_byte)(0.5+s[0]/s[4]);
+		q->pal[e].g = (iw_byte)(0.5+s[1]/s[4]);
+		q->pal[e].b = (iw_byte)(0.5+s[2]/s[4]);
+		q->pal[e].a = (iw_byte)(0.5+s[3]/s[4]);
 	}
-	else if(iwopt_palette_opt_ok(ctx,optctx,2)) {
-		;
+}
+
+// Write the palette image, in place.
+// If errbuf is not NULL, use Floyd-Steinberg error diffusion. It must have
+// room for 2*4*(width+2) ints.
+static void iwopt_q_write_image(struct iw_context *ctx, struct iw_opt_ctx *optctx,
+	struct iwopt_quantctx *q, int trns_entry, int *errbuf)
+{
+	int i,j,k;
+	int e;
+	int v[4];
+	int err;
+	const iw_byte *row;
+	iw_byte *dstrow;
+	int *err_cur = NULL; // Errors to add to this row, times 16
+	int *err_next = NULL; // Errors to add to the next row, times 16
+	int *tmp;
+	const struct iw_palette *pal = optctx->palette;
+
+	iw_zeromem(q->table, q->table_size*sizeof(iw_uint32));
+	if(errbuf) {
+		iw_zeromem(errbuf, 2*4*(optctx->width+2)*sizeof(int));
+		// Index -1 and width are valid, to simplify the edge cases.
+		err_cur = &errbuf[4];
+		err_next = &errbuf[4*(optctx->width+2)+4];
 	}
-	else if(ctx->opt_grayscale && (ctx->output_profile&IW_PROFILE_GRAY4) && iwopt_palette_is_valid_gray(ctx,optctx,4,&binary_trns,&trns_shade)) {
-		iwopt_make_gray_palette(ctx,optctx,4);
-		if(binary_trns) {
-			optctx->has_colorkey_trns = 1;
-			optctx->colorkey[IW_CHANNELTYPE_RED] = optctx->colorkey[IW_CHANNELTYPE_BLUE] = optctx->colorkey[IW_CHANNELTYPE_GREEN] = trns_shade;
+
+	for(j=0;j<optctx->height;j++) {
+		row = &ctx->img2.pixels[j*q->src_bpr];
+		// The destination row never overlaps pixels we haven't read yet.
+		dstrow = &ctx->img2.pixels[j*optctx->width];
+		for(i=0;i<optctx->width;i++) {
+			iwopt_q_get_pixel(q,row,i,v);
+			if(v[3]==0) {
+				dstrow[i] = (iw_byte)trns_entry;
+				continue;
+			}
+
+			if(!errbuf) {
+				dstrow[i] = (iw_byte)iwopt_q_lookup(q,pal->entry,pal->num_entries,v);
+				continue;
+			}
+
+			for(k=0;k<4;k++) {
+				if(k==3 && !q->abits) break;
+				v[k] += (err_cur[i*4+k]>=0) ? (err_cur[i*4+k]+8)/16 : -((8-err_cur[i*4+k])/16);
+				if(v[k]<0) v[k]=0;
+				if(v[k]>255) v[k]=255;
+			}
+			if(v[3]==0) v[3]=1; // Don't let it become invisible.
+
+			e = iwopt_q_lookup(q,pal->entry,pal->num_entries,v);
+			dstrow[i] = (iw_byte)e;
+
+			for(k=0;k<4;k++) {
+				switch(k) {
+				case 0: err = v[k] - pal->entry[e].r; break;
+				case 1: err = v[k] - pal->entry[e].g; break;
+				case 2: err = v[k] - pal->entry[e].b; break;
+				default: err = q->abits ? v[k] - pal->entry[e].a : 0;
+				}
+				err_cur[(i+1)*4+k] += err*7;
+				err_next[(i-1)*4+k] += err*3;
+				err_next[i*4+k] += err*5;
+				err_next[(i+1)*4+k] += err;
+			}
+		}
+
+		if(errbuf) {
+			tmp = err_cur;
+			err_cur = err_next;
+			err_next = tmp;
+			iw_zeromem(&err_next[-4], 4*(optctx->width+2)*sizeof(int));
 		}
 	}
-	else if(iwopt_palette_opt_ok(ctx,optctx,4)) {
-		;
+}
+
+// Reduce the image to a palette image, if possible.
+// On success, returns 1 and sets optctx's image information. On failure,
+// returns 0, and does not change anything.
+static int iwopt_quantize_image(struct iw_context *ctx, struct iw_opt_ctx *optctx,
+	int src_imgtype, int src_bit_depth)
+{
+	struct iwopt_quantctx q;
+	int maxcolors;
+	int trns_entry = -1;
+	int i,k;
+	double *sums = NULL;
+	int *errbuf = NULL;
+	int retval = 0;
+
+	if(!ctx->opt_palette) return 0;
+	if(!(ctx->output_profile&IW_PROFILE_PAL8)) return 0;
+	if(optctx->has_transparency && !(ctx->output_profile&IW_PROFILE_PALETTETRNS)) return 0;
+
+	iw_zeromem(&q,sizeof(struct iwopt_quantctx));
+	q.src_nc = iw_imgtype_num_channels(src_imgtype);
+	q.src_has_alpha = IW_IMGTYPE_HAS_ALPHA(src_imgtype);
+	q.src_bit_depth = src_bit_depth;
+	q.src_bpr = ctx->img2.bpr;
+	q.abits = optctx->has_partial_transparency ? IWOPT_Q_ALPHABITS : 0;
+
+	if(!iwopt_q_make_histogram(ctx,optctx,&q)) goto done;
+
+	// Leave room in the palette for invisible pixels, and the background
+	// color label. (The invisible color can also be used for the background
+	// label.)
+	maxcolors = ctx->quantize_maxcolors;
+	if(maxcolors>256) maxcolors=256;
+	if(q.trns_count) maxcolors--;
+	else if(optctx->has_bkgdlabel) maxcolors--;
+	if(maxcolors<1 || q.num_bins<1) goto done;
+
+	if(!iwopt_q_median_cut(ctx,&q,maxcolors)) goto done;
+
+	sums = iw_malloc(ctx, q.num_colors*5*sizeof(double));
+	if(!sums) goto done;
+	iwopt_q_refine_palette(ctx,optctx,&q,sums);
+
+	if(ctx->quantize_dither) {
+		errbuf = iw_malloc(ctx, 2*4*(optctx->width+2)*sizeof(int));
+		if(!errbuf) goto done;
 	}
-	else if(ctx->opt_grayscale && (ctx->output_profile&IW_PROFILE_GRAYSCALE) && iwopt_palette_is_valid_gray(ctx,optctx,8,&binary_trns,&trns_shade)) {
-		// This image can best be encoded as 8-bit grayscale. We don't handle that here.
-		goto done;
+
+	optctx->palette = iw_malloc(ctx,sizeof(struct iw_palette));
+	if(!optctx->palette) goto done;
+	for(i=0;i<q.num_colors;i++) {
+		optctx->palette->entry[i] = q.pal[i];
 	}
-	else if(iwopt_palette_opt_ok(ctx,optctx,8)) {
-		;
+	optctx->palette->num_entries = q.num_colors;
+	if(q.trns_count) {
+		iw_zeromem(&optctx->palette->entry[optctx->palette->num_entries],sizeof(struct iw_rgba8color));
+		optctx->palette->num_entries++;
 	}
-	else {
-		// Found no optimizations that we can perform.
-		goto done;
+
+	// From here on, this function can't fail.
+
+	if(optctx->has_bkgdlabel) {
+		if(optctx->bit_depth==16) {
+			for(k=0;k<4;k++) {
+				optctx->bkgdlabel[k] = (optctx->bkgdlabel[k]*255+32767)/65535;
+			}
+		}
+		iwopt_add_bkgd_to_palette(ctx,optctx);
 	}
 
-	if(!optctx->palette_is_grayscale) {
-		// Sort the palette
-		qsort((void*)optctx->palette->entry,optctx->palette->num_entries,
-			sizeof(struct iw_rgba8color),iwopt_palsortfunc);
+	qsort((void*)optctx->palette->entry,optctx->palette->num_entries,
+		sizeof(struct iw_rgba8color),iwopt_palsortfunc);
+	if(q.trns_count) {
+		// Invisible pixels use the (only) invisible palette entry.
+		for(i=0;i<optctx->palette->num_entries;i++) {
+			if(optctx->palette->entry[i].a==0) trns_entry = i;
+		}
 	}
 
-	iwopt_convert_to_palette_image(ctx,optctx);
+	iwopt_q_write_image(ctx,optctx,&q,trns_entry,errbuf);
+
+	optctx->imgtype = IW_IMGTYPE_PALETTE;
+	optctx->bit_depth = 8;
+	optctx->pixelsptr = ctx->img2.pixels;
+	optctx->bpr = iw_calc_bytesperrow(optctx->width,8);
+	retval = 1;
 
 done:
-	if(optctx->imgtype!=IW_IMGTYPE_PALETTE) {
-		iw_free(ctx,optctx->palette);
-		optctx->palette = NULL;
-	}
+	if(q.table) iw_free(ctx,q.table);
+	if(q.bins) iw_free(ctx,q.bins);
+	if(q.pal) iw_free(ctx,q.pal);
+	if(sums) iw_free(ctx,sums);
+	if(errbuf) iw_free(ctx,errbuf);
+	return retval;
 }
 
 ////////////////////
@@ -1166,6 +1440,9 @@ static void make_transparent_pixels_black(struct iw_context *ctx, struct iw_imag
 void iwpvt_optimize_image(struct iw_context *ctx)
 {
 	struct iw_opt_ctx *optctx;
+	struct iw_opt_scan *scan;
+	int src_imgtype, src_bit_depth;
+	unsigned int orig_bkgdlabel[4];
 	int k;
 
 	optctx = &ctx->optctx;
@@ -1197,7 +1474,9 @@ void iwpvt_optimize_image(struct iw_context *ctx)
 		return;
 	}
 
-	make_transparent_pixels_black(ctx,&ctx->img2);
+	if(optctx->bit_depth!=8 && optctx->bit_depth!=16) {
+		return;
+	}
 
 	if(optctx->has_bkgdlabel) {
 		// The optimization routines are responsible for ensuring that the
@@ -1230,85 +1509,135 @@ void iwpvt_optimize_image(struct iw_context *ctx)
 		}
 	}
 
-	if(!iw_opt_scanpixels(ctx,optctx)) {
-		goto noscan;
+	if(!optctx->scan) {
+		optctx->scan = iwopt_create_scan(ctx,optctx);
+		if(!optctx->scan) {
+			make_transparent_pixels_black(ctx,&ctx->img2);
+			return;
+		}
 	}
+	scan = optctx->scan;
 
-	if(optctx->imgtype==IW_IMGTYPE_RGBA && optctx->bit_depth==16 && !optctx->has_16bit_precision) {
-		iw_opt_16_to_8(ctx,optctx,4);
-	}
+	// If iwpvt_opt_scan_row() was called for every row while the image was
+	// being generated, there's probably nothing left to do here.
+	iwopt_scan_image(optctx,scan);
 
-	if(optctx->imgtype==IW_IMGTYPE_RGB && optctx->bit_depth==16 && !optctx->has_16bit_precision) {
-		iw_opt_16_to_8(ctx,optctx,3);
+	// Everything from here on only changes optctx's description of the image.
+	// The pixels are written at the end.
+	src_imgtype = optctx->imgtype;
+	src_bit_depth = optctx->bit_depth;
+	for(k=0;k<4;k++) {
+		orig_bkgdlabel[k] = optctx->bkgdlabel[k];
 	}
 
-	if(optctx->imgtype==IW_IMGTYPE_GRAYA && optctx->bit_depth==16 && !optctx->has_16bit_precision) {
-		iw_opt_16_to_8(ctx,optctx,2);
+	if(optctx->bit_depth==16 && !optctx->has_16bit_precision && ctx->opt_16_to_8) {
+		optctx->bit_depth = 8;
+		// If there's a background color label, also reduce its precision.
+		if(optctx->has_bkgdlabel) {
+			for(k=0;k<4;k++) {
+				optctx->bkgdlabel[k] >>= 8;
+			}
+		}
 	}
 
-	if(optctx->imgtype==IW_IMGTYPE_GRAY && optctx->bit_depth==16 && !optctx->has_16bit_precision) {
-		iw_opt_16_to_8(ctx,optctx,1);
+	if(!optctx->has_transparency && ctx->opt_strip_alpha) {
+		if(optctx->imgtype==IW_IMGTYPE_RGBA)
+			optctx->imgtype = IW_IMGTYPE_RGB; // RGBA -> RGB
+		else if(optctx->imgtype==IW_IMGTYPE_GRAYA)
+			optctx->imgtype = IW_IMGTYPE_GRAY; // GA -> G
 	}
 
-	if(optctx->imgtype==IW_IMGTYPE_RGBA && optctx->bit_depth==8 && !optctx->has_transparency && ctx->opt_strip_alpha) {
-		iw_opt_copychannels_8(ctx,optctx,IW_IMGTYPE_RGB,0,1,2); // RGBA -> RGB
+	if(!optctx->has_color && (ctx->output_profile&IW_PROFILE_GRAYSCALE) && ctx->opt_grayscale) {
+		if(optctx->imgtype==IW_IMGTYPE_RGB)
+			optctx->imgtype = IW_IMGTYPE_GRAY; // RGB -> G
+		else if(optctx->imgtype==IW_IMGTYPE_RGBA)
+			optctx->imgtype = IW_IMGTYPE_GRAYA; // RGBA -> GA
 	}
 
-	if(optctx->imgtype==IW_IMGTYPE_RGBA && optctx->bit_depth==16 && !optctx->has_transparency && ctx->opt_strip_alpha) {
-		iw_opt_copychannels_16(ctx,optctx,IW_IMGTYPE_RGB,0,1,2); // RGBA -> RGB (16)
-	}
+	iwopt_try_pal_lowgray_optimization(ctx,optctx,scan);
 
-	if(optctx->imgtype==IW_IMGTYPE_GRAYA && optctx->bit_depth==16 && !optctx->has_transparency && ctx->opt_strip_alpha) {
-		iw_opt_copychannels_16(ctx,optctx,IW_IMGTYPE_GRAY,0, 0,0); // GA -> G (16)
+	// If the image has too many colors for a palette (or we don't know how
+	// many it has), and color quantization was requested, try that.
+	if(ctx->quantize_maxcolors>0 && optctx->imgtype!=IW_IMGTYPE_PALETTE &&
+		!(scan->collect_colors && !scan->too_many_colors && !optctx->has_16bit_precision))
+	{
+		if(iwopt_quantize_image(ctx,optctx,src_imgtype,src_bit_depth)) {
+			goto done;
+		}
 	}
 
-	if(optctx->imgtype==IW_IMGTYPE_GRAYA && optctx->bit_depth==8 && !optctx->has_transparency && ctx->opt_strip_alpha) {
-		iw_opt_copychannels_8(ctx,optctx,IW_IMGTYPE_GRAY,0, 0,0); // GA -> G
+	// Try to convert an alpha channel to binary transparency.
+	if(IW_IMGTYPE_HAS_ALPHA(optctx->imgtype) && !optctx->has_partial_transparency) {
+		iwopt_decide_binary_trns(ctx,optctx,scan);
 	}
 
-	if(optctx->imgtype==IW_IMGTYPE_RGB && optctx->bit_depth==8 && !optctx->has_color &&
-	   (ctx->output_profile&IW_PROFILE_GRAYSCALE) && ctx->opt_grayscale)
-	{
-		iw_opt_copychannels_8(ctx,optctx,IW_IMGTYPE_GRAY,0, 0,0); // RGB -> G
+	if(optctx->imgtype==src_imgtype && optctx->bit_depth==src_bit_depth) {
+		// The image doesn't need to be rewritten.
+		if(optctx->has_transparency) {
+			make_transparent_pixels_black(ctx,&ctx->img2);
+		}
 	}
-
-	if(optctx->imgtype==IW_IMGTYPE_RGB && optctx->bit_depth==16 && !optctx->has_color &&
-	   (ctx->output_profile&IW_PROFILE_GRAYSCALE) && ctx->opt_grayscale)
-	{
-		iw_opt_copychannels_16(ctx,optctx,IW_IMGTYPE_GRAY,0, 0,0); // RGB -> G (16)
+	else if(!iwopt_write_optimized_image(ctx,optctx,src_imgtype,src_bit_depth)) {
+		// Probably out of memory. Leave the image unoptimized.
+		optctx->imgtype = src_imgtype;
+		optctx->bit_depth = src_bit_depth;
+		for(k=0;k<4;k++) {
+			optctx->bkgdlabel[k] = orig_bkgdlabel[k];
+		}
+		optctx->has_colorkey_trns = 0;
+		optctx->palette_is_grayscale = 0;
+		if(optctx->palette) {
+			iw_free(ctx,optctx->palette);
+			optctx->palette = NULL;
+		}
+		make_transparent_pixels_black(ctx,&ctx->img2);
 	}
 
-	if(optctx->imgtype==IW_IMGTYPE_RGBA && optctx->bit_depth==8 && !optctx->has_color &&
-	   (ctx->output_profile&IW_PROFILE_GRAYSCALE) && ctx->opt_grayscale)
-	{
-		iw_opt_copychannels_8(ctx,optctx,IW_IMGTYPE_GRAYA,0,3, 0); // RGBA -> GA
-	}
+done:
+	iwpvt_opt_free_scan(ctx);
+}
 
-	if(optctx->imgtype==IW_IMGTYPE_RGBA && optctx->bit_depth==16 && !optctx->has_color &&
-	   (ctx->output_profile&IW_PROFILE_GRAYSCALE) && ctx->opt_grayscale)
-	{
-		iw_opt_copychannels_16(ctx,optctx,IW_IMGTYPE_GRAYA,0,3, 0); // RGBA -> GA (16)
-	}
+// Prepare to collect the information needed by the optimizer while the
+// output image is being generated, one row at a time (see
+// iwpvt_opt_scan_row()), so that iwpvt_optimize_image() doesn't have to read
+// the whole image again.
+// The image must not be modified after its rows have been scanned.
+void iwpvt_opt_scan_begin(struct iw_context *ctx)
+{
+	struct iw_opt_ctx *optctx = &ctx->optctx;
 
-noscan:
+	if(optctx->scan) return;
+	if(ctx->img2.sampletype!=IW_SAMPLETYPE_UINT) return;
+	if(ctx->reduced_output_maxcolor_flag) return;
+	if(ctx->img2.bit_depth!=8 && ctx->img2.bit_depth!=16) return;
 
-	iwopt_try_pal_lowgray_optimization(ctx,optctx);
+	optctx->width = ctx->img2.width;
+	optctx->height = ctx->img2.height;
+	optctx->imgtype = ctx->img2.imgtype;
+	optctx->bit_depth = ctx->img2.bit_depth;
+	optctx->bpr = ctx->img2.bpr;
+	optctx->pixelsptr = ctx->img2.pixels;
 
-	// Try to convert an alpha channel to binary transparency.
+	// If this fails, the optimizer will just scan the image itself.
+	optctx->scan = iwopt_create_scan(ctx,optctx);
+}
 
-	if(optctx->imgtype==IW_IMGTYPE_RGBA && optctx->bit_depth==8 && !optctx->has_partial_transparency) {
-		iwopt_try_rgb8_binary_trns(ctx,optctx);
-	}
+// Row 'row' of ctx->img2 is finished. Rows must be reported in order.
+void iwpvt_opt_scan_row(struct iw_context *ctx, int row)
+{
+	struct iw_opt_scan *scan = ctx->optctx.scan;
 
-	if(optctx->imgtype==IW_IMGTYPE_RGBA && optctx->bit_depth==16 && !optctx->has_partial_transparency) {
-		iwopt_try_rgb16_binary_trns(ctx,optctx);
-	}
+	if(!scan || scan->done) return;
+	if(row!=scan->rows_scanned) return;
+	iwopt_scan_next_row(&ctx->optctx,scan);
+}
 
-	if(optctx->imgtype==IW_IMGTYPE_GRAYA && optctx->bit_depth==8 && !optctx->has_partial_transparency) {
-		iwopt_try_gray8_binary_trns(ctx,optctx);
-	}
+void iwpvt_opt_free_scan(struct iw_context *ctx)
+{
+	struct iw_opt_scan *scan = ctx->optctx.scan;
 
-	if(optctx->imgtype==IW_IMGTYPE_GRAYA && optctx->bit_depth==16 && !optctx->has_partial_transparency) {
-		iwopt_try_gray16_binary_trns(ctx,optctx);
-	}
+	if(!scan) return;
+	if(scan->palette) iw_free(ctx,scan->palette);
+	iw_free(ctx,scan);
+	ctx->optctx.scan = NULL;
 }
@@ -12,6 +12,7 @@
 #include <math.h>
 
 #include <png.h>
+#include <zlib.h>
 
 #define IW_INCLUDE_UTIL_FUNCTIONS
 #include "imagew.h"
@@ -383,7 +384,7 @@ static int iw_read_png_file3(struct pr_rsrc_struct *pr)
 	pr->img.height = height;
 	pr->img.bpr = iw_calc_bytesperrow(pr->img.width,pr->img.bit_depth*numchannels);
 
-	pr->img.pixels = (iw_byte*)iw_malloc_large(ctx, pr->img.bpr,pr->img.height);
+	pr->img.pixels = (iw_byte*)iw_malloc_input_pixels(ctx, pr->img.bpr,pr->img.height);
 	if(!pr->img.pixels) {
 		goto done;
 	}
@@ -395,6 +396,8 @@ static int iw_read_png_file3(struct pr_rsrc_struct *pr)
 	}
 
 	png_read_image(pr->png_ptr, pr->row_pointers);
+	iw_free(ctx, pr->row_pointers);
+	pr->row_pointers = NULL;
 
 	png_read_end(pr->png_ptr, pr->info_ptr);
 
@@ -468,6 +471,7 @@ struct pw_rsrc_struct {
 	struct iwpngwcontext wctx;
 	struct iw_image img;
 	struct errstruct errinfo;
+	struct iwpng_par_ctx *par;
 };
 
 static void iwpng_set_phys(struct iwpngwcontext *wctx)
@@ -646,6 +650,459 @@ static void my_png_flush_fn(png_structp png_ptr)
 {
 }
 
+// Presets for the "png:speed" option. Each one selects a compression level,
+// a set of row filters, and a zlib strategy.
+// filters=0 and strategy=-1 mean to use libpng's default, which is adaptive
+// filtering with Z_FILTERED for most images.
+// 'filters' is only used for images with at least 8 bits per sample that
+// don't use a palette. libpng doesn't filter other images by default, and
+// it rarely helps.
+struct iwpng_speed_preset {
+	const char *name;
+	int cmprlevel;
+	int filters;
+	int strategy;
+};
+
+static const struct iwpng_speed_preset iwpng_speed_presets[] = {
+	{ "fastest",  1, PNG_FILTER_UP, Z_RLE },
+	{ "fast",     1, PNG_FILTER_PAETH, Z_RLE },
+	{ "balanced", 5, PNG_FILTER_PAETH, Z_FILTERED },
+	{ "small",    6, 0, -1 },
+	{ "smallest", 9, 0, -1 }, // The default
+	{ NULL, 0, 0, 0 }
+};
+
+static const struct iwpng_speed_preset *iwpng_find_speed_preset(const char *name)
+{
+	int i;
+	for(i=0; iwpng_speed_presets[i].name; i++) {
+		if(!strcmp(name,iwpng_speed_presets[i].name)) {
+			return &iwpng_speed_presets[i];
+		}
+	}
+	return NULL;
+}
+
+// Returns a set of PNG_FILTER_* flags, or 0 if the name is not recognized.
+static int iwpng_parse_filter(const char *name)
+{
+	if(!strcmp(name,"none")) return PNG_FILTER_NONE;
+	if(!strcmp(name,"sub")) return PNG_FILTER_SUB;
+	if(!strcmp(name,"up")) return PNG_FILTER_UP;
+	if(!strcmp(name,"average")) return PNG_FILTER_AVG;
+	if(!strcmp(name,"paeth")) return PNG_FILTER_PAETH;
+	if(!strcmp(name,"all")) return PNG_ALL_FILTERS;
+	return 0;
+}
+
+// Returns a Z_* strategy constant, or -1 if the name is not recognized.
+static int iwpng_parse_strategy(const char *name)
+{
+	if(!strcmp(name,"default")) return Z_DEFAULT_STRATEGY;
+	if(!strcmp(name,"filtered")) return Z_FILTERED;
+	if(!strcmp(name,"huffman")) return Z_HUFFMAN_ONLY;
+	if(!strcmp(name,"rle")) return Z_RLE;
+	return -1;
+}
+
+// Multithreaded compression of the image data, used if IW_VAL_MAX_THREADS
+// is more than 1.
+// The rows are filtered, then split into strips which are compressed
+// independently, each using the previous 32K of filtered data as a preset
+// dictionary. The compressed strips are joined into a single zlib stream,
+// which we write ourselves. libpng is used only to write the chunks.
+
+// The approximate number of bytes of filtered data in each strip.
+#define IWPNG_STRIP_SIZE 262144
+
+static png_byte iwpng_IDAT[5] = { 73, 68, 65, 84, '\0' };
+static png_byte iwpng_IEND[5] = { 73, 69, 78, 68, '\0' };
+
+struct iwpng_strip {
+	size_t src_pos; // Offset of the strip's first byte in par->filtered
+	size_t src_len;
+	iw_byte *dst;
+	size_t dst_len; // Size of dst, then the number of bytes used
+	uLong adler;
+	int ok;
+};
+
+struct iwpng_par_ctx {
+	struct iw_context *ctx;
+	const struct iw_image *img;
+	int bit_depth;
+	size_t rowbytes; // Not including the filter type byte
+	size_t bpp; // Bytes per complete pixel, or 1 if less than 8 bits
+	int filters; // PNG_FILTER_* flags
+	iw_byte *filtered; // height*(rowbytes+1) bytes
+	iw_byte *zerorow; // The "previous row" of the first row
+	iw_byte *tmprows; // 4 rows for each thread
+	int rows_per_strip;
+	int num_strips;
+	struct iwpng_strip *strips;
+	int num_threads;
+	z_stream *strms; // One for each thread
+	int num_strms;
+	iw_byte *cmpr;
+};
+
+static voidpf my_png_zlib_malloc(voidpf opaque, uInt items, uInt size)
+{
+	return iw_malloc((struct iw_context*)opaque,((size_t)items)*size);
+}
+
+static void my_png_zlib_free(voidpf opaque, voidpf address)
+{
+	iw_free((struct iw_context*)opaque,address);
+}
+
+static void iwpng_par_free(struct iwpng_par_ctx *par)
+{
+	struct iw_context *ctx = par->ctx;
+	int i;
+
+	for(i=0; i<par->num_strms; i++) {
+		deflateEnd(&par->strms[i]);
+	}
+	iw_free(ctx,par->strms);
+	iw_free(ctx,par->strips);
+	iw_free(ctx,par->cmpr);
+	iw_free(ctx,par->tmprows);
+	iw_free(ctx,par->zerorow);
+	iw_free(ctx,par->filtered);
+	iw_free(ctx,par);
+}
+
+// Returns a pointer to row j, in the format PNG uses. If the samples need
+// to be packed, buf is used.
+static const iw_byte *iwpng_get_raw_row(struct iwpng_par_ctx *par, int j, iw_byte *buf)
+{
+	const iw_byte *src;
+	int i;
+	int bit_pos;
+
+	src = &par->img->pixels[(size_t)j*par->img->bpr];
+	if(par->bit_depth>=8) return src;
+
+	iw_zeromem(buf,par->rowbytes);
+	for(i=0; i<par->img->width; i++) {
+		bit_pos = i*par->bit_depth;
+		buf[bit_pos/8] |= (iw_byte)(src[i] << (8-par->bit_depth-bit_pos%8));
+	}
+	return buf;
+}
+
+static int iwpng_paeth(int a, int b, int c)
+{
+	int p, pa, pb, pc;
+	p = a+b-c;
+	pa = abs(p-a);
+	pb = abs(p-b);
+	pc = abs(p-c);
+	if(pa<=pb && pa<=pc) return a;
+	if(pb<=pc) return b;
+	return c;
+}
+
+// Write the filter type byte, and the filtered row, to dst.
+static void iwpng_apply_filter(struct iwpng_par_ctx *par, int ftype,
+	const iw_byte *prev, const iw_byte *cur, iw_byte *dst)
+{
+	size_t i;
+	size_t n = par->rowbytes;
+	size_t bpp = par->bpp;
+
+	dst[0] = (iw_byte)ftype;
+	dst++;
+
+	switch(ftype) {
+	case 1: // Sub
+		for(i=0; i<bpp && i<n; i++) dst[i] = cur[i];
+		for(; i<n; i++) dst[i] = (iw_byte)(cur[i]-cur[i-bpp]);
+		break;
+	case 2: // Up
+		for(i=0; i<n; i++) dst[i] = (iw_byte)(cur[i]-prev[i]);
+		break;
+	case 3: // Average
+		for(i=0; i<bpp && i<n; i++) dst[i] = (iw_byte)(cur[i]-prev[i]/2);
+		for(; i<n; i++) dst[i] = (iw_byte)(cur[i]-(cur[i-bpp]+prev[i])/2);
+		break;
+	case 4: // Paeth
+		for(i=0; i<bpp && i<n; i++) dst[i] = (iw_byte)(cur[i]-prev[i]);
+		for(; i<n; i++) {
+			dst[i] = (iw_byte)(cur[i]-iwpng_paeth(cur[i-bpp],prev[i],prev[i-bpp]));
+		}
+		break;
+	default: // None
+		memcpy(dst,cur,n);
+	}
+}
+
+// The usual heuristic for choosing a filter: the sum of the absolute values
+// of the filtered bytes, treated as signed numbers. Lower is better.
+static size_t iwpng_filter_cost(const iw_byte *d, size_t n)
+{
+	size_t i;
+	size_t cost = 0;
+	for(i=0; i<n; i++) {
+		cost += (d[i]<128) ? d[i] : 256-d[i];
+	}
+	return cost;
+}
+
+static void iwpng_filter_row(struct iwpng_par_ctx *par, const iw_byte *prev,
+	const iw_byte *cur, iw_byte *dst, iw_byte *trialbuf, iw_byte *bestbuf)
+{
+	static const int filter_flags[5] = { PNG_FILTER_NONE, PNG_FILTER_SUB,
+		PNG_FILTER_UP, PNG_FILTER_AVG, PNG_FILTER_PAETH };
+	int ftype;
+	int num_filters = 0;
+	size_t cost;
+	size_t best_cost = 0;
+	int have_best = 0;
+	iw_byte *tmpp;
+
+	for(ftype=0; ftype<5; ftype++) {
+		if(par->filters & filter_flags[ftype]) num_filters++;
+	}
+	if(num_filters<=1) {
+		for(ftype=4; ftype>0; ftype--) {
+			if(par->filters & filter_flags[ftype]) break;
+		}
+		iwpng_apply_filter(par,ftype,prev,cur,dst);
+		return;
+	}
+
+	for(ftype=0; ftype<5; ftype++) {
+		if(!(par->filters & filter_flags[ftype])) continue;
+		iwpng_apply_filter(par,ftype,prev,cur,trialbuf);
+		cost = iwpng_filter_cost(&trialbuf[1],par->rowbytes);
+		if(!have_best || cost<best_cost) {
+			best_cost = cost;
+			have_best = 1;
+			tmpp = bestbuf; bestbuf = trialbuf; trialbuf = tmpp;
+		}
+	}
+	memcpy(dst,bestbuf,par->rowbytes+1);
+}
+
+static void iwpng_filter_strip(void *userdata, int task_num, int thread_num)
+{
+	struct iwpng_par_ctx *par = (struct iwpng_par_ctx*)userdata;
+	iw_byte *tmprows;
+	const iw_byte *prev, *cur;
+	int j, j0, j1;
+	size_t fbpr = par->rowbytes+1;
+
+	tmprows = &par->tmprows[4*fbpr*thread_num];
+
+	j0 = task_num*par->rows_per_strip;
+	j1 = j0+par->rows_per_strip;
+	if(j1>par->img->height) j1=par->img->height;
+
+	prev = par->zerorow;
+	if(j0>0) prev = iwpng_get_raw_row(par,j0-1,&tmprows[0]);
+	for(j=j0; j<j1; j++) {
+		cur = iwpng_get_raw_row(par,j,&tmprows[((j-j0+1)%2)*fbpr]);
+		iwpng_filter_row(par,prev,cur,&par->filtered[j*fbpr],
+			&tmprows[2*fbpr],&tmprows[3*fbpr]);
+		prev = cur;
+	}
+}
+
+static void iwpng_deflate_strip(void *userdata, int task_num, int thread_num)
+{
+	struct iwpng_par_ctx *par = (struct iwpng_par_ctx*)userdata;
+	struct iwpng_strip *strip = &par->strips[task_num];
+	z_stream *strm = &par->strms[thread_num];
+	size_t dict_len;
+	int is_last;
+	int ret;
+
+	if(deflateReset(strm)!=Z_OK) return;
+
+	if(strip->src_pos>0) {
+		dict_len = strip->src_pos;
+		if(dict_len>32768) dict_len=32768;
+		if(deflateSetDictionary(strm,&par->filtered[strip->src_pos-dict_len],
+			(uInt)dict_len)!=Z_OK)
+		{
+			return;
+		}
+	}
+
+	strm->next_in = &par->filtered[strip->src_pos];
+	strm->avail_in = (uInt)strip->src_len;
+	strm->next_out = strip->dst;
+	strm->avail_out = (uInt)strip->dst_len;
+
+	// Every strip but the last ends with a sync flush, so that it ends on a
+	// byte boundary, and the next strip can be appended to it.
+	is_last = (task_num == par->num_strips-1);
+	ret = deflate(strm, is_last ? Z_FINISH : Z_SYNC_FLUSH);
+	if(is_last) {
+		if(ret!=Z_STREAM_END) return;
+	}
+	else {
+		if(ret!=Z_OK || strm->avail_in!=0 || strm->avail_out==0) return;
+	}
+
+	strip->dst_len -= strm->avail_out;
+	strip->adler = adler32(adler32(0,NULL,0),&par->filtered[strip->src_pos],
+		(uInt)strip->src_len);
+	strip->ok = 1;
+}
+
+// Write the IDAT and IEND chunks.
+static int iwpng_write_image_parallel(struct pw_rsrc_struct *pw,
+	int bit_depth, int color_type, int filters, int cmprlevel, int strategy)
+{
+	struct iw_context *ctx = pw->ctx;
+	struct iwpng_par_ctx *par;
+	const struct iw_image *img = &pw->img;
+	int samples_per_pixel;
+	size_t fbpr;
+	size_t cmpr_size;
+	size_t pos;
+	uLong adler;
+	iw_byte zhdr[2];
+	iw_byte ztrlr[4];
+	unsigned int hdr;
+	int flevel;
+	int i;
+	int ret;
+
+	par = iw_mallocz(ctx, sizeof(struct iwpng_par_ctx));
+	if(!par) return 0;
+	pw->par = par;
+	par->ctx = ctx;
+	par->img = img;
+	par->bit_depth = bit_depth;
+	par->filters = filters;
+
+	switch(color_type) {
+	case PNG_COLOR_TYPE_RGB_ALPHA: samples_per_pixel=4; break;
+	case PNG_COLOR_TYPE_RGB:        samples_per_pixel=3; break;
+	case PNG_COLOR_TYPE_GRAY_ALPHA: samples_per_pixel=2; break;
+	default: samples_per_pixel=1;
+	}
+
+	if(bit_depth>=8) {
+		par->bpp = (size_t)samples_per_pixel*(bit_depth/8);
+		par->rowbytes = par->bpp*img->width;
+	}
+	else {
+		par->bpp = 1;
+		par->rowbytes = ((size_t)img->width*bit_depth+7)/8;
+	}
+	fbpr = par->rowbytes+1;
+
+	par->filtered = iw_malloc_large(ctx, fbpr, img->height);
+	if(!par->filtered) return 0;
+	par->zerorow = iw_mallocz(ctx, par->rowbytes);
+	if(!par->zerorow) return 0;
+
+	par->rows_per_strip = (int)(IWPNG_STRIP_SIZE/fbpr);
+	if(par->rows_per_strip<1) par->rows_per_strip=1;
+	par->num_strips = (img->height+par->rows_per_strip-1)/par->rows_per_strip;
+	par->num_threads = iw_get_num_threads_for_tasks(ctx, par->num_strips);
+
+	par->tmprows = iw_malloc_large(ctx, 4*fbpr, par->num_threads);
+	if(!par->tmprows) return 0;
+
+	iw_run_tasks(ctx, par->num_strips, par->num_threads, iwpng_filter_strip, (void*)par);
+
+	// Compress the strips.
+
+	if(cmprlevel<0) cmprlevel = Z_DEFAULT_COMPRESSION;
+	if(strategy<0) {
+		// Same as libpng's default.
+		strategy = (filters==PNG_FILTER_NONE) ? Z_DEFAULT_STRATEGY : Z_FILTERED;
+	}
+
+	par->strms = iw_mallocz(ctx, par->num_threads*sizeof(z_stream));
+	if(!par->strms) return 0;
+	for(i=0; i<par->num_threads; i++) {
+		par->strms[i].zalloc = my_png_zlib_malloc;
+		par->strms[i].zfree = my_png_zlib_free;
+		par->strms[i].opaque = (voidpf)ctx;
+		// Negative windowBits means to write raw deflate data, without
+		// the zlib header and trailer.
+		ret = deflateInit2(&par->strms[i], cmprlevel, Z_DEFLATED, -15, 8, strategy);
+		if(ret!=Z_OK) {
+			iw_set_error(ctx,"Failed to initialize zlib");
+			return 0;
+		}
+		par->num_strms++;
+	}
+
+	par->strips = iw_mallocz(ctx, par->num_strips*sizeof(struct iwpng_strip));
+	if(!par->strips) return 0;
+
+	cmpr_size = 0;
+	for(i=0; i<par->num_strips; i++) {
+		par->strips[i].src_pos = (size_t)i*par->rows_per_strip*fbpr;
+		if(i==par->num_strips-1)
+			par->strips[i].src_len = fbpr*img->height - par->strips[i].src_pos;
+		else
+			par->strips[i].src_len = par->rows_per_strip*fbpr;
+		// Leave room for the sync flush marker.
+		par->strips[i].dst_len = deflateBound(&par->strms[0],
+			(uLong)par->strips[i].src_len) + 16;
+		cmpr_size += par->strips[i].dst_len;
+	}
+
+	par->cmpr = iw_malloc(ctx, cmpr_size);
+	if(!par->cmpr) return 0;
+	pos = 0;
+	for(i=0; i<par->num_strips; i++) {
+		par->strips[i].dst = &par->cmpr[pos];
+		pos += par->strips[i].dst_len;
+	}
+
+	iw_run_tasks(ctx, par->num_strips, par->num_threads, iwpng_deflate_strip, (void*)par);
+
+	adler = adler32(0,NULL,0);
+	for(i=0; i<par->num_strips; i++) {
+		if(!par->strips[i].ok) {
+			iw_set_error(ctx,"zlib compression failed");
+			return 0;
+		}
+		adler = adler32_combine(adler, par->strips[i].adler,
+			(z_off_t)par->strips[i].src_len);
+	}
+
+	// The zlib header. The FLEVEL field is set the way zlib would set it.
+	if(strategy>=Z_HUFFMAN_ONLY || (cmprlevel>=0 && cmprlevel<2)) flevel=0;
+	else if(cmprlevel>=2 && cmprlevel<6) flevel=1;
+	else if(cmprlevel==6 || cmprlevel==Z_DEFAULT_COMPRESSION) flevel=2;
+	else flevel=3;
+	hdr = (0x78<<8) | (flevel<<6);
+	hdr += 31 - hdr%31;
+	iw_set_ui16be(zhdr, hdr);
+
+	iw_set_ui32be(ztrlr, (unsigned int)adler);
+
+	// Write each strip to its own IDAT chunk. The zlib header goes in the
+	// first chunk, and the trailer (Adler-32 checksum) in the last.
+	for(i=0; i<par->num_strips; i++) {
+		png_uint_32 chunk_len;
+		chunk_len = (png_uint_32)par->strips[i].dst_len;
+		if(i==0) chunk_len += 2;
+		if(i==par->num_strips-1) chunk_len += 4;
+
+		png_write_chunk_start(pw->png_ptr, iwpng_IDAT, chunk_len);
+		if(i==0) png_write_chunk_data(pw->png_ptr, zhdr, 2);
+		png_write_chunk_data(pw->png_ptr, par->strips[i].dst, par->strips[i].dst_len);
+		if(i==par->num_strips-1) png_write_chunk_data(pw->png_ptr, ztrlr, 4);
+		png_write_chunk_end(pw->png_ptr);
+	}
+
+	png_write_chunk(pw->png_ptr, iwpng_IEND, NULL, 0);
+	return 1;
+}
+
 static int iw_write_png_file3(struct pw_rsrc_struct *pw)
 {
 	struct iw_context *ctx = pw->ctx;
@@ -660,6 +1117,12 @@ static int iw_write_png_file3(struct pw_rsrc_struct *pw)
 	int no_cslabel;
 	int palette_is_gray;
 	int cmprlevel;
+	int filters = 0; // 0 = libpng's default
+	int filters_requested = 0;
+	int strategy = -1; // -1 = libpng's default
+	int used_filters; // The filters that will be used
+	const struct iwpng_speed_preset *preset = NULL;
+	int tmpi;
 	const char *optv;
 
 	iw_get_output_image(ctx,&pw->img);
@@ -674,13 +1137,52 @@ static int iw_write_png_file3(struct pw_rsrc_struct *pw)
 	if(!pw->png_ptr) goto done;
 
 	cmprlevel = 9;
+	optv = iw_get_option(ctx, "png:speed");
+	if(optv) {
+		preset = iwpng_find_speed_preset(optv);
+		if(!preset) {
+			iw_warningf(ctx,"Unrecognized png:speed setting \"%s\"",optv);
+		}
+	}
+	if(preset) {
+		cmprlevel = preset->cmprlevel;
+		filters = preset->filters;
+		strategy = preset->strategy;
+	}
+
+	// Individual options override the preset.
 	optv = iw_get_option(ctx, "deflate:cmprlevel");
 	if(optv) {
 		cmprlevel = iw_parse_int(optv);
 	}
+	optv = iw_get_option(ctx, "png:filter");
+	if(optv) {
+		tmpi = iwpng_parse_filter(optv);
+		if(tmpi) {
+			filters = tmpi;
+			filters_requested = 1;
+		}
+		else {
+			iw_warningf(ctx,"Unrecognized png:filter setting \"%s\"",optv);
+		}
+	}
+	optv = iw_get_option(ctx, "png:strategy");
+	if(optv) {
+		tmpi = iwpng_parse_strategy(optv);
+		if(tmpi>=0) {
+			strategy = tmpi;
+		}
+		else {
+			iw_warningf(ctx,"Unrecognized png:strategy setting \"%s\"",optv);
+		}
+	}
+
 	if(cmprlevel >= 0) {
 		png_set_compression_level(pw->png_ptr, cmprlevel);
 	}
+	if(strategy >= 0) {
+		png_set_compression_strategy(pw->png_ptr, strategy);
+	}
 
 	png_set_compression_buffer_size(pw->png_ptr, 1048576);
 
@@ -740,6 +1242,19 @@ static int iw_write_png_file3(struct pw_rsrc_struct *pw)
 		lpng_bit_depth, lpng_color_type, lpng_interlace_type,
 		PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
 
+	if(filters && (filters_requested ||
+		(lpng_bit_depth>=8 && lpng_color_type!=PNG_COLOR_TYPE_PALETTE)))
+	{
+		png_set_filter(pw->png_ptr, PNG_FILTER_TYPE_BASE, filters);
+		used_filters = filters;
+	}
+	else if(lpng_bit_depth>=8 && lpng_color_type!=PNG_COLOR_TYPE_PALETTE) {
+		used_filters = PNG_ALL_FILTERS;
+	}
+	else {
+		used_filters = PNG_FILTER_NONE;
+	}
+
 	no_cslabel = iw_get_value(ctx,IW_VAL_NO_CSLABEL);
 
 	if(no_cslabel) {
@@ -779,6 +1294,15 @@ static int iw_write_png_file3(struct pw_rsrc_struct *pw)
 
 	png_write_info(pw->png_ptr, pw->info_ptr);
 
+	if(iw_get_value(ctx,IW_VAL_MAX_THREADS)>1 &&
+		lpng_interlace_type==PNG_INTERLACE_NONE && !pw->img.reduced_maxcolors)
+	{
+		// This writes the rest of the file.
+		retval = iwpng_write_image_parallel(pw, lpng_bit_depth, lpng_color_type,
+			used_filters, cmprlevel, strategy);
+		goto done;
+	}
+
 	pw->row_pointers = (iw_byte**)iw_malloc(ctx, pw->img.height * sizeof(iw_byte*));
 	if(!pw->row_pointers) goto done;
 
@@ -833,6 +1357,7 @@ done:
 			png_destroy_write_struct(&pw->png_ptr, &pw->info_ptr);
 		}
 		if(pw->row_pointers) iw_free(ctx, pw->row_pointers);
+		if(pw->par) iwpng_par_free(pw->par);
 		iw_free(ctx, pw);
 	}
 	return retval;
@@ -198,7 +198,7 @@ static int iwpnm_read_pnm_bitmap(struct iwpnmrcontext *rctx)
 
 	rctx->img->bpr = pnm_bpr;
 
-	rctx->img->pixels = (iw_byte*)iw_malloc_large(rctx->ctx,rctx->img->bpr,rctx->img->height);
+	rctx->img->pixels = (iw_byte*)iw_malloc_input_pixels(rctx->ctx,rctx->img->bpr,rctx->img->height);
 	if(!rctx->img->pixels) goto done;
 
 	for(j=0;j<rctx->img->height;j++) {
@@ -0,0 +1,450 @@
+// imagew-simd.c
+// Part of ImageWorsener, Copyright (c) 2011 by Jason Summers.
+// For more information, see the readme.txt file.
+
+// Row scanners used by the optimizer, with SSE2 and AVX2 versions for
+// x86-64 processors.
+
+#include "imagew-config.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if IW_SUPPORT_SIMD == 1
+#ifdef IW_WINDOWS
+#include <intrin.h>
+#endif
+#include <immintrin.h>
+
+#if defined(__GNUC__) || defined(__clang__)
+// The rest of the library is compiled for the baseline processor, so
+// functions that use AVX2 instructions have to be marked.
+#define IW_AVX2_FN __attribute__((target("avx2")))
+#else
+#define IW_AVX2_FN
+#endif
+#endif
+
+#include "imagew-internals.h"
+
+int iwpvt_get_simd_level(void)
+{
+#if IW_SUPPORT_SIMD == 1
+#if defined(__GNUC__) || defined(__clang__)
+	if(__builtin_cpu_supports("avx2")) return IW_SIMD_AVX2;
+#elif defined(IW_WINDOWS)
+	int info[4];
+
+	__cpuid(info,0);
+	if(info[0]>=7) {
+		__cpuid(info,1);
+		// Check for AVX, and that the OS saves the YMM registers (OSXSAVE,
+		// and XCR0 bits 1 and 2).
+		if((info[2]&(1<<27)) && (info[2]&(1<<28)) && (_xgetbv(0)&6)==6) {
+			__cpuidex(info,7,0);
+			if(info[1]&(1<<5)) return IW_SIMD_AVX2;
+		}
+	}
+#endif
+	// All x86-64 processors have SSE2.
+	return IW_SIMD_SSE2;
+#else
+	return IW_SIMD_NONE;
+#endif
+}
+
+////////////////////////////////////////////
+// Scalar versions.
+// These look at pixels i1 through width-1.
+
+static unsigned int iwsimd_scan8_scalar(const iw_byte *row, int i1, int width, int nc)
+{
+	int i;
+	const iw_byte *ptr;
+	unsigned int d = 0;
+
+	if(nc==4) {
+		for(i=i1;i<width;i++) {
+			ptr = &row[i*4];
+			// Ignore the color of invisible pixels.
+			if(ptr[3]) d |= (ptr[0]^ptr[1]) | (ptr[0]^ptr[2]);
+		}
+	}
+	else if(nc==3) {
+		for(i=i1;i<width;i++) {
+			ptr = &row[i*3];
+			d |= (ptr[0]^ptr[1]) | (ptr[0]^ptr[2]);
+		}
+	}
+
+	return d ? IW_SCANFLAG_COLOR : 0;
+}
+
+// nc is the number of channels. It is a separate parameter so that, when
+// this function is inlined, the compiler knows the number of channels.
+static unsigned int iwsimd_scan16_scalar_nc(const iw_byte *row, int i1, int width,
+	int nc)
+{
+	int i, k;
+	const iw_byte *ptr;
+	unsigned int d_color = 0; // Nonzero if a pixel has color
+	unsigned int d_prec = 0; // Nonzero if a sample needs 16 bits
+	unsigned int found = 0;
+
+	for(i=i1;i<width;i++) {
+		ptr = &row[i*nc*2];
+		// Ignore invisible pixels. They will be made black.
+		if((nc==2 || nc==4) && ptr[(nc-1)*2]==0 && ptr[(nc-1)*2+1]==0) continue;
+
+		for(k=0;k<nc;k++) {
+			d_prec |= ptr[k*2]^ptr[k*2+1];
+		}
+		if(nc>=3) {
+			d_color |= (ptr[0]^ptr[2]) | (ptr[1]^ptr[3]) | (ptr[0]^ptr[4]) | (ptr[1]^ptr[5]);
+		}
+	}
+
+	if(d_color) found |= IW_SCANFLAG_COLOR;
+	if(d_prec) found |= IW_SCANFLAG_16BIT;
+	return found;
+}
+
+static unsigned int iwsimd_scan16_scalar(const iw_byte *row, int i1, int width, int nc)
+{
+	switch(nc) {
+	case 1: return iwsimd_scan16_scalar_nc(row,i1,width,1);
+	case 2: return iwsimd_scan16_scalar_nc(row,i1,width,2);
+	case 3: return iwsimd_scan16_scalar_nc(row,i1,width,3);
+	case 4: return iwsimd_scan16_scalar_nc(row,i1,width,4);
+	}
+	return 0;
+}
+
+#if IW_SUPPORT_SIMD == 1
+
+////////////////////////////////////////////
+// SSE2 and AVX2 versions.
+// These process as many whole blocks of pixels as they can, and return the
+// number of pixels they looked at. They stop early if every flag in 'want'
+// has been found. The caller finishes the row with a scalar version.
+// The RGB versions compare each sample to the next one in memory, so they
+// need one more pixel after the last block.
+
+// For comparing each sample with the next one in RGB pixels: 0xff for the R
+// and G samples, whose next sample is in the same pixel, and 0 for B.
+// 96 bytes is a whole number of pixels, and of vectors.
+static const iw_byte iwsimd_rgb8_mask[96] = {
+	0xff,0xff,0x00,0xff,0xff,0x00,0xff,0xff,0x00,0xff,0xff,0x00,
+	0xff,0xff,0x00,0xff,0xff,0x00,0xff,0xff,0x00,0xff,0xff,0x00,
+	0xff,0xff,0x00,0xff,0xff,0x00,0xff,0xff,0x00,0xff,0xff,0x00,
+	0xff,0xff,0x00,0xff,0xff,0x00,0xff,0xff,0x00,0xff,0xff,0x00,
+	0xff,0xff,0x00,0xff,0xff,0x00,0xff,0xff,0x00,0xff,0xff,0x00,
+	0xff,0xff,0x00,0xff,0xff,0x00,0xff,0xff,0x00,0xff,0xff,0x00,
+	0xff,0xff,0x00,0xff,0xff,0x00,0xff,0xff,0x00,0xff,0xff,0x00,
+	0xff,0xff,0x00,0xff,0xff,0x00,0xff,0xff,0x00,0xff,0xff,0x00 };
+static const iw_byte iwsimd_rgb16_mask[96] = {
+	0xff,0xff,0xff,0xff,0x00,0x00,0xff,0xff,0xff,0xff,0x00,0x00,
+	0xff,0xff,0xff,0xff,0x00,0x00,0xff,0xff,0xff,0xff,0x00,0x00,
+	0xff,0xff,0xff,0xff,0x00,0x00,0xff,0xff,0xff,0xff,0x00,0x00,
+	0xff,0xff,0xff,0xff,0x00,0x00,0xff,0xff,0xff,0xff,0x00,0x00,
+	0xff,0xff,0xff,0xff,0x00,0x00,0xff,0xff,0xff,0xff,0x00,0x00,
+	0xff,0xff,0xff,0xff,0x00,0x00,0xff,0xff,0xff,0xff,0x00,0x00,
+	0xff,0xff,0xff,0xff,0x00,0x00,0xff,0xff,0xff,0xff,0x00,0x00,
+	0xff,0xff,0xff,0xff,0x00,0x00,0xff,0xff,0xff,0xff,0x00,0x00 };
+
+static unsigned int iwsimd_flags_from_vec(__m128i d_color, __m128i d_prec)
+{
+	const __m128i zero = _mm_setzero_si128();
+	unsigned int found = 0;
+
+	if(_mm_movemask_epi8(_mm_cmpeq_epi8(d_color,zero))!=0xffff) found |= IW_SCANFLAG_COLOR;
+	if(_mm_movemask_epi8(_mm_cmpeq_epi8(d_prec,zero))!=0xffff) found |= IW_SCANFLAG_16BIT;
+	return found;
+}
+
+static int iwsimd_scan8_sse2(const iw_byte *row, int width, int nc,
+	unsigned int want, unsigned int *pfound)
+{
+	int i = 0;
+	const iw_byte *p;
+	__m128i d = _mm_setzero_si128();
+	const __m128i zero = _mm_setzero_si128();
+
+	if(nc==4) {
+		const __m128i alpha_mask = _mm_set1_epi32((int)0xff000000U);
+		const __m128i rg_gb_mask = _mm_set1_epi32(0x0000ffff);
+		__m128i v, x, invisible;
+
+		for(i=0; i+4<=width; i+=4) {
+			v = _mm_loadu_si128((const __m128i*)&row[i*4]);
+			// Low bytes of each pixel: R^G, G^B
+			x = _mm_and_si128(_mm_xor_si128(v,_mm_srli_epi32(v,8)),rg_gb_mask);
+			invisible = _mm_cmpeq_epi32(_mm_and_si128(v,alpha_mask),zero);
+			d = _mm_or_si128(d,_mm_andnot_si128(invisible,x));
+			if((i&0x3c)==0x3c && (iwsimd_flags_from_vec(d,zero)&want)==want) { i+=4; break; }
+		}
+	}
+	else if(nc==3) {
+		const __m128i m0 = _mm_loadu_si128((const __m128i*)&iwsimd_rgb8_mask[0]);
+		const __m128i m1 = _mm_loadu_si128((const __m128i*)&iwsimd_rgb8_mask[16]);
+		const __m128i m2 = _mm_loadu_si128((const __m128i*)&iwsimd_rgb8_mask[32]);
+
+		// 16 pixels (48 bytes) at a time
+		for(i=0; i+16<width; i+=16) {
+			p = &row[i*3];
+			d = _mm_or_si128(d,_mm_and_si128(m0,_mm_xor_si128(
+				_mm_loadu_si128((const __m128i*)p),_mm_loadu_si128((const __m128i*)(p+1)))));
+			d = _mm_or_si128(d,_mm_and_si128(m1,_mm_xor_si128(
+				_mm_loadu_si128((const __m128i*)(p+16)),_mm_loadu_si128((const __m128i*)(p+17)))));
+			d = _mm_or_si128(d,_mm_and_si128(m2,_mm_xor_si128(
+				_mm_loadu_si128((const __m128i*)(p+32)),_mm_loadu_si128((const __m128i*)(p+33)))));
+			if((i&0xf0)==0xf0 && (iwsimd_flags_from_vec(d,zero)&want)==want) { i+=16; break; }
+		}
+	}
+
+	*pfound = iwsimd_flags_from_vec(d,zero);
+	return i;
+}
+
+static int iwsimd_scan16_sse2(const iw_byte *row, int width, int nc,
+	unsigned int want, unsigned int *pfound)
+{
+	int i = 0;
+	const iw_byte *p;
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i lowbyte_mask = _mm_set1_epi16(0x00ff);
+	__m128i d_color = _mm_setzero_si128();
+	__m128i d_prec = _mm_setzero_si128();
+	__m128i v, invisible;
+
+	// For each 16-bit sample (big-endian), the low byte of (v ^ (v>>8)) is
+	// the high byte XOR the low byte.
+#define IWSIMD_PREC16(v) _mm_and_si128(_mm_xor_si128((v),_mm_srli_epi16((v),8)),lowbyte_mask)
+
+	if(nc==1) {
+		for(i=0; i+8<=width; i+=8) {
+			v = _mm_loadu_si128((const __m128i*)&row[i*2]);
+			d_prec = _mm_or_si128(d_prec,IWSIMD_PREC16(v));
+			if((i&0x78)==0x78 && (iwsimd_flags_from_vec(d_color,d_prec)&want)==want) { i+=8; break; }
+		}
+	}
+	else if(nc==2) {
+		const __m128i alpha_mask = _mm_set1_epi32((int)0xffff0000U);
+		for(i=0; i+4<=width; i+=4) {
+			v = _mm_loadu_si128((const __m128i*)&row[i*4]);
+			invisible = _mm_cmpeq_epi32(_mm_and_si128(v,alpha_mask),zero);
+			d_prec = _mm_or_si128(d_prec,_mm_andnot_si128(invisible,IWSIMD_PREC16(v)));
+			if((i&0x3c)==0x3c && (iwsimd_flags_from_vec(d_color,d_prec)&want)==want) { i+=4; break; }
+		}
+	}
+	else if(nc==3) {
+		const __m128i m0 = _mm_loadu_si128((const __m128i*)&iwsimd_rgb16_mask[0]);
+		const __m128i m1 = _mm_loadu_si128((const __m128i*)&iwsimd_rgb16_mask[16]);
+		const __m128i m2 = _mm_loadu_si128((const __m128i*)&iwsimd_rgb16_mask[32]);
+		__m128i v1, v2;
+
+		// 8 pixels (48 bytes) at a time
+		for(i=0; i+8<width; i+=8) {
+			p = &row[i*6];
+			v = _mm_loadu_si128((const __m128i*)p);
+			v1 = _mm_loadu_si128((const __m128i*)(p+16));
+			v2 = _mm_loadu_si128((const __m128i*)(p+32));
+			d_prec = _mm_or_si128(d_prec,_mm_or_si128(IWSIMD_PREC16(v),
+				_mm_or_si128(IWSIMD_PREC16(v1),IWSIMD_PREC16(v2))));
+			d_color = _mm_or_si128(d_color,_mm_and_si128(m0,
+				_mm_xor_si128(v,_mm_loadu_si128((const __m128i*)(p+2)))));
+			d_color = _mm_or_si128(d_color,_mm_and_si128(m1,
+				_mm_xor_si128(v1,_mm_loadu_si128((const __m128i*)(p+18)))));
+			d_color = _mm_or_si128(d_color,_mm_and_si128(m2,
+				_mm_xor_si128(v2,_mm_loadu_si128((const __m128i*)(p+34)))));
+			if((i&0x78)==0x78 && (iwsimd_flags_from_vec(d_color,d_prec)&want)==want) { i+=8; break; }
+		}
+	}
+	else if(nc==4) {
+		const __m128i alpha_mask = _mm_set_epi32((int)0xffff0000U,0,(int)0xffff0000U,0);
+		const __m128i rg_gb_mask = _mm_set_epi32(0,-1,0,-1);
+		for(i=0; i+2<=width; i+=2) {
+			v = _mm_loadu_si128((const __m128i*)&row[i*8]);
+			// The alpha sample is in the high 32 bits of each pixel, so
+			// spread the result of comparing those to the whole pixel.
+			invisible = _mm_cmpeq_epi32(_mm_and_si128(v,alpha_mask),zero);
+			invisible = _mm_shuffle_epi32(invisible,_MM_SHUFFLE(3,3,1,1));
+			d_prec = _mm_or_si128(d_prec,_mm_andnot_si128(invisible,IWSIMD_PREC16(v)));
+			// Low 32 bits of each pixel: R^G, G^B
+			d_color = _mm_or_si128(d_color,_mm_andnot_si128(invisible,
+				_mm_and_si128(_mm_xor_si128(v,_mm_srli_epi64(v,16)),rg_gb_mask)));
+			if((i&0x3e)==0x3e && (iwsimd_flags_from_vec(d_color,d_prec)&want)==want) { i+=2; break; }
+		}
+	}
+
+#undef IWSIMD_PREC16
+
+	*pfound = iwsimd_flags_from_vec(d_color,d_prec);
+	return i;
+}
+
+IW_AVX2_FN static unsigned int iwsimd_flags_from_vec256(__m256i d_color, __m256i d_prec)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	unsigned int found = 0;
+
+	if(_mm256_movemask_epi8(_mm256_cmpeq_epi8(d_color,zero))!=-1) found |= IW_SCANFLAG_COLOR;
+	if(_mm256_movemask_epi8(_mm256_cmpeq_epi8(d_prec,zero))!=-1) found |= IW_SCANFLAG_16BIT;
+	return found;
+}
+
+// The same as the SSE2 versions, with twice as many pixels at a time.
+
+IW_AVX2_FN static int iwsimd_scan8_avx2(const iw_byte *row, int width, int nc,
+	unsigned int want, unsigned int *pfound)
+{
+	int i = 0;
+	const iw_byte *p;
+	__m256i d = _mm256_setzero_si256();
+	const __m256i zero = _mm256_setzero_si256();
+
+	if(nc==4) {
+		const __m256i alpha_mask = _mm256_set1_epi32((int)0xff000000U);
+		const __m256i rg_gb_mask = _mm256_set1_epi32(0x0000ffff);
+		__m256i v, x, invisible;
+
+		for(i=0; i+8<=width; i+=8) {
+			v = _mm256_loadu_si256((const __m256i*)&row[i*4]);
+			x = _mm256_and_si256(_mm256_xor_si256(v,_mm256_srli_epi32(v,8)),rg_gb_mask);
+			invisible = _mm256_cmpeq_epi32(_mm256_and_si256(v,alpha_mask),zero);
+			d = _mm256_or_si256(d,_mm256_andnot_si256(invisible,x));
+			if((i&0x78)==0x78 && (iwsimd_flags_from_vec256(d,zero)&want)==want) { i+=8; break; }
+		}
+	}
+	else if(nc==3) {
+		const __m256i m0 = _mm256_loadu_si256((const __m256i*)&iwsimd_rgb8_mask[0]);
+		const __m256i m1 = _mm256_loadu_si256((const __m256i*)&iwsimd_rgb8_mask[32]);
+		const __m256i m2 = _mm256_loadu_si256((const __m256i*)&iwsimd_rgb8_mask[64]);
+
+		// 32 pixels (96 bytes) at a time
+		for(i=0; i+32<width; i+=32) {
+			p = &row[i*3];
+			d = _mm256_or_si256(d,_mm256_and_si256(m0,_mm256_xor_si256(
+				_mm256_loadu_si256((const __m256i*)p),_mm256_loadu_si256((const __m256i*)(p+1)))));
+			d = _mm256_or_si256(d,_mm256_and_si256(m1,_mm256_xor_si256(
+				_mm256_loadu_si256((const __m256i*)(p+32)),_mm256_loadu_si256((const __m256i*)(p+33)))));
+			d = _mm256_or_si256(d,_mm256_and_si256(m2,_mm256_xor_si256(
+				_mm256_loadu_si256((const __m256i*)(p+64)),_mm256_loadu_si256((const __m256i*)(p+65)))));
+			if((i&0xe0)==0xe0 && (iwsimd_flags_from_vec256(d,zero)&want)==want) { i+=32; break; }
+		}
+	}
+
+	*pfound = iwsimd_flags_from_vec256(d,zero);
+	return i;
+}
+
+IW_AVX2_FN static int iwsimd_scan16_avx2(const iw_byte *row, int width, int nc,
+	unsigned int want, unsigned int *pfound)
+{
+	int i = 0;
+	const iw_byte *p;
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i lowbyte_mask = _mm256_set1_epi16(0x00ff);
+	__m256i d_color = _mm256_setzero_si256();
+	__m256i d_prec = _mm256_setzero_si256();
+	__m256i v, invisible;
+
+#define IWSIMD_PREC16(v) _mm256_and_si256(_mm256_xor_si256((v),_mm256_srli_epi16((v),8)),lowbyte_mask)
+
+	if(nc==1) {
+		for(i=0; i+16<=width; i+=16) {
+			v = _mm256_loadu_si256((const __m256i*)&row[i*2]);
+			d_prec = _mm256_or_si256(d_prec,IWSIMD_PREC16(v));
+			if((i&0xf0)==0xf0 && (iwsimd_flags_from_vec256(d_color,d_prec)&want)==want) { i+=16; break; }
+		}
+	}
+	else if(nc==2) {
+		const __m256i alpha_mask = _mm256_set1_epi32((int)0xffff0000U);
+		for(i=0; i+8<=width; i+=8) {
+			v = _mm256_loadu_si256((const __m256i*)&row[i*4]);
+			invisible = _mm256_cmpeq_epi32(_mm256_and_si256(v,alpha_mask),zero);
+			d_prec = _mm256_or_si256(d_prec,_mm256_andnot_si256(invisible,IWSIMD_PREC16(v)));
+			if((i&0x78)==0x78 && (iwsimd_flags_from_vec256(d_color,d_prec)&want)==want) { i+=8; break; }
+		}
+	}
+	else if(nc==3) {
+		const __m256i m0 = _mm256_loadu_si256((const __m256i*)&iwsimd_rgb16_mask[0]);
+		const __m256i m1 = _mm256_loadu_si256((const __m256i*)&iwsimd_rgb16_mask[32]);
+		const __m256i m2 = _mm256_loadu_si256((const __m256i*)&iwsimd_rgb16_mask[64]);
+		__m256i v1, v2;
+
+		// 16 pixels (96 bytes) at a time
+		for(i=0; i+16<width; i+=16) {
+			p = &row[i*6];
+			v = _mm256_loadu_si256((const __m256i*)p);
+			v1 = _mm256_loadu_si256((const __m256i*)(p+32));
+			v2 = _mm256_loadu_si256((const __m256i*)(p+64));
+			d_prec = _mm256_or_si256(d_prec,_mm256_or_si256(IWSIMD_PREC16(v),
+				_mm256_or_si256(IWSIMD_PREC16(v1),IWSIMD_PREC16(v2))));
+			d_color = _mm256_or_si256(d_color,_mm256_and_si256(m0,
+				_mm256_xor_si256(v,_mm256_loadu_si256((const __m256i*)(p+2)))));
+			d_color = _mm256_or_si256(d_color,_mm256_and_si256(m1,
+				_mm256_xor_si256(v1,_mm256_loadu_si256((const __m256i*)(p+34)))));
+			d_color = _mm256_or_si256(d_color,_mm256_and_si256(m2,
+				_mm256_xor_si256(v2,_mm256_loadu_si256((const __m256i*)(p+66)))));
+			if((i&0xf0)==0xf0 && (iwsimd_flags_from_vec256(d_color,d_prec)&want)==want) { i+=16; break; }
+		}
+	}
+	else if(nc==4) {
+		const __m256i alpha_mask = _mm256_set_epi32((int)0xffff0000U,0,(int)0xffff0000U,0,
+			(int)0xffff0000U,0,(int)0xffff0000U,0);
+		const __m256i rg_gb_mask = _mm256_set_epi32(0,-1,0,-1,0,-1,0,-1);
+		for(i=0; i+4<=width; i+=4) {
+			v = _mm256_loadu_si256((const __m256i*)&row[i*8]);
+			invisible = _mm256_cmpeq_epi32(_mm256_and_si256(v,alpha_mask),zero);
+			invisible = _mm256_shuffle_epi32(invisible,_MM_SHUFFLE(3,3,1,1));
+			d_prec = _mm256_or_si256(d_prec,_mm256_andnot_si256(invisible,IWSIMD_PREC16(v)));
+			d_color = _mm256_or_si256(d_color,_mm256_andnot_si256(invisible,
+				_mm256_and_si256(_mm256_xor_si256(v,_mm256_srli_epi64(v,16)),rg_gb_mask)));
+			if((i&0x7c)==0x7c && (iwsimd_flags_from_vec256(d_color,d_prec)&want)==want) { i+=4; break; }
+		}
+	}
+
+#undef IWSIMD_PREC16
+
+	*pfound = iwsimd_flags_from_vec256(d_color,d_prec);
+	return i;
+}
+
+#endif // IW_SUPPORT_SIMD
+
+////////////////////////////////////////////
+
+unsigned int iwpvt_scan_row_flags(int simd_level, const iw_byte *row, int width,
+	int nc, int bit_depth, unsigned int want)
+{
+	unsigned int found = 0;
+	int i = 0;
+
+	// Grayscale pixels have no color.
+	if(nc<3) want &= ~IW_SCANFLAG_COLOR;
+	if(bit_depth!=16) want &= ~IW_SCANFLAG_16BIT;
+	if(!want) return 0;
+
+#if IW_SUPPORT_SIMD == 1
+	if(simd_level>=IW_SIMD_AVX2) {
+		if(bit_depth==16)
+			i = iwsimd_scan16_avx2(row,width,nc,want,&found);
+		else
+			i = iwsimd_scan8_avx2(row,width,nc,want,&found);
+	}
+	else if(simd_level>=IW_SIMD_SSE2) {
+		if(bit_depth==16)
+			i = iwsimd_scan16_sse2(row,width,nc,want,&found);
+		else
+			i = iwsimd_scan8_sse2(row,width,nc,want,&found);
+	}
+	if((found&want)==want) return want;
+#endif
+
+	if(bit_depth==16)
+		found |= iwsimd_scan16_scalar(row,i,width,nc);
+	else
+		found |= iwsimd_scan8_scalar(row,i,width,nc);
+	return found&want;
+}
@@ -16,14 +16,52 @@
 #include <stdarg.h>
 #include <time.h>
 
+#if IW_SUPPORT_THREADS == 1
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+#endif
+
 #include "imagew-internals.h"
 #ifdef IW_WINDOWS
 #include <strsafe.h>
 #endif
 
 
+#ifdef _WIN32
+
+// Memory from _aligned_malloc must be freed by _aligned_free, so we use it
+// for everything.
+void* iwpvt_default_malloc(void *userdata, unsigned int flags, size_t n)
+{
+	void *mem;
+	mem = _aligned_malloc(n?n:1, (flags&IW_MALLOCFLAG_ALIGNED)?IW_MALLOC_ALIGNMENT:16);
+	if(mem && (flags&IW_MALLOCFLAG_ZEROMEM)) {
+		memset(mem,0,n);
+	}
+	return mem;
+}
+
+void iwpvt_default_free(void *userdata, void *mem)
+{
+	_aligned_free(mem);
+}
+
+#else
+
 void* iwpvt_default_malloc(void *userdata, unsigned int flags, size_t n)
 {
+	void *mem;
+
+	if(flags & IW_MALLOCFLAG_ALIGNED) {
+		if(posix_memalign(&mem,IW_MALLOC_ALIGNMENT,n?n:1)) return NULL;
+		if(flags & IW_MALLOCFLAG_ZEROMEM) {
+			memset(mem,0,n);
+		}
+		return mem;
+	}
 	if(flags & IW_MALLOCFLAG_ZEROMEM) {
 		return calloc(n,1);
 	}
@@ -35,6 +73,95 @@ void iwpvt_default_free(void *userdata, void *mem)
 	free(mem);
 }
 
+#endif
+
+// Allocate memory for the context's arena, which will be used for later
+// allocations until it is full.
+int iwpvt_arena_init(struct iw_context *ctx, size_t size)
+{
+	struct iw_arena *a = &ctx->arena;
+	size_t pad;
+
+	if(size<IW_ARENA_ALIGN) return 1;
+	a->block = (*ctx->mallocfn)(ctx->userdata,0,size+IW_ARENA_ALIGN);
+	if(!a->block) return 0;
+	pad = (IW_ARENA_ALIGN - ((size_t)a->block)%IW_ARENA_ALIGN)%IW_ARENA_ALIGN;
+	a->mem = &((unsigned char*)a->block)[pad];
+	a->size = size;
+	return 1;
+}
+
+void iwpvt_arena_destroy(struct iw_context *ctx)
+{
+	if(ctx->arena.block) {
+		(*ctx->freefn)(ctx->userdata,ctx->arena.block);
+	}
+	iw_zeromem(&ctx->arena,sizeof(struct iw_arena));
+}
+
+int iwpvt_arena_owns(struct iw_context *ctx, const void *mem)
+{
+	const unsigned char *m = (const unsigned char*)mem;
+	return ctx->arena.mem && m>=ctx->arena.mem && m<ctx->arena.mem+ctx->arena.size;
+}
+
+// Returns NULL if there is not enough room.
+static void* arena_alloc(struct iw_context *ctx, unsigned int flags, size_t n)
+{
+	struct iw_arena *a = &ctx->arena;
+	void *mem;
+	size_t pos;
+
+	pos = a->used;
+	if(flags & IW_MALLOCFLAG_ALIGNED) {
+		pos += (IW_MALLOC_ALIGNMENT - ((size_t)&a->mem[pos])%IW_MALLOC_ALIGNMENT)%IW_MALLOC_ALIGNMENT;
+		if(pos>a->size) return NULL;
+	}
+
+	if(n>a->size-pos) return NULL;
+	// Round up to a multiple of IW_ARENA_ALIGN. Zero-size blocks still use
+	// some space, so that every block has a unique address.
+	n = (n==0) ? IW_ARENA_ALIGN : ((n+IW_ARENA_ALIGN-1)/IW_ARENA_ALIGN)*IW_ARENA_ALIGN;
+	if(n>a->size-pos) return NULL;
+
+	mem = &a->mem[pos];
+	a->last_pos = pos;
+	a->used = pos+n;
+	a->num_allocs++;
+	if(flags & IW_MALLOCFLAG_ZEROMEM) {
+		iw_zeromem(mem,n);
+	}
+	return mem;
+}
+
+// Individual blocks are not reclaimed, except for the most recent one.
+// Once every block has been freed, the whole arena is available again.
+static void arena_free(struct iw_context *ctx, void *mem)
+{
+	struct iw_arena *a = &ctx->arena;
+
+	a->num_allocs--;
+	if(a->num_allocs<1) {
+		a->num_allocs = 0;
+		a->used = 0;
+	}
+	else if((unsigned char*)mem == &a->mem[a->last_pos]) {
+		a->used = a->last_pos;
+	}
+	a->last_pos = a->used;
+}
+
+static void* lowlevel_malloc(struct iw_context *ctx, unsigned int flags, size_t n)
+{
+	void *mem;
+
+	if(ctx->arena.mem && !(flags&IW_MALLOCFLAG_NOARENA)) {
+		mem = arena_alloc(ctx,flags,n);
+		if(mem) return mem;
+	}
+	return (*ctx->mallocfn)(ctx->userdata,flags&(~IW_MALLOCFLAG_NOARENA),n);
+}
+
 IW_IMPL(void*) iw_malloc_ex(struct iw_context *ctx, unsigned int flags, size_t n)
 {
 	void *mem;
@@ -45,7 +172,7 @@ IW_IMPL(void*) iw_malloc_ex(struct iw_context *ctx, unsigned int flags, size_t n
 		return NULL;
 	}
 
-	mem = (*ctx->mallocfn)(ctx->userdata,flags,n);
+	mem = lowlevel_malloc(ctx,flags,n);
 
 	if(!mem) {
 		if(!(flags&IW_MALLOCFLAG_NOERRORS))
@@ -74,7 +201,73 @@ IW_IMPL(void*) iw_malloc_large(struct iw_context *ctx, size_t n1, size_t n2)
 		iw_set_error(ctx,"Image too large to process");
 		return NULL;
 	}
-	return iw_malloc_ex(ctx,0,n1*n2);
+	return iw_malloc_ex(ctx,IW_MALLOCFLAG_NOARENA,n1*n2);
+}
+
+// Returns a block of memory of at least n1*n2 bytes, like iw_malloc_large().
+// If buf already has enough memory, that memory is returned. Otherwise, its
+// memory is replaced by a new block.
+// The memory belongs to buf, and should be freed by iwpvt_membuf_free().
+void* iwpvt_membuf_get(struct iw_context *ctx, struct iw_membuf *buf, size_t n1, size_t n2)
+{
+	if(n1 > ctx->max_malloc/n2) {
+		iw_set_error(ctx,"Image too large to process");
+		return NULL;
+	}
+	if(buf->mem && buf->size>=n1*n2) {
+		return buf->mem;
+	}
+
+	iwpvt_membuf_free(ctx,buf);
+	buf->mem = iw_malloc_ex(ctx,IW_MALLOCFLAG_NOARENA|IW_MALLOCFLAG_ALIGNED,n1*n2);
+	if(buf->mem) buf->size = n1*n2;
+	return buf->mem;
+}
+
+void iwpvt_membuf_free(struct iw_context *ctx, struct iw_membuf *buf)
+{
+	if(buf->mem) iw_free(ctx,buf->mem);
+	buf->mem = NULL;
+	buf->size = 0;
+}
+
+// Allocate memory for the pixels of an image that will be passed to
+// iw_set_input_image(). This may reuse memory from a previous image.
+IW_IMPL(void*) iw_malloc_input_pixels(struct iw_context *ctx, size_t bpr, size_t height)
+{
+	void *mem;
+
+	mem = iwpvt_membuf_get(ctx,&ctx->spare_input_buf,bpr,height);
+	// The memory now belongs to the caller.
+	ctx->spare_input_buf.mem = NULL;
+	ctx->spare_input_buf.size = 0;
+	return mem;
+}
+
+// Free the input image, and anything else that is only needed to read it.
+// If keep_pixels is set, the pixel memory may be kept for
+// iw_malloc_input_pixels().
+void iwpvt_release_input_image(struct iw_context *ctx, int keep_pixels)
+{
+	if(ctx->img1.pixels) {
+		// Keep the larger of this and any previous input image memory.
+		if(keep_pixels &&
+			ctx->img1.bpr*ctx->img1.height > ctx->spare_input_buf.size &&
+			!iwpvt_arena_owns(ctx,ctx->img1.pixels))
+		{
+			iwpvt_membuf_free(ctx,&ctx->spare_input_buf);
+			ctx->spare_input_buf.mem = ctx->img1.pixels;
+			ctx->spare_input_buf.size = ctx->img1.bpr*ctx->img1.height;
+		}
+		else {
+			iw_free(ctx,ctx->img1.pixels);
+		}
+		ctx->img1.pixels = NULL;
+	}
+	if(ctx->input_color_corr_table) {
+		iw_free(ctx,ctx->input_color_corr_table);
+		ctx->input_color_corr_table = NULL;
+	}
 }
 
 // Emulate realloc using malloc, by always allocating a new memory block.
@@ -83,7 +276,7 @@ static void* emulated_realloc(struct iw_context *ctx, unsigned int flags,
 {
 	void *newmem;
 
-	newmem = (*ctx->mallocfn)(ctx->userdata,flags,newmem_size);
+	newmem = lowlevel_malloc(ctx,flags,newmem_size);
 	if(oldmem && newmem) {
 		if(oldmem_size<newmem_size)
 			memcpy(newmem,oldmem,oldmem_size);
@@ -92,7 +285,7 @@ static void* emulated_realloc(struct iw_context *ctx, unsigned int flags,
 	}
 	if(oldmem) {
 		// Our realloc functions always free the old memory, even on failure.
-		(*ctx->freefn)(ctx->userdata,oldmem);
+		iw_free(ctx,oldmem);
 	}
 	return newmem;
 }
@@ -131,6 +324,10 @@ IW_IMPL(void*) iw_realloc(struct iw_context *ctx, void *oldmem,
 IW_IMPL(void) iw_free(struct iw_context *ctx, void *mem)
 {
 	if(!mem) return;
+	if(iwpvt_arena_owns(ctx,mem)) {
+		arena_free(ctx,mem);
+		return;
+	}
 	// Note that this function can be used to free the ctx struct itself,
 	// so we're not allowed to use ctx after freeing the memory.
 	(*ctx->freefn)(ctx->userdata,mem);
@@ -232,6 +429,202 @@ iw_uint32 iwpvt_prng_rand(struct iw_prng *prng)
 	return prng->multiply;
 }
 
+// An integer hash function, used to scramble the bits of a 32-bit number.
+static iw_uint32 iw_mix32(iw_uint32 h)
+{
+	h ^= h>>16;
+	h *= 0x7feb352d;
+	h ^= h>>15;
+	h *= 0x846ca68b;
+	h ^= h>>16;
+	return h;
+}
+
+// A counter-based alternative to iwpvt_prng_rand(). The result is a
+// pseudorandom function of (seed,x,y), so samples can be computed in any
+// order, and the same inputs always give the same output.
+iw_uint32 iwpvt_prng_hash(iw_uint32 seed, int x, int y)
+{
+	iw_uint32 h;
+	h = iw_mix32(seed + 0x9e3779b9);
+	h = iw_mix32(h ^ (iw_uint32)x);
+	h = iw_mix32(h ^ (iw_uint32)y);
+	return h;
+}
+
+////////////////////////////////////////////
+
+IW_IMPL(int) iw_get_num_threads_for_tasks(struct iw_context *ctx, int num_tasks)
+{
+	int n;
+#if IW_SUPPORT_THREADS == 1
+	n = ctx->max_threads;
+#else
+	n = 1;
+#endif
+	if(n>num_tasks) n=num_tasks;
+	if(n<1) n=1;
+	return n;
+}
+
+struct iw_worker_struct {
+	iw_task_fn fn;
+	void *userdata;
+	int num_tasks;
+	int num_threads;
+	int thread_num;
+#if IW_SUPPORT_THREADS == 1
+	int started;
+#ifdef _WIN32
+	HANDLE hThread;
+#else
+	pthread_t thread;
+#endif
+#endif
+};
+
+// Worker n runs tasks n, n+num_threads, n+2*num_threads, ...
+static void run_worker(struct iw_worker_struct *w)
+{
+	int i;
+	for(i=w->thread_num; i<w->num_tasks; i+=w->num_threads) {
+		w->fn(w->userdata, i, w->thread_num);
+	}
+}
+
+#if IW_SUPPORT_THREADS == 1
+#ifdef _WIN32
+static DWORD WINAPI worker_thread_main(LPVOID param)
+{
+	run_worker((struct iw_worker_struct*)param);
+	return 0;
+}
+#else
+static void *worker_thread_main(void *param)
+{
+	run_worker((struct iw_worker_struct*)param);
+	return NULL;
+}
+#endif
+#endif
+
+// If a thread can't be started, its tasks are run by the calling thread.
+IW_IMPL(void) iw_run_tasks(struct iw_context *ctx, int num_tasks, int num_threads,
+	iw_task_fn fn, void *userdata)
+{
+	struct iw_worker_struct w[IW_MAX_THREADS];
+	int i;
+
+	if(num_threads>IW_MAX_THREADS) num_threads=IW_MAX_THREADS;
+	if(num_threads<1) num_threads=1;
+
+	for(i=0; i<num_threads; i++) {
+		iw_zeromem(&w[i],sizeof(struct iw_worker_struct));
+		w[i].fn = fn;
+		w[i].userdata = userdata;
+		w[i].num_tasks = num_tasks;
+		w[i].num_threads = num_threads;
+		w[i].thread_num = i;
+	}
+
+#if IW_SUPPORT_THREADS == 1
+	for(i=1; i<num_threads; i++) {
+#ifdef _WIN32
+		w[i].hThread = CreateThread(NULL,0,worker_thread_main,(LPVOID)&w[i],0,NULL);
+		w[i].started = (w[i].hThread!=NULL);
+#else
+		w[i].started = !pthread_create(&w[i].thread,NULL,worker_thread_main,(void*)&w[i]);
+#endif
+	}
+#endif
+
+	run_worker(&w[0]);
+
+	for(i=1; i<num_threads; i++) {
+#if IW_SUPPORT_THREADS == 1
+		if(w[i].started) {
+#ifdef _WIN32
+			WaitForSingleObject(w[i].hThread,INFINITE);
+			CloseHandle(w[i].hThread);
+#else
+			pthread_join(w[i].thread,NULL);
+#endif
+			continue;
+		}
+#endif
+		run_worker(&w[i]);
+	}
+}
+
+////////////////////////////////////////////
+
+#define IW_MAX_QUALITY_TRIES 12
+
+IW_IMPL(int) iw_search_quality(struct iw_context *ctx, size_t target_size,
+	int qmin, int qmax, int start, iw_encode_at_quality_fn fn, void *userdata,
+	int *pquality)
+{
+	// lo = the highest quality known to fit; hi = the lowest quality known
+	// not to fit. qmin-1 and qmax+1 mean "nothing known yet".
+	int lo, hi;
+	size_t lo_size = 0, hi_size = 0;
+	int q;
+	int tries = 0;
+	int prev_width;
+	size_t size;
+
+	if(qmax<qmin) qmax=qmin;
+	lo = qmin-1;
+	hi = qmax+1;
+	prev_width = hi-lo;
+
+	q = start;
+	if(q<qmin) q=qmin;
+	if(q>qmax) q=qmax;
+
+	while(tries<IW_MAX_QUALITY_TRIES) {
+		if(!(*fn)(userdata,q,&size)) return 0;
+		tries++;
+
+		if(size<=target_size) {
+			lo = q;
+			lo_size = size;
+		}
+		else {
+			hi = q;
+			hi_size = size;
+		}
+		if(hi-lo<=1) break;
+
+		if(lo>=qmin && hi<=qmax && hi_size>lo_size && (hi-lo)*2<=prev_width) {
+			// Both ends are known, and the last step made good progress:
+			// interpolate, assuming the size is roughly linear in the quality.
+			q = lo + (int)(((double)(target_size-lo_size)*(double)(hi-lo))/(double)(hi_size-lo_size));
+		}
+		else {
+			q = lo + (hi-lo)/2;
+		}
+		if(q<=lo) q=lo+1;
+		if(q>=hi) q=hi-1;
+		prev_width = hi-lo;
+	}
+
+	// At least one quality was tried, so at least one of lo and hi is known.
+	if(lo>=qmin) {
+		*pquality = lo;
+		size = lo_size;
+	}
+	else {
+		*pquality = hi;
+		size = hi_size;
+	}
+
+	ctx->req.targetsize_quality = *pquality;
+	ctx->req.targetsize_tries = tries;
+	ctx->req.targetsize_filesize = (size>0x7fffffff) ? 0x7fffffff : (int)size;
+	return 1;
+}
+
 ////////////////////////////////////////////
 
 int iwpvt_util_randomize(struct iw_prng *prng)
@@ -213,7 +213,7 @@ static int iwwebp_read_main(struct iwwebprcontext *rctx)
 	img->bit_depth = 8;
 	bytes_per_pixel = iw_imgtype_num_channels(img->imgtype);
 	img->bpr = bytes_per_pixel * img->width;
-	img->pixels = (iw_byte*)iw_malloc_large(rctx->ctx, img->bpr, img->height);
+	img->pixels = (iw_byte*)iw_malloc_input_pixels(rctx->ctx, img->bpr, img->height);
 	if(!img->pixels) goto done;
 
 	switch(img->imgtype) {
@@ -333,7 +333,7 @@ static int iwwebp_read_main(struct iwwebprcontext *rctx)
 	img->bit_depth = 8;
 	bytes_per_pixel = iw_imgtype_num_channels(img->imgtype);
 	img->bpr = bytes_per_pixel * img->width;
-	img->pixels = (iw_byte*)iw_malloc_large(rctx->ctx, img->bpr, img->height);
+	img->pixels = (iw_byte*)iw_malloc_input_pixels(rctx->ctx, img->bpr, img->height);
 	if(!img->pixels) goto done;
 
 	switch(img->imgtype) {
@@ -405,7 +405,7 @@ static int iwwebp_read_main(struct iwwebprcontext *rctx)
 	img->bit_depth = 8;
 	bytes_per_pixel = iw_imgtype_num_channels(img->imgtype);
 	img->bpr = bytes_per_pixel * img->width;
-	img->pixels = (unsigned char*)iw_malloc_large(rctx->ctx, img->bpr, img->height);
+	img->pixels = (unsigned char*)iw_malloc_input_pixels(rctx->ctx, img->bpr, img->height);
 	if(!img->pixels) goto done;
 
 	switch(img->imgtype) {
@@ -504,7 +504,7 @@ static int iwwebp_read_main(struct iwwebprcontext *rctx)
 	img->bit_depth = 8;
 	bytes_per_pixel = iw_imgtype_num_channels(img->imgtype);
 	img->bpr = bytes_per_pixel * img->width;
-	img->pixels = (unsigned char*)iw_malloc_large(rctx->ctx, img->bpr, img->height);
+	img->pixels = (unsigned char*)iw_malloc_input_pixels(rctx->ctx, img->bpr, img->height);
 	if(!img->pixels) goto done;
 
 	switch(img->imgtype) {
@@ -566,6 +566,17 @@ struct iwwebpwcontext {
 	struct iw_context *ctx;
 	struct iw_image *img;
 	iw_byte *tmppixels;
+
+	// The image to give to libwebp
+	const uint8_t *pixels;
+	int stride;
+	int has_alpha;
+
+	// Used with the "webp:targetsize" option
+	size_t target_size;
+	uint8_t *best_data; // Allocated by libwebp
+	size_t best_size;
+	int best_quality;
 };
 
 static void iwwebp_write(struct iwwebpwcontext *wctx, const void *buf, size_t n)
@@ -600,19 +611,73 @@ static void iwwebp_gray_to_rgb(struct iwwebpwcontext *wctx, int alphaflag)
 	}
 }
 
+static size_t iwwebp_encode(struct iwwebpwcontext *wctx, float quality,
+	uint8_t **pdata)
+{
+	struct iw_image *img = wctx->img;
+
+	*pdata = NULL;
+#if IW_WEBP_SUPPORT_TRANSPARENCY
+	if(wctx->has_alpha) {
+		return WebPEncodeRGBA(wctx->pixels, img->width, img->height, wctx->stride,
+			quality, pdata);
+	}
+#endif
+	return WebPEncodeRGB(wctx->pixels, img->width, img->height, wctx->stride,
+		quality, pdata);
+}
+
+// An iw_encode_at_quality_fn, used with the "webp:targetsize" option.
+// Keeps the result that iw_search_quality() is going to choose.
+static int iwwebp_try_quality(void *userdata, int quality, size_t *psize)
+{
+	struct iwwebpwcontext *wctx = (struct iwwebpwcontext*)userdata;
+	uint8_t *data;
+	size_t size;
+	int is_better;
+
+	size = iwwebp_encode(wctx, (float)quality, &data);
+	if(size<1 || !data) {
+		if(data) free(data);
+		return 0;
+	}
+	*psize = size;
+
+	if(!wctx->best_data)
+		is_better = 1;
+	else if(size<=wctx->target_size)
+		is_better = (wctx->best_size>wctx->target_size || quality>wctx->best_quality);
+	else
+		is_better = (wctx->best_size>wctx->target_size && quality<wctx->best_quality);
+
+	if(is_better) {
+		// See the portability warning in iwwebp_write_main().
+		if(wctx->best_data) free(wctx->best_data);
+		wctx->best_data = data;
+		wctx->best_size = size;
+		wctx->best_quality = quality;
+	}
+	else {
+		free(data);
+	}
+	return 1;
+}
+
 static int iwwebp_write_main(struct iwwebpwcontext *wctx)
 {
+	struct iw_context *ctx = wctx->ctx;
 	struct iw_image *img;
 	size_t ret;
 	uint8_t *cmpr_webp_data = NULL;
 	int retval=0;
 	double quality;
 	const char *optv;
+	int final_quality;
 
 	img = wctx->img;
 
 	quality = -1.0;
-	optv = iw_get_option(wctx->ctx, "webp:quality");
+	optv = iw_get_option(ctx, "webp:quality");
 	if(optv) {
 		quality = iw_parse_number(optv);
 	}
@@ -620,32 +685,64 @@ static int iwwebp_write_main(struct iwwebpwcontext *wctx)
 		quality=80.0; // Default quality.
 	}
 
+	optv = iw_get_option(ctx, "webp:targetsize");
+	if(optv && iw_parse_int(optv)>0) {
+		wctx->target_size = (size_t)iw_parse_int(optv);
+	}
+
 	switch(img->imgtype) {
 	case IW_IMGTYPE_GRAY:
 		// IW requires encoders to support grayscale, but WebP doesn't (?)
 		// support it. So, convert grayscale images to RGB.
 		iwwebp_gray_to_rgb(wctx,0); // Allocates RGB image at wctx->tmppixels.
 		if(!wctx->tmppixels) goto done;
-		ret = WebPEncodeRGB(wctx->tmppixels, img->width, img->height, 3*img->width, (float)quality, &cmpr_webp_data);
+		wctx->pixels = wctx->tmppixels;
+		wctx->stride = 3*img->width;
 		break;
 	case IW_IMGTYPE_RGB:
-		ret = WebPEncodeRGB(img->pixels, img->width, img->height, (int)img->bpr, (float)quality, &cmpr_webp_data);
+		wctx->pixels = img->pixels;
+		wctx->stride = (int)img->bpr;
 		break;
 #if IW_WEBP_SUPPORT_TRANSPARENCY
 	case IW_IMGTYPE_GRAYA:
 		iwwebp_gray_to_rgb(wctx,1);
 		if(!wctx->tmppixels) goto done;
-		ret = WebPEncodeRGBA(wctx->tmppixels, img->width, img->height, 4*img->width, (float)quality, &cmpr_webp_data);
+		wctx->pixels = wctx->tmppixels;
+		wctx->stride = 4*img->width;
+		wctx->has_alpha = 1;
 		break;
 	case IW_IMGTYPE_RGBA:
-		ret = WebPEncodeRGBA(img->pixels, img->width, img->height, (int)img->bpr, (float)quality, &cmpr_webp_data);
+		wctx->pixels = img->pixels;
+		wctx->stride = (int)img->bpr;
+		wctx->has_alpha = 1;
 		break;
 #endif
 	default:
-		iw_set_errorf(wctx->ctx,"Internal: WebP encoder doesn\xe2\x80\x99t support this image type (%d)",img->imgtype);
+		iw_set_errorf(ctx,"Internal: WebP encoder doesn\xe2\x80\x99t support this image type (%d)",img->imgtype);
 		goto done;
 	}
 
+	if(wctx->target_size>0) {
+		// Search for the quality, and keep the best encoded image, so that we
+		// don't have to encode it again.
+		if(!iw_search_quality(ctx, wctx->target_size, 0, 100, iw_round_to_int(quality),
+			iwwebp_try_quality, (void*)wctx, &final_quality))
+		{
+			goto done;
+		}
+		if(!wctx->best_data || wctx->best_quality!=final_quality) goto done;
+		cmpr_webp_data = wctx->best_data;
+		wctx->best_data = NULL;
+		ret = wctx->best_size;
+		if(ret > wctx->target_size) {
+			iw_warningf(ctx, "Could not make a WebP file as small as %u bytes",
+				(unsigned int)wctx->target_size);
+		}
+	}
+	else {
+		ret = iwwebp_encode(wctx, (float)quality, &cmpr_webp_data);
+	}
+
 	if(ret<1 || !cmpr_webp_data) {
 		goto done;
 	}
@@ -657,9 +754,10 @@ done:
 	// allocated by libwebp. There's no way to be sure that our free() function
 	// is the right one.
 	if(cmpr_webp_data) free(cmpr_webp_data);
+	if(wctx->best_data) free(wctx->best_data);
 
-	if(wctx->tmppixels) iw_free(wctx->ctx,wctx->tmppixels);
-	return 1;
+	if(wctx->tmppixels) iw_free(ctx,wctx->tmppixels);
+	return retval;
 }
 
 IW_IMPL(int) iw_write_webp_file(struct iw_context *ctx, struct iw_iodescr *iodescr)
@@ -148,6 +148,58 @@ extern "C" {
 // Make a negative image (in target colorspace).
 #define IW_VAL_NEGATE_TARGET     53
 
+// If set, the information needed to optimize the output image is collected
+// while the image is being generated, instead of in a separate pass
+// afterward. Does not change the output image.
+#define IW_VAL_INCREMENTAL_OPT_SCAN 54
+
+// If nonzero, and the output image has too many colors to be written as a
+// palette image, reduce it to at most this many colors (2-256), and write a
+// palette image. This changes the image. Only works with formats that
+// support 8-bit palette images.
+#define IW_VAL_QUANTIZE          55
+// If set, use error diffusion dithering with IW_VAL_QUANTIZE.
+#define IW_VAL_QUANTIZE_DITHER   56
+
+// If set, each row of the internal floating point images starts on a
+// 64-byte boundary, and is padded to a multiple of 64 bytes. This uses a
+// little more memory. Does not change the output image.
+#define IW_VAL_PADDED_STRIDE     57
+
+// The format used to store the internal full-size floating point images.
+// An IW_PRECISION_* code. The 16-bit formats use half as much memory, but
+// are less accurate, so the output image may change slightly.
+#define IW_VAL_INTERMED_PRECISION 58
+#define IW_PRECISION_FLOAT32  0 // Default
+#define IW_PRECISION_FLOAT16  1 // IEEE 754 half precision
+#define IW_PRECISION_BFLOAT16 2 // The upper 16 bits of a float32
+
+// The maximum number of threads to use, for the operations that support
+// multithreading (1 to IW_MAX_THREADS). Default is 1. Some file format
+// encoders write slightly different (but equivalent) files when this is
+// more than 1.
+#define IW_VAL_MAX_THREADS       59
+#define IW_MAX_THREADS 64
+
+// A hint that the caller is going to shrink the image to at least this
+// width and height (after any Exif orientation is applied). 0=unknown.
+// If set, readers may use faster, less accurate decoding methods if the
+// image is going to be shrunk a lot (currently only JPEG; see the
+// "jpeg:fastdecode" option). With "jpeg:thumbnail", the JPEG reader decodes a
+// smaller version of the image, so the input image will not have its
+// original dimensions.
+#define IW_VAL_MIN_READ_WIDTH    60
+#define IW_VAL_MIN_READ_HEIGHT   61
+
+// Set by encoders that support a target file size (the "jpeg:targetsize" and
+// "webp:targetsize" options), for the caller to read back: the quality
+// chosen, the number of times the image was encoded while searching for it,
+// and the size of the file written. TRIES is 0 if no search was done.
+// These can only be read; iw_set_value() ignores them.
+#define IW_VAL_TARGETSIZE_QUALITY  62
+#define IW_VAL_TARGETSIZE_TRIES    63
+#define IW_VAL_TARGETSIZE_FILESIZE 64
+
 // File formats.
 #define IW_FORMAT_UNKNOWN  0
 #define IW_FORMAT_PNG      1
@@ -292,6 +344,10 @@ extern "C" {
 #define  IW_DITHERSUBTYPE_ATKINSON     7
 #define IW_DITHERFAMILY_RANDOM       3 // (default subtype = color channels use different patterns)
 #define  IW_DITHERSUBTYPE_SAMEPATTERN  1 // color channels use the same pattern
+// The "hash" subtypes compute each sample's random value from its position,
+// instead of taking the next number from a sequential generator.
+#define  IW_DITHERSUBTYPE_HASH         2
+#define  IW_DITHERSUBTYPE_HASH_SAMEPATTERN 3
 
 // Density codes used by the API (iw_image.density_code).
 #define IW_DENSITY_UNKNOWN         0
@@ -341,6 +397,8 @@ extern "C" {
 
 #define IW_MALLOCFLAG_ZEROMEM     0x01
 #define IW_MALLOCFLAG_NOERRORS    0x02
+#define IW_MALLOCFLAG_ALIGNED     0x04 // Align to IW_MALLOC_ALIGNMENT bytes
+#define IW_MALLOC_ALIGNMENT       64
 
 #ifdef IW_WINDOWS
 #define iw_byte     unsigned char
@@ -467,6 +525,10 @@ struct iw_iodescr {
 // Allocate n bytes of memory. Return NULL on failure.
 // If the IW_MALLOCFLAG_ZEROMEM flag is set, the new memory must be initialized
 // to all zero bytes.
+// If the IW_MALLOCFLAG_ALIGNED flag is set, the memory should be aligned to
+// IW_MALLOC_ALIGNMENT bytes. This only affects performance; IW still works
+// if the flag is ignored. Any memory returned must be freeable by the free
+// function.
 // IW will not attempt to allocate memory blocks larger than the limit set by
 // iw_set_max_malloc().
 typedef void* (*iw_mallocfn_type)(void *userdata, unsigned int flags, size_t n);
@@ -498,6 +560,35 @@ IW_EXPORT(struct iw_context*) iw_create_context(struct iw_init_params *params);
 
 IW_EXPORT(void) iw_destroy_context(struct iw_context *ctx);
 
+// Prepare a context to be used for another image, as if it had been
+// destroyed and recreated with the same iw_init_params.
+// The following are kept: The memory limits (iw_set_max_malloc(), etc.), the
+// options set by iw_set_option(), the translate and warning functions, the
+// zlib module, and IW_VAL_API_VERSION. Everything else, including the error
+// state, returns to the default.
+// After this has been called, the context keeps its large internal buffers
+// after processing an image, so that they can be reused for the next one.
+// They are freed by iw_destroy_context().
+IW_EXPORT(void) iw_reset_context(struct iw_context *ctx);
+
+// Allocate an "arena" of arena_size bytes for the context. Small, short-lived
+// allocations (row buffers, resize contexts, palettes, etc.) are then taken
+// from it, instead of being allocated individually. When it is full, memory
+// is allocated normally. Arena memory is aligned to 16 bytes (or
+// IW_MALLOC_ALIGNMENT, if requested).
+// Space in the arena is not reclaimed block by block. Freeing the most
+// recently allocated block makes its space available again, but otherwise
+// nothing is reclaimed until every block has been freed (normally by
+// iw_reset_context()). So, one block that stays allocated for a long time
+// keeps the whole arena in use until then.
+// The arena is kept by iw_reset_context(), and released by
+// iw_destroy_context(). A few hundred KB is enough for most images.
+// This should be called right after iw_create_context(). 0 removes the
+// arena. Returns 0 if the memory could not be allocated (the context can still
+// be used, without an arena), or if the current arena still has blocks in
+// use.
+IW_EXPORT(int) iw_set_arena_size(struct iw_context *ctx, size_t arena_size);
+
 IW_EXPORT(int) iw_process_image(struct iw_context *ctx);
 
 // Rotate and/or mirror the image. 'x' is an IW_REORIENT_ code.
@@ -631,7 +722,8 @@ IW_EXPORT(void) iw_set_random_seed(struct iw_context *ctx, int randomize, int ra
 // n: 0 to disable this class of optimizations.
 IW_EXPORT(void) iw_set_allow_opt(struct iw_context *ctx, int opt, int n);
 
-// Caller allocates the pixels with (preferably) iw_malloc_large().
+// Caller allocates the pixels with (preferably) iw_malloc_input_pixels() or
+// iw_malloc_large().
 // The memory will be freed by IW.
 // A copy is made of the img structure itself.
 IW_EXPORT(void) iw_set_input_image(struct iw_context *ctx, const struct iw_image *img);
@@ -709,6 +801,43 @@ IW_EXPORT(char*) iw_get_zlib_version_string(char *s, int s_len);
 IW_EXPORT(int) iw_read_jpeg_file(struct iw_context *ctx, struct iw_iodescr *iodescr);
 IW_EXPORT(int) iw_write_jpeg_file(struct iw_context *ctx, struct iw_iodescr *iodescr);
 IW_EXPORT(char*) iw_get_libjpeg_version_string(char *s, int s_len);
+// Rotate/mirror and/or crop a JPEG image by rearranging its DCT coefficients,
+// without decoding it, so that no quality is lost.
+// The orientation is that of the Exif data (as with iw_read_jpeg_file()),
+// followed by 'reorient' (an IW_REORIENT_* code). The crop region is
+// relative to the reoriented image. A crop width or height of -1 means to
+// extend to the edge of the image.
+// The jpeg:arith, jpeg:optcoding, jpeg:rstm, and jpeg:rstr options are
+// supported, as is IW_VAL_OUTPUT_INTERLACED. Other settings are ignored.
+// This can only be done if the upper-left corner of the crop region falls on
+// an MCU boundary, and so does any edge of the image that gets moved to the
+// top or left. The image must be grayscale or YCbCr.
+// If writedescr is NULL, nothing is written; returns 1 if the transform can
+// be done, or 0 if it can't (or on error).
+// Otherwise, returns 1 on success, 0 on failure.
+#define IW_JPEGXFORM_SQUARE_PIXELS  0x01 // Fail if pixels are not square
+#define IW_JPEGXFORM_REQUIRE_CHANGE 0x02 // Fail if the image would not change
+IW_EXPORT(int) iw_jpeg_lossless_transform(struct iw_context *ctx,
+	struct iw_iodescr *readdescr, struct iw_iodescr *writedescr,
+	unsigned int reorient, int crop_x, int crop_y, int crop_w, int crop_h,
+	unsigned int flags);
+// Read the Y, Cb, and Cr planes of a JPEG image, without converting them to
+// RGB, or upsampling the chroma planes. Each plane becomes the 8-bit
+// grayscale input image of one of the contexts in plane_ctx[0..2]; the
+// orientation from the Exif data is applied to it.
+// Sets *pnum_planes to 3 (YCbCr), 1 (grayscale), or 0 if the image is of
+// some other type, in which case nothing is read beyond the header.
+// h_samp[] and v_samp[] (3 elements) receive the sampling factors of the
+// planes.
+IW_EXPORT(int) iw_read_jpeg_planes(struct iw_context *ctx, struct iw_iodescr *iodescr,
+	struct iw_context **plane_ctx, int *pnum_planes, int *h_samp, int *v_samp);
+// Write the processed output images of plane_ctx[] as the planes of a JPEG
+// image. The size of the image is that of plane 0; the other planes should
+// be the size implied by the sampling factors. The jpeg:quality, jpeg:arith,
+// jpeg:optcoding, jpeg:rstm, and jpeg:rstr options are supported, as is
+// IW_VAL_OUTPUT_INTERLACED.
+IW_EXPORT(int) iw_write_jpeg_planes(struct iw_context *ctx, struct iw_iodescr *iodescr,
+	struct iw_context **plane_ctx, int num_planes, const int *h_samp, const int *v_samp);
 IW_EXPORT(int) iw_read_bmp_file(struct iw_context *ctx, struct iw_iodescr *iodescr);
 IW_EXPORT(int) iw_write_bmp_file(struct iw_context *ctx, struct iw_iodescr *iodescr);
 IW_EXPORT(int) iw_write_tiff_file(struct iw_context *ctx, struct iw_iodescr *iodescr);
@@ -717,6 +846,31 @@ IW_EXPORT(int) iw_write_miff_file(struct iw_context *ctx, struct iw_iodescr *iod
 IW_EXPORT(int) iw_read_webp_file(struct iw_context *ctx, struct iw_iodescr *iodescr);
 IW_EXPORT(int) iw_write_webp_file(struct iw_context *ctx, struct iw_iodescr *iodescr);
 IW_EXPORT(int) iw_read_gif_file(struct iw_context *ctx, struct iw_iodescr *iodescr);
+
+// Information about a frame of a GIF image, for iw_read_gif_frames().
+struct iw_gif_frame_info {
+	int frame_num; // 1 = the first frame
+	// The area of the screen covered by the frame's own image. This may
+	// extend past the edge of the screen.
+	int left, top, width, height;
+	int delay; // In hundredths of a second
+	int disposal; // The disposal method, from the file (0 to 7)
+	int has_bkgd_label;
+	struct iw_color bkgd_label; // As for iw_set_input_bkgd_label_2()
+};
+// img is the whole GIF "screen", with the frame painted onto it. It is an
+// 8-bit RGBA image in the sRGB colorspace, and is only valid until the
+// function returns. Return 0 to stop reading the file. To make
+// iw_read_gif_frames() fail, report an error with iw_set_error() first;
+// otherwise it returns 1 without reading the rest of the file.
+typedef int (*iw_gif_frame_fn)(struct iw_context *ctx, void *userdata,
+	const struct iw_image *img, const struct iw_gif_frame_info *info);
+// Read all the images (frames) of a GIF file in a single pass, and call fn
+// for each one. Each frame is composited onto the screen left by the
+// previous frames, according to their disposal methods. ctx is used for
+// memory allocation and errors; no input image is set.
+IW_EXPORT(int) iw_read_gif_frames(struct iw_context *ctx, struct iw_iodescr *iodescr,
+	iw_gif_frame_fn fn, void *userdata);
 IW_EXPORT(int) iw_read_pnm_file(struct iw_context *ctx, struct iw_iodescr *iodescr);
 // The output format can be refined by setting IW_VAL_OUTPUT_FORMAT.
 IW_EXPORT(int) iw_write_pnm_file(struct iw_context *ctx, struct iw_iodescr *iodescr);
@@ -786,10 +940,16 @@ IW_EXPORT(int) iw_file_to_memory(struct iw_context *ctx, struct iw_iodescr *iode
 IW_EXPORT(void*) iw_malloc_ex(struct iw_context *ctx, unsigned int flags, size_t n);
 IW_EXPORT(void*) iw_malloc(struct iw_context *ctx, size_t n);
 // "mallocz" initializes the memory to all 0 bytes.
+// The IW_MALLOCFLAG_ALIGNED flag can be used with iw_malloc_ex and
+// iw_realloc_ex.
 IW_EXPORT(void*) iw_mallocz(struct iw_context *ctx, size_t n);
 // iw_malloc_large is the same as iw_malloc, but allocates a block of memory of
 // size n1*n2. This function is careful to avoid integer overflow.
 IW_EXPORT(void*) iw_malloc_large(struct iw_context *ctx, size_t n1, size_t n2);
+// Like iw_malloc_large(ctx,bpr,height), but intended for the pixels of an
+// image to be passed to iw_set_input_image(). If the context has been reset,
+// this may reuse the memory of the previous input image.
+IW_EXPORT(void*) iw_malloc_input_pixels(struct iw_context *ctx, size_t bpr, size_t height);
 
 IW_EXPORT(void*) iw_realloc_ex(struct iw_context *ctx, unsigned int flags,
 	void *m, size_t oldn, size_t n);
@@ -801,6 +961,35 @@ IW_EXPORT(char*) iw_strdup(struct iw_context *ctx, const char *s);
 // If mem is NULL, does nothing.
 IW_EXPORT(void) iw_free(struct iw_context *ctx, void *mem);
 
+// Decide how many threads iw_run_tasks() should use for num_tasks tasks,
+// based on IW_VAL_MAX_THREADS. Callers that need a separate resource for
+// each thread should allocate this many of them.
+IW_EXPORT(int) iw_get_num_threads_for_tasks(struct iw_context *ctx, int num_tasks);
+typedef void (*iw_task_fn)(void *userdata, int task_num, int thread_num);
+// Call fn(userdata,i,thread_num) for each i from 0 to num_tasks-1, spread
+// over num_threads threads (as returned by iw_get_num_threads_for_tasks()).
+// The calling thread is thread 0. Returns when all tasks are done.
+// The tasks may run at the same time, so they must not allocate memory with
+// the iw_malloc functions, or report errors.
+IW_EXPORT(void) iw_run_tasks(struct iw_context *ctx, int num_tasks, int num_threads,
+	iw_task_fn fn, void *userdata);
+
+// Encode an image at the given quality, and set *psize to the size of the
+// result. Returns 0 on failure.
+typedef int (*iw_encode_at_quality_fn)(void *userdata, int quality, size_t *psize);
+// Search for the highest quality from qmin to qmax that makes an encoded
+// image no larger than target_size, starting at the given quality. Calls fn
+// a bounded number of times (see IW_VAL_TARGETSIZE_TRIES). The result is the
+// highest quality tried whose size was at most target_size, or if there was
+// none, the lowest quality tried. The caller should keep the encoded image
+// that goes with the result, so that it does not have to encode it again,
+// and write it. The result is also recorded for IW_VAL_TARGETSIZE_QUALITY,
+// etc.
+// Returns 0 if fn failed.
+IW_EXPORT(int) iw_search_quality(struct iw_context *ctx, size_t target_size,
+	int qmin, int qmax, int start, iw_encode_at_quality_fn fn, void *userdata,
+	int *pquality);
+
 #define IW_ENDIAN_BIG    0
 #define IW_ENDIAN_LITTLE 1
 IW_EXPORT(int) iw_get_host_endianness(void);
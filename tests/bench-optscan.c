@@ -0,0 +1,162 @@
+// bench-optscan.c
+// Part of ImageWorsener, Copyright (c) 2011 by Jason Summers.
+// For more information, see the readme.txt file.
+
+// Checks that the SSE2 and AVX2 versions of the optimizer's row scanner
+// agree with the scalar version, then times each of them.
+// Build it with "make bench-optscan" in the scripts directory.
+
+#include "imagew-config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "imagew-internals.h"
+
+#define BENCH_WIDTH 6000
+#define BENCH_HEIGHT 4000
+
+static const char *level_name(int level)
+{
+	switch(level) {
+	case IW_SIMD_SSE2: return "SSE2";
+	case IW_SIMD_AVX2: return "AVX2";
+	}
+	return "scalar";
+}
+
+static unsigned int rnd_state = 1;
+
+static unsigned int rnd(void)
+{
+	rnd_state = rnd_state*1103515245U + 12345U;
+	return (rnd_state>>16)&0x7fff;
+}
+
+// Makes a row of gray pixels, which use only 8 bits of precision, then
+// changes a few samples so that some of the flags are found, at random
+// places.
+static void make_test_row(iw_byte *row, int width, int nc, int bit_depth)
+{
+	int i, k, n;
+	int bps = bit_depth/8;
+	int bpp = nc*bps;
+	iw_byte v;
+
+	for(i=0;i<width;i++) {
+		v = (iw_byte)rnd();
+		memset(&row[i*bpp],v,bpp);
+		// Some invisible pixels, whose other samples should be ignored.
+		if((nc==2 || nc==4) && rnd()%8==0) {
+			memset(&row[i*bpp+(nc-1)*bps],0,bps);
+			row[i*bpp] ^= (iw_byte)(1+rnd()%255);
+		}
+	}
+
+	n = rnd()%4;
+	for(k=0;k<n && width>0;k++) {
+		i = rnd()%width;
+		row[i*bpp + rnd()%bpp] ^= (iw_byte)(1+rnd()%255);
+	}
+}
+
+static int check_levels(int max_level)
+{
+	static const int depths[2] = { 8, 16 };
+	iw_byte *row;
+	int d, nc, width, trial, level;
+	unsigned int want, found0, found;
+	int errors = 0;
+	int checks = 0;
+
+	for(d=0;d<2;d++) {
+		for(nc=1;nc<=4;nc++) {
+			for(width=0;width<300;width++) {
+				// Exactly the size of the row, so that memory checkers can
+				// detect reads past the end.
+				row = malloc(width>0 ? (size_t)width*nc*(depths[d]/8) : 1);
+				if(!row) return 1;
+				for(trial=0;trial<20;trial++) {
+					make_test_row(row,width,nc,depths[d]);
+					for(want=1;want<=3;want++) {
+						found0 = iwpvt_scan_row_flags(IW_SIMD_NONE,row,width,nc,depths[d],want);
+						for(level=IW_SIMD_SSE2;level<=max_level;level++) {
+							found = iwpvt_scan_row_flags(level,row,width,nc,depths[d],want);
+							checks++;
+							if(found!=found0) {
+								if(errors<10) {
+									fprintf(stderr,"%s mismatch: depth=%d nc=%d width=%d want=%u: %u, expected %u\n",
+										level_name(level),depths[d],nc,width,want,found,found0);
+								}
+								errors++;
+							}
+						}
+					}
+				}
+				free(row);
+			}
+		}
+	}
+
+	printf("%d checks, %d mismatches\n",checks,errors);
+	return errors;
+}
+
+// Times the worst case: a gray 8-bit-precision image, in which no flag is
+// ever found, so every row is scanned completely.
+static void bench(int max_level, int nc, int bit_depth, const char *name)
+{
+	iw_byte *img;
+	size_t bpr = (size_t)BENCH_WIDTH*nc*(bit_depth/8);
+	size_t i;
+	int y, level;
+	unsigned int want, found;
+	clock_t t0;
+	double secs[3];
+
+	img = malloc(bpr*BENCH_HEIGHT);
+	if(!img) return;
+	for(i=0;i<bpr*BENCH_HEIGHT;i+=(size_t)nc*(bit_depth/8)) {
+		memset(&img[i],(int)(rnd()&0xff),(size_t)nc*(bit_depth/8));
+	}
+
+	want = (nc>=3 ? IW_SCANFLAG_COLOR : 0) | (bit_depth==16 ? IW_SCANFLAG_16BIT : 0);
+
+	printf("%-7s",name);
+	for(level=IW_SIMD_NONE;level<=max_level;level++) {
+		found = 0;
+		t0 = clock();
+		for(y=0;y<BENCH_HEIGHT;y++) {
+			found |= iwpvt_scan_row_flags(level,&img[y*bpr],BENCH_WIDTH,nc,bit_depth,want);
+		}
+		secs[level] = (double)(clock()-t0)/CLOCKS_PER_SEC;
+		if(found) printf(" (unexpected flags %u)",found);
+		printf("  %s %6.1f ms",level_name(level),secs[level]*1000.0);
+		if(level>IW_SIMD_NONE && secs[level]>0.0) {
+			printf(" (%.1fx)",secs[IW_SIMD_NONE]/secs[level]);
+		}
+	}
+	printf("\n");
+	free(img);
+}
+
+int main(int argc, char **argv)
+{
+	int max_level;
+
+	max_level = iwpvt_get_simd_level();
+	printf("CPU supports: %s\n",level_name(max_level));
+
+	if(check_levels(max_level)) return 1;
+
+	printf("Scanning a %dx%d gray image:\n",BENCH_WIDTH,BENCH_HEIGHT);
+	bench(max_level,3,8,"RGB8");
+	bench(max_level,4,8,"RGBA8");
+	bench(max_level,1,16,"G16");
+	bench(max_level,2,16,"GA16");
+	bench(max_level,3,16,"RGB16");
+	bench(max_level,4,16,"RGBA16");
+	return 0;
+}